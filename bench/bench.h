@@ -0,0 +1,76 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Default size of each generated corpus
+#define CORPUS_SIZE_DEFAULT (8 * 1024 * 1024)
+
+struct corpus
+{
+    const char *name;
+    // a directory of many small files instead of a single file
+    bool is_directory;
+    void (*generate)(FILE *file, size_t size, uint64_t *seed);
+};
+
+enum perf_counter
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_BRANCH_MISSES,
+    PERF_CACHE_MISSES,
+    PERF_COUNTERS_LEN,
+};
+
+struct perf_counters
+{
+    bool   available;
+    int    fds[PERF_COUNTERS_LEN];
+    double start;
+};
+
+struct perf_sample
+{
+    double   seconds;
+    // the counters are only valid if available is true
+    bool     available;
+    uint64_t values[PERF_COUNTERS_LEN];
+};
+
+extern const struct corpus corpora[];
+extern const size_t        corpora_len;
+
+// corpus.c
+const struct corpus *
+corpus_lookup(const char *name);
+void
+corpus_generate(const struct corpus *corpus, const char *path, size_t size);
+bool
+corpus_exists(const char *path, size_t size);
+char **
+corpus_filepaths(const struct corpus *corpus,
+                 const char          *path,
+                 size_t               size,
+                 size_t              *len);
+void
+corpus_filepaths_free(char **filepaths, size_t len);
+
+
+// perf.c
+void
+perf_open(struct perf_counters *counters);
+void
+perf_close(struct perf_counters *counters);
+void
+perf_start(struct perf_counters *counters);
+void
+perf_stop(struct perf_counters *counters, struct perf_sample *sample);
+
+#endif
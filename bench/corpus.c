@@ -0,0 +1,288 @@
+#include "bench.h"
+#include <sys/stat.h>
+
+// Deterministic synthetic inputs for the benchmarks. Every corpus is generated
+// from a fixed seed so that results are comparable between runs and machines.
+
+#define CORPUS_SEED 0x5eda11c0ffeeULL
+#define SMALL_FILE_SIZE 4096
+
+// xorshift64*
+static uint64_t
+random_next(uint64_t *seed)
+{
+    *seed ^= *seed >> 12;
+    *seed ^= *seed << 25;
+    *seed ^= *seed >> 27;
+    return *seed * 2685821657736338717ULL;
+}
+
+static size_t
+random_range(uint64_t *seed, size_t min, size_t max)
+{
+    return min + random_next(seed) % (max - min + 1);
+}
+
+static const char *
+random_pick(uint64_t *seed, const char *const *words, size_t words_len)
+{
+    return words[random_next(seed) % words_len];
+}
+
+#define PICK(seed, words) random_pick(seed, words, sizeof(words) / sizeof(*words))
+
+static const char *const words[] = {
+    "lorem", "ipsum",  "dolor", "sit",    "amet",   "consectetur", "adipiscing",
+    "elit",  "sed",    "do",    "tempor", "magna",  "aliqua",      "enim",
+    "minim", "veniam", "quis",  "ut",     "labore", "exercitation"};
+
+static const char *const methods[] = {
+    "GET", "GET", "GET", "GET", "GET", "GET", "GET", "POST", "POST", "HEAD"};
+
+static const char *const paths[] = {"/",
+                                    "/index.html",
+                                    "/static/app.js",
+                                    "/static/style.css",
+                                    "/api/v1/users",
+                                    "/api/v1/orders",
+                                    "/images/logo.png",
+                                    "/login",
+                                    "/search?q=sed",
+                                    "/robots.txt"};
+
+static const int statuses[] = {200, 200, 200, 200, 200, 200, 304, 301, 404, 500};
+
+static const char *const agents[] = {
+    "Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0",
+    "Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/605.1.15",
+    "curl/8.1.2",
+    "Wget/1.21.4",
+    "Googlebot/2.1 (+http://www.google.com/bot.html)"};
+
+static const char *const months[] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+static const char *const names[] = {
+    "alice", "bob", "charles", "diane", "eve", "frank", "grace", "heidi"};
+
+static const char *const cities[] = {
+    "Paris", "Lyon", "\"Saint-Denis, Reunion\"", "Berlin", "Oslo", "Lisbon"};
+
+static void
+write_access_log_line(FILE *file, uint64_t *seed)
+{
+    fprintf(file,
+            "%zu.%zu.%zu.%zu - - [%02zu/%s/2023:%02zu:%02zu:%02zu +0000] "
+            "\"%s %s HTTP/1.1\" %d %zu \"-\" \"%s\"\n",
+            random_range(seed, 1, 254),
+            random_range(seed, 0, 255),
+            random_range(seed, 0, 255),
+            random_range(seed, 1, 254),
+            random_range(seed, 1, 28),
+            PICK(seed, months),
+            random_range(seed, 0, 23),
+            random_range(seed, 0, 59),
+            random_range(seed, 0, 59),
+            PICK(seed, methods),
+            PICK(seed, paths),
+            statuses[random_next(seed) % (sizeof(statuses) / sizeof(*statuses))],
+            random_range(seed, 0, 100000),
+            PICK(seed, agents));
+}
+
+static void
+generate_access_log(FILE *file, size_t size, uint64_t *seed)
+{
+    while ((size_t)ftell(file) < size)
+        write_access_log_line(file, seed);
+}
+
+static void
+generate_csv(FILE *file, size_t size, uint64_t *seed)
+{
+    fputs("id,name,city,amount,date\n", file);
+    for (size_t id = 1; (size_t)ftell(file) < size; id++)
+    {
+        fprintf(file,
+                "%zu,%s,%s,%zu.%02zu,2023-%02zu-%02zu\n",
+                id,
+                PICK(seed, names),
+                PICK(seed, cities),
+                random_range(seed, 0, 9999),
+                random_range(seed, 0, 99),
+                random_range(seed, 1, 12),
+                random_range(seed, 1, 28));
+    }
+}
+
+// Lines of 64 KiB to 1 MiB of words
+static void
+generate_long_lines(FILE *file, size_t size, uint64_t *seed)
+{
+    while ((size_t)ftell(file) < size)
+    {
+        size_t line_len = random_range(seed, 64 * 1024, 1024 * 1024);
+        for (size_t len = 0; len < line_len;)
+        {
+            const char *word = PICK(seed, words);
+            fputs(word, file);
+            fputc(' ', file);
+            len += strlen(word) + 1;
+        }
+        fputc('\n', file);
+    }
+}
+
+// Binary-ish data: a quarter of NUL bytes, lines of 80 bytes on average
+static void
+generate_nul(FILE *file, size_t size, uint64_t *seed)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        uint64_t r = random_next(seed);
+        if (r % 80 == 0)
+            fputc('\n', file);
+        else if (r % 4 == 0)
+            fputc('\0', file);
+        else
+            fputc((r >> 8) % 255 + 1, file);
+    }
+    fputc('\n', file);
+}
+
+const struct corpus corpora[] = {
+    {"access_log", false, generate_access_log},
+    {"csv", false, generate_csv},
+    {"long_lines", false, generate_long_lines},
+    {"nul", false, generate_nul},
+    {"small_files", true, generate_access_log},
+};
+
+const size_t corpora_len = sizeof(corpora) / sizeof(*corpora);
+
+const struct corpus *
+corpus_lookup(const char *name)
+{
+    for (size_t i = 0; i < corpora_len; i++)
+    {
+        if (strcmp(corpora[i].name, name) == 0)
+            return &corpora[i];
+    }
+    return NULL;
+}
+
+static FILE *
+corpus_open(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "couldn't open %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return file;
+}
+
+static void
+corpus_close(FILE *file, const char *path)
+{
+    if (fclose(file) == EOF)
+    {
+        fprintf(stderr, "couldn't write %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+// The stamp records the size the corpus was generated with, it's written last
+// so that an interrupted generation is started again.
+static char *
+corpus_stamp_path(const char *path)
+{
+    size_t len = strlen(path) + sizeof(".stamp");
+    char  *stamp_path = malloc(len);
+    if (stamp_path == NULL)
+        abort();
+    snprintf(stamp_path, len, "%s.stamp", path);
+    return stamp_path;
+}
+
+// Files making up the corpus, path itself unless it is a directory
+char **
+corpus_filepaths(const struct corpus *corpus,
+                 const char          *path,
+                 size_t               size,
+                 size_t              *len)
+{
+    *len = corpus->is_directory ? (size + SMALL_FILE_SIZE - 1) / SMALL_FILE_SIZE : 1;
+    char **filepaths = malloc(sizeof(char *) * *len);
+    if (filepaths == NULL)
+        abort();
+    for (size_t i = 0; i < *len; i++)
+    {
+        size_t filepath_len = strlen(path) + 16;
+        filepaths[i] = malloc(filepath_len);
+        if (filepaths[i] == NULL)
+            abort();
+        if (corpus->is_directory)
+            snprintf(filepaths[i], filepath_len, "%s/%05zu.log", path, i);
+        else
+            snprintf(filepaths[i], filepath_len, "%s", path);
+    }
+    return filepaths;
+}
+
+void
+corpus_filepaths_free(char **filepaths, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        free(filepaths[i]);
+    free(filepaths);
+}
+
+void
+corpus_generate(const struct corpus *corpus, const char *path, size_t size)
+{
+    uint64_t seed = CORPUS_SEED;
+    if (!corpus->is_directory)
+    {
+        FILE *file = corpus_open(path);
+        corpus->generate(file, size, &seed);
+        corpus_close(file, path);
+    }
+    else
+    {
+        if (mkdir(path, 0777) == -1 && errno != EEXIST)
+        {
+            fprintf(stderr, "couldn't create %s: %s\n", path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        size_t filepaths_len;
+        char **filepaths = corpus_filepaths(corpus, path, size, &filepaths_len);
+        for (size_t i = 0; i < filepaths_len; i++)
+        {
+            FILE *file = corpus_open(filepaths[i]);
+            corpus->generate(file, SMALL_FILE_SIZE, &seed);
+            corpus_close(file, filepaths[i]);
+        }
+        corpus_filepaths_free(filepaths, filepaths_len);
+    }
+    char *stamp_path = corpus_stamp_path(path);
+    FILE *stamp = corpus_open(stamp_path);
+    fprintf(stamp, "%zu\n", size);
+    corpus_close(stamp, stamp_path);
+    free(stamp_path);
+}
+
+bool
+corpus_exists(const char *path, size_t size)
+{
+    char *stamp_path = corpus_stamp_path(path);
+    FILE *stamp = fopen(stamp_path, "r");
+    free(stamp_path);
+    if (stamp == NULL)
+        return false;
+    size_t stamp_size = 0;
+    bool   ret = fscanf(stamp, "%zu", &stamp_size) == 1 && stamp_size == size;
+    fclose(stamp);
+    return ret;
+}
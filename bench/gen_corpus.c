@@ -0,0 +1,24 @@
+#include "bench.h"
+
+// Generate a single corpus, e.g. to feed it to another sed implementation
+int
+main(int argc, char *argv[])
+{
+    if (argc < 3 || argc > 4)
+    {
+        fputs("usage: gen_corpus KIND PATH [SIZE]\nkinds:", stderr);
+        for (size_t i = 0; i < corpora_len; i++)
+            fprintf(stderr, " %s", corpora[i].name);
+        fputc('\n', stderr);
+        return EXIT_FAILURE;
+    }
+    const struct corpus *corpus = corpus_lookup(argv[1]);
+    if (corpus == NULL)
+    {
+        fprintf(stderr, "unknown corpus: %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    size_t size = argc == 4 ? strtoul(argv[3], NULL, 10) : CORPUS_SIZE_DEFAULT;
+    corpus_generate(corpus, argv[2], size);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,199 @@
+#include "bench.h"
+#include "sed.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// Micro-benchmarks of the executor kernels, driven directly like the unit tests
+// do, on the lines of the access log corpus. The fastest of a few runs is kept
+// and reported with the hardware counters when they are available.
+//
+// usage: bench_micro CORPUS_DIR [SIZE]
+
+#define MICRO_SIZE_DEFAULT (4 * 1024 * 1024)
+#define RUNS 5
+
+char *
+_debug_exec_set_pattern_space(struct context *ctx, const char *content);
+bool
+_debug_exec_address_match(struct context *ctx, struct address *address);
+void
+exec_init(struct context *ctx,
+          char          **local_filepaths,
+          size_t          local_filepaths_len,
+          bool            auto_print_);
+char *
+next_line(struct context *ctx);
+
+struct lines
+{
+    char  *filepath;
+    char **lines;
+    size_t len;
+    size_t bytes;
+};
+
+static struct context context = CONTEXT_INIT;
+static struct command command;
+static char           command_string[128];
+static size_t         matches = 0;
+
+// The pattern space is loaded before each execution, like next_line would
+static void
+run_command(struct lines *lines)
+{
+    for (size_t i = 0; i < lines->len; i++)
+    {
+        _debug_exec_set_pattern_space(&context, lines->lines[i]);
+        exec_command(&context, &command);
+    }
+    output_flush(&context);
+}
+
+static void
+run_address(struct lines *lines)
+{
+    for (size_t i = 0; i < lines->len; i++)
+    {
+        _debug_exec_set_pattern_space(&context, lines->lines[i]);
+        matches +=
+            _debug_exec_address_match(&context, &command.addresses.addresses[0]);
+    }
+}
+
+static void
+run_next_line(struct lines *lines)
+{
+    exec_init(&context, &lines->filepath, 1, false);
+    while (next_line(&context) != NULL)
+        ;
+}
+
+struct kernel
+{
+    const char *name;
+    const char *command;
+    void (*run)(struct lines *lines);
+};
+
+static const struct kernel kernels[] = {
+    {"substitute_literal", "s/GET/POST/g", run_command},
+    {"substitute_regex", "s/[0-9][0-9]*/N/g", run_command},
+    {"substitute_groups", "s/\\([^ ]*\\) \\([^ ]*\\)/\\2 \\1/", run_command},
+    {"translate", "y/abcdefghij/ABCDEFGHIJ/", run_command},
+    {"print_escape", "l", run_command},
+    {"address_regex", "/ 404 /p", run_address},
+    {"address_line", "1000p", run_address},
+    {"next_line", NULL, run_next_line},
+};
+
+static const size_t kernels_len = sizeof(kernels) / sizeof(*kernels);
+
+static void
+lines_load(struct lines *lines)
+{
+    FILE *file = fopen(lines->filepath, "r");
+    if (file == NULL)
+        die("couldn't open file %s: %s", lines->filepath, strerror(errno));
+    size_t  capacity = 1024;
+    char   *line = NULL;
+    size_t  line_size = 0;
+    ssize_t len;
+    lines->lines = xmalloc(sizeof(char *) * capacity);
+    lines->len = 0;
+    lines->bytes = 0;
+    while ((len = getline(&line, &line_size, file)) != -1)
+    {
+        if (lines->len == capacity)
+        {
+            capacity *= 2;
+            lines->lines = xrealloc(lines->lines, sizeof(char *) * capacity);
+        }
+        lines->lines[lines->len++] = xstrdup(line);
+        lines->bytes += len;
+    }
+    free(line);
+    fclose(file);
+}
+
+static void
+report_sample(FILE *report, const char *name, size_t bytes, struct perf_sample *s)
+{
+    fprintf(report, "%-20s %8.1f", name, bytes / s->seconds / 1e6);
+    if (!s->available)
+    {
+        fprintf(report, " %9s %9s %12s %12s\n", "-", "-", "-", "-");
+        return;
+    }
+    fprintf(report,
+            " %9.2f %9.2f %12llu %12llu\n",
+            (double)s->values[PERF_CYCLES] / bytes,
+            (double)s->values[PERF_INSTRUCTIONS] / bytes,
+            (unsigned long long)s->values[PERF_BRANCH_MISSES],
+            (unsigned long long)s->values[PERF_CACHE_MISSES]);
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 3)
+    {
+        fputs("usage: bench_micro CORPUS_DIR [SIZE]\n", stderr);
+        return EXIT_FAILURE;
+    }
+    const char *corpus_dir = argv[1];
+    size_t size = argc == 3 ? strtoul(argv[2], NULL, 10) : MICRO_SIZE_DEFAULT;
+    if (mkdir(corpus_dir, 0777) == -1 && errno != EEXIST)
+        die("couldn't create %s: %s", corpus_dir, strerror(errno));
+    struct lines lines;
+    size_t       filepath_len = strlen(corpus_dir) + sizeof("/micro_access_log");
+    lines.filepath = xmalloc(filepath_len);
+    snprintf(lines.filepath, filepath_len, "%s/micro_access_log", corpus_dir);
+    if (!corpus_exists(lines.filepath, size))
+        corpus_generate(corpus_lookup("access_log"), lines.filepath, size);
+    lines_load(&lines);
+
+    // the report is written to the original stdout, the output of the kernels is
+    // discarded
+    FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+    int   null_fd = open("/dev/null", O_WRONLY);
+    if (report == NULL || null_fd == -1 || dup2(null_fd, STDOUT_FILENO) == -1)
+        die("couldn't redirect stdout: %s", strerror(errno));
+
+    struct perf_counters counters;
+    perf_open(&counters);
+    if (!counters.available)
+        fputs("hardware counters unavailable, reporting time only\n", report);
+    fprintf(report,
+            "%-20s %8s %9s %9s %12s %12s\n",
+            "kernel",
+            "MB/s",
+            "cycles/B",
+            "instr/B",
+            "branch-miss",
+            "cache-miss");
+    for (size_t i = 0; i < kernels_len; i++)
+    {
+        if (kernels[i].command != NULL)
+        {
+            strcpy(command_string, kernels[i].command);
+            parse_command(command_string, &command);
+        }
+        // warm up the caches and the allocator
+        kernels[i].run(&lines);
+        struct perf_sample best;
+        for (size_t run = 0; run < RUNS; run++)
+        {
+            struct perf_sample sample;
+            perf_start(&counters);
+            kernels[i].run(&lines);
+            perf_stop(&counters, &sample);
+            if (run == 0 || sample.seconds < best.seconds)
+                best = sample;
+        }
+        report_sample(report, kernels[i].name, lines.bytes, &best);
+        fflush(report);
+    }
+    perf_close(&counters);
+    script_free();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,101 @@
+// syscall() isn't part of POSIX
+#define _DEFAULT_SOURCE
+#include "bench.h"
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Hardware counters of the calling thread, opened as a single group so that they
+// are scheduled together. perf_event_open is often unavailable (containers,
+// perf_event_paranoid, virtual machines), in which case only the time is
+// measured.
+
+static const uint64_t perf_configs[PERF_COUNTERS_LEN] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_BRANCH_MISSES,
+    PERF_COUNT_HW_CACHE_MISSES,
+};
+
+static int
+perf_event_open(uint64_t config, int group_fd)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = group_fd == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+void
+perf_open(struct perf_counters *counters)
+{
+    counters->available = false;
+    for (size_t i = 0; i < PERF_COUNTERS_LEN; i++)
+        counters->fds[i] = -1;
+    for (size_t i = 0; i < PERF_COUNTERS_LEN; i++)
+    {
+        counters->fds[i] = perf_event_open(perf_configs[i], counters->fds[0]);
+        if (counters->fds[i] == -1)
+        {
+            perf_close(counters);
+            return;
+        }
+    }
+    counters->available = true;
+}
+
+void
+perf_close(struct perf_counters *counters)
+{
+    for (size_t i = 0; i < PERF_COUNTERS_LEN; i++)
+    {
+        if (counters->fds[i] != -1)
+            close(counters->fds[i]);
+        counters->fds[i] = -1;
+    }
+    counters->available = false;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+perf_start(struct perf_counters *counters)
+{
+    if (counters->available)
+    {
+        ioctl(counters->fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(counters->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+    counters->start = now();
+}
+
+void
+perf_stop(struct perf_counters *counters, struct perf_sample *sample)
+{
+    sample->seconds = now() - counters->start;
+    sample->available = false;
+    if (!counters->available)
+        return;
+    ioctl(counters->fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    // PERF_FORMAT_GROUP: number of counters followed by their values
+    uint64_t values[PERF_COUNTERS_LEN + 1];
+    if (read(counters->fds[0], values, sizeof(values)) != sizeof(values) ||
+        values[0] != PERF_COUNTERS_LEN)
+        return;
+    memcpy(sample->values, values + 1, sizeof(sample->values));
+    sample->available = true;
+}
@@ -0,0 +1,186 @@
+#include "bench.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// End-to-end throughput of the sed executable on every corpus with a matrix of
+// representative scripts. Each run is repeated and the fastest one is kept.
+//
+// usage: bench_throughput SED CORPUS_DIR [SIZE]
+
+#define RUNS 3
+
+struct script
+{
+    const char *name;
+    const char *args[4];
+};
+
+static const struct script scripts[] = {
+    {"s_literal_global", {"s/GET/POST/g", NULL}},
+    {"s_regex_global", {"s/[0-9][0-9]*/N/g", NULL}},
+    {"translate", {"y/abcdefghij/ABCDEFGHIJ/", NULL}},
+    {"delete_regex", {"/ 404 /d", NULL}},
+    {"npd_window", {"$!N;P;D", NULL}},
+    {"hold_slurp", {"H;$!d;x", NULL}},
+    {"line_range", {"-n", "1000,2000p", NULL}},
+    {"regex_range", {"-n", "/POST/,/HEAD/p", NULL}},
+};
+
+static const size_t scripts_len = sizeof(scripts) / sizeof(*scripts);
+
+struct corpus_stats
+{
+    size_t bytes;
+    size_t lines;
+};
+
+static struct corpus_stats
+corpus_stats(char **filepaths, size_t filepaths_len)
+{
+    struct corpus_stats stats = {0, 0};
+    char                buf[65536];
+    for (size_t i = 0; i < filepaths_len; i++)
+    {
+        FILE *file = fopen(filepaths[i], "r");
+        if (file == NULL)
+            continue;
+        size_t len;
+        while ((len = fread(buf, 1, sizeof(buf), file)) > 0)
+        {
+            stats.bytes += len;
+            for (char *s = buf; (s = memchr(s, '\n', buf + len - s)) != NULL; s++)
+                stats.lines++;
+        }
+        fclose(file);
+    }
+    return stats;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Run sed on the corpus with its output discarded, returns the elapsed time or a
+// negative value if it didn't exit successfully.
+static double
+run(const char *sed, const struct script *script, char **filepaths, size_t len)
+{
+    size_t args_len = 0;
+    while (script->args[args_len] != NULL)
+        args_len++;
+    char **argv = malloc(sizeof(char *) * (args_len + len + 2));
+    if (argv == NULL)
+        abort();
+    argv[0] = (char *)sed;
+    memcpy(argv + 1, script->args, sizeof(char *) * args_len);
+    memcpy(argv + 1 + args_len, filepaths, sizeof(char *) * len);
+    argv[1 + args_len + len] = NULL;
+
+    double start = now();
+    pid_t  pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0)
+    {
+        int fd = open("/dev/null", O_WRONLY);
+        if (fd != -1)
+            dup2(fd, STDOUT_FILENO);
+        execv(sed, argv);
+        perror(sed);
+        _exit(127);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) == -1)
+    {
+        if (errno != EINTR)
+        {
+            perror("waitpid");
+            exit(EXIT_FAILURE);
+        }
+    }
+    double elapsed = now() - start;
+    free(argv);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+    return elapsed;
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (argc < 3 || argc > 4)
+    {
+        fputs("usage: bench_throughput SED CORPUS_DIR [SIZE]\n", stderr);
+        return EXIT_FAILURE;
+    }
+    const char *sed = argv[1];
+    const char *corpus_dir = argv[2];
+    size_t size = argc == 4 ? strtoul(argv[3], NULL, 10) : CORPUS_SIZE_DEFAULT;
+    if (mkdir(corpus_dir, 0777) == -1 && errno != EEXIST)
+    {
+        fprintf(stderr, "couldn't create %s: %s\n", corpus_dir, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    bool failed = false;
+    printf("%-18s %-12s %10s %14s\n", "script", "corpus", "MB/s", "lines/s");
+    for (size_t i = 0; i < corpora_len; i++)
+    {
+        const struct corpus *corpus = &corpora[i];
+        size_t path_len = strlen(corpus_dir) + strlen(corpus->name) + 2;
+        char  *path = malloc(path_len);
+        if (path == NULL)
+            abort();
+        snprintf(path, path_len, "%s/%s", corpus_dir, corpus->name);
+        if (!corpus_exists(path, size))
+            corpus_generate(corpus, path, size);
+        size_t filepaths_len;
+        char **filepaths = corpus_filepaths(corpus, path, size, &filepaths_len);
+        struct corpus_stats stats = corpus_stats(filepaths, filepaths_len);
+
+        for (size_t j = 0; j < scripts_len; j++)
+        {
+            double best = -1;
+            for (size_t k = 0; k < RUNS; k++)
+            {
+                double elapsed = run(sed, &scripts[j], filepaths, filepaths_len);
+                if (elapsed < 0)
+                {
+                    best = -1;
+                    break;
+                }
+                if (best < 0 || elapsed < best)
+                    best = elapsed;
+            }
+            if (best < 0)
+            {
+                printf("%-18s %-12s %10s %14s\n",
+                       scripts[j].name,
+                       corpus->name,
+                       "FAILED",
+                       "-");
+                failed = true;
+                continue;
+            }
+            printf("%-18s %-12s %10.1f %14.0f\n",
+                   scripts[j].name,
+                   corpus->name,
+                   stats.bytes / best / 1e6,
+                   stats.lines / best);
+            fflush(stdout);
+        }
+        corpus_filepaths_free(filepaths, filepaths_len);
+        free(path);
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
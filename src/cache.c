@@ -0,0 +1,532 @@
+#include "sed.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// On-disk cache of parsed scripts.
+//
+// The parsed command tree is flattened into a single file named after a hash of
+// the script text: a header, the commands (blocks children are stored as a
+// contiguous range), the regexes, a table of all the strings of the script and
+// the script text itself, compared on load since two scripts can share a hash.
+// On a hit the file is mapped read-only, the strings are copied to the script
+// arena, the command arrays are rebuilt and the regexes compiled again since
+// regex_t is opaque and can't be stored. Every offset and index is checked against
+// the sizes of the file, the script is parsed again when one is out of range.
+
+#define SCRIPT_CACHE_MAGIC "SEDCACHE"
+#define SCRIPT_CACHE_VERSION 2
+#define SCRIPT_CACHE_NONE UINT32_MAX
+
+struct cache_header
+{
+    char     magic[8];
+    uint64_t key;
+    uint32_t version;
+    uint32_t script_len;
+    uint32_t commands_len;
+    uint32_t regexes_len;
+    uint32_t strings_len;
+    uint32_t text_len;
+};
+
+struct cache_address
+{
+    uint8_t  type;
+    uint32_t regex;
+    uint64_t line;
+};
+
+struct cache_command
+{
+    char                 id;
+    uint8_t              inverse;
+    uint8_t              addresses_count;
+    struct cache_address addresses[2];
+    union
+    {
+        uint32_t text;
+        struct
+        {
+            uint32_t first;
+            uint32_t len;
+        } children;
+        struct
+        {
+            uint32_t regex;
+            uint32_t replacement;
+            uint64_t occurence_index;
+            uint8_t  global;
+            uint8_t  print;
+            uint32_t write_filepath;
+        } substitute;
+        struct
+        {
+            uint32_t from;
+            uint32_t to;
+        } translate;
+    } data;
+};
+
+struct cache_regex
+{
+    uint32_t source;
+    int32_t  cflags;
+};
+
+// Identifies the binary, a cache written by another build is never used
+static const char *script_cache_build = __DATE__ " " __TIME__;
+
+uint64_t
+script_cache_key(const char *script_string)
+{
+    char version[64];
+    snprintf(version,
+             sizeof(version),
+             "%d %zu %s\n",
+             SCRIPT_CACHE_VERSION,
+             sizeof(struct cache_command),
+             script_cache_build);
+    return hash_string(version) ^ hash_string(script_string);
+}
+
+static char *
+script_cache_filepath(const char *dir, uint64_t key)
+{
+    size_t len = strlen(dir) + 32;
+    char  *filepath = xmalloc(len);
+    snprintf(filepath, len, "%s/%016llx.sedc", dir, (unsigned long long)key);
+    return filepath;
+}
+
+/**************************************************************************/
+/* store                                                                  */
+
+struct cache_writer
+{
+    struct cache_command *commands;
+    size_t                commands_len;
+    size_t                commands_capacity;
+    struct cache_regex   *regexes;
+    size_t                regexes_len;
+    size_t                regexes_capacity;
+    char                 *strings;
+    size_t                strings_len;
+    size_t                strings_capacity;
+};
+
+static uint32_t
+writer_string(struct cache_writer *writer, const char *s)
+{
+    if (s == NULL)
+        return SCRIPT_CACHE_NONE;
+    size_t len = strlen(s) + 1;
+    while (writer->strings_len + len > writer->strings_capacity)
+    {
+        writer->strings_capacity =
+            writer->strings_capacity == 0 ? 4096 : writer->strings_capacity * 2;
+        writer->strings = xrealloc(writer->strings, writer->strings_capacity);
+    }
+    uint32_t offset = writer->strings_len;
+    memcpy(writer->strings + offset, s, len);
+    writer->strings_len += len;
+    return offset;
+}
+
+static uint32_t
+writer_regex(struct cache_writer *writer, const struct regex *regex)
+{
+    if (writer->regexes_len == writer->regexes_capacity)
+    {
+        writer->regexes_capacity =
+            writer->regexes_capacity == 0 ? 64 : writer->regexes_capacity * 2;
+        writer->regexes = xrealloc(
+            writer->regexes, sizeof(struct cache_regex) * writer->regexes_capacity);
+    }
+    struct cache_regex *cached = &writer->regexes[writer->regexes_len];
+    cached->source = writer_string(writer, regex->source);
+    cached->cflags = regex->cflags;
+    return writer->regexes_len++;
+}
+
+// Reserve len contiguous commands, returns the index of the first one
+static size_t
+writer_reserve(struct cache_writer *writer, size_t len)
+{
+    while (writer->commands_len + len > writer->commands_capacity)
+    {
+        writer->commands_capacity =
+            writer->commands_capacity == 0 ? 64 : writer->commands_capacity * 2;
+        writer->commands =
+            xrealloc(writer->commands,
+                     sizeof(struct cache_command) * writer->commands_capacity);
+    }
+    size_t first = writer->commands_len;
+    memset(writer->commands + first, 0, sizeof(struct cache_command) * len);
+    writer->commands_len += len;
+    return first;
+}
+
+static size_t
+commands_len(const struct command *commands, bool block)
+{
+    size_t len = 0;
+    if (block)
+    {
+        while (commands[len].id != '}')
+            len++;
+        return len + 1;
+    }
+    while (commands[len].id != COMMAND_LAST)
+        len++;
+    return len + 1;
+}
+
+static size_t
+writer_commands(struct cache_writer  *writer,
+                const struct command *commands,
+                size_t                len)
+{
+    size_t first = writer_reserve(writer, len);
+    for (size_t i = 0; i < len; i++)
+    {
+        const struct command *command = &commands[i];
+        struct cache_command  cached;
+        memset(&cached, 0, sizeof(struct cache_command));
+        cached.id = command->id;
+        cached.inverse = command->inverse;
+        if (command->id != COMMAND_LAST)
+            cached.addresses_count = command->addresses.count;
+        for (size_t j = 0; j < cached.addresses_count; j++)
+        {
+            const struct address *address = &command->addresses.addresses[j];
+            cached.addresses[j].type = address->type;
+            if (address->type == ADDRESS_LINE)
+                cached.addresses[j].line = address->data.line;
+            else if (address->type == ADDRESS_RE)
+                cached.addresses[j].regex =
+                    writer_regex(writer, address->data.regex);
+        }
+        switch (command->id)
+        {
+        case '{':
+            cached.data.children.len = commands_len(command->data.children, true);
+            cached.data.children.first = writer_commands(
+                writer, command->data.children, cached.data.children.len);
+            break;
+        case 'a':
+        case 'c':
+        case 'i':
+        case ':':
+        case 'b':
+        case 't':
+        case 'r':
+        case 'R':
+        case 'w':
+            cached.data.text = writer_string(writer, command->data.text);
+            break;
+        case 's':
+            cached.data.substitute.regex =
+                writer_regex(writer, command->data.substitute.regex);
+            cached.data.substitute.replacement =
+                writer_string(writer, command->data.substitute.replacement);
+            cached.data.substitute.occurence_index =
+                command->data.substitute.occurence_index;
+            cached.data.substitute.global = command->data.substitute.global;
+            cached.data.substitute.print = command->data.substitute.print;
+            cached.data.substitute.write_filepath =
+                writer_string(writer, command->data.substitute.write_filepath);
+            break;
+        case 'y':
+            cached.data.translate.from =
+                writer_string(writer, command->data.translate.from);
+            cached.data.translate.to =
+                writer_string(writer, command->data.translate.to);
+            break;
+        }
+        // the array can be moved by the recursive call above
+        writer->commands[first + i] = cached;
+    }
+    return first;
+}
+
+static bool
+write_all(int fd, const void *buf, size_t len)
+{
+    const char *s = buf;
+    while (len > 0)
+    {
+        ssize_t ret = write(fd, s, len);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1)
+            return false;
+        s += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+// Write the parsed script to the cache directory.
+// Failures are silently ignored, the script will just be parsed again next time.
+void
+script_cache_store(const char *dir,
+                   uint64_t    key,
+                   const char *script_string,
+                   script_t    script)
+{
+    struct cache_writer writer;
+    memset(&writer, 0, sizeof(struct cache_writer));
+    size_t script_len = commands_len(script, false);
+    writer_commands(&writer, script, script_len);
+
+    struct cache_header header;
+    memset(&header, 0, sizeof(struct cache_header));
+    memcpy(header.magic, SCRIPT_CACHE_MAGIC, sizeof(header.magic));
+    header.key = key;
+    header.version = SCRIPT_CACHE_VERSION;
+    header.script_len = script_len;
+    header.commands_len = writer.commands_len;
+    header.regexes_len = writer.regexes_len;
+    header.strings_len = writer.strings_len;
+    header.text_len = strlen(script_string);
+
+    char  *filepath = script_cache_filepath(dir, key);
+    size_t tmp_filepath_len = strlen(filepath) + 32;
+    char  *tmp_filepath = xmalloc(tmp_filepath_len);
+    snprintf(tmp_filepath, tmp_filepath_len, "%s.%ld", filepath, (long)getpid());
+    int fd = open(tmp_filepath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd != -1)
+    {
+        bool ok =
+            write_all(fd, &header, sizeof(struct cache_header)) &&
+            write_all(fd,
+                      writer.commands,
+                      sizeof(struct cache_command) * writer.commands_len) &&
+            write_all(fd,
+                      writer.regexes,
+                      sizeof(struct cache_regex) * writer.regexes_len) &&
+            write_all(fd, writer.strings, writer.strings_len) &&
+            write_all(fd, script_string, header.text_len);
+        close(fd);
+        if (!ok || rename(tmp_filepath, filepath) == -1)
+            unlink(tmp_filepath);
+    }
+    free(tmp_filepath);
+    free(filepath);
+    free(writer.commands);
+    free(writer.regexes);
+    free(writer.strings);
+}
+
+/**************************************************************************/
+/* load                                                                   */
+
+struct cache_reader
+{
+    const struct cache_header  *header;
+    const struct cache_command *commands;
+    const struct cache_regex   *regexes;
+    const char                 *strings;
+    // set as soon as something refers outside of the file
+    bool invalid;
+};
+
+static char *
+reader_string(struct cache_reader *reader, uint32_t offset)
+{
+    if (offset == SCRIPT_CACHE_NONE)
+        return NULL;
+    if (offset >= reader->header->strings_len)
+    {
+        reader->invalid = true;
+        return NULL;
+    }
+    return (char *)reader->strings + offset;
+}
+
+static struct regex *
+reader_regex(struct cache_reader *reader, uint32_t index, bool submatches)
+{
+    if (index >= reader->header->regexes_len)
+    {
+        reader->invalid = true;
+        return NULL;
+    }
+    const struct cache_regex *cached = &reader->regexes[index];
+    char                     *source = reader_string(reader, cached->source);
+    if (source == NULL)
+    {
+        reader->invalid = true;
+        return NULL;
+    }
+    return regex_intern(source, cached->cflags, submatches);
+}
+
+// Whether the commands [first, first + len) are in the file and end with last
+static bool
+reader_range_valid(const struct cache_reader *reader,
+                   size_t                     first,
+                   size_t                     len,
+                   char                       last)
+{
+    size_t commands_len = reader->header->commands_len;
+    return len > 0 && first < commands_len && len <= commands_len - first &&
+           reader->commands[first + len - 1].id == last;
+}
+
+static bool
+reader_command_valid(const struct cache_command *cached)
+{
+    if (cached->id != COMMAND_LAST &&
+        (cached->id == '\0' || strchr(available_commands, cached->id) == NULL))
+        return false;
+    if (cached->addresses_count > 2)
+        return false;
+    for (size_t j = 0; j < cached->addresses_count; j++)
+    {
+        uint8_t type = cached->addresses[j].type;
+        if (type != ADDRESS_LINE && type != ADDRESS_LAST && type != ADDRESS_RE)
+            return false;
+    }
+    return true;
+}
+
+static struct command *
+reader_commands(struct cache_reader *reader, size_t first, size_t len)
+{
+    struct command *commands =
+        arena_alloc(&script_arena, sizeof(struct command) * len);
+    for (size_t i = 0; i < len; i++)
+    {
+        const struct cache_command *cached = &reader->commands[first + i];
+        struct command             *command = &commands[i];
+        if (!reader_command_valid(cached))
+        {
+            reader->invalid = true;
+            return NULL;
+        }
+        command->id = cached->id;
+        command->inverse = cached->inverse;
+        command->profile = NULL;
+        command->addresses.count = cached->addresses_count;
+        // the commands are numbered uniquely by their position in the cache
+        command->addresses.range = first + i;
+        for (size_t j = 0; j < cached->addresses_count; j++)
+        {
+            struct address *address = &command->addresses.addresses[j];
+            address->type = cached->addresses[j].type;
+            if (address->type == ADDRESS_LINE)
+                address->data.line = cached->addresses[j].line;
+            else if (address->type == ADDRESS_RE)
+                address->data.regex =
+                    reader_regex(reader, cached->addresses[j].regex, false);
+        }
+        switch (command->id)
+        {
+        case '{':
+            // the children are stored after their parent, which rules out cycles
+            if (cached->data.children.first <= first + i ||
+                !reader_range_valid(reader,
+                                    cached->data.children.first,
+                                    cached->data.children.len,
+                                    '}'))
+            {
+                reader->invalid = true;
+                return NULL;
+            }
+            command->data.children = reader_commands(
+                reader, cached->data.children.first, cached->data.children.len);
+            break;
+        case 'a':
+        case 'c':
+        case 'i':
+        case ':':
+        case 'b':
+        case 't':
+        case 'r':
+        case 'R':
+        case 'w':
+            command->data.text = reader_string(reader, cached->data.text);
+            break;
+        case 's':
+            command->data.substitute.regex =
+                reader_regex(reader, cached->data.substitute.regex, true);
+            command->data.substitute.replacement =
+                reader_string(reader, cached->data.substitute.replacement);
+            command->data.substitute.occurence_index =
+                cached->data.substitute.occurence_index;
+            command->data.substitute.global = cached->data.substitute.global;
+            command->data.substitute.print = cached->data.substitute.print;
+            command->data.substitute.write_filepath =
+                reader_string(reader, cached->data.substitute.write_filepath);
+            break;
+        case 'y':
+            command->data.translate.from =
+                reader_string(reader, cached->data.translate.from);
+            command->data.translate.to =
+                reader_string(reader, cached->data.translate.to);
+            break;
+        }
+        if (reader->invalid)
+            return NULL;
+    }
+    return commands;
+}
+
+// Returns the cached script, NULL if there is none, if it is invalid or if it
+// was parsed from another script with the same key.
+script_t
+script_cache_load(const char *dir, uint64_t key, const char *script_string)
+{
+    char *filepath = script_cache_filepath(dir, key);
+    int   fd = open(filepath, O_RDONLY);
+    free(filepath);
+    if (fd == -1)
+        return NULL;
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) == -1 ||
+        (size_t)statbuf.st_size < sizeof(struct cache_header))
+    {
+        close(fd);
+        return NULL;
+    }
+    size_t size = statbuf.st_size;
+    void  *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    struct cache_reader reader;
+    reader.header = map;
+    reader.commands = (const struct cache_command *)(reader.header + 1);
+    reader.regexes =
+        (const struct cache_regex *)(reader.commands + reader.header->commands_len);
+    reader.strings = (const char *)(reader.regexes + reader.header->regexes_len);
+    reader.invalid = false;
+    const struct cache_header *header = reader.header;
+    const char                *text = reader.strings + header->strings_len;
+    // the sections are checked against the size before anything past the header
+    // is read
+    size_t sections_size =
+        (size_t)header->commands_len * sizeof(struct cache_command) +
+        (size_t)header->regexes_len * sizeof(struct cache_regex) +
+        header->strings_len + header->text_len;
+    if (memcmp(header->magic, SCRIPT_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->key != key || header->version != SCRIPT_CACHE_VERSION ||
+        sizeof(struct cache_header) + sections_size != size ||
+        !reader_range_valid(&reader, 0, header->script_len, COMMAND_LAST) ||
+        (header->strings_len > 0 && text[-1] != '\0') ||
+        header->text_len != strlen(script_string) ||
+        memcmp(text, script_string, header->text_len) != 0)
+    {
+        munmap(map, size);
+        return NULL;
+    }
+    // the script owns a copy of the strings so that the file can be unmapped
+    reader.strings =
+        arena_strndup(&script_arena, reader.strings, header->strings_len);
+    script_t script = reader_commands(&reader, 0, header->script_len);
+    munmap(map, size);
+    return reader.invalid ? NULL : script;
+}
@@ -0,0 +1,265 @@
+#include "sed.h"
+#include <sys/stat.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// Transparent decompression of gzip and zstd input files.
+//
+// The format is recognized by the magic bytes starting the file, a regular file
+// is peeked at without moving its offset, a pipe has the bytes of its first read
+// kept by the decoder. Plain regular files don't get a decoder and are read as
+// before. Concatenated members (gzip) and frames (zstd) are decompressed one
+// after the other, like zcat does.
+
+#define DECODER_BUF_SIZE 65536
+#define MAGIC_LEN 4
+
+enum decoder_format
+{
+    // a pipe whose first bytes were read to look for a magic number
+    FORMAT_PLAIN,
+    FORMAT_GZIP,
+    FORMAT_ZSTD,
+};
+
+struct decoder
+{
+    enum decoder_format format;
+    int                 fd;
+    // data read from fd and not decoded yet
+    unsigned char *in;
+    size_t         in_start;
+    size_t         in_end;
+    bool           in_eof;
+    // the end of a member or frame was reached and nothing follows it yet
+    bool ended;
+#ifdef HAVE_ZLIB
+    z_stream zstream;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *dstream;
+#endif
+};
+
+static enum decoder_format
+format_detect(const unsigned char *magic, size_t len)
+{
+#ifdef HAVE_ZLIB
+    if (len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+        return FORMAT_GZIP;
+#endif
+#ifdef HAVE_ZSTD
+    if (len >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f &&
+        magic[3] == 0xfd)
+        return FORMAT_ZSTD;
+#endif
+    (void)magic;
+    (void)len;
+    return FORMAT_PLAIN;
+}
+
+// Returns the decoder of fd, NULL if it's read as is. Only regular files and pipes
+// are looked at.
+struct decoder *
+decoder_open(int fd)
+{
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) == -1)
+        return NULL;
+    unsigned char magic[MAGIC_LEN];
+    ssize_t       len;
+    if (S_ISREG(statbuf.st_mode))
+    {
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+        if (offset == -1)
+            return NULL;
+        do
+            len = pread(fd, magic, MAGIC_LEN, offset);
+        while (len == -1 && errno == EINTR);
+        if (len == -1 || format_detect(magic, len) == FORMAT_PLAIN)
+            return NULL;
+    }
+    else if (S_ISFIFO(statbuf.st_mode))
+    {
+        // a single read, waiting for more would hold a short first line back. A
+        // magic number cut short is read as plain text, an error is reported by
+        // the next read.
+        do
+            len = read(fd, magic, MAGIC_LEN);
+        while (len == -1 && errno == EINTR);
+        if (len == -1)
+            len = 0;
+    }
+    else
+        return NULL;
+    struct decoder *decoder = xmalloc(sizeof(struct decoder));
+    memset(decoder, 0, sizeof(struct decoder));
+    decoder->format = format_detect(magic, len);
+    decoder->fd = fd;
+    decoder->in = xmalloc(DECODER_BUF_SIZE);
+    if (!S_ISREG(statbuf.st_mode))
+    {
+        memcpy(decoder->in, magic, len);
+        decoder->in_end = len;
+    }
+#ifdef HAVE_ZLIB
+    // 15 bits of window, + 16 for a gzip header
+    if (decoder->format == FORMAT_GZIP &&
+        inflateInit2(&decoder->zstream, 15 + 16) != Z_OK)
+        die("couldn't initialize zlib");
+#endif
+#ifdef HAVE_ZSTD
+    if (decoder->format == FORMAT_ZSTD &&
+        (decoder->dstream = ZSTD_createDStream()) == NULL)
+        die("couldn't initialize zstd");
+#endif
+    return decoder;
+}
+
+void
+decoder_free(struct decoder *decoder)
+{
+    if (decoder == NULL)
+        return;
+#ifdef HAVE_ZLIB
+    if (decoder->format == FORMAT_GZIP)
+        inflateEnd(&decoder->zstream);
+#endif
+#ifdef HAVE_ZSTD
+    if (decoder->format == FORMAT_ZSTD)
+        ZSTD_freeDStream(decoder->dstream);
+#endif
+    free(decoder->in);
+    free(decoder);
+}
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+// Read more compressed data if everything read was decoded, returns false at the
+// end of the file (or with errno set on an error)
+static bool
+decoder_fill(struct decoder *decoder)
+{
+    if (decoder->in_start < decoder->in_end)
+        return true;
+    if (decoder->in_eof)
+        return false;
+    ssize_t ret;
+    do
+        ret = read(decoder->fd, decoder->in, DECODER_BUF_SIZE);
+    while (ret == -1 && errno == EINTR);
+    if (ret <= 0)
+    {
+        decoder->in_eof = ret == 0;
+        return false;
+    }
+    decoder->in_start = 0;
+    decoder->in_end = ret;
+    return true;
+}
+
+// The compressed data is invalid or truncated
+static ssize_t
+decoder_corrupted(void)
+{
+    errno = EBADMSG;
+    return -1;
+}
+#endif
+
+#ifdef HAVE_ZLIB
+static ssize_t
+gzip_read(struct decoder *decoder, char *buf, size_t len)
+{
+    z_stream *zstream = &decoder->zstream;
+    zstream->next_out = (unsigned char *)buf;
+    zstream->avail_out = len;
+    while (zstream->avail_out == len)
+    {
+        if (!decoder_fill(decoder))
+        {
+            if (!decoder->in_eof)
+                return -1;
+            // a truncated member
+            if (!decoder->ended)
+                return decoder_corrupted();
+            return 0;
+        }
+        // a new member follows the previous one
+        if (decoder->ended)
+        {
+            inflateReset(zstream);
+            decoder->ended = false;
+        }
+        zstream->next_in = decoder->in + decoder->in_start;
+        zstream->avail_in = decoder->in_end - decoder->in_start;
+        int ret = inflate(zstream, Z_NO_FLUSH);
+        decoder->in_start = decoder->in_end - zstream->avail_in;
+        if (ret == Z_STREAM_END)
+            decoder->ended = true;
+        else if (ret != Z_OK && ret != Z_BUF_ERROR)
+            return decoder_corrupted();
+    }
+    return len - zstream->avail_out;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static ssize_t
+zstd_read(struct decoder *decoder, char *buf, size_t len)
+{
+    ZSTD_outBuffer out = {buf, len, 0};
+    while (out.pos == 0)
+    {
+        if (!decoder_fill(decoder))
+        {
+            if (!decoder->in_eof)
+                return -1;
+            // a truncated frame
+            if (!decoder->ended)
+                return decoder_corrupted();
+            return 0;
+        }
+        ZSTD_inBuffer in = {decoder->in, decoder->in_end, decoder->in_start};
+        size_t        ret = ZSTD_decompressStream(decoder->dstream, &out, &in);
+        decoder->in_start = in.pos;
+        if (ZSTD_isError(ret))
+            return decoder_corrupted();
+        // 0 once a frame is complete and flushed
+        decoder->ended = ret == 0;
+    }
+    return out.pos;
+}
+#endif
+
+// Like read(2), fills buf with at most len bytes of decompressed data
+ssize_t
+decoder_read(struct decoder *decoder, char *buf, size_t len)
+{
+    switch (decoder->format)
+    {
+    case FORMAT_PLAIN:
+        if (decoder->in_start < decoder->in_end)
+        {
+            if (decoder->in_end - decoder->in_start < len)
+                len = decoder->in_end - decoder->in_start;
+            memcpy(buf, decoder->in + decoder->in_start, len);
+            decoder->in_start += len;
+            return len;
+        }
+        return read(decoder->fd, buf, len);
+    case FORMAT_GZIP:
+#ifdef HAVE_ZLIB
+        return gzip_read(decoder, buf, len);
+#endif
+    case FORMAT_ZSTD:
+#ifdef HAVE_ZSTD
+        return zstd_read(decoder, buf, len);
+#endif
+        break;
+    }
+    return 0;
+}
@@ -3,197 +3,516 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define CHAR_SPACE_MAX 20480
-// need under buffer for implementation of the 'x' command (can't swap array aka
-// constant pointers)
-static char   pattern_space_under[CHAR_SPACE_MAX + 1] = {'\0'};
-static char   hold_space_under[CHAR_SPACE_MAX + 1] = {'\0'};
-static char  *pattern_space = pattern_space_under;
-static char  *hold_space = hold_space_under;
-static size_t line_index = 0;
-static bool   last_line = false;
-static bool   auto_print = false;
+// The state of the run is kept in the context (see sed.h), the script is only
+// read.
 
 char *
-next_line(void);
+next_line(struct context *ctx);
+
+// \0 to \9
+#define SUBSTITUTE_NMATCH_MAX 10
+
+static void
+pattern_space_changed(struct context *ctx)
+{
+    ctx->pattern_generation++;
+}
+
+// Results of the regexes run on the pattern space since it last changed, so that
+// testing the same regex again (e.g. `/foo/s//bar/; /foo/p`) doesn't run it. The
+// offsets are only known for regexes compiled with submatches.
+#define MATCH_MEMO_LEN 8
+
+struct match_memo
+{
+    const struct regex *regex;
+    uint64_t            generation;
+    bool                matched;
+    regmatch_t          pmatch[SUBSTITUTE_NMATCH_MAX];
+};
+
+static struct match_memo *
+match_memo_slot(struct context *ctx, const struct regex *regex)
+{
+    if (ctx->match_memo == NULL)
+    {
+        ctx->match_memo = xmalloc(sizeof(struct match_memo) * MATCH_MEMO_LEN);
+        memset(ctx->match_memo, 0, sizeof(struct match_memo) * MATCH_MEMO_LEN);
+    }
+    return &ctx->match_memo[((uintptr_t)regex / sizeof(struct regex)) %
+                            MATCH_MEMO_LEN];
+}
+
+// Number of submatches asked to regexec for regex
+static size_t
+regex_nmatch(const struct regex *regex)
+{
+    if (regex->nosub)
+        return 0;
+    return regex->preg.re_nsub + 1 < SUBSTITUTE_NMATCH_MAX ? regex->preg.re_nsub + 1
+                                                           : SUBSTITUTE_NMATCH_MAX;
+}
+
+// Match regex on the len bytes of s, the forms recognized by regex.c are matched
+// without regexec. An anchored regex is only run at the beginning of a line.
+static bool
+regex_run(const struct regex *regex,
+          const char         *s,
+          size_t              len,
+          regmatch_t         *pmatch,
+          int                 eflags)
+{
+    if (regex->anchor != ANCHOR_NONE)
+        return regex_anchored_match(regex, s, len, pmatch);
+    if (regex->folded)
+        return regex_folded_match(regex, s, len, pmatch);
+    return regexec(&regex->preg, s, regex_nmatch(regex), pmatch, eflags) == 0;
+}
+
+// Run regex on the whole pattern space, the result is memoized until the pattern
+// space changes. pmatch is set if regex has submatches.
+static bool
+pattern_space_match(struct context     *ctx,
+                    const struct regex *regex,
+                    regmatch_t        **pmatch)
+{
+    struct match_memo *memo = match_memo_slot(ctx, regex);
+    if (memo->regex != regex || memo->generation != ctx->pattern_generation)
+    {
+        memo->regex = regex;
+        memo->generation = ctx->pattern_generation;
+        memo->matched = regex_run(regex,
+                                  space_string(&ctx->pattern_space),
+                                  space_len(&ctx->pattern_space),
+                                  memo->pmatch,
+                                  0);
+    }
+    if (pmatch != NULL)
+        *pmatch = memo->pmatch;
+    return memo->matched;
+}
+
+struct regex *
+exec_regex_resolve(struct context *ctx, struct regex *regex)
+{
+    if (regex->compiled)
+        return ctx->last_regex = regex;
+    if (ctx->last_regex == NULL)
+        die("no previous regular expression");
+    return ctx->last_regex;
+}
+
+// Output of the `a`, `r` and `R` commands, written along with the pattern space at
+// the end of the cycle. Lines read by `R` are the only entries owned by the queue.
+
+static void
+append_queue_grow(struct context *ctx)
+{
+    ctx->append_queue_capacity =
+        ctx->append_queue_capacity == 0 ? 16 : ctx->append_queue_capacity * 2;
+    ctx->append_queue = xrealloc(ctx->append_queue,
+                                 sizeof(struct iovec) * ctx->append_queue_capacity);
+}
+
+static void
+append_queue_push(struct context *ctx, const char *s, size_t len)
+{
+    if (ctx->append_queue_len >= ctx->append_queue_capacity)
+        append_queue_grow(ctx);
+    ctx->append_queue[ctx->append_queue_len].iov_base = (void *)s;
+    ctx->append_queue[ctx->append_queue_len].iov_len = len;
+    ctx->append_queue_len++;
+}
+
+static void
+append_lines_push(struct context *ctx, char *line)
+{
+    if (ctx->append_lines_len == ctx->append_lines_capacity)
+    {
+        ctx->append_lines_capacity =
+            ctx->append_lines_capacity == 0 ? 4 : ctx->append_lines_capacity * 2;
+        ctx->append_lines =
+            xrealloc(ctx->append_lines, sizeof(char *) * ctx->append_lines_capacity);
+    }
+    ctx->append_lines[ctx->append_lines_len++] = line;
+}
+
+static void
+append_lines_clear(struct context *ctx)
+{
+    for (size_t i = 0; i < ctx->append_lines_len; i++)
+        free(ctx->append_lines[i]);
+    ctx->append_lines_len = 0;
+}
+
+// Write the pattern space (if print_pattern_space) and the queued output in one
+// batch
+static void
+append_queue_flush(struct context *ctx, bool print_pattern_space)
+{
+    if (ctx->append_queue_len == 2 && !print_pattern_space)
+        return;
+    if (ctx->append_queue == NULL)
+        append_queue_grow(ctx);
+    struct iovec *queue = ctx->append_queue;
+    size_t        start = 2;
+    bool          defer_separator = false;
+    if (print_pattern_space)
+    {
+        start = 0;
+        size_t      separator_len;
+        const char *separator = input_separator(ctx, &separator_len);
+        queue[0].iov_base = NULL;
+        queue[0].iov_len = 0;
+        // a pattern space made of several pieces is written piece by piece first
+        if (space_is_flat(&ctx->pattern_space))
+        {
+            queue[0].iov_base = (void *)space_string(&ctx->pattern_space);
+            queue[0].iov_len = space_len(&ctx->pattern_space);
+        }
+        else
+            space_output(ctx, &ctx->pattern_space);
+        queue[1].iov_base = (void *)separator;
+        queue[1].iov_len = separator_len;
+        // the last line had no separator, it's only written if output follows
+        if (!input_line_terminated(ctx) && ctx->append_queue_len == 2)
+        {
+            queue[1].iov_len = 0;
+            defer_separator = true;
+        }
+    }
+    output_writev(ctx, queue + start, ctx->append_queue_len - start);
+    if (defer_separator)
+        output_separator(ctx);
+    ctx->append_queue_len = 2;
+    append_lines_clear(ctx);
+    cached_files_release(ctx);
+}
+
+void
+exec_end_cycle(struct context *ctx)
+{
+    append_queue_flush(ctx, ctx->auto_print && !ctx->cycle_deleted);
+    ctx->cycle_deleted = false;
+}
+
+// Write the pattern space and its separator
+static void
+print_pattern_space(struct context *ctx)
+{
+    space_output(ctx, &ctx->pattern_space);
+    output_separator(ctx);
+}
+
+// Write the pattern space and its separator to a `w` file
+static void
+write_pattern_space(struct context *ctx, const char *filepath)
+{
+    struct write_target *target = write_target_get(ctx, filepath);
+    size_t               separator_len;
+    const char          *separator = input_separator(ctx, &separator_len);
+    write_target_write(ctx,
+                       target,
+                       space_string(&ctx->pattern_space),
+                       space_len(&ctx->pattern_space));
+    if (input_line_terminated(ctx))
+        write_target_write(ctx, target, separator, separator_len);
+}
 
 void
-exec_insert(union command_data *data)
+exec_insert(struct context *ctx, union command_data *data)
 {
-    fputs(data->text, stdout);
+    struct iovec iov[] = {{data->text, strlen(data->text)}, {"\n", 1}};
+    output_writev(ctx, iov, 2);
 }
 
 void
-exec_read_file(union command_data *data)
+exec_append(struct context *ctx, union command_data *data)
 {
-    FILE *file = fopen(data->text, "r");
-    if (file == NULL)
+    append_queue_push(ctx, data->text, strlen(data->text));
+    append_queue_push(ctx, "\n", 1);
+}
+
+void
+exec_read_file(struct context *ctx, union command_data *data)
+{
+    size_t      len;
+    const char *content = cached_file_get(ctx, data->text, &len);
+    if (content == NULL)
         return;
-    char c;
-    while ((c = fgetc(file)) != EOF)
-        fputc(c, stdout);
+    append_queue_push(ctx, content, len);
 }
 
 void
-exec_delete()
+exec_read_line(struct context *ctx, union command_data *data)
 {
-    pattern_space[0] = '\0';
+    size_t len;
+    char  *line = line_reader_next(ctx, data->text, &len);
+    if (line == NULL)
+        return;
+    char *copy = xmalloc(len + 1);
+    memcpy(copy, line, len);
+    copy[len] = '\n';
+    append_lines_push(ctx, copy);
+    append_queue_push(ctx, copy, len + 1);
 }
 
 void
-exec_delete_newline()
+exec_delete(struct context *ctx, union command_data *data)
 {
-    char *newline = strchr(pattern_space, '\n');
+    (void)data;
+    space_set(&ctx->pattern_space, "", 0);
+    pattern_space_changed(ctx);
+    ctx->cycle_deleted = true;
+}
+
+void
+exec_delete_newline(struct context *ctx, union command_data *data)
+{
+    const size_t len = space_len(&ctx->pattern_space);
+    const char  *space = space_string(&ctx->pattern_space);
+    const char  *newline = memchr(space, '\n', len);
     if (newline == NULL)
     {
-        exec_delete();
+        exec_delete(ctx, data);
         return;
     }
-    memmove(pattern_space, newline + 1, strlen(newline + 1) + 1);
-    if (pattern_space[0] == '\0')
-        ;  // load new line
+    size_t deleted = newline + 1 - space;
+    space_remove_prefix(&ctx->pattern_space, deleted);
+    pattern_space_changed(ctx);
+    ctx->cycle_deleted = true;
+    // the next cycle starts with what's left, even if it's empty
+    ctx->cycle_restart = true;
 }
 
 void
-exec_replace_pattern_by_hold()
+exec_replace_pattern_by_hold(struct context *ctx, union command_data *data)
 {
-    strncpy(pattern_space, hold_space, CHAR_SPACE_MAX);
+    (void)data;
+    space_assign(&ctx->pattern_space, &ctx->hold_space);
+    pattern_space_changed(ctx);
 }
 
 void
-exec_append_pattern_by_hold()
+exec_append_pattern_by_hold(struct context *ctx, union command_data *data)
 {
-    char *pattern_space_end = pattern_space + strlen(pattern_space);
-    strncat(pattern_space_end, "\n", CHAR_SPACE_MAX);
-    strncat(pattern_space_end, hold_space, CHAR_SPACE_MAX);
+    (void)data;
+    space_concat(&ctx->pattern_space, &ctx->hold_space);
+    pattern_space_changed(ctx);
 }
 
 void
-exec_replace_hold_by_pattern()
+exec_replace_hold_by_pattern(struct context *ctx, union command_data *data)
 {
-    strncpy(hold_space, pattern_space, CHAR_SPACE_MAX);
+    (void)data;
+    space_assign(&ctx->hold_space, &ctx->pattern_space);
 }
 
 void
-exec_append_hold_by_pattern()
+exec_append_hold_by_pattern(struct context *ctx, union command_data *data)
 {
-    char *hold_space_end = hold_space + strlen(hold_space);
-    strncat(hold_space_end, "\n", CHAR_SPACE_MAX);
-    strncat(hold_space_end, pattern_space, CHAR_SPACE_MAX);
+    (void)data;
+    space_concat(&ctx->hold_space, &ctx->pattern_space);
 }
 
 void
-exec_print(union command_data *data)
+exec_print(struct context *ctx, union command_data *data)
 {
     (void)data;
-    fputs(pattern_space, stdout);
+    print_pattern_space(ctx);
 }
 
 void
-exec_print_until_newline()
+exec_print_until_newline(struct context *ctx, union command_data *data)
 {
-    size_t newline_index = strcspn(pattern_space, "\n");
-    fwrite(pattern_space, sizeof(*pattern_space), newline_index, stdout);
+    (void)data;
+    const char *space = space_string(&ctx->pattern_space);
+    output_write(ctx, space, strcspn(space, "\n"));
+    output_separator(ctx);
 }
 
 void
-exec_exchange()
+exec_exchange(struct context *ctx, union command_data *data)
 {
-    char *tmp = hold_space;
-    hold_space = pattern_space;
-    pattern_space = tmp;
+    (void)data;
+    space_swap(&ctx->pattern_space, &ctx->hold_space);
+    pattern_space_changed(ctx);
 }
 
 void
-exec_translate(union command_data *data)
+exec_translate(struct context *ctx, union command_data *data)
 {
-    char *from = data->translate.from;
-    for (size_t i = 0; pattern_space[i] != '\0'; i++)
+    char        *from = data->translate.from;
+    const size_t len = space_len(&ctx->pattern_space);
+    char        *space = space_mutable(&ctx->pattern_space, len);
+    for (size_t i = 0; i < len; i++)
     {
-        char *from_found = strchr(from, pattern_space[i]);
+        char *from_found = strchr(from, space[i]);
         if (from_found == NULL)
             continue;
-        pattern_space[i] = data->translate.to[from_found - from];
+        space[i] = data->translate.to[from_found - from];
+    }
+    pattern_space_changed(ctx);
+}
+
+// The result of a substitution is built in the substitute buffer of the context,
+// it then replaces the pattern space
+static void
+substitute_append(struct context *ctx, const char *s, size_t len)
+{
+    if (ctx->substitute_buf_len + len > ctx->substitute_buf_capacity)
+    {
+        while (ctx->substitute_buf_len + len > ctx->substitute_buf_capacity)
+            ctx->substitute_buf_capacity = ctx->substitute_buf_capacity == 0
+                                               ? 4096
+                                               : ctx->substitute_buf_capacity * 2;
+        ctx->substitute_buf =
+            xrealloc(ctx->substitute_buf, ctx->substitute_buf_capacity);
+    }
+    memcpy(ctx->substitute_buf + ctx->substitute_buf_len, s, len);
+    ctx->substitute_buf_len += len;
+}
+
+// Append the replacement of the match in space described by pmatch
+static void
+substitute_append_replacement(struct context   *ctx,
+                              const char       *replacement,
+                              const char       *space,
+                              const regmatch_t *pmatch,
+                              size_t            nmatch)
+{
+    while (*replacement != '\0')
+    {
+        size_t literal_len = strcspn(replacement, "&\\");
+        substitute_append(ctx, replacement, literal_len);
+        replacement += literal_len;
+        if (*replacement == '\0')
+            break;
+        size_t group;
+        if (*replacement == '&')
+            group = 0;
+        else if (isdigit(replacement[1]))
+            group = todigit(*++replacement);
+        else
+        {
+            // any other escaped character stands for itself, e.g. `\&`
+            if (*++replacement == '\0')
+                break;
+            substitute_append(ctx, replacement++, 1);
+            continue;
+        }
+        replacement++;
+        if (group < nmatch && pmatch[group].rm_so != -1)
+            substitute_append(ctx,
+                              space + pmatch[group].rm_so,
+                              pmatch[group].rm_eo - pmatch[group].rm_so);
     }
 }
 
-#define SUBSTITUTE_NMATCH 10
+static void
+substitute_done(struct context *ctx, union command_data *data)
+{
+    pattern_space_changed(ctx);
+    if (data->substitute.print)
+        print_pattern_space(ctx);
+    if (data->substitute.write_filepath != NULL)
+        write_pattern_space(ctx, data->substitute.write_filepath);
+}
+
+// Substitution of an anchored regex (see regex.c), which matches once at most. The
+// replacement is put in place of the match, e.g. `s/$/;/` appends to the pattern
+// space without copying it.
+static void
+substitute_anchored(struct context     *ctx,
+                    union command_data *data,
+                    const regmatch_t   *pmatch)
+{
+    const char  *space = space_string(&ctx->pattern_space);
+    const size_t len = space_len(&ctx->pattern_space);
+    const size_t start = pmatch[0].rm_so;
+    const size_t end = pmatch[0].rm_eo;
+    ctx->substitute_buf_len = 0;
+    substitute_append_replacement(
+        ctx, data->substitute.replacement, space, pmatch, 1);
+    const size_t new_len = len - (end - start) + ctx->substitute_buf_len;
+    char        *mutable = space_mutable(&ctx->pattern_space, new_len);
+    memmove(mutable + start + ctx->substitute_buf_len, mutable + end, len - end);
+    memcpy(mutable + start, ctx->substitute_buf, ctx->substitute_buf_len);
+    space_set_len(&ctx->pattern_space, new_len);
+    substitute_done(ctx, data);
+}
 
 void
-exec_substitute(union command_data *data)
+exec_substitute(struct context *ctx, union command_data *data)
 {
-    assert(data->substitute.preg.re_nsub <= SUBSTITUTE_NMATCH - 1);
-    if (data->substitute.occurence_index == 0)
-        data->substitute.occurence_index = 1;
-    char      *space = pattern_space;
-    regmatch_t pmatch[SUBSTITUTE_NMATCH + 1];
-    bool       found = false;
-    for (size_t occurence = 1;
-         *space != '\0' &&
-         regexec(&data->substitute.preg, space, SUBSTITUTE_NMATCH, pmatch, 0) == 0;
-         occurence++)
+    // 0 is the same as 1 (the default)
+    const size_t wanted = data->substitute.occurence_index > 1
+                              ? data->substitute.occurence_index
+                              : 1;
+    const struct regex *regex = exec_regex_resolve(ctx, data->substitute.regex);
+    assert(!regex->nosub);
+    // only the groups of the regex are asked for
+    const size_t nmatch = regex_nmatch(regex);
+    const char  *space = space_string(&ctx->pattern_space);
+    const char  *space_end = space + space_len(&ctx->pattern_space);
+    // the part of the pattern space before copied isn't in the result yet
+    const char *copied = space;
+    regmatch_t  pmatch[SUBSTITUTE_NMATCH_MAX];
+    regmatch_t *first_pmatch;
+    bool        found = false;
+    int         eflags = 0;
+    // space starts right where the previous match ended
+    bool   after_match = false;
+    size_t occurence = 0;
+    // the first match is usually known already from an address
+    if (!pattern_space_match(ctx, regex, &first_pmatch))
+        return;
+    if (regex->anchor != ANCHOR_NONE)
     {
-        found = true;
-        if (occurence < data->substitute.occurence_index)
+        if (wanted == 1)
+            substitute_anchored(ctx, data, first_pmatch);
+        return;
+    }
+    memcpy(pmatch, first_pmatch, sizeof(regmatch_t) * nmatch);
+    ctx->substitute_buf_len = 0;
+    for (bool matched = true; matched;
+         matched = regex_run(regex, space, space_end - space, pmatch, eflags))
+    {
+        // the rest of the pattern space isn't the beginning of a line
+        eflags = REG_NOTBOL;
+        const bool empty_match = pmatch[0].rm_so == pmatch[0].rm_eo;
+        // an empty match right after a match doesn't count, e.g. s/b*/-/g on
+        // "abc" gives "-a-c-"
+        if (empty_match && pmatch[0].rm_so == 0 && after_match)
         {
-            space += pmatch[0].rm_eo;
+            if (*space == '\0')
+                break;
+            space++;
+            after_match = false;
             continue;
         }
-        char *replacement = xstrdup(data->substitute.replacement);
-        for (char *r = replacement; *r != '\0'; r++)
+        occurence++;
+        if (occurence >= wanted)
         {
-            size_t group = -1;
-            if (*r == '&')
-                group = 0;
-            else if (*r == '\\')
-            {
-                memmove(r, r + 1, strlen(r + 1) + 1);
-                if (isdigit(*r))
-                    group = todigit(*r);
-            }
-            if (group == -1)
-                continue;
-            memmove(r, r + 1, strlen(r + 1) + 1);
-            if (pmatch[group].rm_so == -1 || pmatch[group].rm_eo == -1)
-            {
-                r--;
-                continue;
-            }
-            size_t group_len = pmatch[group].rm_eo - pmatch[group].rm_so;
-            size_t old_offset = r - replacement;
-            replacement = xrealloc(replacement, strlen(replacement) + group_len + 1);
-            r = replacement + old_offset;
-            memmove(r + group_len, r, strlen(r) + 1);
-            memcpy(r, space + pmatch[group].rm_so, group_len);
-            r += group_len - 1;
+            found = true;
+            substitute_append(ctx, copied, space + pmatch[0].rm_so - copied);
+            substitute_append_replacement(
+                ctx, data->substitute.replacement, space, pmatch, nmatch);
+            copied = space + pmatch[0].rm_eo;
+            if (!data->substitute.global)
+                break;
         }
-        char  *dest = space + pmatch[0].rm_so;
-        char  *src = space + pmatch[0].rm_eo;
-        size_t replacement_len = strlen(replacement);
-        memmove(dest + replacement_len, src, strlen(src) + 1);
-        memcpy(dest, replacement, replacement_len);
-        free(replacement);
-        if (!data->substitute.global &&
-            occurence == data->substitute.occurence_index)
-            break;
-        space += replacement_len;
-    }
-    if (data->substitute.print && found)
-        fputs(pattern_space, stdout);
-    if (data->substitute.write_filepath != NULL && found)
-    {
-        // This is pretty inefficient since we reopen the file on every substitute
-        FILE *file = fopen(data->substitute.write_filepath, "a");
-        if (file == NULL)
-            die("couldn't open file %s: %s",
-                data->substitute.write_filepath,
-                strerror(errno));
-        fputs(pattern_space, file);
-        fclose(file);
+        space += pmatch[0].rm_eo;
+        after_match = true;
     }
+    if (!found)
+        return;
+    substitute_append(ctx, copied, space_end - copied);
+    space_set(&ctx->pattern_space, ctx->substitute_buf, ctx->substitute_buf_len);
+    substitute_done(ctx, data);
 }
 
-static const char *reverse_available_escape = "\\\a\b\t\r\v\f";
+static const char *reverse_available_escape = "\\\a\b\t\r\v\f\n";
 static const char  reverse_escape_lookup[] = {
     ['\\'] = '\\',
     ['\a'] = 'a',
@@ -202,104 +521,125 @@ static const char  reverse_escape_lookup[] = {
     ['\r'] = 'r',
     ['\v'] = 'v',
     ['\f'] = 'f',
+    ['\n'] = 'n',
 };
 
 static const size_t print_escape_line_wrap = 60;
 
 void
-exec_print_escape(union command_data *data)
+exec_print_escape(struct context *ctx, union command_data *data)
 {
+    (void)data;
     size_t len = 1;
-    for (char *space = pattern_space; *space != '\0'; space++, len++)
+    for (const char *space = space_string(&ctx->pattern_space); *space != '\0';
+         space++, len++)
     {
-        if (strchr(reverse_available_escape, *space) != NULL)
+        // bytes above 0x7f are negative when char is signed
+        unsigned char c = *space;
+        char          buf[8];
+        if (strchr(reverse_available_escape, c) != NULL)
         {
-            fputc('\\', stdout);
-            fputc(reverse_escape_lookup[(size_t)*space], stdout);
+            buf[0] = '\\';
+            buf[1] = reverse_escape_lookup[c];
+            output_write(ctx, buf, 2);
             continue;
         }
-        else if (*space == '\n')
+        else if (isprint(c))
+            output_write(ctx, space, 1);
+        else
         {
-            fputc('$', stdout);
-            fputc('\n', stdout);
+            int buf_len = snprintf(buf, sizeof(buf), "\\%03o", c);
+            output_write(ctx, buf, buf_len);
         }
-        else if (isprint(*space))
-            fputc(*space, stdout);
-        else
-            printf("\\%03o", *space);
         if (len == print_escape_line_wrap)
+            output_write(ctx, "\\\n", 2);
+    }
+    output_write(ctx, "$\n", 2);
+}
+
+// Put the next line in the pattern space, or append it (`N`). Without one the
+// run is over, or the cycle is suspended when it hasn't been pushed yet.
+static void
+next_line_load(struct context *ctx, bool append)
+{
+    char *line = next_line(ctx);
+    if (line == NULL)
+    {
+        if (input_push_waiting(ctx))
         {
-            fputc('\\', stdout);
-            fputc('\n', stdout);
+            ctx->suspended = true;
+            return;
         }
+        // quit without printing (again for `n`)
+        ctx->quitting = true;
+        ctx->cycle_deleted = true;
+        return;
     }
+    if (append)
+        space_append(&ctx->pattern_space, line, ctx->line_len, true);
+    else
+        space_set(&ctx->pattern_space, line, ctx->line_len);
+    pattern_space_changed(ctx);
 }
 
 void
-exec_next(union command_data *data)
+exec_next(struct context *ctx, union command_data *data)
 {
     (void)data;
-    if (auto_print)
-        fputs(pattern_space, stdout);
-    char *line = next_line();
-    if (line == NULL)
-        exit(EXIT_SUCCESS);
-    strncpy(pattern_space, line, CHAR_SPACE_MAX);
+    append_queue_flush(ctx, ctx->auto_print);
+    next_line_load(ctx, false);
 }
 
 void
-exec_next_append(union command_data *data)
+exec_next_append(struct context *ctx, union command_data *data)
 {
     (void)data;
-    char *line = next_line();
-    if (line == NULL)
-        exit(EXIT_SUCCESS);
-    strncat(pattern_space, "\n", CHAR_SPACE_MAX);
-    strncat(pattern_space, line, CHAR_SPACE_MAX);
+    append_queue_flush(ctx, false);
+    next_line_load(ctx, true);
 }
 
 void
-exec_quit(union command_data *data)
+exec_quit(struct context *ctx, union command_data *data)
 {
     (void)data;
-    exit(EXIT_SUCCESS);
+    exec_end_cycle(ctx);
+    ctx->quitting = true;
+    ctx->cycle_deleted = true;
 }
 
 void
-exec_print_line_number(union command_data *data)
+exec_print_line_number(struct context *ctx, union command_data *data)
 {
     (void)data;
-    printf("%zu\n", line_index);
+    char buf[32];
+    output_write(ctx, buf, snprintf(buf, sizeof(buf), "%zu\n", ctx->line_index));
 }
 
 void
-exec_comment(union command_data *data)
+exec_comment(struct context *ctx, union command_data *data)
 {
+    (void)ctx;
     (void)data;
 }
 
 void
-exec_write(union command_data *data)
+exec_write(struct context *ctx, union command_data *data)
 {
-    FILE *file = fopen(data->text, "a");
-    if (file == NULL)
-        die("couldn't open file %s: %s", data->text, strerror(errno));
-    fputs(pattern_space, file);
-    fclose(file);
+    write_pattern_space(ctx, data->text);
 }
 
-typedef void (*exec_func)(union command_data *data);
-
+typedef void (*exec_func)(struct context *ctx, union command_data *data);
 static const exec_func exec_func_lookup[] = {
     ['{'] = NULL,
     ['}'] = NULL,
-    ['a'] = NULL,
+    ['a'] = exec_append,
     ['c'] = NULL,
     ['i'] = exec_insert,
     [':'] = NULL,
     ['b'] = NULL,
     ['t'] = NULL,
     ['r'] = exec_read_file,
+    ['R'] = exec_read_line,
     ['w'] = exec_write,
     ['d'] = exec_delete,
     ['D'] = exec_delete_newline,
@@ -321,240 +661,390 @@ static const exec_func exec_func_lookup[] = {
 };
 
 void
-exec_command(struct command *command)
+exec_command(struct context *ctx, struct command *command)
 {
-    (exec_func_lookup[(size_t)command->id])(&command->data);
+    (exec_func_lookup[(size_t)command->id])(ctx, &command->data);
 }
 
+// Whether the current line is the last one, looked up the first time it's asked
 static bool
-address_match(struct address *address)
+last_line(struct context *ctx)
+{
+    if (ctx->last_line_pending)
+        ctx->last_line = input_last_line(ctx);
+    ctx->last_line_pending = false;
+    return ctx->last_line;
+}
+
+static bool
+address_match(struct context *ctx, struct address *address)
 {
     switch (address->type)
     {
     case ADDRESS_LAST:
-        return last_line;
+        return last_line(ctx);
     case ADDRESS_LINE:
-        return line_index == address->data.line;
+        return ctx->line_index == address->data.line;
     case ADDRESS_RE:
-        return regexec(&address->data.preg, pattern_space, 0, NULL, 0) == 0;
+        return pattern_space_match(
+            ctx, exec_regex_resolve(ctx, address->data.regex), NULL);
     }
     return false;
 }
 
-void
-exec_commands(script_t commands)
+struct range
 {
-    for (struct command *command = commands; command->id != COMMAND_LAST; command++)
+    bool in_range;
+    // a range starting at a line number is only entered once
+    bool closed;
+};
+
+// The state of the range of addresses, ranges start closed on every run
+static struct range *
+range_state(struct context *ctx, const struct addresses *addresses)
+{
+    if (addresses->range >= ctx->ranges_len)
     {
-        assert(command->addresses.count <= 2);
-        bool match = false;
-        switch (command->addresses.count)
+        size_t len = ctx->ranges_len == 0 ? 16 : ctx->ranges_len;
+        while (addresses->range >= len)
+            len *= 2;
+        ctx->ranges = xrealloc(ctx->ranges, sizeof(struct range) * len);
+        memset(ctx->ranges + ctx->ranges_len,
+               0,
+               sizeof(struct range) * (len - ctx->ranges_len));
+        ctx->ranges_len = len;
+    }
+    return &ctx->ranges[addresses->range];
+}
+
+// Whether the addresses select the current line, regardless of `!`
+static bool
+addresses_match(struct context *ctx, struct addresses *addresses)
+{
+    assert(addresses->count <= 2);
+    bool          match = false;
+    struct range *range;
+    switch (addresses->count)
+    {
+    case 0:
+        match = true;
+        break;
+    case 1:
+        match = address_match(ctx, &addresses->addresses[0]);
+        break;
+    case 2:
+        range = range_state(ctx, addresses);
+        if (address_match(ctx, &addresses->addresses[0]) ||
+            // the line of the first address was skipped (e.g. by `d`), the range
+            // starts at the first line after it which reaches the command
+            (addresses->addresses[0].type == ADDRESS_LINE && !range->in_range &&
+             !range->closed && addresses->addresses[0].data.line < ctx->line_index))
+            range->in_range = true;
+        match = range->in_range;
+        if (address_match(ctx, &addresses->addresses[1]) ||
+            // Edge case when the second address line number is lower then the
+            // first one
+            (addresses->addresses[1].type == ADDRESS_LINE &&
+             addresses->addresses[1].data.line <= ctx->line_index))
         {
-        case 0:
-            match = true;
-            break;
-        case 1:
-            match = address_match(&command->addresses.addresses[0]);
-            break;
-        case 2:
-            if (address_match(&command->addresses.addresses[0]))
-                command->addresses.in_range = true;
-            match = command->addresses.in_range;
-            if (address_match(&command->addresses.addresses[1]) ||
-                // Edge case when the second address line number is lower then the
-                // first one
-                (command->addresses.addresses[1].type == ADDRESS_LINE &&
-                 command->addresses.addresses[1].data.line <= line_index))
-                command->addresses.in_range = false;
-            break;
+            if (range->in_range && addresses->addresses[0].type == ADDRESS_LINE)
+                range->closed = true;
+            range->in_range = false;
         }
-        if (command->inverse)
-            match = !match;
-        if (match)
+        break;
+    }
+    return match;
+}
+
+// Whether the command is executed on the current line
+bool
+exec_command_selected(struct context *ctx, struct command *command)
+{
+    return addresses_match(ctx, &command->addresses) != command->inverse;
+}
+
+static void
+exec_command_profiled(struct context *ctx, struct command *command)
+{
+    struct profile *profile = command->profile;
+    uint64_t        start = profile_clock();
+    profile->evaluations++;
+    bool match = addresses_match(ctx, &command->addresses);
+    if (match)
+        profile->matches++;
+    if (match != command->inverse)
+    {
+        profile->executions++;
+        exec_command(ctx, command);
+    }
+    profile->ticks += profile_clock() - start;
+}
+
+void
+exec_commands(struct context *ctx, script_t commands)
+{
+    for (struct command *command = commands; command->id != COMMAND_LAST; command++)
+    {
+        if (command->profile != NULL)
+            exec_command_profiled(ctx, command);
+        else if (exec_command_selected(ctx, command))
         {
-            exec_command(command);
+            exec_command(ctx, command);
             // next_command = exec_command(command);
             // if next_command == NULL then command++
             // else command = next_command
         }
+        if (ctx->suspended)
+        {
+            ctx->resume = command + 1;
+            return;
+        }
+        if (ctx->cycle_deleted)
+            return;
     }
 }
 
-static char  *filepaths_stdin_only[] = {"-"};
-static char **filepaths = NULL;
-static size_t filepaths_len = 0;
-
 void
-exec_init(char **local_filepaths, size_t local_filepaths_len, bool auto_print_)
+exec_init(struct context *ctx,
+          char          **local_filepaths,
+          size_t          local_filepaths_len,
+          bool            auto_print_)
 {
-    auto_print = auto_print_;
-    filepaths = local_filepaths;
-    filepaths_len = local_filepaths_len;
-    if (local_filepaths_len == 0)
-    {
-        filepaths = filepaths_stdin_only;
-        filepaths_len = 1;
-    }
+    ctx->auto_print = auto_print_;
+    input_init(ctx, local_filepaths, local_filepaths_len);
+    ctx->line_index = 0;
+    ctx->last_line = false;
+    ctx->last_line_pending = false;
+    ctx->streaming = false;
+    ctx->cycle_deleted = false;
+    ctx->cycle_restart = false;
+    ctx->quitting = false;
+    ctx->suspended = false;
+    ctx->resume = NULL;
+    ctx->last_regex = NULL;
+    space_free(&ctx->pattern_space);
+    space_free(&ctx->hold_space);
+    if (ctx->ranges != NULL)
+        memset(ctx->ranges, 0, sizeof(struct range) * ctx->ranges_len);
 }
 
+// Flush the output, close the files and release everything the context holds,
+// it's then back to CONTEXT_INIT
 void
-exec(script_t commands, char **local_filepaths, size_t local_filepaths_len, bool auto_print_)
+context_free(struct context *ctx)
 {
-    exec_init(local_filepaths, local_filepaths_len, auto_print_);
-    for (char *line = next_line(); line != NULL; line = next_line())
+    output_flush(ctx);
+    pipeline_stop(ctx);
+    write_targets_close(ctx);
+    output_free(ctx);
+    input_free(ctx);
+    uring_free(ctx);
+    stream_free(ctx);
+    space_free(&ctx->pattern_space);
+    space_free(&ctx->hold_space);
+    append_lines_clear(ctx);
+    free(ctx->append_lines);
+    free(ctx->append_queue);
+    free(ctx->line);
+    free(ctx->match_memo);
+    free(ctx->substitute_buf);
+    free(ctx->ranges);
+    *ctx = (struct context)CONTEXT_INIT;
+}
+
+// Run cycles until the end of the input, or until the next line hasn't been
+// pushed yet
+static void
+exec_cycles(struct context *ctx, script_t commands)
+{
+    while (!ctx->quitting)
     {
-        // TODO: next_line skipped sometimes with D
-        strncpy(pattern_space, line, CHAR_SPACE_MAX);
-        exec_commands(commands);
-        if (auto_print)
-            fputs(pattern_space, stdout);
+        struct command *start = commands;
+        if (ctx->suspended)
+        {
+            ctx->suspended = false;
+            next_line_load(ctx, ctx->resume[-1].id == 'N');
+            if (ctx->suspended || ctx->quitting)
+                return;
+            start = ctx->resume;
+        }
+        else if (!ctx->cycle_restart)
+        {
+            char *line = next_line(ctx);
+            if (line == NULL)
+                return;
+            space_set(&ctx->pattern_space, line, ctx->line_len);
+            pattern_space_changed(ctx);
+        }
+        ctx->cycle_restart = false;
+        exec_commands(ctx, start);
+        // the cycle was already ended
+        if (ctx->suspended || ctx->quitting)
+            return;
+        exec_end_cycle(ctx);
     }
 }
 
-FILE *
-current_file(void)
+void
+exec(struct context *ctx,
+     script_t        commands,
+     char          **local_filepaths,
+     size_t          local_filepaths_len,
+     bool            auto_print_)
 {
-    static size_t filepaths_index = 0;
-    static FILE  *file = NULL;
-
-    if (file == NULL && filepaths_index == filepaths_len)
-        return NULL;
-    if (file != NULL)
+    exec_init(ctx, local_filepaths, local_filepaths_len, auto_print_);
+    write_targets_open(ctx, commands);
+    if (ctx->pipelined)
+        pipeline_start(ctx);
+    if (!idiom_exec(ctx, commands, auto_print_))
     {
-        if (!feof(file))
-            return file;
-        if (file != stdin)
-            fclose(file);
-        file = NULL;
-        if (filepaths_index == filepaths_len - 1)
-            return NULL;
-        filepaths_index++;
+        ctx->streaming = stream_prepare(ctx, commands, auto_print_);
+        exec_cycles(ctx, commands);
     }
-    char *filepath = filepaths[filepaths_index];
-    if (strcmp(filepath, "-") == 0)
-        file = stdin;
-    else
-        file = fopen(filepath, "r");
-    if (file == NULL)
+    if (ctx->pipeline != NULL)
     {
-        put_error("can't read %s: %s", filepath, strerror(errno));
-        filepaths_index++;
-        return current_file();
+        output_flush(ctx);
+        pipeline_stop(ctx);
     }
-    return file;
 }
 
-static const size_t line_size_init = 4098;
-
-char *
-next_line(void)
+// Run commands on input pushed by exec_feed instead of read from files, nothing
+// blocks nor reads a file (except for `r`, `R` and `w` of the script). The
+// output is flushed at the end of each call, to the sink if one is set.
+void
+exec_push_start(struct context *ctx, script_t commands, bool auto_print_)
 {
-    static size_t line_size = line_size_init;
-    static char  *line = NULL;
-    if (line == NULL)
-        line = xmalloc(sizeof(char) * line_size);
-    FILE *file = current_file();
-    if (file == NULL)
-    {
-        free(line);
-        return NULL;
-    }
-    errno = 0;
-    ssize_t ret = getline(&line, &line_size, file);
-    if (ret == -1 && errno != 0)
-        die("error getline: %s", strerror(errno));
-    if (ret == -1)  // eof (why no eof before getline call tho?)
-        return next_line();
-        // return NULL;
-    // Cannot check eof with feof, need to get next character and unget it.
-    int c = fgetc(file);
-    // TODO: last_line should only refer the last line of the LAST file, not the last
-    // line of EVERY file
-    last_line = c == EOF;
-    ungetc(c, file);
-    line_index++;
-    return line;
-}
-
-#define FILE_LOOKUP_CAPACITY 10
-
-struct file_lookup_entry
-{
-    char *filepath;
-    FILE *file;
-};
-
-static struct file_lookup_entry file_lookup[FILE_LOOKUP_CAPACITY + 1] = {0};
-static size_t                   file_lookup_len = 0;
+    exec_init(ctx, NULL, 0, auto_print_);
+    write_targets_open(ctx, commands);
+    input_push_init(ctx);
+    ctx->pushed_script = commands;
+}
 
-FILE *
-get_file(char *filepath)
+// Run the cycles of the lines completed by data, the last line is held until
+// more is pushed or the input finished. Returns false once the script quit, what
+// is pushed next is ignored.
+bool
+exec_feed(struct context *ctx, const char *data, size_t len)
 {
-    for (size_t i = 0; i < filepaths_len; i++)
-    {
-        if (strcmp(file_lookup[i].filepath, filepath) == 0)
-            return file_lookup[i].file;
-    }
-    FILE *file = fopen(filepath, "a");
-    if (file == NULL)
-        die("couldn't open file %s: %s", filepath, strerror(errno));
-    file_lookup[file_lookup_len].filepath = xstrdup(filepath);
-    file_lookup[file_lookup_len].file = file;
-    file_lookup_len++;
-    return file;
+    if (ctx->quitting)
+        return false;
+    input_push(ctx, data, len);
+    exec_cycles(ctx, ctx->pushed_script);
+    output_flush(ctx);
+    return !ctx->quitting;
 }
 
+// Run the cycles left once everything was pushed
 void
-free_files(void)
+exec_finish(struct context *ctx)
 {
-    for (size_t i = 0; i < filepaths_len; i++)
+    input_push_finish(ctx);
+    exec_cycles(ctx, ctx->pushed_script);
+    output_flush(ctx);
+    write_targets_flush(ctx);
+}
+
+// Returns the next line of the input (without its separator), NULL at the end of
+// the last file. The line is valid until the next call.
+char *
+next_line(struct context *ctx)
+{
+    stats_poll();
+    size_t len;
+    char  *input;
+    bool   line_end = true;
+    while (true)
     {
-        free(file_lookup[i].filepath);
-        fclose(file_lookup[i].file);
+        if (ctx->input.pushed)
+        {
+            input = input_pushed_line(ctx, &len);
+            break;
+        }
+        if (!ctx->streaming)
+        {
+            input = input_next_line(ctx, &len);
+            break;
+        }
+        input = input_next_window(ctx, &len, STREAM_WINDOW_SIZE, &line_end);
+        if (input == NULL || line_end)
+            break;
+        // the line doesn't fit in a window, it's streamed and the cycle is over
+        ctx->line_index++;
+        stream_line(ctx, input, len);
+        stats_poll();
+    }
+    if (input == NULL)
+    {
+        free(ctx->line);
+        ctx->line = NULL;
+        ctx->line_size = 0;
+        return NULL;
     }
+    if (len + 1 > ctx->line_size)
+    {
+        while (len + 1 > ctx->line_size)
+            ctx->line_size = ctx->line_size == 0 ? 4096 : ctx->line_size * 2;
+        ctx->line = xrealloc(ctx->line, ctx->line_size);
+    }
+    memcpy(ctx->line, input, len);
+    ctx->line[len] = '\0';
+    ctx->line_len = len;
+    ctx->last_line_pending = true;
+    ctx->line_index++;
+    return ctx->line;
 }
 
 /******************************************************************/
 /* debug fonctions used to access global variables during testing */
 
 char *
-_debug_exec_pattern_space(void)
+_debug_exec_pattern_space(struct context *ctx)
 {
-    return pattern_space;
+    return (char *)space_string(&ctx->pattern_space);
 }
 
 char *
-_debug_exec_hold_space(void)
+_debug_exec_hold_space(struct context *ctx)
 {
-    return hold_space;
+    return (char *)space_string(&ctx->hold_space);
 }
 
 bool
-_debug_exec_last_line(void)
+_debug_exec_last_line(struct context *ctx)
 {
-    return last_line;
+    return last_line(ctx);
 }
 
 char *
-_debug_exec_set_pattern_space(const char *content)
+_debug_exec_set_pattern_space(struct context *ctx, const char *content)
 {
-    return strncpy(pattern_space, content, CHAR_SPACE_MAX);
+    pattern_space_changed(ctx);
+    space_set(&ctx->pattern_space, content, strlen(content));
+    return _debug_exec_pattern_space(ctx);
 }
 
 char *
-_debug_exec_set_hold_space(const char *content)
+_debug_exec_set_hold_space(struct context *ctx, const char *content)
 {
-    return strncpy(hold_space, content, CHAR_SPACE_MAX);
+    space_set(&ctx->hold_space, content, strlen(content));
+    return _debug_exec_hold_space(ctx);
 }
 
 void
-_debug_exec_set_line_index(const size_t line_index_)
+_debug_exec_set_line_index(struct context *ctx, const size_t line_index_)
 {
-    line_index = line_index_;
+    ctx->line_index = line_index_;
 }
 
 void
-_debug_exec_set_last_line(const bool last_line_)
+_debug_exec_set_last_line(struct context *ctx, const bool last_line_)
+{
+    ctx->last_line = last_line_;
+    ctx->last_line_pending = false;
+}
+
+bool
+_debug_exec_address_match(struct context *ctx, struct address *address)
 {
-    last_line = last_line_;
+    return address_match(ctx, address);
 }
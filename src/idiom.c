@@ -0,0 +1,450 @@
+#include "sed.h"
+
+// Native implementations of common one-liners.
+//
+// A few scripts make up most of the sed runs, they're recognized once parsed and
+// run by a dedicated routine instead of the interpreter, with the same output.
+// A script is one of them when its commands are the same as the ones of the
+// canonical form, so spacing, delimiters and comments don't matter. Scripts which
+// are profiled are always interpreted.
+//
+// The canonical forms are parsed once in their own arena (see idiom_prepare),
+// runs only read them.
+
+struct idiom
+{
+    const char *name;
+    // canonical form, NULL if the script is checked by match
+    const char *script;
+    size_t      commands_len;
+    bool (*match)(script_t script);
+    // output is only identical with (or without) auto print
+    bool auto_print;
+    // lines can contain newlines with another separator, which the idiom handles
+    // differently
+    bool newline_separator;
+    void (*run)(struct context *ctx, script_t script);
+};
+
+// A copy of the line returned by the input, kept across input calls
+struct line_copy
+{
+    char  *data;
+    size_t len;
+    size_t capacity;
+};
+
+static void
+line_copy_set(struct line_copy *copy, const char *line, size_t len)
+{
+    if (len + 1 > copy->capacity)
+    {
+        while (len + 1 > copy->capacity)
+            copy->capacity = copy->capacity == 0 ? 256 : copy->capacity * 2;
+        copy->data = xrealloc(copy->data, copy->capacity);
+    }
+    memcpy(copy->data, line, len);
+    copy->len = len;
+}
+
+static void
+line_copy_swap(struct line_copy *copy1, struct line_copy *copy2)
+{
+    struct line_copy tmp = *copy1;
+    *copy1 = *copy2;
+    *copy2 = tmp;
+}
+
+// `$=` with -n
+static void
+idiom_count_lines(struct context *ctx, script_t script)
+{
+    (void)script;
+    size_t lines = input_count_lines(ctx);
+    if (lines == 0)
+        return;
+    char buf[32];
+    output_write(ctx, buf, snprintf(buf, sizeof(buf), "%zu\n", lines));
+}
+
+// `$!N;$!D`, the last two lines
+static void
+idiom_last_two_lines(struct context *ctx, script_t script)
+{
+    (void)script;
+    struct line_copy previous = {NULL, 0, 0};
+    struct line_copy last = {NULL, 0, 0};
+    size_t           lines = 0;
+    size_t           len;
+    for (char *line; (line = input_next_line(ctx, &len)) != NULL; lines++)
+    {
+        line_copy_swap(&previous, &last);
+        line_copy_set(&last, line, len);
+    }
+    if (lines >= 2)
+    {
+        output_write(ctx, previous.data, previous.len);
+        output_write(ctx, "\n", 1);
+    }
+    if (lines >= 1)
+    {
+        output_write(ctx, last.data, last.len);
+        output_separator(ctx);
+    }
+    free(previous.data);
+    free(last.data);
+}
+
+// `1!G;h;$!d`, the lines in reverse order. They're all kept in one buffer and
+// written back from the last one.
+static void
+idiom_reverse_lines(struct context *ctx, script_t script)
+{
+    (void)script;
+    char   *buf = NULL;
+    size_t  buf_len = 0;
+    size_t  buf_capacity = 0;
+    size_t *ends = NULL;
+    size_t  lines = 0;
+    size_t  ends_capacity = 0;
+    size_t  len;
+    for (char *line; (line = input_next_line(ctx, &len)) != NULL; lines++)
+    {
+        if (buf_len + len > buf_capacity)
+        {
+            while (buf_len + len > buf_capacity)
+                buf_capacity = buf_capacity == 0 ? 65536 : buf_capacity * 2;
+            buf = xrealloc(buf, buf_capacity);
+        }
+        if (lines == ends_capacity)
+        {
+            ends_capacity = ends_capacity == 0 ? 1024 : ends_capacity * 2;
+            ends = xrealloc(ends, sizeof(size_t) * ends_capacity);
+        }
+        memcpy(buf + buf_len, line, len);
+        buf_len += len;
+        ends[lines] = buf_len;
+    }
+    for (size_t i = lines; i-- > 0;)
+    {
+        size_t start = i == 0 ? 0 : ends[i - 1];
+        output_write(ctx, buf + start, ends[i] - start);
+        if (i > 0)
+            output_write(ctx, "\n", 1);
+    }
+    if (lines > 0)
+        output_separator(ctx);
+    free(buf);
+    free(ends);
+}
+
+// `:a;N;$!ba;s/\n/ /g`, the lines joined by spaces. `N` quits without printing
+// on the last line, so a single line isn't printed.
+static void
+idiom_join_lines(struct context *ctx, script_t script)
+{
+    (void)script;
+    struct line_copy first = {NULL, 0, 0};
+    size_t           len;
+    char            *line = input_next_line(ctx, &len);
+    if (line == NULL)
+        return;
+    line_copy_set(&first, line, len);
+    line = input_next_line(ctx, &len);
+    if (line != NULL)
+    {
+        output_write(ctx, first.data, first.len);
+        for (; line != NULL; line = input_next_line(ctx, &len))
+        {
+            output_write(ctx, " ", 1);
+            output_write(ctx, line, len);
+        }
+        output_separator(ctx);
+    }
+    free(first.data);
+}
+
+// `$!N;/^\(.*\)\n\1$/!P;D`, the lines which aren't the same as the next one
+static void
+idiom_unique_lines(struct context *ctx, script_t script)
+{
+    (void)script;
+    struct line_copy previous = {NULL, 0, 0};
+    size_t           len;
+    char            *line = input_next_line(ctx, &len);
+    if (line == NULL)
+        return;
+    line_copy_set(&previous, line, len);
+    while ((line = input_next_line(ctx, &len)) != NULL)
+    {
+        if (len == previous.len && memcmp(line, previous.data, len) == 0)
+            continue;
+        // like `P`, the separator depends on the line just read
+        output_write(ctx, previous.data, previous.len);
+        output_separator(ctx);
+        line_copy_set(&previous, line, len);
+    }
+    output_write(ctx, previous.data, previous.len);
+    output_separator(ctx);
+    free(previous.data);
+}
+
+// Whether the command is `s/^[...]*//` where the bracket expression is a list of
+// characters or a `[:blank:]` or `[:space:]` class, set tells which characters
+// are in it
+static bool
+ltrim_set_build(const struct command *command, bool set[256])
+{
+    if (command->id != 's' || command->addresses.count != 0 || command->inverse ||
+        command->data.substitute.replacement[0] != '\0' ||
+        command->data.substitute.occurence_index > 1 ||
+        command->data.substitute.print ||
+        command->data.substitute.write_filepath != NULL)
+        return false;
+    const struct regex *regex = command->data.substitute.regex;
+    const char         *source = regex->source;
+    if (regex->cflags != 0 || strncmp(source, "^[", 2) != 0)
+        return false;
+    memset(set, 0, sizeof(bool) * 256);
+    const char *list = source + 2;
+    size_t      list_len;
+    if (strcmp(list, "[:blank:]]*") == 0 || strcmp(list, "[:space:]]*") == 0)
+    {
+        const char *class = list[2] == 'b' ? " \t" : " \t\n\v\f\r";
+        for (; *class != '\0'; class++)
+            set[(unsigned char)*class] = true;
+        return true;
+    }
+    // `]` can't be first and `^` would negate the list, `[` could start a class
+    // and `-` a range
+    list_len = strcspn(list, "]");
+    if (list_len == 0 || strcmp(list + list_len, "]*") != 0 || list[0] == '^' ||
+        memchr(list, '[', list_len) != NULL || memchr(list, '-', list_len) != NULL)
+        return false;
+    for (size_t i = 0; i < list_len; i++)
+        set[(unsigned char)list[i]] = true;
+    return true;
+}
+
+static bool
+ltrim_match(script_t script)
+{
+    bool set[256];
+    return ltrim_set_build(script, set);
+}
+
+// `s/^[ \t]*//`, the lines without their leading blanks
+static void
+idiom_ltrim_lines(struct context *ctx, script_t script)
+{
+    bool set[256];
+    // comments aside, the command is the script
+    while (script->id == '#')
+        script++;
+    ltrim_set_build(script, set);
+    size_t len;
+    for (char *line; (line = input_next_line(ctx, &len)) != NULL;)
+    {
+        size_t start = 0;
+        while (start < len && set[(unsigned char)line[start]])
+            start++;
+        output_write(ctx, line + start, len - start);
+        output_separator(ctx);
+    }
+}
+
+static const struct idiom idioms[] = {
+    {"count", "$=", 1, NULL, false, false, idiom_count_lines},
+    {"last two", "$!N;$!D", 2, NULL, true, true, idiom_last_two_lines},
+    {"tac", "1!G;h;$!d", 3, NULL, true, false, idiom_reverse_lines},
+    {"join", ":a;N;$!ba;s/\\n/ /g", 4, NULL, true, true, idiom_join_lines},
+    {"uniq", "$!N;/^\\(.*\\)\\n\\1$/!P;D", 3, NULL, true, true, idiom_unique_lines},
+    {"ltrim", NULL, 1, ltrim_match, true, false, idiom_ltrim_lines},
+};
+
+#define IDIOMS_LEN (sizeof(idioms) / sizeof(idioms[0]))
+
+static struct arena canonical_arena = {NULL, NULL};
+static script_t     canonical_scripts[IDIOMS_LEN];
+static bool         canonical_parsed = false;
+
+// Parse the canonical forms if they aren't yet, this must happen before scripts
+// run concurrently
+void
+idiom_prepare(void)
+{
+    if (canonical_parsed)
+        return;
+    for (size_t i = 0; i < IDIOMS_LEN; i++)
+    {
+        if (idioms[i].script == NULL)
+            continue;
+        char *source = xstrdup(idioms[i].script);
+        canonical_scripts[i] = parse_into(source, &canonical_arena);
+        free(source);
+    }
+    canonical_parsed = true;
+}
+
+// The canonical forms have their own regexes, identical ones are only shared
+// within a script
+static bool
+regex_equal(const struct regex *regex1, const struct regex *regex2)
+{
+    return regex1 == regex2 ||
+           (regex1->cflags == regex2->cflags &&
+            strcmp(regex1->source, regex2->source) == 0);
+}
+
+static bool
+addresses_equal(const struct addresses *addresses1,
+                const struct addresses *addresses2)
+{
+    if (addresses1->count != addresses2->count)
+        return false;
+    for (size_t i = 0; i < addresses1->count; i++)
+    {
+        const struct address *address1 = &addresses1->addresses[i];
+        const struct address *address2 = &addresses2->addresses[i];
+        if (address1->type != address2->type)
+            return false;
+        if (address1->type == ADDRESS_LINE &&
+            address1->data.line != address2->data.line)
+            return false;
+        if (address1->type == ADDRESS_RE &&
+            !regex_equal(address1->data.regex, address2->data.regex))
+            return false;
+    }
+    return true;
+}
+
+// The occurence replaced by `s`, 0 is the same as 1 (the default)
+static size_t
+occurence(const union command_data *data)
+{
+    return data->substitute.occurence_index > 1 ? data->substitute.occurence_index
+                                                : 1;
+}
+
+// Label of the script standing for the label of the canonical form
+struct label_pair
+{
+    const char *canonical;
+    const char *script;
+};
+
+static bool
+commands_equal(const struct command *canonical,
+               const struct command *command,
+               struct label_pair    *labels)
+{
+    if (canonical->id != command->id || canonical->inverse != command->inverse ||
+        !addresses_equal(&canonical->addresses, &command->addresses))
+        return false;
+    const union command_data *data1 = &canonical->data;
+    const union command_data *data2 = &command->data;
+    switch (command->id)
+    {
+    case ':':
+        labels->canonical = data1->text;
+        labels->script = data2->text;
+        return true;
+    case 'b':
+    case 't':
+        if (labels->canonical != NULL && strcmp(data1->text, labels->canonical) == 0)
+            return strcmp(data2->text, labels->script) == 0;
+        return strcmp(data1->text, data2->text) == 0;
+    case 's':
+        return regex_equal(data1->substitute.regex, data2->substitute.regex) &&
+               strcmp(data1->substitute.replacement,
+                      data2->substitute.replacement) == 0 &&
+               occurence(data1) == occurence(data2) &&
+               data1->substitute.global == data2->substitute.global &&
+               data1->substitute.print == data2->substitute.print &&
+               data2->substitute.write_filepath == NULL;
+    case '{':
+    case 'a':
+    case 'c':
+    case 'i':
+    case 'r':
+    case 'R':
+    case 'w':
+    case 'y':
+        return false;
+    }
+    return true;
+}
+
+// Number of commands of the script without its comments, which are collected in
+// commands unless it's NULL. 0 if the script is profiled.
+static size_t
+script_len(script_t script, struct command **commands)
+{
+    size_t len = 0;
+    for (struct command *command = script; command->id != COMMAND_LAST; command++)
+    {
+        if (command->profile != NULL)
+            return 0;
+        if (command->id == '#')
+            continue;
+        if (commands != NULL)
+            commands[len] = command;
+        len++;
+    }
+    return len;
+}
+
+static bool
+idiom_match(size_t index, script_t script)
+{
+    const struct idiom *idiom = &idioms[index];
+    struct command     *commands[8];
+    script_len(script, commands);
+    if (idiom->match != NULL)
+        return idiom->match(commands[0]);
+    script_t          canonical = canonical_scripts[index];
+    struct label_pair labels = {NULL, NULL};
+    bool              equal = true;
+    for (size_t i = 0; equal && i < idiom->commands_len; i++)
+        equal = commands_equal(&canonical[i], commands[i], &labels);
+    return equal;
+}
+
+static const struct idiom *
+idiom_find(struct context *ctx, script_t script, bool auto_print)
+{
+    size_t      len = script_len(script, NULL);
+    size_t      separator_len;
+    const char *separator = input_separator(ctx, &separator_len);
+    bool        newline_separator = separator_len == 1 && separator[0] == '\n';
+    idiom_prepare();
+    for (size_t i = 0; i < IDIOMS_LEN; i++)
+    {
+        const struct idiom *idiom = &idioms[i];
+        if (idiom->commands_len != len || idiom->auto_print != auto_print ||
+            (idiom->newline_separator && !newline_separator))
+            continue;
+        if (idiom_match(i, script))
+            return idiom;
+    }
+    return NULL;
+}
+
+// Run the script natively if it's one of the idioms, the input must be initialized
+bool
+idiom_exec(struct context *ctx, script_t script, bool auto_print)
+{
+    const struct idiom *idiom = idiom_find(ctx, script, auto_print);
+    if (idiom == NULL)
+        return false;
+    idiom->run(ctx, script);
+    return true;
+}
+
+// The name of the idiom the script is recognized as, NULL if none
+const char *
+_debug_idiom_find(struct context *ctx, script_t script, bool auto_print)
+{
+    const struct idiom *idiom = idiom_find(ctx, script, auto_print);
+    return idiom != NULL ? idiom->name : NULL;
+}
@@ -0,0 +1,749 @@
+#include "sed.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Open filepath the way the context sees it: relative paths from its directory,
+// and /dev/stdin, /dev/stdout and /dev/stderr as its own standard streams when
+// they aren't those of the process (a request of the daemon mode, libsed)
+int
+context_open(const struct context *ctx, const char *filepath, int flags)
+{
+    static const char *std_paths[] = {"/dev/stdin", "/dev/stdout", "/dev/stderr"};
+    const int          std_fds[] = {
+        ctx->input.stdin_fd, ctx->output.fd, ctx->error_fd};
+    for (int i = 0; i < 3; i++)
+    {
+        if (std_fds[i] != i && strcmp(filepath, std_paths[i]) == 0)
+            return dup(std_fds[i]);
+    }
+    return openat(ctx->dir_fd, filepath, flags, 0666);
+}
+
+// Contents of the files read by the `r` command.
+//
+// A file is loaded (mapped when possible) the first time it's referenced and kept
+// for the whole run. It is only checked again (by mtime and size) when one of
+// the script's write targets has been written to since, which is the only way
+// the script itself can modify it. The previous content is then kept until the
+// end of the cycle, the append queue may still refer to it.
+
+struct cached_file
+{
+    char             *filepath;
+    bool              exists;
+    bool              mapped;
+    char             *content;
+    size_t            len;
+    off_t             size;
+    time_t            mtime_sec;
+    long              mtime_nsec;
+    size_t            generation;
+    struct cached_file *next;
+};
+
+#define CACHED_FILES_BUCKETS 64
+
+static void
+cached_file_unload(struct cached_file *file)
+{
+    if (file->mapped)
+        munmap(file->content, file->len);
+    else
+        free(file->content);
+    file->exists = false;
+    file->mapped = false;
+    file->content = NULL;
+    file->len = 0;
+}
+
+// Keep the content of file aside until cached_files_release and forget it
+static void
+cached_file_retire(struct context *ctx, struct cached_file *file)
+{
+    if (file->content != NULL)
+    {
+        struct cached_file *retired = xmalloc(sizeof(struct cached_file));
+        memset(retired, 0, sizeof(struct cached_file));
+        retired->mapped = file->mapped;
+        retired->content = file->content;
+        retired->len = file->len;
+        retired->next = ctx->input.retired_files;
+        ctx->input.retired_files = retired;
+    }
+    file->exists = false;
+    file->mapped = false;
+    file->content = NULL;
+    file->len = 0;
+}
+
+// Release the contents replaced since the last call, once the queued output
+// which could refer to them has been written
+void
+cached_files_release(struct context *ctx)
+{
+    while (ctx->input.retired_files != NULL)
+    {
+        struct cached_file *retired = ctx->input.retired_files;
+        ctx->input.retired_files = retired->next;
+        cached_file_unload(retired);
+        free(retired);
+    }
+}
+
+// Read a non regular file (fifo, character device) until the end
+static void
+cached_file_slurp(struct cached_file *file, int fd)
+{
+    size_t capacity = 4096;
+    file->content = xmalloc(capacity);
+    while (true)
+    {
+        if (file->len == capacity)
+        {
+            capacity *= 2;
+            file->content = xrealloc(file->content, capacity);
+        }
+        ssize_t ret = read(fd, file->content + file->len, capacity - file->len);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        file->len += ret;
+    }
+}
+
+static void
+cached_file_load(struct context *ctx, struct cached_file *file)
+{
+    file->generation = write_targets_generation(ctx);
+    write_target_sync(ctx, file->filepath);
+    int fd = context_open(ctx, file->filepath, O_RDONLY);
+    if (fd == -1)
+        return;
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) == -1)
+    {
+        close(fd);
+        return;
+    }
+    file->exists = true;
+    file->size = statbuf.st_size;
+    file->mtime_sec = statbuf.st_mtim.tv_sec;
+    file->mtime_nsec = statbuf.st_mtim.tv_nsec;
+    if (!S_ISREG(statbuf.st_mode))
+        cached_file_slurp(file, fd);
+    else if (statbuf.st_size > 0)
+    {
+        void *content = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (content != MAP_FAILED)
+        {
+            file->mapped = true;
+            file->content = content;
+            file->len = statbuf.st_size;
+        }
+        else
+            cached_file_slurp(file, fd);
+    }
+    close(fd);
+}
+
+// Reload the file if it may have been modified by a write target
+static void
+cached_file_validate(struct context *ctx, struct cached_file *file)
+{
+    if (file->generation == write_targets_generation(ctx))
+        return;
+    write_target_sync(ctx, file->filepath);
+    file->generation = write_targets_generation(ctx);
+    struct stat statbuf;
+    int         fd = context_open(ctx, file->filepath, O_RDONLY);
+    if (fd == -1 || fstat(fd, &statbuf) == -1)
+    {
+        if (fd != -1)
+            close(fd);
+        cached_file_retire(ctx, file);
+        return;
+    }
+    close(fd);
+    if (file->exists && statbuf.st_size == file->size &&
+        statbuf.st_mtim.tv_sec == file->mtime_sec &&
+        statbuf.st_mtim.tv_nsec == file->mtime_nsec)
+        return;
+    cached_file_retire(ctx, file);
+    cached_file_load(ctx, file);
+}
+
+// Returns the content of a file read by `r`, NULL if it can't be read
+const char *
+cached_file_get(struct context *ctx, const char *filepath, size_t *len)
+{
+    if (ctx->input.cached_files == NULL)
+    {
+        ctx->input.cached_files =
+            xmalloc(sizeof(struct cached_file *) * CACHED_FILES_BUCKETS);
+        memset(ctx->input.cached_files,
+               0,
+               sizeof(struct cached_file *) * CACHED_FILES_BUCKETS);
+    }
+    struct cached_file **bucket =
+        &ctx->input.cached_files[hash_string(filepath) % CACHED_FILES_BUCKETS];
+    struct cached_file *file = *bucket;
+    for (; file != NULL; file = file->next)
+    {
+        if (strcmp(file->filepath, filepath) == 0)
+            break;
+    }
+    if (file == NULL)
+    {
+        file = xmalloc(sizeof(struct cached_file));
+        memset(file, 0, sizeof(struct cached_file));
+        file->filepath = xstrdup(filepath);
+        file->next = *bucket;
+        *bucket = file;
+        cached_file_load(ctx, file);
+    }
+    else
+        cached_file_validate(ctx, file);
+    if (!file->exists)
+        return NULL;
+    *len = file->len;
+    return file->content;
+}
+
+// Files read line by line by the `R` command, each keeps its position for the
+// whole run.
+
+struct line_reader
+{
+    char               *filepath;
+    FILE               *file;
+    char               *line;
+    size_t              line_size;
+    struct line_reader *next;
+};
+
+// Returns the next line of filepath without its newline, NULL at the end of the
+// file or if it can't be read. The line is valid until the next call.
+char *
+line_reader_next(struct context *ctx, const char *filepath, size_t *len)
+{
+    struct line_reader *reader = ctx->input.line_readers;
+    for (; reader != NULL; reader = reader->next)
+    {
+        if (strcmp(reader->filepath, filepath) == 0)
+            break;
+    }
+    if (reader == NULL)
+    {
+        write_target_sync(ctx, filepath);
+        reader = xmalloc(sizeof(struct line_reader));
+        reader->filepath = xstrdup(filepath);
+        int fd = context_open(ctx, filepath, O_RDONLY);
+        reader->file = fd == -1 ? NULL : fdopen(fd, "r");
+        reader->line = NULL;
+        reader->line_size = 0;
+        reader->next = ctx->input.line_readers;
+        ctx->input.line_readers = reader;
+    }
+    if (reader->file == NULL)
+        return NULL;
+    ssize_t ret = getline(&reader->line, &reader->line_size, reader->file);
+    if (ret == -1)
+    {
+        fclose(reader->file);
+        reader->file = NULL;
+        return NULL;
+    }
+    if (ret > 0 && reader->line[ret - 1] == '\n')
+        ret--;
+    *len = ret;
+    return reader->line;
+}
+
+// Input files of the script. They are read with read(2) into a buffer which grows
+// to hold the longest line, so that the I/O can be accounted for.
+
+#define INPUT_BUF_SIZE 65536
+
+static char *input_stdin_only[] = {"-"};
+
+void
+input_set_separator(struct context *ctx, const char *separator, size_t len)
+{
+    ctx->input.separator = separator;
+    ctx->input.separator_len = len;
+}
+
+const char *
+input_separator(struct context *ctx, size_t *len)
+{
+    *len = ctx->input.separator_len;
+    return ctx->input.separator;
+}
+
+// Whether the last line returned by the input ended with the record separator,
+// only the last line of a file can lack it
+bool
+input_line_terminated(struct context *ctx)
+{
+    return ctx->input.terminated;
+}
+
+// Returns the first record separator in s, memchr does the heavy lifting (it's
+// vectorized in every libc that matters), a longer separator is then compared
+// at each occurence of its first byte
+static char *
+separator_find(const struct input *input, char *s, size_t len)
+{
+    const char  *separator = input->separator;
+    const size_t separator_len = input->separator_len;
+    if (separator_len == 1)
+        return memchr(s, separator[0], len);
+    char *end = s + len;
+    while (s + separator_len <= end)
+    {
+        s = memchr(s, separator[0], end - s - separator_len + 1);
+        if (s == NULL)
+            return NULL;
+        if (memcmp(s, separator, separator_len) == 0)
+            return s;
+        s++;
+    }
+    return NULL;
+}
+
+// The standard input (or what stands for it) is left open
+static void
+input_close(struct context *ctx)
+{
+    struct input *input = &ctx->input;
+    if (input->read_ahead)
+        uring_read_stop(ctx);
+    input->read_ahead = false;
+    decoder_free(input->decoder);
+    input->decoder = NULL;
+    if (input->fd != -1 && input->fd != input->stdin_fd)
+        close(input->fd);
+    input->fd = -1;
+}
+
+void
+input_init(struct context *ctx, char **filepaths, size_t filepaths_len)
+{
+    struct input *input = &ctx->input;
+    input_close(ctx);
+    input->filepaths = filepaths;
+    input->filepaths_len = filepaths_len;
+    if (filepaths_len == 0)
+    {
+        input->filepaths = input_stdin_only;
+        input->filepaths_len = 1;
+    }
+    input->filepaths_index = 0;
+    input->start = 0;
+    input->end = 0;
+    input->eof = false;
+    input->in_line = false;
+    input->pushed = false;
+}
+
+// Forget the files read by `r` and `R` and release the buffer, the context can
+// then run again from scratch
+void
+input_free(struct context *ctx)
+{
+    struct input *input = &ctx->input;
+    input_close(ctx);
+    for (size_t i = 0; input->cached_files != NULL && i < CACHED_FILES_BUCKETS; i++)
+    {
+        while (input->cached_files[i] != NULL)
+        {
+            struct cached_file *file = input->cached_files[i];
+            input->cached_files[i] = file->next;
+            cached_file_unload(file);
+            free(file->filepath);
+            free(file);
+        }
+    }
+    free(input->cached_files);
+    input->cached_files = NULL;
+    cached_files_release(ctx);
+    while (input->line_readers != NULL)
+    {
+        struct line_reader *reader = input->line_readers;
+        input->line_readers = reader->next;
+        if (reader->file != NULL)
+            fclose(reader->file);
+        free(reader->filepath);
+        free(reader->line);
+        free(reader);
+    }
+    free(input->buf);
+    input->buf = NULL;
+    input->buf_size = 0;
+}
+
+// Flush the output if reading fd would block, what was produced from the input so
+// far is then seen while waiting for more (`tail -f | sed p`)
+static void
+input_wait_flush(struct context *ctx, int fd)
+{
+    if (ctx->output.len == 0)
+        return;
+    struct pollfd pollfd = {.fd = fd, .events = POLLIN};
+    if (poll(&pollfd, 1, 0) == 0)
+        output_flush(ctx);
+}
+
+// Open the next file that can be read, returns false if there is none left
+static bool
+input_open_next(struct context *ctx)
+{
+    struct input *input = &ctx->input;
+    while (true)
+    {
+        const char *filepath;
+        if (ctx->pipeline != NULL)
+        {
+            filepath = pipeline_open_next(ctx);
+            if (filepath == NULL)
+                return false;
+            // the descriptor belongs to the reader thread, it's never closed here
+            input->fd = input->stdin_fd;
+        }
+        else
+        {
+            if (input->filepaths_index == input->filepaths_len)
+                return false;
+            filepath = input->filepaths[input->filepaths_index++];
+            if (strcmp(filepath, "-") == 0)
+                input->fd = input->stdin_fd;
+            else
+                input->fd = context_open(ctx, filepath, O_RDONLY);
+            if (input->fd == -1)
+            {
+                put_error("can't read %s: %s", filepath, strerror(errno));
+                continue;
+            }
+            // the format of a pipe is detected by reading its first bytes
+            input_wait_flush(ctx, input->fd);
+            input->decoder = decoder_open(input->fd);
+            input->read_ahead = input->decoder == NULL && ctx->io_uring &&
+                                uring_read_start(ctx, input->fd, filepath);
+        }
+        ctx->stats.files_opened++;
+        ctx->stats.filepath = filepath;
+        ctx->stats.offset = 0;
+        input->start = 0;
+        input->end = 0;
+        input->eof = false;
+        input->in_line = false;
+        return true;
+    }
+}
+
+// Read more data at the end of the buffer, moving the unread data to the front
+// first and growing the buffer if it's full. Returns false at the end of the file.
+static bool
+input_refill(struct context *ctx)
+{
+    struct input *input = &ctx->input;
+    if (input->eof)
+        return false;
+    ctx->stats.refills++;
+    if (input->start > 0)
+    {
+        memmove(input->buf, input->buf + input->start, input->end - input->start);
+        input->end -= input->start;
+        input->start = 0;
+    }
+    if (input->end == input->buf_size)
+    {
+        input->buf_size =
+            input->buf_size == 0 ? INPUT_BUF_SIZE : input->buf_size * 2;
+        input->buf = xrealloc(input->buf, input->buf_size);
+    }
+    // the pipeline flushes the output itself, see pipeline_block
+    if (ctx->pipeline == NULL)
+        input_wait_flush(ctx, input->fd);
+    ssize_t  ret;
+    uint64_t start = stats_clock();
+    if (ctx->pipeline != NULL)
+        ret = pipeline_read(
+            ctx, input->buf + input->end, input->buf_size - input->end);
+    else if (input->read_ahead)
+        ret = uring_read(ctx, input->buf + input->end, input->buf_size - input->end);
+    else
+    {
+        char  *buf = input->buf + input->end;
+        size_t len = input->buf_size - input->end;
+        do
+        {
+            ctx->stats.read_calls++;
+            if (input->decoder != NULL)
+                ret = decoder_read(input->decoder, buf, len);
+            else
+                ret = read(input->fd, buf, len);
+        } while (ret == -1 && errno == EINTR);
+    }
+    ctx->stats.read_ns += stats_clock() - start;
+    if (ret == -1)
+        die("couldn't read %s: %s", ctx->stats.filepath, strerror(errno));
+    if (ret == 0)
+    {
+        input->eof = true;
+        return false;
+    }
+    input->end += ret;
+    ctx->stats.bytes_read += ret;
+    return true;
+}
+
+// Returns at most max bytes (no limit if max is 0) of the current line, NULL at
+// the end of the last file. line_end tells whether the window ends the line, the
+// record separator which ends it isn't part of the window. A line without a
+// separator at the end of a file is ended by an empty window if it was split.
+// The window is valid until the next call to an input function.
+char *
+input_next_window(struct context *ctx, size_t *len, size_t max, bool *line_end)
+{
+    struct input *input = &ctx->input;
+    const size_t  separator_len = input->separator_len;
+    while (true)
+    {
+        if (input->fd == -1 && !input_open_next(ctx))
+            return NULL;
+        // only the new data is searched after a refill, a separator can start in
+        // the last bytes searched
+        size_t scanned = 0;
+        char  *separator = NULL;
+        size_t available;
+        while (true)
+        {
+            available = input->end - input->start;
+            // a separator starting in the window ends the line
+            size_t limit = available;
+            if (max != 0 && available > max + separator_len - 1)
+                limit = max + separator_len - 1;
+            if (scanned < limit)
+                separator = separator_find(
+                    input, input->buf + input->start + scanned, limit - scanned);
+            if (separator != NULL ||
+                (max != 0 && available >= max + separator_len - 1))
+                break;
+            scanned = limit > separator_len - 1 ? limit - (separator_len - 1) : 0;
+            if (!input_refill(ctx))
+                break;
+        }
+        if (separator == NULL && available == 0 && !input->in_line)
+        {
+            input_close(ctx);
+            continue;
+        }
+        char  *window = input->buf + input->start;
+        size_t consumed;
+        *line_end = true;
+        if (separator != NULL && (max == 0 || (size_t)(separator - window) <= max))
+        {
+            *len = separator - window;
+            consumed = *len + separator_len;
+        }
+        else if (max != 0 && available >= max)
+        {
+            *len = max;
+            consumed = max;
+            *line_end = false;
+        }
+        else
+        {
+            *len = available;
+            consumed = available;
+        }
+        input->in_line = !*line_end;
+        if (*line_end)
+        {
+            input->terminated = separator != NULL;
+            ctx->stats.lines_read++;
+        }
+        input->start += consumed;
+        ctx->stats.offset += consumed;
+        return window;
+    }
+}
+
+// Returns the next line of the input without its separator, NULL at the end of
+// the last file. The line is valid until the next call to an input function.
+char *
+input_next_line(struct context *ctx, size_t *len)
+{
+    bool line_end;
+    return input_next_window(ctx, len, 0, &line_end);
+}
+
+// Count the lines left in the input without splitting them (`$=`), a
+// single byte separator is counted a buffer at a time
+size_t
+input_count_lines(struct context *ctx)
+{
+    struct input *input = &ctx->input;
+    size_t        lines = 0;
+    if (input->separator_len > 1)
+    {
+        size_t len;
+        while (input_next_line(ctx, &len) != NULL)
+            lines++;
+        return lines;
+    }
+    const char separator = input->separator[0];
+    while (input->fd != -1 || input_open_next(ctx))
+    {
+        while (input->start < input->end || input_refill(ctx))
+        {
+            const size_t len = input->end - input->start;
+            const size_t found = memcount(input->buf + input->start, len, separator);
+            lines += found;
+            ctx->stats.lines_read += found;
+            ctx->stats.offset += len;
+            input->in_line = input->buf[input->end - 1] != separator;
+            input->start = input->end;
+            stats_poll();
+        }
+        // the last line of a file can lack the separator
+        input->terminated = !input->in_line;
+        if (input->in_line)
+        {
+            lines++;
+            ctx->stats.lines_read++;
+        }
+        input->in_line = false;
+        input_close(ctx);
+    }
+    return lines;
+}
+
+// Whether the current file has no data left. The last line returned is
+// invalidated.
+bool
+input_file_end(struct context *ctx)
+{
+    if (ctx->input.fd == -1)
+        return true;
+    return ctx->input.start == ctx->input.end && !input_refill(ctx);
+}
+
+// Whether there is no line left in the input, the next files are opened (and
+// the unreadable ones skipped) to find out. The last line returned is
+// invalidated.
+bool
+input_last_line(struct context *ctx)
+{
+    if (ctx->input.pushed)
+        return ctx->input.eof && ctx->input.start == ctx->input.end;
+    while (input_file_end(ctx))
+    {
+        input_close(ctx);
+        if (!input_open_next(ctx))
+            return true;
+    }
+    return false;
+}
+
+// Input pushed by the caller in chunks of any size (see exec_feed) instead of
+// being read from files. A line is only returned once the byte following its
+// separator has been pushed, or the input finished, so that `$` is known by then.
+
+void
+input_push_init(struct context *ctx)
+{
+    struct input *input = &ctx->input;
+    input_close(ctx);
+    input->pushed = true;
+    input->start = 0;
+    input->end = 0;
+    input->scanned = 0;
+    input->eof = false;
+    input->in_line = false;
+}
+
+void
+input_push(struct context *ctx, const char *data, size_t len)
+{
+    struct input *input = &ctx->input;
+    if (input->start > 0 && input->end + len > input->buf_size)
+    {
+        memmove(input->buf, input->buf + input->start, input->end - input->start);
+        input->end -= input->start;
+        input->scanned =
+            input->scanned > input->start ? input->scanned - input->start : 0;
+        input->start = 0;
+    }
+    if (input->end + len > input->buf_size)
+    {
+        size_t size = input->buf_size == 0 ? INPUT_BUF_SIZE : input->buf_size;
+        while (input->end + len > size)
+            size *= 2;
+        input->buf = xrealloc(input->buf, size);
+        input->buf_size = size;
+    }
+    memcpy(input->buf + input->end, data, len);
+    input->end += len;
+    ctx->stats.bytes_read += len;
+}
+
+// Nothing will be pushed anymore
+void
+input_push_finish(struct context *ctx)
+{
+    ctx->input.eof = true;
+}
+
+// Returns the next pushed line without its separator, NULL if it's incomplete
+// (input_push_waiting) or at the end of the input. The line is valid until the
+// next call to an input function.
+char *
+input_pushed_line(struct context *ctx, size_t *len)
+{
+    struct input *input = &ctx->input;
+    const size_t  separator_len = input->separator_len;
+    if (input->scanned < input->start)
+        input->scanned = input->start;
+    char *separator = NULL;
+    if (input->scanned < input->end)
+        separator = separator_find(
+            input, input->buf + input->scanned, input->end - input->scanned);
+    char *line = input->buf + input->start;
+    if (separator == NULL)
+    {
+        // only the last bytes searched can start a separator
+        input->scanned = input->end > input->start + separator_len - 1
+                             ? input->end - (separator_len - 1)
+                             : input->start;
+        if (!input->eof || input->start == input->end)
+            return NULL;
+        *len = input->end - input->start;
+        input->terminated = false;
+        input->start = input->end;
+    }
+    else
+    {
+        size_t consumed = separator + separator_len - line;
+        input->scanned = separator - input->buf;
+        if (!input->eof && input->start + consumed == input->end)
+            return NULL;
+        *len = separator - line;
+        input->terminated = true;
+        input->start += consumed;
+    }
+    ctx->stats.lines_read++;
+    ctx->stats.offset += input->start - (line - input->buf);
+    return line;
+}
+
+// Whether input_pushed_line returned NULL because more has to be pushed
+bool
+input_push_waiting(struct context *ctx)
+{
+    return ctx->input.pushed && !ctx->input.eof;
+}
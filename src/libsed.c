@@ -0,0 +1,290 @@
+#include "sed.h"
+#include "libsed.h"
+#include <pthread.h>
+
+// The library interface (see libsed.h).
+//
+// A compiled script owns its arena, independently of the scripts of the command
+// (script_arena). Parsing uses state shared by the whole process (the arena and
+// regex table being filled, the canonical forms of the idioms), compilations
+// are serialized. Runs only touch their own context.
+//
+// The errors which exit the command are caught by each call (see errors_catch)
+// and returned, their message is given by sed_error. A context which failed is
+// released, a pushed run is then over.
+
+struct sed_script
+{
+    struct arena arena;
+    script_t     commands;
+};
+
+struct sed
+{
+    struct context           context;
+    const struct sed_script *script;
+    bool                     auto_print;
+    char                    *separator;
+    size_t                   separator_len;
+    // the pushed run failed, it's over until the next sed_start
+    bool failed;
+};
+
+static pthread_mutex_t compile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Call func(arg), returns false if it failed (die), the error is in sed_error
+static bool
+caught(void (*func)(void *), void *arg)
+{
+    jmp_buf  jmp;
+    jmp_buf *outer = errors_catch(&jmp);
+    if (setjmp(jmp) != 0)
+    {
+        errors_catch(outer);
+        return false;
+    }
+    func(arg);
+    errors_catch(outer);
+    return true;
+}
+
+static void
+context_free_call(void *arg)
+{
+    context_free(arg);
+}
+
+// Release the context once a run is over, flushing the output can fail too. The
+// output which fails to be written is dropped, so that releasing it again ends.
+static bool
+context_release(struct context *ctx)
+{
+    bool ok = true;
+    while (!caught(context_free_call, ctx))
+        ok = false;
+    return ok;
+}
+
+struct compile_call
+{
+    const char        *text;
+    char              *source;
+    struct sed_script *script;
+};
+
+static void
+compile(void *arg)
+{
+    struct compile_call *call = arg;
+    call->source = xstrdup(call->text);
+    call->script = xmalloc(sizeof(struct sed_script));
+    call->script->arena = (struct arena){NULL, NULL};
+    call->script->commands = parse_into(call->source, &call->script->arena);
+    idiom_prepare();
+}
+
+struct sed_script *
+sed_compile(const char *text)
+{
+    struct compile_call call = {text, NULL, NULL};
+    pthread_mutex_lock(&compile_lock);
+    bool ok = caught(compile, &call);
+    pthread_mutex_unlock(&compile_lock);
+    free(call.source);
+    if (ok)
+        return call.script;
+    // parse_into freed the arena
+    free(call.script);
+    return NULL;
+}
+
+void
+sed_script_free(struct sed_script *script)
+{
+    if (script == NULL)
+        return;
+    arena_free(&script->arena);
+    free(script);
+}
+
+const char *
+sed_error(void)
+{
+    return errors_message();
+}
+
+static void
+sed_new_call(void *arg)
+{
+    struct sed **sed = arg;
+    *sed = xmalloc(sizeof(struct sed));
+}
+
+struct sed *
+sed_new(const struct sed_script *script)
+{
+    struct sed *sed = NULL;
+    if (!caught(sed_new_call, &sed))
+        return NULL;
+    sed->context = (struct context)CONTEXT_INIT;
+    sed->script = script;
+    sed->auto_print = true;
+    sed->separator = NULL;
+    sed->separator_len = 0;
+    sed->failed = false;
+    return sed;
+}
+
+void
+sed_set_quiet(struct sed *sed, bool quiet)
+{
+    sed->auto_print = !quiet;
+}
+
+struct separator_call
+{
+    struct sed *sed;
+    const char *separator;
+    size_t      len;
+};
+
+static void
+set_separator(void *arg)
+{
+    struct separator_call *call = arg;
+    struct sed            *sed = call->sed;
+    if (call->len == 0)
+        die("invalid separator: empty");
+    char *separator = xmalloc(call->len);
+    memcpy(separator, call->separator, call->len);
+    free(sed->separator);
+    sed->separator = separator;
+    sed->separator_len = call->len;
+}
+
+int
+sed_set_separator(struct sed *sed, const char *separator, size_t len)
+{
+    struct separator_call call = {sed, separator, len};
+    return caught(set_separator, &call) ? 0 : -1;
+}
+
+struct run_call
+{
+    struct sed *sed;
+    int         input_fd;
+    int         output_fd;
+};
+
+static void
+run(void *arg)
+{
+    struct run_call *call = arg;
+    struct sed      *sed = call->sed;
+    struct context  *ctx = &sed->context;
+    ctx->input.stdin_fd = call->input_fd;
+    ctx->output.fd = call->output_fd;
+    if (sed->separator != NULL)
+        input_set_separator(ctx, sed->separator, sed->separator_len);
+    exec(ctx, sed->script->commands, NULL, 0, sed->auto_print);
+}
+
+int
+sed_run(struct sed *sed, int input_fd, int output_fd)
+{
+    struct run_call call = {sed, input_fd, output_fd};
+    bool            ok = caught(run, &call);
+    return context_release(&sed->context) && ok ? 0 : -1;
+}
+
+struct start_call
+{
+    struct sed *sed;
+    sed_sink    sink;
+    void       *data;
+};
+
+static void
+start(void *arg)
+{
+    struct start_call *call = arg;
+    struct sed        *sed = call->sed;
+    struct context    *ctx = &sed->context;
+    output_set_sink(ctx, call->sink, call->data);
+    if (sed->separator != NULL)
+        input_set_separator(ctx, sed->separator, sed->separator_len);
+    exec_push_start(ctx, sed->script->commands, sed->auto_print);
+}
+
+// The pushed run is over on an error
+static int
+push_failed(struct sed *sed)
+{
+    context_release(&sed->context);
+    sed->failed = true;
+    return -1;
+}
+
+int
+sed_start(struct sed *sed, sed_sink sink, void *data)
+{
+    struct start_call call = {sed, sink, data};
+    sed->failed = false;
+    if (!caught(start, &call))
+        return push_failed(sed);
+    return 0;
+}
+
+struct feed_call
+{
+    struct sed *sed;
+    const char *data;
+    size_t      len;
+    bool        running;
+};
+
+static void
+feed(void *arg)
+{
+    struct feed_call *call = arg;
+    call->running = exec_feed(&call->sed->context, call->data, call->len);
+}
+
+int
+sed_feed(struct sed *sed, const char *data, size_t len)
+{
+    struct feed_call call = {sed, data, len, false};
+    if (sed->failed)
+        return -1;
+    if (!caught(feed, &call))
+        return push_failed(sed);
+    return call.running ? 1 : 0;
+}
+
+static void
+finish(void *arg)
+{
+    exec_finish(arg);
+}
+
+int
+sed_finish(struct sed *sed)
+{
+    if (sed->failed)
+    {
+        sed->failed = false;
+        return -1;
+    }
+    bool ok = caught(finish, &sed->context);
+    return context_release(&sed->context) && ok ? 0 : -1;
+}
+
+void
+sed_free(struct sed *sed)
+{
+    if (sed == NULL)
+        return;
+    context_release(&sed->context);
+    free(sed->separator);
+    free(sed);
+}
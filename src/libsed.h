@@ -0,0 +1,73 @@
+#ifndef _LIBSED_H_
+#define _LIBSED_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Embedding sed.
+//
+// A script is compiled once and is then never modified, any number of contexts
+// can run it at the same time, each on its own input and output. Contexts are
+// independent from each other and can be used from different threads, a context
+// itself must only be used by one thread at a time.
+//
+// Errors don't exit the process: the calls return NULL or -1 and sed_error gives
+// the message. A run which fails is over, its context can run again.
+
+// Only the sed_* functions are exported by the library
+#if defined(__GNUC__)
+#define SED_API __attribute__((visibility("default")))
+#else
+#define SED_API
+#endif
+
+struct sed_script;
+struct sed;
+
+// Message of the last error of the calling thread, valid until its next error
+SED_API const char *
+sed_error(void);
+
+// Compile the text of a script, as given to `-e`. NULL if it's invalid.
+SED_API struct sed_script *
+sed_compile(const char *text);
+// The contexts running the script must have been freed
+SED_API void
+sed_script_free(struct sed_script *script);
+
+SED_API struct sed *
+sed_new(const struct sed_script *script);
+// Don't print the pattern space at the end of each cycle (`-n`)
+SED_API void
+sed_set_quiet(struct sed *sed, bool quiet);
+// Records are terminated by separator instead of a newline (`--separator`)
+SED_API int
+sed_set_separator(struct sed *sed, const char *separator, size_t len);
+// Run the script on what's read from input_fd until its end, the output is
+// written to output_fd. Neither is closed. Nothing is carried over from one run
+// to the next: ranges, hold space, and the files of `r`, `R` and `w` start over.
+// Returns 0, or -1 if reading or writing failed.
+SED_API int
+sed_run(struct sed *sed, int input_fd, int output_fd);
+
+// Receives the output of a pushed run, s is only valid during the call
+typedef void (*sed_sink)(void *data, const char *s, size_t len);
+// Start a run on input pushed with sed_feed instead of read from a descriptor,
+// for event loops: the calls never block nor do I/O themselves (the `r`, `R` and
+// `w` commands of the script still access their files). The output is given to
+// sink, at the latest before sed_feed returns. Returns 0 or -1.
+SED_API int
+sed_start(struct sed *sed, sed_sink sink, void *data);
+// data can be any chunk of the input, a line is run once it's complete and the
+// next one started (or sed_finish called) so that `$` is known. Returns 1, 0 once
+// the script quit (`q`) and nothing more will be read, or -1 once the run failed.
+SED_API int
+sed_feed(struct sed *sed, const char *data, size_t len);
+// End the input and the run, the context can start again. Returns 0, or -1 if the
+// run failed.
+SED_API int
+sed_finish(struct sed *sed);
+SED_API void
+sed_free(struct sed *sed);
+
+#endif
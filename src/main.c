@@ -1,35 +1,349 @@
 #include "sed.h"
+#include <getopt.h>
+#include <pthread.h>
 
-static bool auto_print = true;
+static struct context context = CONTEXT_INIT;
 
-char *script_string = NULL;
+// Options of an invocation, each request of the daemon mode has its own
+struct options
+{
+    bool auto_print;
+    // the pieces of script given by -e and -f, each followed by a newline
+    char  *script_string;
+    size_t script_string_len;
+    size_t script_string_capacity;
+    // `-z` or the argument of --separator once unescaped
+    const char *separator;
+    size_t      separator_len;
+    char       *separator_owned;
+    char       *cache_dir;
+    bool        stats;
+    bool        io_uring;
+    bool        pipelined;
+    bool        profile;
+    enum profile_format profile_format;
+    // daemon mode, see server.c
+    char  *serve_socket;
+    char  *connect_socket;
+    size_t workers;
+    // index of the first operand
+    int operands;
+};
 
-int
-main(int argc, char *argv[])
+// getopt keeps its state in globals
+static pthread_mutex_t getopt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+enum long_option
+{
+    OPTION_CACHE_DIR = 256,
+    OPTION_PROFILE,
+    OPTION_STATS,
+    OPTION_SEPARATOR,
+    OPTION_SERVE,
+    OPTION_CONNECT,
+    OPTION_WORKERS,
+    OPTION_IO_URING,
+    OPTION_PIPELINE,
+};
+
+static const struct option long_options[] = {
+    {"cache-dir", required_argument, NULL, OPTION_CACHE_DIR},
+    {"null-data", no_argument, NULL, 'z'},
+    {"separator", required_argument, NULL, OPTION_SEPARATOR},
+    {"profile", optional_argument, NULL, OPTION_PROFILE},
+    {"stats", no_argument, NULL, OPTION_STATS},
+    {"serve", required_argument, NULL, OPTION_SERVE},
+    {"connect", required_argument, NULL, OPTION_CONNECT},
+    {"workers", required_argument, NULL, OPTION_WORKERS},
+    {"io-uring", no_argument, NULL, OPTION_IO_URING},
+    {"pipeline", no_argument, NULL, OPTION_PIPELINE},
+    {NULL, 0, NULL, 0},
+};
+
+// Append a piece of script followed by a newline, the script string grows
+// geometrically so that many -e/-f options stay linear.
+static void
+script_append(struct options *options, const char *s)
+{
+    const size_t len = strlen(s);
+    if (options->script_string_len + len + 2 > options->script_string_capacity)
+    {
+        options->script_string_capacity *= 2;
+        if (options->script_string_capacity < options->script_string_len + len + 2)
+            options->script_string_capacity = options->script_string_len + len + 2;
+        options->script_string =
+            xrealloc(options->script_string, options->script_string_capacity);
+    }
+    memcpy(options->script_string + options->script_string_len, s, len);
+    options->script_string_len += len;
+    options->script_string[options->script_string_len++] = '\n';
+    options->script_string[options->script_string_len] = '\0';
+}
+
+// Unescape the argument of `--separator`: `\n`, `\t`, `\r`, `\0`, `\\` and `\xHH`
+// are recognized, e.g. `\r\n` or `\x1e`
+static char *
+separator_parse(const char *s, size_t *len)
 {
+    char *separator = xmalloc(strlen(s) + 1);
+    *len = 0;
+    for (; *s != '\0'; s++)
+    {
+        if (*s != '\\')
+        {
+            separator[(*len)++] = *s;
+            continue;
+        }
+        switch (*++s)
+        {
+        case 'n':
+            separator[(*len)++] = '\n';
+            break;
+        case 't':
+            separator[(*len)++] = '\t';
+            break;
+        case 'r':
+            separator[(*len)++] = '\r';
+            break;
+        case '0':
+            separator[(*len)++] = '\0';
+            break;
+        case '\\':
+            separator[(*len)++] = '\\';
+            break;
+        case 'x':
+            if (!isxdigit(s[1]) || !isxdigit(s[2]))
+                die("invalid separator: expected two hexadecimal digits after \\x");
+            separator[(*len)++] = strtol((char[]){s[1], s[2], '\0'}, NULL, 16);
+            s += 2;
+            break;
+        default:
+            die("invalid separator: unknown escape sequence");
+        }
+    }
+    if (*len == 0)
+        die("invalid separator: empty");
+    return separator;
+}
+
+static void
+options_init(struct options *options)
+{
+    memset(options, 0, sizeof(struct options));
+    options->auto_print = true;
+    options->separator = "\n";
+    options->separator_len = 1;
+    options->profile_format = PROFILE_TEXT;
+    options->connect_socket = getenv("SED_SOCKET");
+}
+
+static void
+options_free(void *arg)
+{
+    struct options *options = arg;
+    free(options->script_string);
+    free(options->separator_owned);
+}
+
+// Parse the options of argv, relative paths are opened from dir_fd
+static void
+options_parse(struct options *options, int dir_fd, int argc, char *argv[])
+{
+    // a full reinitialization with glibc
+    optind = 0;
     int option;
-    while ((option = getopt(argc, argv, "e:f:n")) != -1)
+    while ((option = getopt_long(argc, argv, "e:f:nz", long_options, NULL)) != -1)
     {
         switch (option)
         {
         case 'e':
-            script_string = strjoinf(script_string, optarg, "\n", NULL);
+            script_append(options, optarg);
             break;
         case 'f':
-            script_string = strjoinf(script_string, read_file(optarg), "\n", NULL);
+        {
+            char *content = read_file_at(dir_fd, optarg);
+            script_append(options, content);
+            free(content);
             break;
+        }
         case 'n':
-            auto_print = false;
+            options->auto_print = false;
+            break;
+        case 'z':
+            options->separator = "";
+            options->separator_len = 1;
+            break;
+        case OPTION_SEPARATOR:
+            free(options->separator_owned);
+            options->separator_owned =
+                separator_parse(optarg, &options->separator_len);
+            options->separator = options->separator_owned;
+            break;
+        case OPTION_CACHE_DIR:
+            options->cache_dir = optarg;
+            break;
+        case OPTION_PROFILE:
+            options->profile = true;
+            if (optarg == NULL || strcmp(optarg, "text") == 0)
+                options->profile_format = PROFILE_TEXT;
+            else if (strcmp(optarg, "json") == 0)
+                options->profile_format = PROFILE_JSON;
+            else
+                die("unknown profile format: %s", optarg);
+            break;
+        case OPTION_STATS:
+            options->stats = true;
+            break;
+        case OPTION_IO_URING:
+            options->io_uring = true;
+            break;
+        case OPTION_PIPELINE:
+            options->pipelined = true;
+            break;
+        case OPTION_SERVE:
+            options->serve_socket = optarg;
+            break;
+        case OPTION_CONNECT:
+            options->connect_socket = optarg;
+            break;
+        case OPTION_WORKERS:
+        {
+            char *end;
+            options->workers = strtoul(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || options->workers == 0)
+                die("invalid number of workers: %s", optarg);
+            break;
+        }
+        case '?':
+            // getopt only reports it on the standard error of the process
+            if (!opterr)
+                put_error("invalid option: %s", argv[optind - 1]);
             break;
         }
     }
-    if (script_string == NULL)
+    options->operands = optind;
+}
+
+// The script is the first operand unless -e or -f were given
+static char *
+options_script(struct options *options, int argc, char *argv[])
+{
+    if (options->script_string_len > 0)
+        return options->script_string;
+    if (argc == options->operands)
+        die("missing script");
+    return argv[options->operands++];
+}
+
+// The output is written before the statistics are reported, also when exiting on
+// an error
+static void
+context_flush(void)
+{
+    output_flush(&context);
+    write_targets_close(&context);
+}
+
+static void
+getopt_unlock(void *arg)
+{
+    (void)arg;
+    pthread_mutex_unlock(&getopt_lock);
+}
+
+// Run a request of the daemon mode on the context of a worker, which releases it
+// along with arena. Profiles and statistics are only reported by a local run, the
+// daemon options are ignored.
+static int
+run_request(struct context *ctx, struct arena *arena, int argc, char *argv[])
+{
+    struct options options;
+    options_init(&options);
+    pthread_cleanup_push(options_free, &options);
+    pthread_mutex_lock(&getopt_lock);
+    pthread_cleanup_push(getopt_unlock, NULL);
+    // the request has its own standard error
+    opterr = 0;
+    options_parse(&options, ctx->dir_fd, argc, argv);
+    pthread_cleanup_pop(true);
+    script_t script = server_script(options_script(&options, argc, argv), arena);
+    input_set_separator(ctx, options.separator, options.separator_len);
+    ctx->io_uring = options.io_uring;
+    ctx->pipelined = options.pipelined;
+    exec(ctx,
+         script,
+         argv + options.operands,
+         argc - options.operands,
+         options.auto_print);
+    pthread_cleanup_pop(true);
+    return EXIT_SUCCESS;
+}
+
+static int
+run(int argc, char *argv[])
+{
+    struct options options;
+    options_init(&options);
+    options_parse(&options, AT_FDCWD, argc, argv);
+    if (options.serve_socket != NULL)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (options.workers == 0)
+            options.workers = cpus > 0 ? cpus : 1;
+        return server_run(options.serve_socket,
+                          options.workers,
+                          argv + options.operands,
+                          argc - options.operands,
+                          run_request);
+    }
+    // profiles and statistics are only reported by a local run
+    if (options.connect_socket != NULL && *options.connect_socket != '\0' &&
+        !options.profile && !options.stats)
+    {
+        int status = client_run(options.connect_socket, argc, argv);
+        // the script is run locally if the server can't be reached
+        if (status != -1)
+            return status;
+    }
+    char    *text = options_script(&options, argc, argv);
+    script_t script = NULL;
+    uint64_t cache_key = 0;
+    if (options.cache_dir != NULL)
     {
-        if (argc == optind)
-            die("missing script");
-        script_string = argv[optind];
+        cache_key = script_cache_key(text);
+        script = script_cache_load(options.cache_dir, cache_key, text);
     }
-    script_t script = parse(script_string);
-    exec(script, argv + optind, argc - optind, auto_print);
+    if (script == NULL)
+    {
+        script = parse(text);
+        if (options.cache_dir != NULL)
+            script_cache_store(options.cache_dir, cache_key, text, script);
+    }
+    if (options.profile)
+        profile_init(script, options.profile_format);
+    stats_init(&context.stats, options.stats);
+    atexit(context_flush);
+    input_set_separator(&context, options.separator, options.separator_len);
+    context.io_uring = options.io_uring;
+    context.pipelined = options.pipelined;
+    exec(&context,
+         script,
+         argv + options.operands,
+         argc - options.operands,
+         options.auto_print);
+    // the profiles live in the script arena, they are reported before it is freed
+    if (options.profile)
+    {
+        output_flush(&context);
+        profile_report();
+    }
+    script_free();
+    options_free(&options);
     return EXIT_SUCCESS;
 }
+
+int
+main(int argc, char *argv[])
+{
+    return run(argc, argv);
+}
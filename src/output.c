@@ -0,0 +1,483 @@
+#include "sed.h"
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+
+// Output files of the `w` command and the `w` flag of `s`.
+//
+// A script can reference thousands of files, more than the process is allowed to
+// keep open. Each target gets its own buffer and only a bounded pool of them hold
+// an open descriptor, the least recently flushed one is closed when the pool is
+// full and reopened later in append mode. Every file is created (or truncated)
+// when the run starts, as POSIX requires, so an `r` of one of them never sees it
+// shrink. `/dev/stdout` is written to the standard output buffer instead, so that
+// it's interleaved with the rest of the output.
+
+#define WRITE_TARGET_BUF_SIZE 16384
+// descriptors kept for stdin/stdout/stderr, input files and `r` files
+#define WRITE_TARGET_FD_RESERVE 32
+#define WRITE_TARGET_FD_MIN 4
+// IOV_MAX on Linux and the BSDs, not exposed by the POSIX headers
+#define WRITEV_IOV_MAX 1024
+
+struct write_target
+{
+    char                *filepath;
+    int                  fd;
+    // the file was opened (and truncated) before, it's reopened in append mode
+    bool                 opened;
+    bool                 to_stdout;
+    char                *buf;
+    size_t               buf_len;
+    struct write_target *lru_prev;
+    struct write_target *lru_next;
+};
+
+static size_t
+open_max_init(void)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur == RLIM_INFINITY)
+        return 1024;
+    if (limit.rlim_cur < WRITE_TARGET_FD_RESERVE + WRITE_TARGET_FD_MIN)
+        return WRITE_TARGET_FD_MIN;
+    return limit.rlim_cur - WRITE_TARGET_FD_RESERVE;
+}
+
+static void
+lru_unlink(struct output *output, struct write_target *target)
+{
+    if (target->lru_prev != NULL)
+        target->lru_prev->lru_next = target->lru_next;
+    else
+        output->lru_head = target->lru_next;
+    if (target->lru_next != NULL)
+        target->lru_next->lru_prev = target->lru_prev;
+    else
+        output->lru_tail = target->lru_prev;
+    target->lru_prev = NULL;
+    target->lru_next = NULL;
+}
+
+static void
+lru_push_front(struct output *output, struct write_target *target)
+{
+    target->lru_prev = NULL;
+    target->lru_next = output->lru_head;
+    if (output->lru_head != NULL)
+        output->lru_head->lru_prev = target;
+    output->lru_head = target;
+    if (output->lru_tail == NULL)
+        output->lru_tail = target;
+}
+
+static void
+target_close(struct context *ctx, struct write_target *target)
+{
+    struct output *output = &ctx->output;
+    if (target->fd == -1)
+        return;
+    uring_write_wait(ctx, target->fd);
+    if (close(target->fd) == -1)
+        put_error("couldn't close file %s: %s", target->filepath, strerror(errno));
+    target->fd = -1;
+    lru_unlink(output, target);
+    output->open_len--;
+}
+
+// Make sure the target has an open descriptor, evicting the least recently used
+// one if the pool is full.
+static void
+target_acquire(struct context *ctx, struct write_target *target)
+{
+    struct output *output = &ctx->output;
+    if (target->fd != -1)
+    {
+        lru_unlink(output, target);
+        lru_push_front(output, target);
+        return;
+    }
+    if (output->open_max == 0)
+        output->open_max = open_max_init();
+    if (output->open_len >= output->open_max)
+        target_close(ctx, output->lru_tail);
+    int flags = O_WRONLY | O_CREAT | (target->opened ? O_APPEND : O_TRUNC);
+    target->fd = context_open(ctx, target->filepath, flags);
+    if (target->fd == -1)
+        die("couldn't open file %s: %s", target->filepath, strerror(errno));
+    target->opened = true;
+    output->open_len++;
+    lru_push_front(output, target);
+}
+
+// Write all of iov, retrying on partial writes (or hand it to io_uring). iov is
+// modified.
+static void
+writev_all(struct context *ctx,
+           int             fd,
+           struct iovec   *iov,
+           size_t          iovcnt,
+           const char     *filepath)
+{
+    struct io_stats *stats = &ctx->stats;
+    for (size_t i = 0; stats->count_lines_written && i < iovcnt; i++)
+    {
+        const char *s = iov[i].iov_base;
+        const char *end = s + iov[i].iov_len;
+        for (; (s = memchr(s, '\n', end - s)) != NULL; s++)
+            stats->lines_written++;
+    }
+    if (ctx->pipeline != NULL && fd == ctx->output.fd)
+    {
+        pipeline_write(ctx, iov, iovcnt);
+        return;
+    }
+    if (ctx->io_uring && uring_write(ctx, fd, iov, iovcnt, filepath))
+        return;
+    while (iovcnt > 0)
+    {
+        int      count = iovcnt > WRITEV_IOV_MAX ? WRITEV_IOV_MAX : iovcnt;
+        uint64_t start = stats_clock();
+        ssize_t  ret = writev(fd, iov, count);
+        stats->write_ns += stats_clock() - start;
+        stats->write_calls++;
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1)
+            die("couldn't write to file %s: %s", filepath, strerror(errno));
+        stats->bytes_written += ret;
+        for (; iovcnt > 0 && (size_t)ret >= iov->iov_len; iov++, iovcnt--)
+            ret -= iov->iov_len;
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+}
+
+static void
+target_write_fd(struct context      *ctx,
+                struct write_target *target,
+                const char          *s,
+                size_t               len)
+{
+    target_acquire(ctx, target);
+    struct iovec iov = {(void *)s, len};
+    writev_all(ctx, target->fd, &iov, 1, target->filepath);
+}
+
+static void
+target_flush(struct context *ctx, struct write_target *target)
+{
+    if (target->buf_len == 0)
+        return;
+    // what fails to be written is dropped, closing the target after an error
+    // doesn't fail again
+    size_t len = target->buf_len;
+    target->buf_len = 0;
+    target_write_fd(ctx, target, target->buf, len);
+}
+
+static void
+targets_grow(struct output *output)
+{
+    size_t                old_capacity = output->targets_capacity;
+    struct write_target **old_targets = output->targets;
+    size_t                capacity = old_capacity == 0 ? 64 : old_capacity * 2;
+    struct write_target **targets =
+        xmalloc(sizeof(struct write_target *) * capacity);
+    memset(targets, 0, sizeof(struct write_target *) * capacity);
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old_targets[i] == NULL)
+            continue;
+        size_t j = hash_string(old_targets[i]->filepath) & (capacity - 1);
+        while (targets[j] != NULL)
+            j = (j + 1) & (capacity - 1);
+        targets[j] = old_targets[i];
+    }
+    free(old_targets);
+    output->targets = targets;
+    output->targets_capacity = capacity;
+}
+
+// Returns the slot of filepath in the hash table, or the empty slot where it
+// should be inserted
+static size_t
+targets_find(struct output *output, const char *filepath)
+{
+    const size_t mask = output->targets_capacity - 1;
+    size_t       i = hash_string(filepath) & mask;
+    for (; output->targets[i] != NULL; i = (i + 1) & mask)
+    {
+        if (strcmp(output->targets[i]->filepath, filepath) == 0)
+            break;
+    }
+    return i;
+}
+
+struct write_target *
+write_target_get(struct context *ctx, const char *filepath)
+{
+    struct output *output = &ctx->output;
+    if (output->targets_len * 2 >= output->targets_capacity)
+        targets_grow(output);
+    size_t i = targets_find(output, filepath);
+    if (output->targets[i] != NULL)
+        return output->targets[i];
+    struct write_target *target = xmalloc(sizeof(struct write_target));
+    target->filepath = xstrdup(filepath);
+    target->fd = -1;
+    target->opened = false;
+    target->to_stdout = strcmp(filepath, "/dev/stdout") == 0;
+    target->buf = NULL;
+    target->buf_len = 0;
+    target->lru_prev = NULL;
+    target->lru_next = NULL;
+    output->targets[i] = target;
+    output->targets_len++;
+    return target;
+}
+
+// Create or truncate the files written by the script before the input is read
+void
+write_targets_open(struct context *ctx, script_t commands)
+{
+    for (struct command *command = commands; command->id != COMMAND_LAST; command++)
+    {
+        const char *filepath = NULL;
+        if (command->id == 'w')
+            filepath = command->data.text;
+        else if (command->id == 's')
+            filepath = command->data.substitute.write_filepath;
+        else if (command->id == '{')
+            write_targets_open(ctx, command->data.children);
+        else if (command->id == '}')
+            break;
+        if (filepath == NULL)
+            continue;
+        struct write_target *target = write_target_get(ctx, filepath);
+        if (!target->to_stdout && !target->opened)
+            target_acquire(ctx, target);
+    }
+}
+
+// Flush the buffered output of filepath, if it is a target, so that it can be read
+void
+write_target_sync(struct context *ctx, const char *filepath)
+{
+    if (ctx->output.targets_len == 0)
+        return;
+    size_t i = targets_find(&ctx->output, filepath);
+    if (ctx->output.targets[i] == NULL)
+        return;
+    target_flush(ctx, ctx->output.targets[i]);
+    uring_write_wait(ctx, ctx->output.targets[i]->fd);
+}
+
+void
+write_target_write(struct context      *ctx,
+                   struct write_target *target,
+                   const char          *s,
+                   size_t               len)
+{
+    if (target->to_stdout)
+    {
+        output_write(ctx, s, len);
+        return;
+    }
+    ctx->output.generation++;
+    if (target->buf_len + len > WRITE_TARGET_BUF_SIZE)
+        target_flush(ctx, target);
+    if (len >= WRITE_TARGET_BUF_SIZE)
+    {
+        target_write_fd(ctx, target, s, len);
+        return;
+    }
+    if (target->buf == NULL)
+        target->buf = xmalloc(WRITE_TARGET_BUF_SIZE);
+    memcpy(target->buf + target->buf_len, s, len);
+    target->buf_len += len;
+}
+
+void
+write_targets_flush(struct context *ctx)
+{
+    for (size_t i = 0; i < ctx->output.targets_capacity; i++)
+    {
+        if (ctx->output.targets[i] != NULL)
+            target_flush(ctx, ctx->output.targets[i]);
+    }
+    uring_write_wait(ctx, -1);
+}
+
+size_t
+write_targets_generation(struct context *ctx)
+{
+    return ctx->output.generation;
+}
+
+void
+write_targets_close(struct context *ctx)
+{
+    struct output *output = &ctx->output;
+    for (size_t i = 0; i < output->targets_capacity; i++)
+    {
+        struct write_target *target = output->targets[i];
+        if (target == NULL)
+            continue;
+        target_flush(ctx, target);
+        target_close(ctx, target);
+        free(target->filepath);
+        free(target->buf);
+        free(target);
+        output->targets[i] = NULL;
+    }
+    free(output->targets);
+    output->targets = NULL;
+    output->targets_capacity = 0;
+    output->targets_len = 0;
+}
+
+// Standard output, buffered the same way as write targets. Batches of strings
+// which don't fit in the buffer are written along with it in a single writev. A
+// terminal is written to at each newline, and the input flushes the buffer before
+// a read which would block (see input_refill).
+
+#define OUTPUT_BUF_SIZE 65536
+#define OUTPUT_IOV_MAX 64
+
+// Give the output to sink instead of writing it to the descriptor
+void
+output_set_sink(struct context *ctx, output_sink sink, void *data)
+{
+    ctx->output.sink = sink;
+    ctx->output.sink_data = data;
+}
+
+// Write iov to the descriptor or hand it to the sink. iov is modified.
+static void
+output_send(struct context *ctx, struct iovec *iov, size_t iovcnt)
+{
+    struct output *output = &ctx->output;
+    if (output->sink == NULL)
+    {
+        writev_all(ctx, output->fd, iov, iovcnt, "stdout");
+        return;
+    }
+    for (size_t i = 0; i < iovcnt; i++)
+    {
+        if (iov[i].iov_len == 0)
+            continue;
+        output->sink(output->sink_data, iov[i].iov_base, iov[i].iov_len);
+        ctx->stats.bytes_written += iov[i].iov_len;
+    }
+}
+
+void
+output_flush(struct context *ctx)
+{
+    struct output *output = &ctx->output;
+    if (output->len > 0)
+    {
+        struct iovec iov = {output->buf, output->len};
+        output->len = 0;
+        output_send(ctx, &iov, 1);
+    }
+    // what was written behind is out too
+    uring_write_wait(ctx, output->fd);
+    pipeline_sync(ctx);
+}
+
+// Release the buffer, what it holds must have been flushed
+void
+output_free(struct context *ctx)
+{
+    free(ctx->output.buf);
+    ctx->output.buf = NULL;
+    ctx->output.len = 0;
+    ctx->output.deferred = NULL;
+}
+
+void
+output_writev(struct context *ctx, const struct iovec *iov, size_t iovcnt)
+{
+    struct output *output = &ctx->output;
+    if (output->buf == NULL)
+    {
+        output->buf = xmalloc(OUTPUT_BUF_SIZE);
+        output->line_buffered = output->sink == NULL && isatty(output->fd);
+    }
+    if (output->deferred != NULL)
+    {
+        const char *deferred = output->deferred;
+        output->deferred = NULL;
+        output_write(ctx, deferred, output->deferred_len);
+    }
+    size_t total = 0;
+    for (size_t i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    if (output->len + total <= OUTPUT_BUF_SIZE)
+    {
+        size_t start = output->len;
+        for (size_t i = 0; i < iovcnt; i++)
+        {
+            memcpy(output->buf + output->len, iov[i].iov_base, iov[i].iov_len);
+            output->len += iov[i].iov_len;
+        }
+        if (output->line_buffered &&
+            memchr(output->buf + start, '\n', total) != NULL)
+            output_flush(ctx);
+        return;
+    }
+    if (iovcnt >= OUTPUT_IOV_MAX)
+    {
+        output_flush(ctx);
+        struct iovec *copy = xmalloc(sizeof(struct iovec) * iovcnt);
+        memcpy(copy, iov, sizeof(struct iovec) * iovcnt);
+        output_send(ctx, copy, iovcnt);
+        free(copy);
+        return;
+    }
+    struct iovec batch[OUTPUT_IOV_MAX + 1];
+    batch[0].iov_base = output->buf;
+    batch[0].iov_len = output->len;
+    memcpy(batch + 1, iov, sizeof(struct iovec) * iovcnt);
+    output->len = 0;
+    output_send(ctx, batch, iovcnt + 1);
+}
+
+void
+output_write(struct context *ctx, const char *s, size_t len)
+{
+    struct iovec iov = {(void *)s, len};
+    output_writev(ctx, &iov, 1);
+}
+
+void
+output_puts(struct context *ctx, const char *s)
+{
+    output_write(ctx, s, strlen(s));
+}
+
+// Write s only if something else is written after it
+void
+output_defer(struct context *ctx, const char *s, size_t len)
+{
+    ctx->output.deferred = s;
+    ctx->output.deferred_len = len;
+}
+
+// End an output record with the input record separator. It's held back when the
+// input record had none (the end of the last file), unless more output follows.
+void
+output_separator(struct context *ctx)
+{
+    size_t      len;
+    const char *separator = input_separator(ctx, &len);
+    if (input_line_terminated(ctx))
+        output_write(ctx, separator, len);
+    else
+        output_defer(ctx, separator, len);
+}
@@ -1,5 +1,13 @@
 #include "sed.h"
 
+// Owns everything produced by the parser: command arrays, unescaped text and
+// compiled regexes (see regex.c).
+struct arena script_arena = {NULL, NULL};
+
+// ranges of the script being parsed, their state is kept by the context running
+// the script
+static size_t ranges_len = 0;
+
 static char *
 skip_blank(char **s_ptr)
 {
@@ -8,27 +16,90 @@ skip_blank(char **s_ptr)
     return *s_ptr;
 }
 
+static const char *available_escape = "tnrvf";
+static const char  escape_lookup[] = {
+    ['t'] = '\t',
+    ['n'] = '\n',
+    ['r'] = '\r',
+    ['v'] = '\v',
+    ['f'] = '\f',
+};
+
+// How the escape sequences of a delimited piece of text are handled
+enum escape_mode
+{
+    // only the delimiter and `\n` are unescaped, the rest is left to regcomp
+    ESCAPE_REGEX,
+    // like ESCAPE_TEXT but `\&`, `\\` and group references are kept for exec
+    ESCAPE_REPLACEMENT,
+    // special characters (tabs, newline, etc...) are replaced by their code,
+    // every other escaped character by the character itself
+    ESCAPE_TEXT,
+};
+
 static char *
-str_left_shift(char *s)
+unescape_char(char *out, char c, char delim, enum escape_mode mode)
 {
-    return memmove(s, s + 1, strlen(s));
+    if (c == delim)
+        *out++ = c;
+    else if (mode == ESCAPE_REGEX)
+    {
+        if (c == 'n')
+            *out++ = '\n';
+        else
+        {
+            *out++ = '\\';
+            *out++ = c;
+        }
+    }
+    else if (mode == ESCAPE_REPLACEMENT && (c == '&' || c == '\\' || isdigit(c)))
+    {
+        *out++ = '\\';
+        *out++ = c;
+    }
+    else if (strchr(available_escape, c) != NULL)
+        *out++ = escape_lookup[(size_t)c];
+    else
+        *out++ = c;
+    return out;
 }
 
-// Replace the next delimiter character by '\0' to cut the string
-// Also handles escaped delimiter
-// Returns a pointer to the character after the cut.
+// Extract the text up to the next unescaped delimiter character in a new string,
+// handling escape sequences according to mode.
+// The text is scanned once to find its end and once to copy it.
+// Returns a pointer to the delimiter, or to the end of the string if error_id is
+// NULL (dies otherwise).
 static char *
-delimited_cut(char *s, char delim, const char *error_id)
+extract_piece(char            *s,
+              char           **extracted,
+              char             delim,
+              enum escape_mode mode,
+              const char      *error_id)
 {
-    for (; *s != delim; s++)
+    char *end = s;
+    for (; *end != delim; end++)
     {
-        if (*s == '\0')
-            die("unterminated %s", error_id);
-        if (s[0] == '\\' && s[1] == delim)
-            str_left_shift(s);
+        if (*end == '\0')
+        {
+            if (error_id != NULL)
+                die("unterminated %s", error_id);
+            break;
+        }
+        if (end[0] == '\\' && end[1] != '\0')
+            end++;
+    }
+    // an escape sequence never expands to more than its two characters
+    char *out = arena_alloc(&script_arena, end - s + 1);
+    *extracted = out;
+    for (; s != end; s++)
+    {
+        if (s[0] == '\\' && s + 1 != end)
+            out = unescape_char(out, *++s, delim, mode);
+        else
+            *out++ = *s;
     }
-    *s = '\0';
-    return s + 1;
+    *out = '\0';
+    return end;
 }
 
 // Extracts two strings separated by a delimiter character.
@@ -36,80 +107,25 @@ delimited_cut(char *s, char delim, const char *error_id)
 // The first character of the string is the delimiter.
 // If extracted2 is NULL, only tries to extract the first group between delimiter.
 static char *
-extract_delimited(char       *s,
-                  char      **extracted1,
-                  char      **extracted2,
-                  const char *error_id)
+extract_delimited(char            *s,
+                  char           **extracted1,
+                  enum escape_mode mode1,
+                  char           **extracted2,
+                  enum escape_mode mode2,
+                  const char      *error_id)
 {
     const char delim = *s;
     if (delim == '\\')
         die("delimiter can not be a backslash");
-    *extracted1 = s + 1;
-    s = delimited_cut(*extracted1, delim, error_id);
+    if (delim == '\n' || delim == '\0')
+        die("unterminated %s", error_id);
+    s = extract_piece(s + 1, extracted1, delim, mode1, error_id) + 1;
     if (extracted2 == NULL)
         return s;
-    *extracted2 = s;
-    s = delimited_cut(*extracted2, delim, error_id);
-    return s;
-}
-
-static char *
-strchr_newline_or_end(const char *s)
-{
-    char *ret = NULL;
-    ret = strchr(s, '\n');
-    if (ret == NULL)
-        ret = strchr(s, '\0');
-    return ret;
-}
-
-static const char *available_escape = "tnrvf";
-static const char  escape_lookup[] = {
-    ['t'] = '\t',
-    ['n'] = '\n',
-    ['r'] = '\r',
-    ['v'] = '\v',
-    ['f'] = '\f',
-};
-
-// Handle escaped special characters (tabs, newline, etc...)
-// by replacing them by the litteral character code.
-// Replace all other characters (EXCEPT the ones in `reject` param) by the character
-// itself
-static void
-replace_escape_sequence_reject(char *s, const char *reject)
-{
-    for (; *s != '\0'; s++)
-    {
-        if (s[0] == '\\' && s[1] != '\0' && strchr(reject, s[1]) == NULL)
-        {
-            if (strchr(available_escape, s[1]) != NULL)
-                s[1] = escape_lookup[(size_t)s[1]];
-            str_left_shift(s);
-        }
-    }
-}
-
-static void
-replace_escape_sequence(char *s)
-{
-    replace_escape_sequence_reject(s, "");
-}
-
-static void
-xregcomp(regex_t *preg, const char *regex, int cflags)
-{
-    const int errcode = regcomp(preg, regex, cflags);
-    if (errcode != 0)
-    {
-        const size_t errbuf_size = 128;
-        char         errbuf[errbuf_size + 1];
-        regerror(errcode, preg, errbuf, errbuf_size);
-        die("regex error '%s': %s", regex, errbuf);
-    }
+    return extract_piece(s, extracted2, delim, mode2, error_id) + 1;
 }
 
-static const char *available_commands = "{}aci:btrwdDgGhHlnNpPqx=#sy";
+const char *available_commands = "{}aci:btrRwdDgGhHlnNpPqx=#sy";
 
 // Parse an address (place where a command will be executed)
 // '$'     -> end of file
@@ -134,19 +150,27 @@ parse_address(char *s, struct address *address)
         return s;
     }
     char *regex = NULL;
-    s = extract_delimited(s, &regex, NULL, "address regex");
+    s = extract_delimited(s, &regex, ESCAPE_REGEX, NULL, 0, "address regex");
+    int cflags = 0;
+    // `/regex/I` matches regardless of case
+    if (*s == 'I')
+    {
+        cflags = REG_ICASE;
+        s++;
+    }
+    if (cflags != 0 && regex[0] == '\0')
+        die("no modifiers on the empty regex");
     address->type = ADDRESS_RE;
-    xregcomp(&address->data.preg, regex, 0);
+    address->data.regex = regex_intern(regex, cflags, false);
     return s;
 }
-
 // A command can have 0, 1 or 2 addresses.
 // If there is 2, the command will be executed on all line between those addresses
 char *
 parse_addresses(char *s, struct addresses *addresses)
 {
     char *end;
-    addresses->in_range = false;
+    addresses->range = 0;
     addresses->count = 0;
     end = parse_address(s, &addresses->addresses[0]);
     if (s == end)
@@ -161,6 +185,7 @@ parse_addresses(char *s, struct addresses *addresses)
         return s;
     s = end;
     addresses->count++;
+    addresses->range = ranges_len++;
     return s;
 }
 
@@ -171,19 +196,35 @@ parse_singleton(char *s, struct command *command)
     return s;
 }
 
-// Parse a command that takes arbitrary text as an argument
+static char *
+parse_comment(char *s, struct command *command)
+{
+    command->data.text = NULL;
+    return s + strcspn(s, "\n");
+}
+
+// Parse a command that takes arbitrary text as an argument.
+// Labels also end on a semicolon and trailing blanks are ignored.
 static char *
 parse_text(char *s, struct command *command)
 {
-    command->data.text = s;
-    s = strchr_newline_or_end(s);
-    *s = '\0';
-    if ((command->id == 'r' || command->id == 'w') && *command->data.text == '\0')
-        die("missing filename in r/w commands");
-    return s + 1;
+    skip_blank(&s);
+    char *end = s + strcspn(s, strchr(":bt", command->id) != NULL ? ";\n" : "\n");
+    char *text_end = end;
+    if (strchr(":bt", command->id) != NULL)
+    {
+        while (text_end != s && isblank(text_end[-1]))
+            text_end--;
+    }
+    command->data.text = arena_strndup(&script_arena, s, text_end - s);
+    if (strchr("rRw", command->id) != NULL && *command->data.text == '\0')
+        die("missing filename in r/R/w commands");
+    return end;
 }
 
-// Parse a command that takes arbitrary *escapable* text as an argument
+// Parse a command that takes arbitrary *escapable* text as an argument.
+// The text can start on the next line and continue on several lines by escaping
+// the newlines.
 static char *
 parse_escapable_text(char *s, struct command *command)
 {
@@ -191,64 +232,61 @@ parse_escapable_text(char *s, struct command *command)
         die("expected '\\' after a/c/i commands");
     s++;
     skip_blank(&s);
-    command->data.text = s;
-    s = strchr_newline_or_end(s);
-    *s = '\0';
-    replace_escape_sequence(command->data.text);
-    return s + 1;
+    if (*s == '\n')
+        s++;
+    return extract_piece(s, &command->data.text, '\n', ESCAPE_TEXT, NULL);
 }
 
-static const size_t script_realloc_size = 10;
+static bool
+is_separator(char c)
+{
+    return c == ';' || c == '\n' || isspace(c);
+}
 
+// Parse a list of commands until the end of the string or, for a block, until
+// its closing brace which is kept as the last command.
+// The commands are collected in a geometrically growing scratch array and copied
+// to the arena once their number is known.
 static char *
 parse_script(char *s, script_t *script, bool end_on_closing_brace)
 {
-    bool has_separator = false;
-    *script = xmalloc(sizeof(struct command) * script_realloc_size);
-    size_t i = 0;
-    for (i = 0; true; i++)
+    size_t capacity = 16;
+    size_t len = 0;
+    struct command *commands = xmalloc(sizeof(struct command) * capacity);
+    while (true)
     {
-        s = parse_command(s, &(*script)[i]);
-        if (s[-1] == '\0')
-            has_separator = true;  // weird hack for parse*_text where the parser
-                                   // replaces the separator with  a null character
-        while (*s == ';' || *s == '\n' || isspace(*s))
-        {
-            if (*s == ';' || *s == '\n')
-                has_separator = true;
+        while (is_separator(*s))
             s++;
-        }
-        if (end_on_closing_brace)
+        if (*s == '\0')
         {
-            if ((*script)[i].id == '}')
-                break;
-            if (*s == '\0')
+            if (end_on_closing_brace)
                 die("unmatched '{'");
+            break;
         }
-        else
+        if (len + 1 == capacity)
         {
-            if ((*script)[i].id == '}')
-                die("unexpected '}'");
-            if (*s == '\0')
-                break;
+            capacity *= 2;
+            commands = xrealloc(commands, sizeof(struct command) * capacity);
         }
-        if (*s != '{' && *s != '}' && !has_separator)
-            die("extra characters after command");
-        has_separator = false;
-        if ((*script)[i].id == COMMAND_LAST)
-            i--;
-        if ((i + 1) % script_realloc_size == 0)
+        struct command *command = &commands[len++];
+        s = parse_command(s, command);
+        if (command->id == '}')
         {
-            size_t slots = (i / script_realloc_size) + 2;
-            *script = xrealloc(
-                *script, sizeof(struct command) * (slots * script_realloc_size));
+            if (!end_on_closing_brace)
+                die("unexpected '}'");
+            break;
         }
+        if (command->id == '{')
+            continue;
+        skip_blank(&s);
+        if (!is_separator(*s) && *s != '\0' && *s != '{' && *s != '}')
+            die("extra characters after command");
     }
     if (!end_on_closing_brace)
-    {
-        *script = xrealloc(*script, sizeof(struct command) * (i + 2));
-        (*script)[i + 1].id = COMMAND_LAST;
-    }
+        commands[len++].id = COMMAND_LAST;
+    *script = arena_alloc(&script_arena, sizeof(struct command) * len);
+    memcpy(*script, commands, sizeof(struct command) * len);
+    free(commands);
     return s;
 }
 
@@ -265,10 +303,10 @@ parse_translate(char *s, struct command *command)
 {
     s = extract_delimited(s,
                           &command->data.translate.from,
+                          ESCAPE_TEXT,
                           &command->data.translate.to,
+                          ESCAPE_TEXT,
                           "'y' command");
-    replace_escape_sequence(command->data.translate.from);
-    replace_escape_sequence(command->data.translate.to);
     if (strlen(command->data.translate.from) != strlen(command->data.translate.to))
         die("string for 'y' command are different lengths");
     return s;
@@ -280,25 +318,25 @@ static char *
 parse_substitute(char *s, struct command *command)
 {
     char *regex;
-    s = extract_delimited(
-        s, &regex, &command->data.substitute.replacement, "'s' command");
-    xregcomp(&command->data.substitute.preg, regex, 0);
-    char *replacement = command->data.substitute.replacement;
-    replace_escape_sequence_reject(replacement, "&0123456789");
-    for (size_t i = 0; replacement[i] != '\0'; i++)
-    {
-        if (replacement[i] == '\\' && isdigit(replacement[i + 1]) &&
-            (size_t)(replacement[i + 1] - '0') >
-                command->data.substitute.preg.re_nsub)
-            die("invalid reference \\%c on 's' command's RHS", replacement[i + 1]);
-    }
+    s = extract_delimited(s,
+                          &regex,
+                          ESCAPE_REGEX,
+                          &command->data.substitute.replacement,
+                          ESCAPE_REPLACEMENT,
+                          "'s' command");
     command->data.substitute.occurence_index = 0;
     command->data.substitute.global = false;
     command->data.substitute.print = false;
     command->data.substitute.write_filepath = NULL;
-    while (*s != '\0' && (strchr("gpw", *s) != NULL || isdigit(*s)))
+    int cflags = 0;
+    while (*s != '\0' && (strchr("gpwIi", *s) != NULL || isdigit(*s)))
     {
-        if (*s == 'g')
+        if (*s == 'I' || *s == 'i')
+        {
+            cflags = REG_ICASE;
+            s++;
+        }
+        else if (*s == 'g')
         {
             if (command->data.substitute.global)
                 die("multiple number 'g' options to 's' command");
@@ -307,7 +345,7 @@ parse_substitute(char *s, struct command *command)
         }
         else if (*s == 'p')
         {
-            if (command->data.substitute.global)
+            if (command->data.substitute.print)
                 die("multiple number 'p' options to 's' command");
             command->data.substitute.print = true;
             s++;
@@ -316,12 +354,9 @@ parse_substitute(char *s, struct command *command)
         {
             struct command write_file_command;
             write_file_command.id = 'w';
-            s++;
-            skip_blank(&s);
-            s = parse_text(s, &write_file_command);
+            s = parse_text(s + 1, &write_file_command);
             command->data.substitute.write_filepath = write_file_command.data.text;
-            break;  // no switch because I want to break from the loop and not the
-                    // switch
+            break;
         }
         else
         {
@@ -337,6 +372,21 @@ parse_substitute(char *s, struct command *command)
     }
     if (*s != '\0' && *s != '\n' && *s != ';' && *s != '}' && !isblank(*s))
         die("unknown option to 's' command");
+    if (cflags != 0 && regex[0] == '\0')
+        die("no modifiers on the empty regex");
+    command->data.substitute.regex = regex_compile(regex, cflags);
+    char *replacement = command->data.substitute.replacement;
+    for (size_t i = 0; replacement[i] != '\0'; i++)
+    {
+        if (replacement[i] != '\\')
+            continue;
+        i++;
+        // the last regex used is only known at runtime
+        if (isdigit(replacement[i]) && regex[0] != '\0' &&
+            (size_t)(replacement[i] - '0') >
+                command->data.substitute.regex->preg.re_nsub)
+            die("invalid reference \\%c on 's' command's RHS", replacement[i]);
+    }
     return s;
 }
 
@@ -351,16 +401,16 @@ static const struct command_info command_info_lookup[] = {
     ['a'] = {parse_escapable_text, 2}, ['c'] = {parse_escapable_text, 2},
     ['i'] = {parse_escapable_text, 2}, [':'] = {parse_text, 0},
     ['b'] = {parse_text, 2},           ['t'] = {parse_text, 2},
-    ['r'] = {parse_text, 2},           ['w'] = {parse_text, 2},
-    ['d'] = {parse_singleton, 2},      ['D'] = {parse_singleton, 2},
-    ['g'] = {parse_singleton, 2},      ['G'] = {parse_singleton, 2},
-    ['h'] = {parse_singleton, 2},      ['H'] = {parse_singleton, 2},
-    ['l'] = {parse_singleton, 2},      ['n'] = {parse_singleton, 2},
-    ['N'] = {parse_singleton, 2},      ['p'] = {parse_singleton, 2},
-    ['P'] = {parse_singleton, 2},      ['q'] = {parse_singleton, 1},
-    ['x'] = {parse_singleton, 2},      ['='] = {parse_singleton, 2},
-    ['#'] = {parse_singleton, 0},      ['s'] = {parse_substitute, 2},
-    ['y'] = {parse_translate, 2},
+    ['r'] = {parse_text, 2},           ['R'] = {parse_text, 2},
+    ['w'] = {parse_text, 2},           ['d'] = {parse_singleton, 2},
+    ['D'] = {parse_singleton, 2},      ['g'] = {parse_singleton, 2},
+    ['G'] = {parse_singleton, 2},      ['h'] = {parse_singleton, 2},
+    ['H'] = {parse_singleton, 2},      ['l'] = {parse_singleton, 2},
+    ['n'] = {parse_singleton, 2},      ['N'] = {parse_singleton, 2},
+    ['p'] = {parse_singleton, 2},      ['P'] = {parse_singleton, 2},
+    ['q'] = {parse_singleton, 1},      ['x'] = {parse_singleton, 2},
+    ['='] = {parse_singleton, 2},      ['#'] = {parse_comment, 0},
+    ['s'] = {parse_substitute, 2},     ['y'] = {parse_translate, 2},
 };
 
 char *
@@ -371,6 +421,7 @@ parse_command(char *s, struct command *command)
         command->id = COMMAND_LAST;
         return s;
     }
+    command->profile = NULL;
     s = parse_addresses(s, &command->addresses);
     skip_blank(&s);
     command->inverse = (*s == '!');
@@ -395,6 +446,41 @@ script_t
 parse(char *s)
 {
     script_t script = NULL;
+    ranges_len = 0;
     (void)parse_script(s, &script, false);
     return script;
 }
+
+// Parse s in arena instead of the arena of the other scripts, the script is freed
+// along with arena. On an error the script parsed so far is freed and the arena of
+// the other scripts put back before the error goes on (see errors_catch).
+script_t
+parse_into(char *s, struct arena *arena)
+{
+    struct arena        saved_arena = script_arena;
+    struct regex_table *saved_table = regex_table_swap(NULL);
+    jmp_buf             jmp;
+    jmp_buf            *outer = errors_catch(&jmp);
+    script_arena = *arena;
+    if (setjmp(jmp) != 0)
+    {
+        errors_catch(outer);
+        arena_free(&script_arena);
+        script_arena = saved_arena;
+        regex_table_swap(saved_table);
+        errors_rethrow();
+    }
+    script_t script = parse(s);
+    errors_catch(outer);
+    *arena = script_arena;
+    script_arena = saved_arena;
+    regex_table_swap(saved_table);
+    return script;
+}
+
+// Free every script parsed (or loaded from the cache) so far
+void
+script_free(void)
+{
+    arena_free(&script_arena);
+}
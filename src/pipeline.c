@@ -0,0 +1,514 @@
+#include "sed.h"
+#include <fcntl.h>
+#include <pthread.h>
+
+// Reader, executor and writer threads (`--pipeline`).
+//
+// The executor stays a single thread running the script. A reader thread opens
+// the input files and reads them into a ring of blocks, the executor splits them
+// in records as it would the data of read(2). A writer thread writes the batches
+// of standard output the executor puts in another ring. A slow input or output
+// then doesn't stall the script, and the script doesn't stall the I/O.
+//
+// Each ring has one producer and one consumer which advance their own index with
+// atomic operations. A side which finds the ring full (or empty) spins a little
+// and then sleeps on a condition variable, the other side only takes the lock to
+// wake it.
+
+#define RING_SLOTS 8
+#define RING_SLOT_SIZE 262144
+// before sleeping, when the other side can run meanwhile on another CPU
+#define RING_SPINS 256
+
+enum block_kind
+{
+    // the reader opened filepath
+    BLOCK_OPEN,
+    BLOCK_DATA,
+    // end of the file opened last
+    BLOCK_EOF,
+    // filepath couldn't be opened (error), the reader goes on with the next one
+    BLOCK_OPEN_ERROR,
+    // reading the file opened last failed (error), the run is over
+    BLOCK_READ_ERROR,
+    // no file left
+    BLOCK_END,
+};
+
+struct block
+{
+    enum block_kind kind;
+    char           *buf;
+    size_t          len;
+    size_t          consumed;
+    const char     *filepath;
+    int             error;
+};
+
+struct ring
+{
+    struct block    blocks[RING_SLOTS];
+    size_t          head;
+    size_t          tail;
+    size_t          sleepers;
+    size_t          spins;
+    bool            stop;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+};
+
+struct pipeline
+{
+    struct ring input;
+    struct ring output;
+    pthread_t   reader;
+    pthread_t   writer;
+    char      **filepaths;
+    size_t      filepaths_len;
+    int         stdin_fd;
+    int         output_fd;
+    // the files are opened as the context sees them, its descriptors don't change
+    // during the run
+    const struct context *context;
+    // errno of the first failed write, reported by the executor
+    int write_error;
+    // what's left of the block being consumed, NULL if none
+    struct block *reading;
+};
+
+static void
+ring_init(struct ring *ring)
+{
+    memset(ring, 0, sizeof(struct ring));
+    ring->spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? RING_SPINS : 0;
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->cond, NULL);
+    for (size_t i = 0; i < RING_SLOTS; i++)
+        ring->blocks[i].buf = xmalloc(RING_SLOT_SIZE);
+}
+
+static void
+ring_free(struct ring *ring)
+{
+    for (size_t i = 0; i < RING_SLOTS; i++)
+        free(ring->blocks[i].buf);
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->cond);
+}
+
+static bool
+ring_stopped(struct ring *ring)
+{
+    return __atomic_load_n(&ring->stop, __ATOMIC_SEQ_CST);
+}
+
+// The loads are sequentially consistent, as are the stores of the indexes and of
+// sleepers, so that a side going to sleep either sees the other side's progress
+// or is seen sleeping by it
+static bool
+ring_writable(struct ring *ring)
+{
+    return __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) -
+                   __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) <
+               RING_SLOTS ||
+           ring_stopped(ring);
+}
+
+static bool
+ring_readable(struct ring *ring)
+{
+    return __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) !=
+               __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) ||
+           ring_stopped(ring);
+}
+
+static bool
+ring_empty(struct ring *ring)
+{
+    return __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) ==
+               __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) ||
+           ring_stopped(ring);
+}
+
+static void
+ring_wait(struct ring *ring, bool (*ready)(struct ring *))
+{
+    for (size_t i = 0; i < ring->spins; i++)
+    {
+        if (ready(ring))
+            return;
+    }
+    pthread_mutex_lock(&ring->lock);
+    __atomic_add_fetch(&ring->sleepers, 1, __ATOMIC_SEQ_CST);
+    while (!ready(ring))
+        pthread_cond_wait(&ring->cond, &ring->lock);
+    __atomic_sub_fetch(&ring->sleepers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+static void
+ring_wake(struct ring *ring)
+{
+    if (__atomic_load_n(&ring->sleepers, __ATOMIC_SEQ_CST) == 0)
+        return;
+    pthread_mutex_lock(&ring->lock);
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+// The next block to fill, NULL if the ring was stopped
+static struct block *
+ring_produce(struct ring *ring)
+{
+    ring_wait(ring, ring_writable);
+    if (ring_stopped(ring))
+        return NULL;
+    return &ring->blocks[ring->tail % RING_SLOTS];
+}
+
+static void
+ring_publish(struct ring *ring)
+{
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_SEQ_CST);
+    ring_wake(ring);
+}
+
+// The next block to consume, NULL if the ring was stopped
+static struct block *
+ring_consume(struct ring *ring)
+{
+    ring_wait(ring, ring_readable);
+    if (ring_stopped(ring) &&
+        ring->head == __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST))
+        return NULL;
+    return &ring->blocks[ring->head % RING_SLOTS];
+}
+
+static void
+ring_release(struct ring *ring)
+{
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_SEQ_CST);
+    ring_wake(ring);
+}
+
+static void
+ring_stop(struct ring *ring)
+{
+    __atomic_store_n(&ring->stop, true, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&ring->lock);
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+// Publish a block without data, returns false if the ring was stopped
+static bool
+reader_publish(struct ring    *ring,
+               enum block_kind kind,
+               const char     *filepath,
+               int             error)
+{
+    struct block *block = ring_produce(ring);
+    if (block == NULL)
+        return false;
+    block->kind = kind;
+    block->len = 0;
+    block->consumed = 0;
+    block->filepath = filepath;
+    block->error = error;
+    ring_publish(ring);
+    return true;
+}
+
+struct reader_file
+{
+    int             fd;
+    int             stdin_fd;
+    struct decoder *decoder;
+};
+
+static void
+reader_close(void *arg)
+{
+    struct reader_file *file = arg;
+    decoder_free(file->decoder);
+    if (file->fd != file->stdin_fd)
+        close(file->fd);
+}
+
+// Read one file into the ring, returns false if the reader has to stop. The thread
+// can only be canceled while it's blocked in open(2) or read(2).
+static bool
+reader_read_file(struct pipeline *pipeline, const char *filepath)
+{
+    struct ring       *ring = &pipeline->input;
+    struct reader_file file = {pipeline->stdin_fd, pipeline->stdin_fd, NULL};
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    if (strcmp(filepath, "-") != 0)
+        file.fd = context_open(pipeline->context, filepath, O_RDONLY);
+    int error = errno;
+    // compressed files are decompressed by this thread as well, the magic bytes
+    // of a pipe are read here
+    pthread_cleanup_push(reader_close, &file);
+    if (file.fd != -1)
+        file.decoder = decoder_open(file.fd);
+    pthread_cleanup_pop(false);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    if (file.fd == -1)
+        return reader_publish(ring, BLOCK_OPEN_ERROR, filepath, error);
+    bool ok = reader_publish(ring, BLOCK_OPEN, filepath, 0);
+    while (ok)
+    {
+        struct block *block = ring_produce(ring);
+        if (block == NULL)
+        {
+            ok = false;
+            break;
+        }
+        ssize_t ret;
+        pthread_cleanup_push(reader_close, &file);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        do
+        {
+            if (file.decoder != NULL)
+                ret = decoder_read(file.decoder, block->buf, RING_SLOT_SIZE);
+            else
+                ret = read(file.fd, block->buf, RING_SLOT_SIZE);
+        } while (ret == -1 && errno == EINTR);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        pthread_cleanup_pop(false);
+        block->consumed = 0;
+        block->filepath = filepath;
+        block->error = ret == -1 ? errno : 0;
+        if (ret > 0)
+        {
+            block->kind = BLOCK_DATA;
+            block->len = ret;
+            ring_publish(ring);
+            continue;
+        }
+        block->kind = ret == 0 ? BLOCK_EOF : BLOCK_READ_ERROR;
+        block->len = 0;
+        ring_publish(ring);
+        ok = ret == 0;
+        break;
+    }
+    reader_close(&file);
+    return ok;
+}
+
+static void *
+reader_run(void *arg)
+{
+    struct pipeline *pipeline = arg;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    for (size_t i = 0; i < pipeline->filepaths_len; i++)
+    {
+        if (!reader_read_file(pipeline, pipeline->filepaths[i]))
+            return NULL;
+    }
+    reader_publish(&pipeline->input, BLOCK_END, NULL, 0);
+    return NULL;
+}
+
+static void *
+writer_run(void *arg)
+{
+    struct pipeline *pipeline = arg;
+    struct ring     *ring = &pipeline->output;
+    struct block    *block;
+    while ((block = ring_consume(ring)) != NULL)
+    {
+        // after an error the output is dropped, the executor stops at its next write
+        while (block->consumed < block->len && pipeline->write_error == 0)
+        {
+            ssize_t ret = write(pipeline->output_fd,
+                                block->buf + block->consumed,
+                                block->len - block->consumed);
+            if (ret == -1 && errno == EINTR)
+                continue;
+            if (ret == -1)
+                __atomic_store_n(&pipeline->write_error, errno, __ATOMIC_SEQ_CST);
+            else
+                block->consumed += ret;
+        }
+        ring_release(ring);
+    }
+    return NULL;
+}
+
+// Start the reader on the files of the input and the writer on the standard
+// output
+void
+pipeline_start(struct context *ctx)
+{
+    struct pipeline *pipeline = xmalloc(sizeof(struct pipeline));
+    ring_init(&pipeline->input);
+    ring_init(&pipeline->output);
+    pipeline->filepaths = ctx->input.filepaths;
+    pipeline->filepaths_len = ctx->input.filepaths_len;
+    pipeline->stdin_fd = ctx->input.stdin_fd;
+    pipeline->output_fd = ctx->output.fd;
+    pipeline->context = ctx;
+    pipeline->write_error = 0;
+    pipeline->reading = NULL;
+    int error = pthread_create(&pipeline->reader, NULL, reader_run, pipeline);
+    if (error == 0)
+        error = pthread_create(&pipeline->writer, NULL, writer_run, pipeline);
+    if (error != 0)
+        die("couldn't start the pipeline threads: %s", strerror(error));
+    ctx->pipeline = pipeline;
+}
+
+// Wait for the output to be written and stop the threads, the reader may still
+// be blocked on a file the script didn't read until its end
+void
+pipeline_stop(struct context *ctx)
+{
+    struct pipeline *pipeline = ctx->pipeline;
+    if (pipeline == NULL)
+        return;
+    pipeline_sync(ctx);
+    ring_stop(&pipeline->input);
+    pthread_cancel(pipeline->reader);
+    pthread_join(pipeline->reader, NULL);
+    ring_stop(&pipeline->output);
+    pthread_join(pipeline->writer, NULL);
+    ring_free(&pipeline->input);
+    ring_free(&pipeline->output);
+    free(pipeline);
+    ctx->pipeline = NULL;
+}
+
+// The next block from the reader, the blocks without data are handed over once
+static struct block *
+pipeline_block(struct context *ctx)
+{
+    struct pipeline *pipeline = ctx->pipeline;
+    if (pipeline->reading != NULL)
+        return pipeline->reading;
+    // the output is flushed before waiting for the reader, as in input_refill
+    if (ctx->output.len > 0 && !ring_readable(&pipeline->input))
+        output_flush(ctx);
+    uint64_t start = stats_clock();
+    pipeline->reading = ring_consume(&pipeline->input);
+    ctx->stats.read_ns += stats_clock() - start;
+    return pipeline->reading;
+}
+
+static void
+pipeline_block_release(struct context *ctx)
+{
+    ctx->pipeline->reading = NULL;
+    ring_release(&ctx->pipeline->input);
+}
+
+// Move on to the next file the reader could open, returns its path (NULL if
+// there is none left). The files which couldn't be opened are reported.
+const char *
+pipeline_open_next(struct context *ctx)
+{
+    while (true)
+    {
+        struct block *block = pipeline_block(ctx);
+        enum block_kind kind = block->kind;
+        const char     *filepath = block->filepath;
+        int             error = block->error;
+        if (kind == BLOCK_END)
+            return NULL;
+        pipeline_block_release(ctx);
+        if (kind == BLOCK_OPEN)
+            return filepath;
+        if (kind == BLOCK_OPEN_ERROR)
+            put_error("can't read %s: %s", filepath, strerror(error));
+    }
+}
+
+// Copy at most len bytes of the current file to buf, returns 0 at its end
+size_t
+pipeline_read(struct context *ctx, char *buf, size_t len)
+{
+    struct block *block = pipeline_block(ctx);
+    if (block->kind == BLOCK_READ_ERROR)
+        die("couldn't read %s: %s", block->filepath, strerror(block->error));
+    if (block->kind != BLOCK_DATA)
+    {
+        // the end of the file, the next one is opened by pipeline_open_next
+        if (block->kind == BLOCK_EOF)
+            pipeline_block_release(ctx);
+        return 0;
+    }
+    if (block->len - block->consumed < len)
+        len = block->len - block->consumed;
+    memcpy(buf, block->buf + block->consumed, len);
+    block->consumed += len;
+    if (block->consumed == block->len)
+    {
+        pipeline_block_release(ctx);
+        ctx->stats.read_calls++;
+    }
+    return len;
+}
+
+static void
+pipeline_write_check(struct context *ctx)
+{
+    int error = __atomic_load_n(&ctx->pipeline->write_error, __ATOMIC_SEQ_CST);
+    if (error != 0)
+        die("couldn't write to file stdout: %s", strerror(error));
+}
+
+// Hand iov over to the writer
+void
+pipeline_write(struct context *ctx, const struct iovec *iov, size_t iovcnt)
+{
+    struct ring *ring = &ctx->pipeline->output;
+    uint64_t     start = stats_clock();
+    pipeline_write_check(ctx);
+    struct block *block = NULL;
+    for (size_t i = 0; i < iovcnt; i++)
+    {
+        const char *s = iov[i].iov_base;
+        size_t      len = iov[i].iov_len;
+        while (len > 0)
+        {
+            if (block == NULL)
+            {
+                block = ring_produce(ring);
+                block->len = 0;
+                block->consumed = 0;
+            }
+            size_t chunk = RING_SLOT_SIZE - block->len;
+            if (chunk > len)
+                chunk = len;
+            memcpy(block->buf + block->len, s, chunk);
+            block->len += chunk;
+            s += chunk;
+            len -= chunk;
+            ctx->stats.bytes_written += chunk;
+            if (block->len == RING_SLOT_SIZE)
+            {
+                ring_publish(ring);
+                ctx->stats.write_calls++;
+                block = NULL;
+            }
+        }
+    }
+    if (block != NULL)
+    {
+        ring_publish(ring);
+        ctx->stats.write_calls++;
+    }
+    ctx->stats.write_ns += stats_clock() - start;
+}
+
+// Wait for the writer to write everything it was handed
+void
+pipeline_sync(struct context *ctx)
+{
+    if (ctx->pipeline == NULL)
+        return;
+    uint64_t start = stats_clock();
+    ring_wait(&ctx->pipeline->output, ring_empty);
+    ctx->stats.write_ns += stats_clock() - start;
+    pipeline_write_check(ctx);
+}
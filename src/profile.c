@@ -0,0 +1,211 @@
+#include "sed.h"
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Per command profiling (`--profile`). The executor only counts when a command
+// has a profile attached, which is never the case unless profiling is enabled.
+// Time is measured in timestamp counter ticks and converted to seconds with the
+// rate observed over the whole run.
+
+static enum profile_format format = PROFILE_TEXT;
+static script_t            profiled_script = NULL;
+static uint64_t            start_ticks = 0;
+static struct timespec     start_time;
+
+uint64_t
+profile_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static void
+profile_attach(script_t commands)
+{
+    for (struct command *command = commands; command->id != COMMAND_LAST; command++)
+    {
+        command->profile = arena_alloc(&script_arena, sizeof(struct profile));
+        memset(command->profile, 0, sizeof(struct profile));
+        if (command->id == '{')
+            profile_attach(command->data.children);
+        if (command->id == '}')
+            break;
+    }
+}
+
+void
+profile_init(script_t script, enum profile_format format_)
+{
+    format = format_;
+    profiled_script = script;
+    profile_attach(script);
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    start_ticks = profile_clock();
+}
+
+// Print a command the way it could be written in a script
+static void
+command_print(FILE *file, const struct command *command)
+{
+    for (size_t i = 0; i < command->addresses.count; i++)
+    {
+        const struct address *address = &command->addresses.addresses[i];
+        if (i == 1)
+            fputc(',', file);
+        if (address->type == ADDRESS_LINE)
+            fprintf(file, "%zu", address->data.line);
+        else if (address->type == ADDRESS_LAST)
+            fputc('$', file);
+        else
+            fprintf(file, "/%s/", address->data.regex->source);
+    }
+    if (command->inverse)
+        fputc('!', file);
+    fputc(command->id, file);
+    switch (command->id)
+    {
+    case 'a':
+    case 'c':
+    case 'i':
+        fprintf(file, "\\%s", command->data.text);
+        break;
+    case ':':
+    case 'b':
+    case 't':
+    case 'r':
+    case 'R':
+    case 'w':
+        if (*command->data.text != '\0')
+            fprintf(file, " %s", command->data.text);
+        break;
+    case 's':
+        fprintf(file,
+                "/%s/%s/",
+                command->data.substitute.regex->source,
+                command->data.substitute.replacement);
+        if (command->data.substitute.occurence_index > 1)
+            fprintf(file, "%zu", command->data.substitute.occurence_index);
+        if (command->data.substitute.global)
+            fputc('g', file);
+        if (command->data.substitute.print)
+            fputc('p', file);
+        if (command->data.substitute.write_filepath != NULL)
+            fprintf(file, "w %s", command->data.substitute.write_filepath);
+        break;
+    case 'y':
+        fprintf(file,
+                "/%s/%s/",
+                command->data.translate.from,
+                command->data.translate.to);
+        break;
+    }
+}
+
+// Print the command in a JSON string, escaping what needs to be
+static void
+command_print_json(FILE *file, const struct command *command)
+{
+    char  *s = NULL;
+    size_t len = 0;
+    FILE  *memory = open_memstream(&s, &len);
+    if (memory == NULL)
+        die("couldn't profile: %s", strerror(errno));
+    command_print(memory, command);
+    fclose(memory);
+    fputc('"', file);
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\')
+            fprintf(file, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(file, "\\u%04x", c);
+        else
+            fputc(c, file);
+    }
+    fputc('"', file);
+    free(s);
+}
+
+static void
+report_text(script_t commands, size_t depth, double seconds_per_tick)
+{
+    for (struct command *command = commands; command->id != COMMAND_LAST; command++)
+    {
+        const struct profile *profile = command->profile;
+        fprintf(stderr,
+                "%12zu %12zu %12zu %12.6f  %*s",
+                profile->evaluations,
+                profile->matches,
+                profile->executions,
+                profile->ticks * seconds_per_tick,
+                (int)depth * 2,
+                "");
+        command_print(stderr, command);
+        fputc('\n', stderr);
+        if (command->id == '{')
+            report_text(command->data.children, depth + 1, seconds_per_tick);
+        if (command->id == '}')
+            break;
+    }
+}
+
+static void
+report_json(script_t commands, size_t depth, double seconds_per_tick, bool *first)
+{
+    for (struct command *command = commands; command->id != COMMAND_LAST; command++)
+    {
+        const struct profile *profile = command->profile;
+        fprintf(stderr, "%s\n    {\"command\": ", *first ? "" : ",");
+        *first = false;
+        command_print_json(stderr, command);
+        fprintf(stderr,
+                ", \"depth\": %zu, \"evaluations\": %zu, \"matches\": %zu, "
+                "\"executions\": %zu, \"ticks\": %llu, \"seconds\": %.9f}",
+                depth,
+                profile->evaluations,
+                profile->matches,
+                profile->executions,
+                (unsigned long long)profile->ticks,
+                profile->ticks * seconds_per_tick);
+        if (command->id == '{')
+            report_json(command->data.children, depth + 1, seconds_per_tick, first);
+        if (command->id == '}')
+            break;
+    }
+}
+
+void
+profile_report(void)
+{
+    struct timespec end_time;
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    uint64_t ticks = profile_clock() - start_ticks;
+    double   seconds = (end_time.tv_sec - start_time.tv_sec) +
+                     (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+    double seconds_per_tick = ticks == 0 ? 0 : seconds / ticks;
+    if (format == PROFILE_JSON)
+    {
+        bool first = true;
+        fprintf(stderr, "{\"seconds\": %.9f, \"commands\": [", seconds);
+        report_json(profiled_script, 0, seconds_per_tick, &first);
+        fputs("\n]}\n", stderr);
+        return;
+    }
+    fprintf(stderr, "sed: profile of %.6f seconds\n", seconds);
+    fprintf(stderr,
+            "%12s %12s %12s %12s  %s\n",
+            "evaluations",
+            "matches",
+            "executions",
+            "seconds",
+            "command");
+    report_text(profiled_script, 0, seconds_per_tick);
+}
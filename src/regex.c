@@ -0,0 +1,498 @@
+#include "sed.h"
+#include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Regexes of the script.
+//
+// Identical regexes (same source and flags) are compiled once and shared by
+// every command using them. A regex which is only used by addresses is compiled
+// with REG_NOSUB since only whether it matches is needed, it's compiled again
+// with submatches if an `s` command uses it too.
+//
+// The empty regex stands for the last regex used at runtime (see
+// exec_regex_resolve), it's never compiled. Any regex can then end up used by `s`
+// so none of them is compiled with REG_NOSUB once the script has one.
+//
+// Regexes anchored at the start or the end of the pattern space whose rest is a
+// literal (`^#`, `^$`, `\.txt$`, `^` alone) are matched by comparing the head or
+// the tail of the pattern space, a run of a bracket expression anchored at the
+// end (`[ \t]*$`) by scanning the tail backward. regexec would go through the
+// whole line. A literal with the `I` flag (REG_ICASE) is searched anywhere by
+// folding ASCII letters to lowercase, 16 bytes at a time with SSE2. Only basic
+// regexes are analyzed; the locale is the C one, a byte is a character.
+
+#define REGEX_TABLE_MIN_CAPACITY 64
+
+// open addressing hash table of the regexes of the scripts parsed so far in the
+// arena, freed along with it
+struct regex_table
+{
+    struct regex **regexes;
+    size_t         capacity;
+    size_t         len;
+    struct regex  *empty;
+};
+
+static struct regex_table *regex_table = NULL;
+
+static void
+regex_free(void *regex)
+{
+    regfree(&((struct regex *)regex)->preg);
+}
+
+static void
+regex_table_free(void *table)
+{
+    free(((struct regex_table *)table)->regexes);
+    if (regex_table == table)
+        regex_table = NULL;
+}
+
+// Make table the one regexes are interned in, returns the previous one. The
+// arena must be swapped along with it (see parse_into).
+struct regex_table *
+regex_table_swap(struct regex_table *table)
+{
+    struct regex_table *previous = regex_table;
+    regex_table = table;
+    return previous;
+}
+
+static size_t
+regex_hash(const char *source, int cflags)
+{
+    return hash_string(source) ^ ((size_t)cflags * 0x9e3779b97f4a7c15ULL);
+}
+
+static void
+regex_table_grow(void)
+{
+    if (regex_table == NULL)
+    {
+        regex_table = arena_alloc(&script_arena, sizeof(struct regex_table));
+        memset(regex_table, 0, sizeof(struct regex_table));
+        arena_defer(&script_arena, regex_table_free, regex_table);
+    }
+    size_t         old_capacity = regex_table->capacity;
+    struct regex **old_regexes = regex_table->regexes;
+    size_t         capacity =
+        old_capacity == 0 ? REGEX_TABLE_MIN_CAPACITY : old_capacity * 2;
+    struct regex **regexes = xmalloc(sizeof(struct regex *) * capacity);
+    memset(regexes, 0, sizeof(struct regex *) * capacity);
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old_regexes[i] == NULL)
+            continue;
+        size_t j = regex_hash(old_regexes[i]->source, old_regexes[i]->cflags) &
+                   (capacity - 1);
+        while (regexes[j] != NULL)
+            j = (j + 1) & (capacity - 1);
+        regexes[j] = old_regexes[i];
+    }
+    free(old_regexes);
+    regex_table->regexes = regexes;
+    regex_table->capacity = capacity;
+}
+
+// Characters with a special meaning in a basic regex, and the ones which stand for
+// themselves once escaped
+static const char *regex_special = "\\.[*^$";
+static const char *regex_escapable = "\\.[]*^$/";
+
+static const struct
+{
+    const char *name;
+    int (*is)(int);
+} char_classes[] = {
+    {"alnum", isalnum},
+    {"alpha", isalpha},
+    {"blank", isblank},
+    {"cntrl", iscntrl},
+    {"digit", isdigit},
+    {"graph", isgraph},
+    {"lower", islower},
+    {"print", isprint},
+    {"punct", ispunct},
+    {"space", isspace},
+    {"upper", isupper},
+    {"xdigit", isxdigit},
+};
+
+// Whether the character at p is escaped by the backslashes before it
+static bool
+regex_escaped(const char *begin, const char *p)
+{
+    size_t backslashes = 0;
+    while (p > begin && *--p == '\\')
+        backslashes++;
+    return backslashes % 2 == 1;
+}
+
+// Read the literal character at *s into *c, returns false if it has a special
+// meaning
+static bool
+literal_char(const char **s, char *c)
+{
+    *c = **s;
+    if (*c == '\\')
+    {
+        *c = (*s)[1];
+        if (*c == '\0' || strchr(regex_escapable, *c) == NULL)
+            return false;
+        (*s)++;
+    }
+    else if (strchr(regex_special, *c) != NULL)
+        return false;
+    (*s)++;
+    return true;
+}
+
+// Keep the literal between s and end as the one of regex, returns false if it
+// isn't a literal
+static bool
+regex_literal(struct regex *regex, const char *s, const char *end)
+{
+    char  *literal = arena_alloc(&script_arena, end - s + 1);
+    size_t len = 0;
+    while (s < end)
+    {
+        if (!literal_char(&s, &literal[len++]))
+            return false;
+    }
+    literal[len] = '\0';
+    regex->literal = literal;
+    regex->literal_len = len;
+    return true;
+}
+
+// Add the members of the bracket expression at *s to class, returns false for
+// the ones not handled (negated, collating elements, equivalence classes)
+static bool
+bracket_parse(const char **s, bool *class)
+{
+    const char *p = *s + 1;
+    if (*p == '^')
+        return false;
+    // a leading `]` is a member
+    for (bool first = true; *p != ']' || first; first = false)
+    {
+        if (*p == '\0' || (p[0] == '[' && (p[1] == '.' || p[1] == '=')))
+            return false;
+        if (p[0] == '[' && p[1] == ':')
+        {
+            const char *name = p + 2;
+            const char *name_end = strstr(name, ":]");
+            if (name_end == NULL)
+                return false;
+            size_t i = 0;
+            size_t classes_len = sizeof(char_classes) / sizeof(char_classes[0]);
+            while (i < classes_len &&
+                   (strncmp(char_classes[i].name, name, name_end - name) != 0 ||
+                    char_classes[i].name[name_end - name] != '\0'))
+                i++;
+            if (i == classes_len)
+                return false;
+            for (int c = 0; c < 256; c++)
+                class[c] = class[c] || char_classes[i].is(c);
+            p = name_end + 2;
+            continue;
+        }
+        unsigned char low = *p++;
+        unsigned char high = low;
+        if (p[0] == '-' && p[1] != ']' && p[1] != '\0')
+        {
+            if (p[1] == '[')
+                return false;
+            high = p[1];
+            p += 2;
+        }
+        for (int c = low; c <= high; c++)
+            class[c] = true;
+    }
+    *s = p + 1;
+    return true;
+}
+
+// Add the bracket expression or the literal character at *s to class
+static bool
+element_parse(const char **s, bool *class)
+{
+    if (**s == '[')
+        return bracket_parse(s, class);
+    char c;
+    if (!literal_char(s, &c))
+        return false;
+    class[(unsigned char)c] = true;
+    return true;
+}
+
+// Recognize `E*`, `EE*` and `E\+` between s and end, E being a bracket expression
+// or a literal character
+static bool
+regex_end_class(struct regex *regex, const char *s, const char *end)
+{
+    memset(regex->class, 0, sizeof(regex->class));
+    const char *element = s;
+    if (!element_parse(&s, regex->class) || s >= end)
+        return false;
+    size_t element_len = s - element;
+    if (end - s == 1 && *s == '*')
+        regex->class_min = 0;
+    else if (end - s == 2 && s[0] == '\\' && s[1] == '+')
+        regex->class_min = 1;
+    else if ((size_t)(end - s) == element_len + 1 &&
+             memcmp(s, element, element_len) == 0 && end[-1] == '*')
+        regex->class_min = 1;
+    else
+        return false;
+    return true;
+}
+
+// Lowercase the literal and the class of a REG_ICASE regex
+static void
+regex_fold(struct regex *regex)
+{
+    for (size_t i = 0; i < regex->literal_len; i++)
+        regex->literal[i] = tolower((unsigned char)regex->literal[i]);
+    for (int c = 0; c < 256; c++)
+    {
+        if (regex->class[c])
+            regex->class[tolower(c)] = regex->class[toupper(c)] = true;
+    }
+}
+
+// Find out whether regex is one of the anchored forms or a folded literal
+static void
+regex_analyze(struct regex *regex)
+{
+    regex->anchor = ANCHOR_NONE;
+    regex->folded = false;
+    regex->literal_len = 0;
+    memset(regex->class, 0, sizeof(regex->class));
+    const bool icase = regex->cflags == REG_ICASE;
+    if (regex->cflags != 0 && !icase)
+        return;
+    const char *s = regex->source;
+    const char *end = s + strlen(s);
+    const bool  at_start = *s == '^';
+    if (at_start)
+        s++;
+    const bool at_end = end > s && end[-1] == '$' && !regex_escaped(s, end - 1);
+    if (at_end)
+        end--;
+    if (at_start && regex_literal(regex, s, end))
+        regex->anchor = at_end ? ANCHOR_BOTH : ANCHOR_START;
+    else if (!at_start && at_end && regex_literal(regex, s, end))
+        regex->anchor = ANCHOR_END;
+    else if (!at_start && at_end && regex_end_class(regex, s, end))
+        regex->anchor = ANCHOR_END_CLASS;
+    else if (icase && !at_start && !at_end && regex_literal(regex, s, end))
+        regex->folded = true;
+    if (icase)
+        regex_fold(regex);
+}
+
+// Compare the literal of regex with the beginning of s
+static bool
+literal_equal(const struct regex *regex, const char *s)
+{
+    if (regex->cflags != REG_ICASE)
+        return memcmp(s, regex->literal, regex->literal_len) == 0;
+    for (size_t i = 0; i < regex->literal_len; i++)
+    {
+        if (tolower((unsigned char)s[i]) != regex->literal[i])
+            return false;
+    }
+    return true;
+}
+
+// Match regex, which has an anchored form, on the len bytes of s. It matches once
+// at most, pmatch[0] is set to the match.
+bool
+regex_anchored_match(const struct regex *regex,
+                     const char         *s,
+                     size_t              len,
+                     regmatch_t         *pmatch)
+{
+    const size_t literal_len = regex->literal_len;
+    size_t       start = 0;
+    size_t       end = len;
+    switch (regex->anchor)
+    {
+    case ANCHOR_START:
+        if (len < literal_len || !literal_equal(regex, s))
+            return false;
+        end = literal_len;
+        break;
+    case ANCHOR_END:
+        start = len - literal_len;
+        if (len < literal_len || !literal_equal(regex, s + start))
+            return false;
+        break;
+    case ANCHOR_BOTH:
+        if (len != literal_len || !literal_equal(regex, s))
+            return false;
+        break;
+    case ANCHOR_END_CLASS:
+        start = len;
+        while (start > 0 && regex->class[(unsigned char)s[start - 1]])
+            start--;
+        if (len - start < regex->class_min)
+            return false;
+        break;
+    case ANCHOR_NONE:
+        assert(false);
+    }
+    pmatch[0].rm_so = start;
+    pmatch[0].rm_eo = end;
+    return true;
+}
+
+#ifdef __SSE2__
+// Lowercase the ASCII letters of block
+static __m128i
+fold_block(__m128i block)
+{
+    // 'A' to 'Z' are moved to the bottom of the signed range
+    const __m128i shifted = _mm_add_epi8(block, _mm_set1_epi8(0x80 - 'A'));
+    const __m128i upper = _mm_cmplt_epi8(shifted, _mm_set1_epi8(-128 + 26));
+    return _mm_or_si128(block, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+// Candidates are the positions where both the first and the last character of
+// the literal are found, 16 positions at a time. Returns the position to go on
+// from with the scalar search.
+static size_t
+fold_search_sse2(const struct regex *regex, const char *s, size_t len, size_t *found)
+{
+    const size_t  literal_len = regex->literal_len;
+    const __m128i first = _mm_set1_epi8(regex->literal[0]);
+    const __m128i last = _mm_set1_epi8(regex->literal[literal_len - 1]);
+    size_t        i = 0;
+    for (; i + literal_len + 15 <= len; i += 16)
+    {
+        const __m128i block_first = fold_block(_mm_loadu_si128((__m128i *)(s + i)));
+        const __m128i block_last =
+            fold_block(_mm_loadu_si128((__m128i *)(s + i + literal_len - 1)));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+        for (; mask != 0; mask &= mask - 1)
+        {
+            const size_t candidate = i + __builtin_ctz(mask);
+            if (literal_equal(regex, s + candidate))
+            {
+                *found = candidate;
+                return len;
+            }
+        }
+    }
+    return i;
+}
+#endif
+
+// Search the literal of a folded regex in the len bytes of s, pmatch[0] is set to
+// the first match
+bool
+regex_folded_match(const struct regex *regex,
+                   const char         *s,
+                   size_t              len,
+                   regmatch_t         *pmatch)
+{
+    const size_t literal_len = regex->literal_len;
+    size_t       found = len;
+    size_t       i = 0;
+#ifdef __SSE2__
+    i = fold_search_sse2(regex, s, len, &found);
+#endif
+    for (; found == len && i + literal_len <= len; i++)
+    {
+        if (tolower((unsigned char)s[i]) == regex->literal[0] &&
+            literal_equal(regex, s + i))
+            found = i;
+    }
+    if (found == len)
+        return false;
+    pmatch[0].rm_so = found;
+    pmatch[0].rm_eo = found + literal_len;
+    return true;
+}
+
+// (Re)compile regex, with submatches unless nosub
+static void
+regex_build(struct regex *regex, bool nosub)
+{
+    int cflags = regex->cflags | (nosub ? REG_NOSUB : 0);
+    if (regex->compiled)
+        regfree(&regex->preg);
+    const int errcode = regcomp(&regex->preg, regex->source, cflags);
+    if (errcode != 0)
+    {
+        const size_t errbuf_size = 128;
+        char         errbuf[errbuf_size + 1];
+        regerror(errcode, &regex->preg, errbuf, errbuf_size);
+        die("regex error '%s': %s", regex->source, errbuf);
+    }
+    if (!regex->compiled)
+        arena_defer(&script_arena, regex_free, regex);
+    regex->compiled = true;
+    regex->nosub = nosub;
+}
+
+// Returns the regex for source and cflags, compiled with submatches if
+// submatches is true. The source is kept along with the compiled regex so that
+// the script can be written to the cache.
+struct regex *
+regex_intern(const char *source, int cflags, bool submatches)
+{
+    if (regex_table == NULL || regex_table->len * 2 >= regex_table->capacity)
+        regex_table_grow();
+    struct regex **regexes = regex_table->regexes;
+    const size_t   mask = regex_table->capacity - 1;
+    if (source[0] == '\0')
+    {
+        if (regex_table->empty != NULL)
+            return regex_table->empty;
+        struct regex *empty = arena_alloc(&script_arena, sizeof(struct regex));
+        empty->source = source;
+        empty->cflags = cflags;
+        empty->compiled = false;
+        empty->nosub = false;
+        empty->anchor = ANCHOR_NONE;
+        regex_table->empty = empty;
+        // every regex can be the last one used by an `s`
+        for (size_t i = 0; i <= mask; i++)
+        {
+            if (regexes[i] != NULL && regexes[i]->nosub)
+                regex_build(regexes[i], false);
+        }
+        return empty;
+    }
+    size_t i = regex_hash(source, cflags) & mask;
+    for (; regexes[i] != NULL; i = (i + 1) & mask)
+    {
+        struct regex *regex = regexes[i];
+        if (regex->cflags != cflags || strcmp(regex->source, source) != 0)
+            continue;
+        if (submatches && regex->nosub)
+            regex_build(regex, false);
+        return regex;
+    }
+    struct regex *regex = arena_alloc(&script_arena, sizeof(struct regex));
+    regex->source = source;
+    regex->cflags = cflags;
+    regex->compiled = false;
+    regex_build(regex, !submatches && regex_table->empty == NULL);
+    regex_analyze(regex);
+    regexes[i] = regex;
+    regex_table->len++;
+    return regex;
+}
+
+struct regex *
+regex_compile(const char *source, int cflags)
+{
+    return regex_intern(source, cflags, true);
+}
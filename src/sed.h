@@ -4,12 +4,16 @@
 #define _POSIX_C_SOURCE 200809L
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <regex.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 enum address_type
@@ -19,13 +23,48 @@ enum address_type
     ADDRESS_RE,
 };
 
+// Anchored forms of a regex matched without regexec, see regex_analyze
+enum regex_anchor
+{
+    ANCHOR_NONE,
+    // `^literal`
+    ANCHOR_START,
+    // `literal$`
+    ANCHOR_END,
+    // `^literal$`
+    ANCHOR_BOTH,
+    // `[class]*$`, `[class][class]*$` or `[class]\+$`
+    ANCHOR_END_CLASS,
+};
+
+struct regex
+{
+    regex_t     preg;
+    const char *source;
+    int         cflags;
+    // the empty regex (the last one used) is never compiled
+    bool compiled;
+    // compiled with REG_NOSUB, only used by addresses
+    bool nosub;
+    enum regex_anchor anchor;
+    // a literal matched anywhere regardless of case (REG_ICASE)
+    bool folded;
+    // the literal of ANCHOR_START, ANCHOR_END, ANCHOR_BOTH and folded regexes, in
+    // lowercase with REG_ICASE
+    char  *literal;
+    size_t literal_len;
+    // the characters of ANCHOR_END_CLASS and the minimum length of their run
+    bool   class[256];
+    size_t class_min;
+};
+
 struct address
 {
     enum address_type type;
     union
     {
-        size_t  line;
-        regex_t preg;
+        size_t        line;
+        struct regex *regex;
     } data;
 };
 
@@ -33,23 +72,27 @@ struct addresses
 {
     size_t         count;
     struct address addresses[2];
-    bool           in_range;
+    // index of the state of the range in the context, numbered by the parser
+    size_t range;
 };
 
 #define COMMAND_LAST -1
 
+// Size of the windows in which long lines are streamed
+#define STREAM_WINDOW_SIZE 16384
+
 union command_data
 {
     char           *text;
     struct command *children;
     struct
     {
-        regex_t preg;
-        char   *replacement;
-        size_t  occurence_index;
-        bool    global;
-        bool    print;
-        char   *write_filepath;
+        struct regex *regex;
+        char         *replacement;
+        size_t        occurence_index;
+        bool          global;
+        bool          print;
+        char         *write_filepath;
     } substitute;
     struct
     {
@@ -58,16 +101,241 @@ union command_data
     } translate;
 };
 
+// Counters of a command when profiling is enabled
+struct profile
+{
+    size_t   evaluations;
+    size_t   matches;
+    size_t   executions;
+    uint64_t ticks;
+};
+
+enum profile_format
+{
+    PROFILE_TEXT,
+    PROFILE_JSON,
+};
+
+// Counters of the input and output paths, see stats.c
+struct io_stats
+{
+    size_t      files_opened;
+    uint64_t    bytes_read;
+    uint64_t    lines_read;
+    size_t      read_calls;
+    size_t      refills;
+    uint64_t    read_ns;
+    uint64_t    bytes_written;
+    uint64_t    lines_written;
+    size_t      write_calls;
+    uint64_t    write_ns;
+    // current input file and offset in it
+    const char *filepath;
+    uint64_t    offset;
+    bool        count_lines_written;
+};
+
 struct command
 {
     char               id;
     bool               inverse;
     struct addresses   addresses;
     union command_data data;
+    // NULL unless profiling
+    struct profile *profile;
 };
 
 typedef struct command *script_t;
 
+struct rope;
+
+// Pattern or hold space, see space.c
+struct space
+{
+    struct rope *rope;
+};
+
+struct arena_chunk;
+struct arena_cleanup;
+
+struct arena
+{
+    struct arena_chunk   *chunks;
+    struct arena_cleanup *cleanups;
+};
+
+struct cached_file;
+struct line_reader;
+
+// Input files of a run, see input.c
+struct decoder;
+
+struct input
+{
+    // files read by `r` and `R`
+    struct cached_file **cached_files;
+    struct line_reader  *line_readers;
+    // contents of `r` files replaced by a reload, the append queue can still
+    // point to them until it's flushed
+    struct cached_file *retired_files;
+    char               **filepaths;
+    size_t               filepaths_len;
+    size_t               filepaths_index;
+    // read for `-`
+    int    stdin_fd;
+    int    fd;
+    char  *buf;
+    size_t buf_size;
+    // unread data is between start and end
+    size_t start;
+    size_t end;
+    bool   eof;
+    // a line was split in windows and hasn't been ended yet
+    bool in_line;
+    // the data is pushed by the caller instead of read from the files, the
+    // search for a separator resumes at scanned
+    bool   pushed;
+    size_t scanned;
+    // the current file is read ahead through io_uring
+    bool read_ahead;
+    // the current file is decompressed (or is a pipe), see decompress.c
+    struct decoder *decoder;
+    // whether the last line ended with the separator
+    bool terminated;
+    // records are terminated by a newline unless configured otherwise (`-z`,
+    // `--separator`)
+    const char *separator;
+    size_t      separator_len;
+};
+
+struct write_target;
+
+// Receives the output instead of a file descriptor, s is only valid during the call
+typedef void (*output_sink)(void *data, const char *s, size_t len);
+
+// Standard output and `w` files of a run, see output.c
+struct output
+{
+    int    fd;
+    char  *buf;
+    size_t len;
+    // written before the next output, if any
+    const char *deferred;
+    size_t      deferred_len;
+    // flushed at each newline, set when the buffer is allocated if fd is a tty
+    bool line_buffered;
+    // open addressing hash table from filepath to target
+    struct write_target **targets;
+    size_t                targets_capacity;
+    size_t                targets_len;
+    // open targets, most recently used first
+    struct write_target *lru_head;
+    struct write_target *lru_tail;
+    size_t               open_len;
+    size_t               open_max;
+    // incremented every time something is written to a target
+    size_t generation;
+    // set by output_set_sink
+    output_sink sink;
+    void       *sink_data;
+};
+
+struct stream_stage;
+
+// Streaming of the long lines of a run, see stream.c
+struct stream
+{
+    script_t             script;
+    bool                 auto_print;
+    struct stream_stage *stages;
+    size_t               stages_len;
+    size_t               stages_capacity;
+    // whether the stages output is written
+    bool output;
+};
+
+struct match_memo;
+struct range;
+
+// State of a run of a script, the script itself is never modified so that
+// contexts can share it and run concurrently. Everything a context holds is
+// released by context_free.
+struct context
+{
+    struct space pattern_space;
+    struct space hold_space;
+    size_t       line_index;
+    bool         last_line;
+    bool         auto_print;
+    // last_line is only looked up by `$`, the lookahead could block on a pipe
+    bool last_line_pending;
+    // lines longer than STREAM_WINDOW_SIZE are streamed through the script
+    bool streaming;
+    // `--io-uring`, the ring is set up on first use (see uring.c)
+    bool          io_uring;
+    struct uring *uring;
+    // `--pipeline`, the threads run during exec (see pipeline.c)
+    bool             pipelined;
+    struct pipeline *pipeline;
+    // `d` ends the cycle without printing the pattern space
+    bool cycle_deleted;
+    // whether the next cycle runs on the pattern space left by `D`
+    bool cycle_restart;
+    // `q`, or `n` and `N` without a next line, end the run once the cycle is over
+    bool quitting;
+    // `n` or `N` waits for the next line to be pushed, the cycle then goes on
+    // from the command after it
+    bool            suspended;
+    struct command *resume;
+    // the script run on pushed input
+    script_t pushed_script;
+    // copy of the line returned by next_line
+    char  *line;
+    size_t line_len;
+    size_t line_size;
+    // the last regex used, an empty regex stands for it
+    struct regex *last_regex;
+    // incremented whenever the pattern space changes (including a new cycle)
+    uint64_t           pattern_generation;
+    struct match_memo *match_memo;
+    // output of `a`, `r` and `R` queued until the end of the cycle, the first two
+    // slots are reserved for the pattern space and its separator
+    struct iovec *append_queue;
+    size_t        append_queue_len;
+    size_t        append_queue_capacity;
+    char        **append_lines;
+    size_t        append_lines_len;
+    size_t        append_lines_capacity;
+    // result of a substitution
+    char         *substitute_buf;
+    size_t        substitute_buf_len;
+    size_t        substitute_buf_capacity;
+    struct range *ranges;
+    size_t        ranges_len;
+    // relative paths are opened from dir_fd, and /dev/stderr is error_fd (the
+    // working directory and standard error of a request in daemon mode)
+    int             dir_fd;
+    int             error_fd;
+    struct input    input;
+    struct output   output;
+    struct stream   stream;
+    struct io_stats stats;
+};
+
+// A context which hasn't run anything yet, reading the standard input and
+// writing to the standard output
+#define CONTEXT_INIT                                                                \
+    {                                                                               \
+        .pattern_generation = 1, .append_queue_len = 2, .dir_fd = AT_FDCWD,         \
+        .error_fd = STDERR_FILENO,                                                  \
+        .input = {.stdin_fd = STDIN_FILENO,                                         \
+                  .fd = -1,                                                         \
+                  .terminated = true,                                               \
+                  .separator = "\n",                                                \
+                  .separator_len = 1},                                              \
+        .output = {.fd = STDOUT_FILENO},                                            \
+    }
+
 // utils.c
 void *
 xmalloc(size_t size);
@@ -79,14 +347,39 @@ char *
 strjoinf(char *origin, ...);
 char *
 read_file(char *filepath);
+char *
+read_file_at(int dir_fd, const char *filepath);
+void
+thread_errors_set(int fd, bool exit_thread);
+jmp_buf *
+errors_catch(jmp_buf *jmp);
+const char *
+errors_message(void);
+void
+errors_rethrow(void);
 void
 put_error(const char *format, ...);
 void
 die(const char *format, ...);
 int
 todigit(int c);
+size_t
+hash_string(const char *s);
+size_t
+memcount(const char *s, size_t len, char c);
+void *
+arena_alloc(struct arena *arena, size_t size);
+char *
+arena_strndup(struct arena *arena, const char *s, size_t len);
+void
+arena_defer(struct arena *arena, void (*func)(void *), void *ptr);
+void
+arena_free(struct arena *arena);
 
 // parse.c
+extern struct arena script_arena;
+extern const char  *available_commands;
+
 char *
 parse_address(char *s, struct address *address);
 char *
@@ -95,11 +388,251 @@ char *
 parse_command(char *s, struct command *command);
 struct command *
 parse(char *s);
+script_t
+parse_into(char *s, struct arena *arena);
+void
+script_free(void);
+
+// regex.c
+struct regex_table;
+
+struct regex_table *
+regex_table_swap(struct regex_table *table);
+struct regex *
+regex_intern(const char *source, int cflags, bool submatches);
+struct regex *
+regex_compile(const char *source, int cflags);
+bool
+regex_anchored_match(const struct regex *regex,
+                     const char         *s,
+                     size_t              len,
+                     regmatch_t         *pmatch);
+bool
+regex_folded_match(const struct regex *regex,
+                   const char         *s,
+                   size_t              len,
+                   regmatch_t         *pmatch);
+
+// cache.c
+uint64_t
+script_cache_key(const char *script_string);
+script_t
+script_cache_load(const char *dir, uint64_t key, const char *script_string);
+void
+script_cache_store(const char *dir,
+                   uint64_t    key,
+                   const char *script_string,
+                   script_t    script);
+
+// profile.c
+uint64_t
+profile_clock(void);
+void
+profile_init(script_t script, enum profile_format format);
+void
+profile_report(void);
+
+// stats.c
+uint64_t
+stats_clock(void);
+void
+stats_init(struct io_stats *stats, bool report);
+void
+stats_poll(void);
+void
+stats_report(void);
+
+// idiom.c
+void
+idiom_prepare(void);
+bool
+idiom_exec(struct context *ctx, script_t script, bool auto_print);
+
+// decompress.c
+struct decoder *
+decoder_open(int fd);
+void
+decoder_free(struct decoder *decoder);
+ssize_t
+decoder_read(struct decoder *decoder, char *buf, size_t len);
+
+// input.c
+int
+context_open(const struct context *ctx, const char *filepath, int flags);
+const char *
+cached_file_get(struct context *ctx, const char *filepath, size_t *len);
+void
+cached_files_release(struct context *ctx);
+char *
+line_reader_next(struct context *ctx, const char *filepath, size_t *len);
+void
+input_free(struct context *ctx);
+void
+input_set_separator(struct context *ctx, const char *separator, size_t len);
+const char *
+input_separator(struct context *ctx, size_t *len);
+bool
+input_line_terminated(struct context *ctx);
+void
+input_init(struct context *ctx, char **filepaths, size_t filepaths_len);
+char *
+input_next_window(struct context *ctx, size_t *len, size_t max, bool *line_end);
+char *
+input_next_line(struct context *ctx, size_t *len);
+size_t
+input_count_lines(struct context *ctx);
+bool
+input_file_end(struct context *ctx);
+bool
+input_last_line(struct context *ctx);
+void
+input_push_init(struct context *ctx);
+void
+input_push(struct context *ctx, const char *data, size_t len);
+void
+input_push_finish(struct context *ctx);
+char *
+input_pushed_line(struct context *ctx, size_t *len);
+bool
+input_push_waiting(struct context *ctx);
+
+// output.c
+struct write_target *
+write_target_get(struct context *ctx, const char *filepath);
+void
+write_target_write(struct context      *ctx,
+                   struct write_target *target,
+                   const char          *s,
+                   size_t               len);
+void
+write_target_sync(struct context *ctx, const char *filepath);
+void
+write_targets_open(struct context *ctx, script_t commands);
+void
+write_targets_flush(struct context *ctx);
+size_t
+write_targets_generation(struct context *ctx);
+void
+write_targets_close(struct context *ctx);
+void
+output_set_sink(struct context *ctx, output_sink sink, void *data);
+void
+output_flush(struct context *ctx);
+void
+output_free(struct context *ctx);
+void
+output_writev(struct context *ctx, const struct iovec *iov, size_t iovcnt);
+void
+output_write(struct context *ctx, const char *s, size_t len);
+void
+output_puts(struct context *ctx, const char *s);
+void
+output_defer(struct context *ctx, const char *s, size_t len);
+void
+output_separator(struct context *ctx);
+
+// uring.c
+bool
+uring_read_start(struct context *ctx, int fd, const char *filepath);
+size_t
+uring_read(struct context *ctx, char *buf, size_t len);
+void
+uring_read_stop(struct context *ctx);
+void
+uring_write_wait(struct context *ctx, int fd);
+bool
+uring_write(struct context     *ctx,
+            int                 fd,
+            const struct iovec *iov,
+            size_t              iovcnt,
+            const char         *filepath);
+void
+uring_free(struct context *ctx);
+
+// pipeline.c
+void
+pipeline_start(struct context *ctx);
+void
+pipeline_stop(struct context *ctx);
+const char *
+pipeline_open_next(struct context *ctx);
+size_t
+pipeline_read(struct context *ctx, char *buf, size_t len);
+void
+pipeline_write(struct context *ctx, const struct iovec *iov, size_t iovcnt);
+void
+pipeline_sync(struct context *ctx);
+
+// server.c
+void
+server_scripts_load(char **scripts, size_t scripts_len);
+script_t
+server_script(const char *text, struct arena *arena);
+int
+server_run(const char *socket_path,
+           size_t      workers,
+           char      **scripts,
+           size_t      scripts_len,
+           int (*run)(struct context *, struct arena *, int, char **));
+int
+client_run(const char *socket_path, int argc, char **argv);
+
+// space.c
+void
+space_free(struct space *space);
+size_t
+space_len(struct space *space);
+const char *
+space_string(struct space *space);
+char *
+space_mutable(struct space *space, size_t capacity);
+void
+space_set_len(struct space *space, size_t len);
+void
+space_set(struct space *space, const char *s, size_t len);
+void
+space_append(struct space *space, const char *s, size_t len, bool newline);
+void
+space_remove_prefix(struct space *space, size_t len);
+void
+space_assign(struct space *dest, struct space *src);
+void
+space_concat(struct space *dest, struct space *src);
+void
+space_swap(struct space *space1, struct space *space2);
+void
+space_output(struct context *ctx, struct space *space);
+bool
+space_is_flat(struct space *space);
+
+// stream.c
+bool
+stream_prepare(struct context *ctx, script_t script, bool auto_print);
+void
+stream_line(struct context *ctx, char *window, size_t len);
+void
+stream_free(struct context *ctx);
 
 // exec.c
 void
-exec_command(struct command *command);
+exec_command(struct context *ctx, struct command *command);
+bool
+exec_command_selected(struct context *ctx, struct command *command);
+struct regex *
+exec_regex_resolve(struct context *ctx, struct regex *regex);
+void
+context_free(struct context *ctx);
+void
+exec(struct context *ctx,
+     script_t        commands,
+     char           *local_filepaths[],
+     size_t          local_filepaths_len,
+     bool            auto_print_);
+void
+exec_push_start(struct context *ctx, script_t commands, bool auto_print_);
+bool
+exec_feed(struct context *ctx, const char *data, size_t len);
 void
-exec(script_t commands, char *local_filepaths[], size_t local_filepaths_len, bool auto_print_);
+exec_finish(struct context *ctx);
 
 #endif
@@ -0,0 +1,516 @@
+#include "sed.h"
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Daemon mode (`--serve`).
+//
+// The scripts given to the server are parsed (and their regexes compiled) once,
+// then a pool of worker threads accepts requests on a Unix domain socket. Each
+// worker runs a request at a time in its own context (see exec.c), the scripts
+// are shared and never modified by a run. An error in a request ends the worker
+// instead of the server, the worker which replaces it releases the request first.
+//
+// A request is the argument vector of a regular invocation and its working
+// directory, its script is looked up by text among the scripts given to the
+// server. Other scripts are parsed for the request and freed with it, what clients
+// send doesn't grow the server. The client (`--connect` or $SED_SOCKET) passes
+// its standard input, output and error with SCM_RIGHTS and the worker replies
+// with the exit status once the script ran on them. A request without
+// descriptors is served on the connection itself: the input is read from it after
+// the request, the output is written back and the connection is closed. The
+// process wide working directory and standard streams are left alone, the context
+// opens relative paths from the request's directory.
+
+#define REQUEST_MAGIC 0x53454431
+// size of the working directory and arguments of a request
+#define REQUEST_MAX (1 << 20)
+
+struct request_header
+{
+    uint32_t magic;
+    uint32_t argc;
+    // NUL terminated working directory and arguments following the header
+    uint32_t cwd_len;
+    uint32_t args_len;
+};
+
+struct server_script
+{
+    // text without its trailing newlines
+    char        *text;
+    size_t       len;
+    struct arena arena;
+    script_t     script;
+};
+
+// The scripts given to --serve, read only once the workers run
+static struct server_script *server_scripts = NULL;
+static size_t                server_scripts_len = 0;
+// parsing uses state shared by the whole process (see libsed.c)
+static pthread_mutex_t server_parse_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct worker
+{
+    pthread_t thread;
+    int       listen_fd;
+    int (*run)(struct context *, struct arena *, int, char **);
+    // set once the thread is over, the supervisor then replaces it
+    bool exited;
+    // the request being served, left to the next worker if this one dies
+    bool            serving;
+    struct context *context;
+    int             conn;
+    int             fds[3];
+    size_t          fds_len;
+    int             dir_fd;
+    char           *buf;
+    char          **argv;
+    // the script of the request if it wasn't given to --serve
+    struct arena arena;
+    // releasing the context of the request has started
+    bool ending;
+};
+
+static volatile sig_atomic_t server_stopping = 0;
+// wakes the supervisor up when a worker exits or the server is stopped
+static int server_wakeup[2] = {-1, -1};
+
+// Text of a script without its trailing newlines, as compared to the scripts given
+// to --serve
+static size_t
+script_text_len(const char *text)
+{
+    size_t len = strlen(text);
+    while (len > 0 && text[len - 1] == '\n')
+        len--;
+    return len;
+}
+
+// Parse the scripts given to --serve, before the workers are started
+void
+server_scripts_load(char **scripts, size_t scripts_len)
+{
+    server_scripts = xmalloc(sizeof(struct server_script) * scripts_len);
+    for (size_t i = 0; i < scripts_len; i++)
+    {
+        struct server_script *entry = &server_scripts[i];
+        entry->len = script_text_len(scripts[i]);
+        entry->text = xmalloc(entry->len + 1);
+        memcpy(entry->text, scripts[i], entry->len);
+        entry->text[entry->len] = '\0';
+        entry->arena = (struct arena){NULL, NULL};
+        entry->script = parse_into(entry->text, &entry->arena);
+    }
+    server_scripts_len = scripts_len;
+}
+
+// Unlock the parse and free the text it was given, also when it dies
+static void
+server_parse_end(void *source)
+{
+    free(source);
+    pthread_mutex_unlock(&server_parse_lock);
+}
+
+static void
+server_parse(char *source, struct arena *arena, script_t *script)
+{
+    pthread_mutex_lock(&server_parse_lock);
+    pthread_cleanup_push(server_parse_end, source);
+    *script = parse_into(source, arena);
+    pthread_cleanup_pop(true);
+}
+
+// Returns the script for text among the scripts given to --serve. Others are
+// parsed in arena, which the caller frees once the request is over, so that the
+// scripts sent by the clients don't accumulate in the server.
+script_t
+server_script(const char *text, struct arena *arena)
+{
+    size_t len = script_text_len(text);
+    for (size_t i = 0; i < server_scripts_len; i++)
+    {
+        if (server_scripts[i].len == len &&
+            memcmp(server_scripts[i].text, text, len) == 0)
+            return server_scripts[i].script;
+    }
+    script_t script;
+    server_parse(xstrdup(text), arena, &script);
+    return script;
+}
+
+static bool
+read_full(int fd, void *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t ret = read(fd, buf, len);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+        buf = (char *)buf + ret;
+        len -= ret;
+    }
+    return true;
+}
+
+// A peer which went away isn't worth a SIGPIPE
+static bool
+send_full(int fd, const void *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t ret = send(fd, buf, len, MSG_NOSIGNAL);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+        buf = (const char *)buf + ret;
+        len -= ret;
+    }
+    return true;
+}
+
+// Receive the header of a request and the descriptors sent along with it
+static bool
+request_receive_header(int                    conn,
+                       struct request_header *header,
+                       int                   *fds,
+                       size_t                *fds_len)
+{
+    char          control[CMSG_SPACE(sizeof(int) * 3)];
+    struct iovec  iov = {header, sizeof(*header)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t ret;
+    do
+        ret = recvmsg(conn, &msg, 0);
+    while (ret == -1 && errno == EINTR);
+    if (ret <= 0)
+        return false;
+    *fds_len = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        *fds_len = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * *fds_len);
+    }
+    // the descriptors come with the first bytes, the rest can follow
+    return read_full(conn, (char *)header + ret, sizeof(*header) - ret);
+}
+
+// Split the NUL terminated arguments of a request, NULL if they're malformed
+static char **
+request_argv(char *args, size_t args_len, size_t argc)
+{
+    if (argc == 0 || args_len == 0 || args[args_len - 1] != '\0')
+        return NULL;
+    char **argv = xmalloc(sizeof(char *) * (argc + 1));
+    size_t i = 0;
+    for (char *arg = args; arg < args + args_len; arg += strlen(arg) + 1)
+    {
+        if (i == argc)
+        {
+            free(argv);
+            return NULL;
+        }
+        argv[i++] = arg;
+    }
+    if (i != argc)
+    {
+        free(argv);
+        return NULL;
+    }
+    argv[argc] = NULL;
+    return argv;
+}
+
+// Release what the request holds and reply with its exit status. A worker which
+// dies while releasing the context leaves it behind, along with the descriptors
+// the pipeline threads of the run may still be using.
+static void
+request_end(struct worker *worker, int32_t status)
+{
+    bool released = !worker->ending;
+    worker->ending = true;
+    if (released)
+    {
+        context_free(worker->context);
+        free(worker->context);
+        arena_free(&worker->arena);
+    }
+    worker->context = NULL;
+    thread_errors_set(-1, true);
+    for (size_t i = 0; released && i < worker->fds_len; i++)
+        close(worker->fds[i]);
+    if (released && worker->dir_fd != -1)
+        close(worker->dir_fd);
+    if (worker->fds_len == 3 && worker->argv != NULL)
+        send_full(worker->conn, &status, sizeof(status));
+    // the connection is the input and output of a request without descriptors
+    if (released || worker->fds_len == 3)
+        close(worker->conn);
+    free(worker->argv);
+    free(worker->buf);
+    worker->serving = false;
+    worker->ending = false;
+}
+
+// Run a request with the standard streams it was sent, or with the connection as
+// standard input and output
+static void
+request_serve(struct worker *worker, int conn)
+{
+    struct request_header header;
+    worker->context = xmalloc(sizeof(struct context));
+    *worker->context = (struct context)CONTEXT_INIT;
+    worker->conn = conn;
+    worker->fds_len = 0;
+    worker->dir_fd = -1;
+    worker->buf = NULL;
+    worker->argv = NULL;
+    worker->arena = (struct arena){NULL, NULL};
+    worker->serving = true;
+    bool valid =
+        request_receive_header(conn, &header, worker->fds, &worker->fds_len) &&
+        header.magic == REQUEST_MAGIC &&
+        (worker->fds_len == 0 || worker->fds_len == 3) && header.cwd_len > 0 &&
+        header.cwd_len <= REQUEST_MAX && header.args_len <= REQUEST_MAX;
+    if (valid)
+    {
+        worker->buf = xmalloc(header.cwd_len + header.args_len);
+        valid = read_full(conn, worker->buf, header.cwd_len + header.args_len) &&
+                worker->buf[header.cwd_len - 1] == '\0';
+    }
+    if (valid)
+        worker->argv =
+            request_argv(worker->buf + header.cwd_len, header.args_len, header.argc);
+    if (worker->argv == NULL)
+    {
+        request_end(worker, EXIT_FAILURE);
+        return;
+    }
+    struct context *ctx = worker->context;
+    bool            fds_sent = worker->fds_len == 3;
+    ctx->input.stdin_fd = fds_sent ? worker->fds[0] : conn;
+    ctx->output.fd = fds_sent ? worker->fds[1] : conn;
+    if (fds_sent)
+        ctx->error_fd = worker->fds[2];
+    thread_errors_set(fds_sent ? ctx->error_fd : -1, true);
+    int32_t status = EXIT_FAILURE;
+    worker->dir_fd = open(worker->buf, O_RDONLY | O_DIRECTORY);
+    if (worker->dir_fd == -1)
+        put_error("can't open directory %s: %s", worker->buf, strerror(errno));
+    else
+    {
+        ctx->dir_fd = worker->dir_fd;
+        status = worker->run(ctx, &worker->arena, header.argc, worker->argv);
+    }
+    request_end(worker, status);
+}
+
+// Tell the supervisor that the worker is over, on an error in a request
+static void
+worker_exit(void *arg)
+{
+    struct worker *worker = arg;
+    __atomic_store_n(&worker->exited, true, __ATOMIC_SEQ_CST);
+    ssize_t ret = write(server_wakeup[1], "", 1);
+    (void)ret;
+}
+
+static void *
+worker_run(void *arg)
+{
+    struct worker *worker = arg;
+    pthread_cleanup_push(worker_exit, worker);
+    thread_errors_set(-1, true);
+    // the request of the worker this one replaces failed
+    if (worker->serving)
+        request_end(worker, EXIT_FAILURE);
+    while (true)
+    {
+        int conn = accept(worker->listen_fd, NULL, NULL);
+        if (conn == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            die("couldn't accept a connection: %s", strerror(errno));
+        }
+        request_serve(worker, conn);
+    }
+    pthread_cleanup_pop(false);
+    return NULL;
+}
+
+// Start the thread of a worker, the signals stopping the server are left to the
+// supervisor
+static void
+worker_spawn(struct worker *worker)
+{
+    sigset_t signals;
+    sigset_t saved;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &signals, &saved);
+    worker->exited = false;
+    int error = pthread_create(&worker->thread, NULL, worker_run, worker);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (error != 0)
+        die("couldn't start a worker: %s", strerror(error));
+}
+
+static void
+server_stop(int signum)
+{
+    (void)signum;
+    server_stopping = 1;
+    ssize_t ret = write(server_wakeup[1], "", 1);
+    (void)ret;
+}
+
+// Serve the invocations sent to socket_path with a pool of worker threads until
+// SIGTERM or SIGINT, run is called by a worker for each request with a context
+// reading and writing the request's streams and the arena of its script (see
+// server_script), the worker releases both. The scripts are parsed beforehand.
+int
+server_run(const char *socket_path,
+           size_t      workers_len,
+           char      **scripts,
+           size_t      scripts_len,
+           int (*run)(struct context *, struct arena *, int, char **))
+{
+    server_scripts_load(scripts, scripts_len);
+    // the canonical forms of the idioms are parsed before the workers look them up
+    idiom_prepare();
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+        die("socket path too long: %s", socket_path);
+    strcpy(addr.sun_path, socket_path);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd == -1)
+        die("couldn't create a socket: %s", strerror(errno));
+    unlink(socket_path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, SOMAXCONN) == -1)
+        die("couldn't listen on %s: %s", socket_path, strerror(errno));
+    if (pipe(server_wakeup) == -1)
+        die("couldn't create a pipe: %s", strerror(errno));
+    // a client which goes away fails its own request only
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = server_stop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    struct worker *workers = xmalloc(sizeof(struct worker) * workers_len);
+    memset(workers, 0, sizeof(struct worker) * workers_len);
+    for (size_t i = 0; i < workers_len; i++)
+    {
+        workers[i].listen_fd = listen_fd;
+        workers[i].run = run;
+        worker_spawn(&workers[i]);
+    }
+    while (!server_stopping)
+    {
+        char byte;
+        if (read(server_wakeup[0], &byte, 1) == -1 && errno != EINTR)
+            break;
+        for (size_t i = 0; i < workers_len && !server_stopping; i++)
+        {
+            if (!__atomic_load_n(&workers[i].exited, __ATOMIC_SEQ_CST))
+                continue;
+            pthread_join(workers[i].thread, NULL);
+            worker_spawn(&workers[i]);
+        }
+    }
+    // the workers end with the process, a request may never end (e.g. `:a;ba`)
+    unlink(socket_path);
+    return EXIT_SUCCESS;
+}
+
+// Run the invocation on the server listening on socket_path, returns its exit
+// status or -1 if the server can't be reached
+int
+client_run(const char *socket_path, int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, socket_path);
+    int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (conn == -1)
+        return -1;
+    if (connect(conn, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        close(conn);
+        return -1;
+    }
+    char  *cwd = NULL;
+    size_t cwd_size = 256;
+    do
+    {
+        cwd_size *= 2;
+        cwd = xrealloc(cwd, cwd_size);
+    } while (getcwd(cwd, cwd_size) == NULL && errno == ERANGE);
+    struct request_header header = {REQUEST_MAGIC, argc, strlen(cwd) + 1, 0};
+    for (int i = 0; i < argc; i++)
+        header.args_len += strlen(argv[i]) + 1;
+    char *buf = xmalloc(header.cwd_len + header.args_len);
+    memcpy(buf, cwd, header.cwd_len);
+    char *arg = buf + header.cwd_len;
+    for (int i = 0; i < argc; i++)
+        arg = stpcpy(arg, argv[i]) + 1;
+    free(cwd);
+
+    int           fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char          control[CMSG_SPACE(sizeof(fds))];
+    struct iovec  iov = {&header, sizeof(header)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    ssize_t ret;
+    do
+        ret = sendmsg(conn, &msg, MSG_NOSIGNAL);
+    while (ret == -1 && errno == EINTR);
+    // the server is gone, or a standard stream is closed
+    if (ret <= 0)
+    {
+        close(conn);
+        free(buf);
+        return -1;
+    }
+    int32_t status = EXIT_FAILURE;
+    if (!send_full(conn, (char *)&header + ret, sizeof(header) - ret) ||
+        !send_full(conn, buf, header.cwd_len + header.args_len) ||
+        !read_full(conn, &status, sizeof(status)))
+        status = EXIT_FAILURE;
+    close(conn);
+    free(buf);
+    return status;
+}
@@ -0,0 +1,316 @@
+#include "sed.h"
+
+// Pattern and hold spaces.
+//
+// A space is a rope of reference counted pieces. `h` and `g` make both spaces
+// share the same rope and `G` and `H` build a concatenation node instead of
+// copying either side, so that the tac idiom `1!G;h;$!d` is linear. A rope is
+// flattened into a single piece when a command needs its content as a string
+// and a piece is only modified when its space is the only owner (copy on
+// write).
+//
+// The content of a piece starts at an offset in its buffer so that `D` removes
+// the first line without moving the others, the buffer has room after the content
+// for `N` to append in place. The content is moved back to the start of the buffer
+// when the room after it runs out.
+//
+// Ropes can be as deep as the number of lines appended, they are traversed and
+// released with an explicit stack, which is only allocated for concatenations.
+// A zeroed space is empty.
+
+struct rope
+{
+    size_t refs;
+    size_t len;
+    // concatenation of left, a newline and right, both NULL for a piece
+    struct rope *left;
+    struct rope *right;
+    // piece: data has room for capacity bytes and the terminating NUL, the content
+    // starts at offset
+    size_t capacity;
+    size_t offset;
+    char   data[];
+};
+
+struct rope_stack
+{
+    struct rope **ropes;
+    size_t        len;
+    size_t        capacity;
+};
+
+static void
+rope_stack_push(struct rope_stack *stack, struct rope *rope)
+{
+    if (stack->len == stack->capacity)
+    {
+        stack->capacity = stack->capacity == 0 ? 64 : stack->capacity * 2;
+        stack->ropes =
+            xrealloc(stack->ropes, sizeof(struct rope *) * stack->capacity);
+    }
+    stack->ropes[stack->len++] = rope;
+}
+
+static struct rope *
+piece_new(size_t capacity)
+{
+    struct rope *piece = xmalloc(sizeof(struct rope) + capacity + 1);
+    piece->refs = 1;
+    piece->len = 0;
+    piece->left = NULL;
+    piece->right = NULL;
+    piece->capacity = capacity;
+    piece->offset = 0;
+    piece->data[0] = '\0';
+    return piece;
+}
+
+static bool
+rope_is_piece(const struct rope *rope)
+{
+    return rope->left == NULL;
+}
+
+static void
+rope_release(struct rope *rope)
+{
+    if (rope_is_piece(rope))
+    {
+        if (--rope->refs == 0)
+            free(rope);
+        return;
+    }
+    struct rope_stack stack = {NULL, 0, 0};
+    rope_stack_push(&stack, rope);
+    while (stack.len > 0)
+    {
+        struct rope *r = stack.ropes[--stack.len];
+        if (--r->refs > 0)
+            continue;
+        if (!rope_is_piece(r))
+        {
+            rope_stack_push(&stack, r->left);
+            rope_stack_push(&stack, r->right);
+        }
+        free(r);
+    }
+    free(stack.ropes);
+}
+
+typedef void (*rope_func)(const char *s, size_t len, void *ctx);
+
+// Call func on every part of the content of rope, in order
+static void
+rope_each(struct rope *rope, rope_func func, void *ctx)
+{
+    if (rope_is_piece(rope))
+    {
+        func(rope->data + rope->offset, rope->len, ctx);
+        return;
+    }
+    struct rope_stack stack = {NULL, 0, 0};
+    rope_stack_push(&stack, rope);
+    while (stack.len > 0)
+    {
+        struct rope *r = stack.ropes[--stack.len];
+        // a NULL entry stands for the newline between two sides
+        if (r == NULL)
+            func("\n", 1, ctx);
+        else if (rope_is_piece(r))
+            func(r->data + r->offset, r->len, ctx);
+        else
+        {
+            rope_stack_push(&stack, r->right);
+            rope_stack_push(&stack, NULL);
+            rope_stack_push(&stack, r->left);
+        }
+    }
+    free(stack.ropes);
+}
+
+static void
+rope_copy_part(const char *s, size_t len, void *ctx)
+{
+    char **dest = ctx;
+    memcpy(*dest, s, len);
+    *dest += len;
+}
+
+static struct rope *
+space_rope(struct space *space)
+{
+    if (space->rope == NULL)
+        space->rope = piece_new(0);
+    return space->rope;
+}
+
+// Make the rope of space a single piece
+static struct rope *
+space_flatten(struct space *space)
+{
+    struct rope *rope = space_rope(space);
+    if (rope_is_piece(rope))
+        return rope;
+    struct rope *piece = piece_new(rope->len);
+    char        *dest = piece->data;
+    rope_each(rope, rope_copy_part, &dest);
+    *dest = '\0';
+    piece->len = rope->len;
+    rope_release(rope);
+    space->rope = piece;
+    return piece;
+}
+
+void
+space_free(struct space *space)
+{
+    if (space->rope != NULL)
+        rope_release(space->rope);
+    space->rope = NULL;
+}
+
+size_t
+space_len(struct space *space)
+{
+    return space_rope(space)->len;
+}
+
+// The content of space as a string, valid until space is modified
+const char *
+space_string(struct space *space)
+{
+    struct rope *piece = space_flatten(space);
+    return piece->data + piece->offset;
+}
+
+// The content of space as a modifiable string of at least capacity bytes (plus
+// the NUL), valid until space is modified
+char *
+space_mutable(struct space *space, size_t capacity)
+{
+    struct rope *rope = space_rope(space);
+    if (rope_is_piece(rope) && rope->refs == 1 && rope->capacity >= capacity)
+    {
+        if (rope->offset + capacity > rope->capacity)
+        {
+            memmove(rope->data, rope->data + rope->offset, rope->len + 1);
+            rope->offset = 0;
+        }
+        return rope->data + rope->offset;
+    }
+    if (capacity < rope->len)
+        capacity = rope->len;
+    struct rope *piece = piece_new(capacity);
+    char        *dest = piece->data;
+    rope_each(rope, rope_copy_part, &dest);
+    *dest = '\0';
+    piece->len = rope->len;
+    rope_release(rope);
+    space->rope = piece;
+    return piece->data;
+}
+
+// Set the length of the content after it was modified through space_mutable
+void
+space_set_len(struct space *space, size_t len)
+{
+    space->rope->len = len;
+    space->rope->data[space->rope->offset + len] = '\0';
+}
+
+void
+space_set(struct space *space, const char *s, size_t len)
+{
+    struct rope *rope = space_rope(space);
+    // the piece is reused from one cycle to the other
+    if (!rope_is_piece(rope) || rope->refs > 1 || rope->capacity < len)
+    {
+        rope_release(rope);
+        rope = piece_new(len);
+        space->rope = rope;
+    }
+    rope->offset = 0;
+    memcpy(rope->data, s, len);
+    space_set_len(space, len);
+}
+
+// Append s to space (`N`), with a newline in between if newline is true
+void
+space_append(struct space *space, const char *s, size_t len, bool newline)
+{
+    struct rope *rope = space_rope(space);
+    size_t       old_len = rope->len;
+    size_t       new_len = old_len + newline + len;
+    size_t       capacity = new_len;
+    // room to append the next lines in place
+    if (!rope_is_piece(rope) || rope->refs > 1 || rope->capacity < new_len)
+        capacity = new_len * 2;
+    char *data = space_mutable(space, capacity);
+    if (newline)
+        data[old_len] = '\n';
+    memcpy(data + old_len + newline, s, len);
+    space_set_len(space, new_len);
+}
+
+// Remove the first len bytes of space (`D`)
+void
+space_remove_prefix(struct space *space, size_t len)
+{
+    space_mutable(space, space_len(space));
+    space->rope->offset += len;
+    space->rope->len -= len;
+}
+
+// Share the content of src (`g` and `h`)
+void
+space_assign(struct space *dest, struct space *src)
+{
+    struct rope *rope = space_rope(src);
+    rope->refs++;
+    rope_release(space_rope(dest));
+    dest->rope = rope;
+}
+
+// Append a newline and the content of src to dest (`G` and `H`), nothing is
+// copied
+void
+space_concat(struct space *dest, struct space *src)
+{
+    struct rope *node = xmalloc(sizeof(struct rope));
+    node->refs = 1;
+    node->left = space_rope(dest);
+    node->right = space_rope(src);
+    node->len = node->left->len + 1 + node->right->len;
+    node->capacity = 0;
+    node->offset = 0;
+    node->right->refs++;
+    dest->rope = node;
+}
+
+void
+space_swap(struct space *space1, struct space *space2)
+{
+    struct rope *tmp = space1->rope;
+    space1->rope = space2->rope;
+    space2->rope = tmp;
+}
+
+static void
+space_output_part(const char *s, size_t len, void *ctx)
+{
+    output_write(ctx, s, len);
+}
+
+// Write the content of space to the output without flattening it
+void
+space_output(struct context *ctx, struct space *space)
+{
+    rope_each(space_rope(space), space_output_part, ctx);
+}
+
+// Whether the content of space is a single piece
+bool
+space_is_flat(struct space *space)
+{
+    return rope_is_piece(space_rope(space));
+}
@@ -0,0 +1,102 @@
+#include "sed.h"
+#include <signal.h>
+#include <time.h>
+
+// I/O statistics (`--stats`) and progress snapshots on SIGUSR1.
+//
+// The counters are always updated by the input and output paths, they only cost
+// a few additions per read(2) or write(2). Lines written are only counted when the
+// statistics are reported since it requires scanning the output.
+
+// counters of the context being reported, see stats_init
+static struct io_stats *io_stats = NULL;
+
+static volatile sig_atomic_t snapshot_requested = 0;
+static uint64_t              start_ns = 0;
+
+uint64_t
+stats_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+snapshot_handler(int signum)
+{
+    (void)signum;
+    snapshot_requested = 1;
+}
+
+void
+stats_init(struct io_stats *stats, bool report)
+{
+    io_stats = stats;
+    start_ns = stats_clock();
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = snapshot_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, NULL);
+    if (report)
+    {
+        io_stats->count_lines_written = true;
+        atexit(stats_report);
+    }
+}
+
+static double
+elapsed(void)
+{
+    return (stats_clock() - start_ns) / 1e9;
+}
+
+// Print the progress if it was requested by a signal since the last call
+void
+stats_poll(void)
+{
+    if (!snapshot_requested || io_stats == NULL)
+        return;
+    snapshot_requested = 0;
+    double seconds = elapsed();
+    fprintf(stderr,
+            "sed: %s: offset %llu, %llu lines read, %llu bytes written, "
+            "%.1f MB/s in %.1f s\n",
+            io_stats->filepath != NULL ? io_stats->filepath : "-",
+            (unsigned long long)io_stats->offset,
+            (unsigned long long)io_stats->lines_read,
+            (unsigned long long)io_stats->bytes_written,
+            seconds > 0 ? io_stats->bytes_read / seconds / 1e6 : 0,
+            seconds);
+}
+
+void
+stats_report(void)
+{
+    fprintf(stderr,
+            "sed: stats\n"
+            "  files opened           %12zu\n"
+            "  bytes read             %12llu\n"
+            "  lines read             %12llu\n"
+            "  read calls             %12zu\n"
+            "  buffer refills         %12zu\n"
+            "  blocked on input       %12.6f s\n"
+            "  bytes written          %12llu\n"
+            "  lines written          %12llu\n"
+            "  write calls            %12zu\n"
+            "  blocked on output      %12.6f s\n"
+            "  elapsed                %12.6f s\n",
+            io_stats->files_opened,
+            (unsigned long long)io_stats->bytes_read,
+            (unsigned long long)io_stats->lines_read,
+            io_stats->read_calls,
+            io_stats->refills,
+            io_stats->read_ns / 1e9,
+            (unsigned long long)io_stats->bytes_written,
+            (unsigned long long)io_stats->lines_written,
+            io_stats->write_calls,
+            io_stats->write_ns / 1e9,
+            elapsed());
+}
@@ -0,0 +1,286 @@
+#include "sed.h"
+
+// Streaming of long lines. When the script only uses commands which can work on a
+// part of a line (literal `s` with a bounded pattern, `y`, `p`, `d`) and line
+// number addresses, a long line is never held in memory: it goes through the
+// commands in windows of STREAM_WINDOW_SIZE bytes.
+//
+// The applicable `s` and `y` commands are chained as stages in front of the
+// output. An `s` stage keeps the bytes which could start a match crossing the
+// window boundary (at most the pattern length minus one) and prepends them to the
+// next window.
+
+struct stream_stage
+{
+    struct command *command;
+    // `s`: bytes kept from the previous window, the current occurence and whether
+    // the substitution is complete
+    char  *buf;
+    size_t buf_size;
+    size_t carry_len;
+    size_t occurence;
+    bool   done;
+    // `y`
+    char table[256];
+};
+
+// A literal pattern is made of characters which have no special meaning in a
+// basic regular expression
+static bool
+stream_literal(const struct regex *regex)
+{
+    return regex->cflags == 0 && regex->source[0] != '\0' &&
+           strpbrk(regex->source, "\\.[]*^$") == NULL;
+}
+
+static bool
+stream_eligible(const struct command *command)
+{
+    if (command->profile != NULL)
+        return false;
+    for (size_t i = 0; i < command->addresses.count; i++)
+    {
+        if (command->addresses.addresses[i].type != ADDRESS_LINE)
+            return false;
+    }
+    switch (command->id)
+    {
+    case 's':
+        return stream_literal(command->data.substitute.regex) &&
+               strpbrk(command->data.substitute.replacement, "&\\") == NULL &&
+               !command->data.substitute.print &&
+               command->data.substitute.write_filepath == NULL;
+    case 'y':
+    case 'p':
+    case 'd':
+    case '#':
+        return true;
+    }
+    return false;
+}
+
+// Whether the lines which don't fit in a window can be streamed through the
+// script, there can only be one output of the pattern space per cycle
+bool
+stream_prepare(struct context *ctx, script_t script, bool auto_print)
+{
+    size_t outputs = auto_print ? 1 : 0;
+    for (struct command *command = script; command->id != COMMAND_LAST; command++)
+    {
+        if (!stream_eligible(command))
+            return false;
+        if (command->id == 'p')
+            outputs++;
+    }
+    if (outputs > 1)
+        return false;
+    ctx->stream.script = script;
+    ctx->stream.auto_print = auto_print;
+    return true;
+}
+
+static void
+stage_push(struct stream *stream, struct command *command)
+{
+    if (stream->stages_len == stream->stages_capacity)
+    {
+        size_t capacity =
+            stream->stages_capacity == 0 ? 4 : stream->stages_capacity * 2;
+        stream->stages =
+            xrealloc(stream->stages, sizeof(struct stream_stage) * capacity);
+        // buffers are kept from one line to the other
+        memset(stream->stages + stream->stages_len,
+               0,
+               sizeof(struct stream_stage) * (capacity - stream->stages_len));
+        stream->stages_capacity = capacity;
+    }
+    struct stream_stage *stage = &stream->stages[stream->stages_len++];
+    stage->command = command;
+    stage->carry_len = 0;
+    stage->occurence = 0;
+    stage->done = false;
+    if (command->id == 'y')
+    {
+        for (size_t i = 0; i < 256; i++)
+            stage->table[i] = i;
+        const char *from = command->data.translate.from;
+        const char *to = command->data.translate.to;
+        // the first occurence of a character in `from` is the one used
+        for (size_t i = strlen(from); i-- > 0;)
+            stage->table[(unsigned char)from[i]] = to[i];
+    }
+}
+
+static void
+stage_reserve(struct stream_stage *stage, size_t size)
+{
+    if (size <= stage->buf_size)
+        return;
+    while (size > stage->buf_size)
+        stage->buf_size =
+            stage->buf_size == 0 ? STREAM_WINDOW_SIZE : stage->buf_size * 2;
+    stage->buf = xrealloc(stage->buf, stage->buf_size);
+}
+
+static void
+stream_feed(struct context *ctx,
+            size_t          index,
+            const char     *data,
+            size_t          len,
+            bool            end);
+
+static void
+stream_translate(struct context *ctx,
+                 size_t          index,
+                 const char     *data,
+                 size_t          len,
+                 bool            end)
+{
+    struct stream_stage *stage = &ctx->stream.stages[index];
+    stage_reserve(stage, len);
+    for (size_t i = 0; i < len; i++)
+        stage->buf[i] = stage->table[(unsigned char)data[i]];
+    stream_feed(ctx, index + 1, stage->buf, len, end);
+}
+
+static void
+stream_substitute(struct context *ctx,
+                  size_t          index,
+                  const char     *data,
+                  size_t          len,
+                  bool            end)
+{
+    struct stream_stage *stage = &ctx->stream.stages[index];
+    if (stage->done)
+    {
+        stream_feed(ctx, index + 1, data, len, end);
+        return;
+    }
+    const char  *pattern = stage->command->data.substitute.regex->source;
+    const size_t pattern_len = strlen(pattern);
+    const char  *replacement = stage->command->data.substitute.replacement;
+    const size_t wanted = stage->command->data.substitute.occurence_index == 0
+                              ? 1
+                              : stage->command->data.substitute.occurence_index;
+    stage_reserve(stage, stage->carry_len + len);
+    memcpy(stage->buf + stage->carry_len, data, len);
+    const size_t buf_len = stage->carry_len + len;
+    char        *buf = stage->buf;
+    size_t       emitted = 0;
+    size_t       pos = 0;
+    // start of a match which could continue in the next window
+    size_t carry_start = buf_len;
+    while (!stage->done && pos < buf_len)
+    {
+        char *found = memchr(buf + pos, pattern[0], buf_len - pos);
+        if (found == NULL)
+            break;
+        size_t offset = found - buf;
+        if (buf_len - offset < pattern_len)
+        {
+            carry_start = offset;
+            break;
+        }
+        if (memcmp(found, pattern, pattern_len) != 0)
+        {
+            pos = offset + 1;
+            continue;
+        }
+        pos = offset + pattern_len;
+        if (++stage->occurence < wanted)
+            continue;
+        stream_feed(ctx, index + 1, buf + emitted, offset - emitted, false);
+        stream_feed(ctx, index + 1, replacement, strlen(replacement), false);
+        emitted = pos;
+        if (!stage->command->data.substitute.global)
+            stage->done = true;
+    }
+    if (end || stage->done)
+        carry_start = buf_len;
+    stream_feed(ctx, index + 1, buf + emitted, carry_start - emitted, end);
+    stage->carry_len = buf_len - carry_start;
+    memmove(buf, buf + carry_start, stage->carry_len);
+}
+
+static void
+stream_feed(struct context *ctx,
+            size_t          index,
+            const char     *data,
+            size_t          len,
+            bool            end)
+{
+    struct stream *stream = &ctx->stream;
+    if (index == stream->stages_len)
+    {
+        if (stream->output && len > 0)
+            output_write(ctx, data, len);
+        return;
+    }
+    if (stream->stages[index].command->id == 'y')
+        stream_translate(ctx, index, data, len, end);
+    else
+        stream_substitute(ctx, index, data, len, end);
+}
+
+// Run the script on the line starting with window, the rest of the line is read
+// from the input
+void
+stream_line(struct context *ctx, char *window, size_t len)
+{
+    struct stream *stream = &ctx->stream;
+    stream->stages_len = 0;
+    stream->output = false;
+    bool   deleted = false;
+    size_t output_stages_len = 0;
+    for (struct command *command = stream->script; command->id != COMMAND_LAST;
+         command++)
+    {
+        if (!exec_command_selected(ctx, command))
+            continue;
+        switch (command->id)
+        {
+        case 's':
+        case 'y':
+            stage_push(stream, command);
+            break;
+        case 'p':
+            stream->output = !deleted;
+            output_stages_len = stream->stages_len;
+            break;
+        case 'd':
+            deleted = true;
+            break;
+        }
+    }
+    if (stream->auto_print && !deleted)
+    {
+        stream->output = true;
+        output_stages_len = stream->stages_len;
+    }
+    stream->stages_len = output_stages_len;
+    bool line_end = false;
+    while (window != NULL)
+    {
+        stream_feed(ctx, 0, window, len, line_end);
+        if (line_end)
+            break;
+        window = input_next_window(ctx, &len, STREAM_WINDOW_SIZE, &line_end);
+    }
+    // flush what the stages hold back
+    if (window == NULL)
+        stream_feed(ctx, 0, "", 0, true);
+    if (stream->output)
+        output_separator(ctx);
+}
+
+void
+stream_free(struct context *ctx)
+{
+    struct stream *stream = &ctx->stream;
+    for (size_t i = 0; i < stream->stages_capacity; i++)
+        free(stream->stages[i].buf);
+    free(stream->stages);
+    stream->stages = NULL;
+    stream->stages_len = 0;
+    stream->stages_capacity = 0;
+}
@@ -0,0 +1,510 @@
+#define _GNU_SOURCE
+#include "sed.h"
+
+// Asynchronous I/O with io_uring (`--io-uring`, Linux only).
+//
+// Regular input files are read ahead: the URING_READ_SLOTS blocks following the
+// one being consumed are in flight while the script runs. Output is written
+// behind: a batch is copied to a slot and written while the next one fills up,
+// with one write in flight per descriptor so that they land in order. Slots are
+// registered with the kernel when RLIMIT_MEMLOCK allows it.
+//
+// The ring is set up with raw system calls, without liburing. A context falls
+// back to read(2) and writev(2) when the kernel doesn't provide it (or a seccomp
+// filter denies it), and for batches bigger than a slot.
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define URING_READ_SLOTS 4
+#define URING_READ_SLOT_SIZE 65536
+#define URING_WRITE_SLOTS 4
+// an output buffer along with the strings which didn't fit in it
+#define URING_WRITE_SLOT_SIZE 262144
+#define URING_SLOTS (URING_READ_SLOTS + URING_WRITE_SLOTS)
+#define URING_ENTRIES 16
+
+enum slot_state
+{
+    SLOT_FREE,
+    SLOT_IN_FLIGHT,
+    SLOT_DONE,
+};
+
+struct uring_slot
+{
+    char           *buf;
+    size_t          size;
+    enum slot_state state;
+    int             fd;
+    // reads: block of the file at offset, done bytes received (the block is full
+    // unless the file ended) and consumed
+    // writes: done bytes written out of len, offset is unused
+    uint64_t    offset;
+    size_t      len;
+    size_t      done;
+    size_t      consumed;
+    bool        eof;
+    const char *filepath;
+};
+
+struct uring
+{
+    int                  fd;
+    void                *ring;
+    size_t               ring_size;
+    struct io_uring_sqe *sqes;
+    size_t               sqes_size;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_array;
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned             to_submit;
+    // the slots are registered buffers
+    bool              fixed;
+    char             *slots_buf;
+    size_t            slots_buf_size;
+    struct uring_slot slots[URING_SLOTS];
+    // read ahead of read_fd (-1 if none), the next data is in the read_head slot
+    int      read_fd;
+    size_t   read_head;
+    uint64_t read_offset;
+    bool     read_eof;
+};
+
+static struct uring *
+uring_setup(void)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (fd == -1)
+        return NULL;
+    // a single mapping for both rings (5.4), reads and writes at the current
+    // position of pipes (5.6)
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_RW_CUR_POS))
+    {
+        close(fd);
+        return NULL;
+    }
+    struct uring *uring = xmalloc(sizeof(struct uring));
+    memset(uring, 0, sizeof(struct uring));
+    uring->fd = fd;
+    uring->read_fd = -1;
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    uring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    uring->ring = mmap(NULL,
+                       uring->ring_size,
+                       PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE,
+                       fd,
+                       IORING_OFF_SQ_RING);
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(NULL,
+                       uring->sqes_size,
+                       PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE,
+                       fd,
+                       IORING_OFF_SQES);
+    uring->slots_buf_size = URING_READ_SLOTS * URING_READ_SLOT_SIZE +
+                            URING_WRITE_SLOTS * URING_WRITE_SLOT_SIZE;
+    uring->slots_buf = mmap(NULL,
+                            uring->slots_buf_size,
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS,
+                            -1,
+                            0);
+    if (uring->ring == MAP_FAILED || uring->sqes == MAP_FAILED ||
+        uring->slots_buf == MAP_FAILED)
+    {
+        if (uring->ring != MAP_FAILED)
+            munmap(uring->ring, uring->ring_size);
+        if (uring->sqes != MAP_FAILED)
+            munmap(uring->sqes, uring->sqes_size);
+        if (uring->slots_buf != MAP_FAILED)
+            munmap(uring->slots_buf, uring->slots_buf_size);
+        close(fd);
+        free(uring);
+        return NULL;
+    }
+    char *ring = uring->ring;
+    uring->sq_tail = (unsigned *)(ring + params.sq_off.tail);
+    uring->sq_mask = (unsigned *)(ring + params.sq_off.ring_mask);
+    uring->sq_array = (unsigned *)(ring + params.sq_off.array);
+    uring->cq_head = (unsigned *)(ring + params.cq_off.head);
+    uring->cq_tail = (unsigned *)(ring + params.cq_off.tail);
+    uring->cq_mask = (unsigned *)(ring + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+    struct iovec iov[URING_SLOTS];
+    char        *buf = uring->slots_buf;
+    for (size_t i = 0; i < URING_SLOTS; i++)
+    {
+        struct uring_slot *slot = &uring->slots[i];
+        slot->size =
+            i < URING_READ_SLOTS ? URING_READ_SLOT_SIZE : URING_WRITE_SLOT_SIZE;
+        slot->buf = buf;
+        slot->fd = -1;
+        iov[i].iov_base = slot->buf;
+        iov[i].iov_len = slot->size;
+        buf += slot->size;
+    }
+    uring->fixed = syscall(__NR_io_uring_register,
+                           fd,
+                           IORING_REGISTER_BUFFERS,
+                           iov,
+                           URING_SLOTS) == 0;
+    return uring;
+}
+
+// The ring of the context, NULL if io_uring isn't used
+static struct uring *
+uring_get(struct context *ctx)
+{
+    if (!ctx->io_uring)
+        return NULL;
+    if (ctx->uring == NULL)
+        ctx->uring = uring_setup();
+    if (ctx->uring == NULL)
+        ctx->io_uring = false;
+    return ctx->uring;
+}
+
+// Queue the read or the write of what's left of the slot
+static void
+slot_submit(struct uring *uring, size_t index, bool read)
+{
+    struct uring_slot   *slot = &uring->slots[index];
+    unsigned             tail = *uring->sq_tail;
+    unsigned             sq_index = tail & *uring->sq_mask;
+    struct io_uring_sqe *sqe = &uring->sqes[sq_index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    if (read)
+    {
+        sqe->opcode = uring->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->addr = (uintptr_t)(slot->buf + slot->done);
+        sqe->len = slot->size - slot->done;
+        sqe->off = slot->offset + slot->done;
+    }
+    else
+    {
+        sqe->opcode = uring->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->addr = (uintptr_t)(slot->buf + slot->done);
+        sqe->len = slot->len - slot->done;
+        // at the current position, the only write in flight on the descriptor
+        sqe->off = (uint64_t)-1;
+    }
+    sqe->fd = slot->fd;
+    if (uring->fixed)
+        sqe->buf_index = index;
+    sqe->user_data = index;
+    uring->sq_array[sq_index] = sq_index;
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    uring->to_submit++;
+    slot->state = SLOT_IN_FLIGHT;
+}
+
+static void
+slot_complete(struct uring *uring, size_t index, int res)
+{
+    struct uring_slot *slot = &uring->slots[index];
+    bool               read = index < URING_READ_SLOTS;
+    if (res == -EINTR || res == -EAGAIN)
+    {
+        slot_submit(uring, index, read);
+        return;
+    }
+    if (res < 0)
+    {
+        if (read)
+            die("couldn't read %s: %s", slot->filepath, strerror(-res));
+        die("couldn't write to file %s: %s", slot->filepath, strerror(-res));
+    }
+    slot->done += res;
+    if (read)
+    {
+        slot->eof = res == 0;
+        if (slot->eof || slot->done == slot->size)
+            slot->state = SLOT_DONE;
+        else
+            slot_submit(uring, index, true);
+        return;
+    }
+    if (slot->done == slot->len)
+        slot->state = SLOT_FREE;
+    else
+        slot_submit(uring, index, false);
+}
+
+// Submit what's queued and wait for min_complete completions
+static void
+uring_enter(struct context *ctx, unsigned min_complete)
+{
+    struct uring *uring = ctx->uring;
+    unsigned      flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    if (uring->to_submit == 0 && min_complete == 0)
+        return;
+    long ret;
+    do
+        ret = syscall(__NR_io_uring_enter,
+                      uring->fd,
+                      uring->to_submit,
+                      min_complete,
+                      flags,
+                      NULL,
+                      0);
+    while (ret == -1 && errno == EINTR);
+    if (ret == -1)
+        die("io_uring_enter: %s", strerror(errno));
+    uring->to_submit -= ret;
+    unsigned head = *uring->cq_head;
+    while (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = &uring->cqes[head & *uring->cq_mask];
+        slot_complete(uring, cqe->user_data, cqe->res);
+        head++;
+    }
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Wait until the slot isn't in flight anymore, each wait resubmits what's left of
+// short transfers
+static void
+slot_wait(struct context *ctx, struct uring_slot *slot)
+{
+    while (slot->state == SLOT_IN_FLIGHT)
+        uring_enter(ctx, 1);
+}
+
+// Start reading fd ahead, returns false if the file isn't read through io_uring
+// (not a regular file, or io_uring isn't used)
+bool
+uring_read_start(struct context *ctx, int fd, const char *filepath)
+{
+    struct uring *uring = uring_get(ctx);
+    struct stat   statbuf;
+    if (uring == NULL || fstat(fd, &statbuf) == -1 || !S_ISREG(statbuf.st_mode))
+        return false;
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (offset == -1)
+        return false;
+    uring_read_stop(ctx);
+    uring->read_fd = fd;
+    uring->read_head = 0;
+    uring->read_offset = offset;
+    uring->read_eof = false;
+    for (size_t i = 0; i < URING_READ_SLOTS; i++)
+    {
+        struct uring_slot *slot = &uring->slots[i];
+        slot->fd = fd;
+        slot->filepath = filepath;
+        slot->offset = uring->read_offset;
+        slot->done = 0;
+        slot->consumed = 0;
+        slot_submit(uring, i, true);
+        uring->read_offset += slot->size;
+        ctx->stats.read_calls++;
+    }
+    uring_enter(ctx, 0);
+    return true;
+}
+
+// Copy at most len bytes of the file read ahead to buf, returns 0 at its end
+size_t
+uring_read(struct context *ctx, char *buf, size_t len)
+{
+    struct uring      *uring = ctx->uring;
+    struct uring_slot *slot = &uring->slots[uring->read_head];
+    if (uring->read_eof)
+        return 0;
+    slot_wait(ctx, slot);
+    if (slot->done - slot->consumed < len)
+        len = slot->done - slot->consumed;
+    memcpy(buf, slot->buf + slot->consumed, len);
+    slot->consumed += len;
+    if (slot->consumed < slot->done)
+        return len;
+    if (slot->eof)
+    {
+        uring->read_eof = true;
+        return len;
+    }
+    // the block is consumed, the slot reads the one after the last in flight
+    slot->offset = uring->read_offset;
+    slot->done = 0;
+    slot->consumed = 0;
+    slot_submit(uring, uring->read_head, true);
+    uring_enter(ctx, 0);
+    uring->read_offset += slot->size;
+    uring->read_head = (uring->read_head + 1) % URING_READ_SLOTS;
+    ctx->stats.read_calls++;
+    return len;
+}
+
+// Stop reading ahead, before the descriptor is closed
+void
+uring_read_stop(struct context *ctx)
+{
+    struct uring *uring = ctx->uring;
+    if (uring == NULL || uring->read_fd == -1)
+        return;
+    for (size_t i = 0; i < URING_READ_SLOTS; i++)
+    {
+        slot_wait(ctx, &uring->slots[i]);
+        uring->slots[i].state = SLOT_FREE;
+        uring->slots[i].fd = -1;
+    }
+    uring->read_fd = -1;
+}
+
+// Wait for the writes in flight on fd, or on every descriptor if fd is -1
+void
+uring_write_wait(struct context *ctx, int fd)
+{
+    struct uring *uring = ctx->uring;
+    if (uring == NULL)
+        return;
+    for (size_t i = URING_READ_SLOTS; i < URING_SLOTS; i++)
+    {
+        if (fd == -1 || uring->slots[i].fd == fd)
+            slot_wait(ctx, &uring->slots[i]);
+    }
+}
+
+// Write iov to fd behind the execution, returns false if it has to be written
+// synchronously (io_uring isn't used or iov doesn't fit in a slot), the writes in
+// flight on fd are then over
+bool
+uring_write(struct context     *ctx,
+            int                 fd,
+            const struct iovec *iov,
+            size_t              iovcnt,
+            const char         *filepath)
+{
+    struct uring *uring = uring_get(ctx);
+    if (uring == NULL)
+        return false;
+    uint64_t start = stats_clock();
+    uring_write_wait(ctx, fd);
+    size_t total = 0;
+    for (size_t i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    if (total > URING_WRITE_SLOT_SIZE)
+    {
+        ctx->stats.write_ns += stats_clock() - start;
+        return false;
+    }
+    // the oldest write is over first
+    struct uring_slot *slot = NULL;
+    size_t             index;
+    while (slot == NULL)
+    {
+        for (index = URING_READ_SLOTS; index < URING_SLOTS; index++)
+        {
+            if (uring->slots[index].state == SLOT_FREE)
+            {
+                slot = &uring->slots[index];
+                break;
+            }
+        }
+        if (slot == NULL)
+            uring_enter(ctx, 1);
+    }
+    slot->fd = fd;
+    slot->filepath = filepath;
+    slot->len = 0;
+    slot->done = 0;
+    for (size_t i = 0; i < iovcnt; i++)
+    {
+        memcpy(slot->buf + slot->len, iov[i].iov_base, iov[i].iov_len);
+        slot->len += iov[i].iov_len;
+    }
+    slot_submit(uring, index, false);
+    uring_enter(ctx, 0);
+    ctx->stats.write_calls++;
+    ctx->stats.bytes_written += total;
+    ctx->stats.write_ns += stats_clock() - start;
+    return true;
+}
+
+// Finish the transfers in flight and tear the ring down
+void
+uring_free(struct context *ctx)
+{
+    struct uring *uring = ctx->uring;
+    if (uring == NULL)
+        return;
+    uring_read_stop(ctx);
+    uring_write_wait(ctx, -1);
+    munmap(uring->slots_buf, uring->slots_buf_size);
+    munmap(uring->sqes, uring->sqes_size);
+    munmap(uring->ring, uring->ring_size);
+    close(uring->fd);
+    free(uring);
+    ctx->uring = NULL;
+}
+
+#else
+
+bool
+uring_read_start(struct context *ctx, int fd, const char *filepath)
+{
+    (void)fd;
+    (void)filepath;
+    ctx->io_uring = false;
+    return false;
+}
+
+size_t
+uring_read(struct context *ctx, char *buf, size_t len)
+{
+    (void)ctx;
+    (void)buf;
+    (void)len;
+    return 0;
+}
+
+void
+uring_read_stop(struct context *ctx)
+{
+    (void)ctx;
+}
+
+void
+uring_write_wait(struct context *ctx, int fd)
+{
+    (void)ctx;
+    (void)fd;
+}
+
+bool
+uring_write(struct context     *ctx,
+            int                 fd,
+            const struct iovec *iov,
+            size_t              iovcnt,
+            const char         *filepath)
+{
+    (void)fd;
+    (void)iov;
+    (void)iovcnt;
+    (void)filepath;
+    ctx->io_uring = false;
+    return false;
+}
+
+void
+uring_free(struct context *ctx)
+{
+    (void)ctx;
+}
+
+#endif
@@ -1,4 +1,5 @@
 #include "sed.h"
+#include <pthread.h>
 
 void *
 xmalloc(size_t size)
@@ -63,27 +64,93 @@ strjoinf(char *origin, ...)
     return new;
 }
 
-#define READ_FILE_BUF_SIZE 1024
+#define READ_FILE_BUF_SIZE 4096
 
+// Read the whole file in a null terminated string, the buffer grows geometrically
 char *
 read_file(char *filepath)
 {
-    char  buf[READ_FILE_BUF_SIZE + 1] = {'\0'};
-    char *ret = NULL;
-    FILE *file = fopen(filepath, "r");
+    return read_file_at(AT_FDCWD, filepath);
+}
+
+// Same as read_file with a relative filepath opened from dir_fd
+char *
+read_file_at(int dir_fd, const char *filepath)
+{
+    int   fd = openat(dir_fd, filepath, O_RDONLY);
+    FILE *file = fd == -1 ? NULL : fdopen(fd, "r");
     if (file == NULL)
         die("couldn't open file %s: %s", filepath, strerror(errno));
-    while (!feof(file))
+    size_t capacity = READ_FILE_BUF_SIZE;
+    size_t len = 0;
+    char  *ret = xmalloc(capacity);
+    while (true)
     {
-        fread(buf, sizeof(char), READ_FILE_BUF_SIZE, file);
-        ret = strjoinf(ret, buf, NULL);
+        if (len + 1 == capacity)
+        {
+            capacity *= 2;
+            ret = xrealloc(ret, capacity);
+        }
+        size_t chunk = fread(ret + len, sizeof(char), capacity - len - 1, file);
+        len += chunk;
+        if (chunk == 0)
+            break;
     }
+    if (ferror(file))
+        die("couldn't read file %s: %s", filepath, strerror(errno));
+    fclose(file);
+    ret[len] = '\0';
     return ret;
 }
 
+#define ERROR_MESSAGE_SIZE 512
+
+// A thread serving a request of the daemon mode reports its errors on the standard
+// error of the request, and an error only ends the thread (see server.c)
+static __thread int  error_fd = -1;
+static __thread bool error_exit_thread = false;
+
+// A libsed call catches the errors of its thread instead, die() jumps back to it
+// with the message (see libsed.c)
+static __thread jmp_buf *error_catch = NULL;
+static __thread char     error_message[ERROR_MESSAGE_SIZE];
+
+// The errors of the calling thread go to fd (the standard error if -1), die() ends
+// the thread instead of the process if exit_thread
+void
+thread_errors_set(int fd, bool exit_thread)
+{
+    error_fd = fd;
+    error_exit_thread = exit_thread;
+}
+
+// die() longjmps to jmp (once set with setjmp) instead of reporting the error,
+// NULL stops catching. Returns the previous one, to be put back.
+jmp_buf *
+errors_catch(jmp_buf *jmp)
+{
+    jmp_buf *previous = error_catch;
+    error_catch = jmp;
+    return previous;
+}
+
+// Message of the last error caught by the calling thread
+const char *
+errors_message(void)
+{
+    return error_message;
+}
+
 static void
 vput_error(const char *format, va_list ap)
 {
+    if (error_fd != -1)
+    {
+        dprintf(error_fd, "sed: ");
+        vdprintf(error_fd, format, ap);
+        dprintf(error_fd, "\n");
+        return;
+    }
     fputs("sed: ", stderr);
     vfprintf(stderr, format, ap);
     fputc('\n', stderr);
@@ -98,14 +165,38 @@ put_error(const char *format, ...)
     va_end(ap);
 }
 
+static void
+die_end(void)
+{
+    if (error_exit_thread)
+        pthread_exit(NULL);
+    exit(EXIT_FAILURE);
+}
+
 void
 die(const char *format, ...)
 {
     va_list ap;
     va_start(ap, format);
+    if (error_catch != NULL)
+    {
+        vsnprintf(error_message, sizeof(error_message), format, ap);
+        va_end(ap);
+        longjmp(*error_catch, 1);
+    }
     vput_error(format, ap);
     va_end(ap);
-    exit(EXIT_FAILURE);
+    die_end();
+}
+
+// Raise the error caught last again, for a caller which only cleaned up after it
+void
+errors_rethrow(void)
+{
+    if (error_catch != NULL)
+        longjmp(*error_catch, 1);
+    put_error("%s", error_message);
+    die_end();
 }
 
 int
@@ -115,3 +206,129 @@ todigit(int c)
         return -1;
     return c - '0';
 }
+
+// FNV-1a
+size_t
+hash_string(const char *s)
+{
+    size_t hash = 14695981039346656037ULL;
+    for (; *s != '\0'; s++)
+    {
+        hash ^= (unsigned char)*s;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+// Number of occurences of c in s, eight bytes at a time: the bytes equal to c are
+// zeroed by a xor and the zero bytes of a word are flagged in their high bit
+size_t
+memcount(const char *s, size_t len, char c)
+{
+    const uint64_t pattern = ONES * (unsigned char)c;
+    size_t         count = 0;
+    size_t         i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, s + i, 8);
+        word ^= pattern;
+        uint64_t zeros = ~(((word & ~HIGHS) + ~HIGHS) | word | ~HIGHS);
+        count += ((zeros >> 7) * ONES) >> 56;
+    }
+    for (; i < len; i++)
+        count += s[i] == c;
+    return count;
+}
+
+// Region allocator: allocations are carved out of large chunks and only freed
+// all at once. Cleanup functions can be registered for resources allocated
+// elsewhere (e.g. by regcomp) which must be released along with the arena.
+
+#define ARENA_CHUNK_SIZE 65536
+#define ARENA_ALIGN 16
+
+struct arena_chunk
+{
+    struct arena_chunk *next;
+    size_t              size;
+    size_t              used;
+    char                data[];
+};
+
+struct arena_cleanup
+{
+    struct arena_cleanup *next;
+    void (*func)(void *);
+    void *ptr;
+};
+
+void *
+arena_alloc(struct arena *arena, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    struct arena_chunk *chunk = arena->chunks;
+    if (chunk == NULL || chunk->size - chunk->used < size)
+    {
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = xmalloc(sizeof(struct arena_chunk) + ARENA_ALIGN + chunk_size);
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        // keep filling the current chunk if the new one is only for this request
+        if (chunk_size > ARENA_CHUNK_SIZE && arena->chunks != NULL)
+        {
+            chunk->next = arena->chunks->next;
+            arena->chunks->next = chunk;
+        }
+        else
+        {
+            chunk->next = arena->chunks;
+            arena->chunks = chunk;
+        }
+    }
+    char     *data = chunk->data;
+    uintptr_t misalign = (uintptr_t)data % ARENA_ALIGN;
+    if (misalign != 0)
+        data += ARENA_ALIGN - misalign;
+    void *ret = data + chunk->used;
+    chunk->used += size;
+    return ret;
+}
+
+char *
+arena_strndup(struct arena *arena, const char *s, size_t len)
+{
+    char *ret = arena_alloc(arena, len + 1);
+    memcpy(ret, s, len);
+    ret[len] = '\0';
+    return ret;
+}
+
+// Call func(ptr) when the arena is freed, in reverse order of registration
+void
+arena_defer(struct arena *arena, void (*func)(void *), void *ptr)
+{
+    struct arena_cleanup *cleanup = arena_alloc(arena, sizeof(struct arena_cleanup));
+    cleanup->func = func;
+    cleanup->ptr = ptr;
+    cleanup->next = arena->cleanups;
+    arena->cleanups = cleanup;
+}
+
+void
+arena_free(struct arena *arena)
+{
+    for (struct arena_cleanup *cleanup = arena->cleanups; cleanup != NULL;
+         cleanup = cleanup->next)
+        cleanup->func(cleanup->ptr);
+    arena->cleanups = NULL;
+    while (arena->chunks != NULL)
+    {
+        struct arena_chunk *next = arena->chunks->next;
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+}
@@ -0,0 +1,143 @@
+#include "sed.h"
+#include <criterion/criterion.h>
+#include <pthread.h>
+
+static char dir[] = "/tmp/sed_test_cacheXXXXXX";
+
+static void
+cache_setup(void)
+{
+    cr_assert_not_null(mkdtemp(dir));
+}
+
+Test(script_cache, store_load, .init = cache_setup)
+{
+    char     input[] = "a\\bonjour\n"
+                       "/abc*/,3s/\\(b\\)c/[\\1]/pg\n"
+                       "$!{y/ab/cd/;p;}";
+    uint64_t key = script_cache_key(input);
+    cr_expect_null(script_cache_load(dir, key, input));
+    script_cache_store(dir, key, input, parse(input));
+
+    script_t script = script_cache_load(dir, key, input);
+    cr_assert_not_null(script);
+    cr_expect_eq(script[0].id, 'a');
+    cr_expect_str_eq(script[0].data.text, "bonjour");
+    cr_expect_eq(script[1].id, 's');
+    cr_expect_eq(script[1].addresses.count, 2);
+    cr_expect_eq(script[1].addresses.addresses[0].type, ADDRESS_RE);
+    cr_expect_str_eq(script[1].addresses.addresses[0].data.regex->source, "abc*");
+    cr_expect_eq(script[1].addresses.addresses[1].type, ADDRESS_LINE);
+    cr_expect_eq(script[1].addresses.addresses[1].data.line, 3);
+    cr_expect_str_eq(script[1].data.substitute.regex->source, "\\(b\\)c");
+    cr_expect_eq(script[1].data.substitute.regex->preg.re_nsub, 1);
+    cr_expect_str_eq(script[1].data.substitute.replacement, "[\\1]");
+    cr_expect(script[1].data.substitute.global);
+    cr_expect(script[1].data.substitute.print);
+    cr_expect_null(script[1].data.substitute.write_filepath);
+    cr_expect_eq(script[2].id, '{');
+    cr_expect(script[2].inverse);
+    cr_expect_eq(script[2].addresses.addresses[0].type, ADDRESS_LAST);
+    cr_expect_eq(script[2].data.children[0].id, 'y');
+    cr_expect_str_eq(script[2].data.children[0].data.translate.from, "ab");
+    cr_expect_str_eq(script[2].data.children[0].data.translate.to, "cd");
+    cr_expect_eq(script[2].data.children[1].id, 'p');
+    cr_expect_eq(script[2].data.children[2].id, '}');
+    cr_expect_eq(script[3].id, COMMAND_LAST);
+}
+
+Test(script_cache, other_script, .init = cache_setup)
+{
+    char     input[] = "p";
+    uint64_t key = script_cache_key(input);
+    script_cache_store(dir, key, input, parse(input));
+    cr_expect_null(script_cache_load(dir, script_cache_key("d"), "d"));
+    cr_expect_not_null(script_cache_load(dir, key, input));
+}
+
+Test(script_cache, same_key, .init = cache_setup)
+{
+    // a colliding script is parsed instead of using the cached one
+    char     input[] = "p";
+    uint64_t key = script_cache_key(input);
+    script_cache_store(dir, key, input, parse(input));
+    cr_expect_null(script_cache_load(dir, key, "d"));
+    cr_expect_null(script_cache_load(dir, key, "pp"));
+    cr_expect_not_null(script_cache_load(dir, key, input));
+}
+
+Test(script_cache, string_out_of_range, .init = cache_setup)
+{
+    char     input[] = "a\\x\na\\y";
+    uint64_t key = script_cache_key(input);
+    script_cache_store(dir, key, input, parse(input));
+    char filepath[64];
+    snprintf(
+        filepath, sizeof(filepath), "%s/%016llx.sedc", dir, (unsigned long long)key);
+    FILE *file = fopen(filepath, "r+");
+    cr_assert_not_null(file);
+    unsigned char content[4096];
+    size_t        len = fread(content, 1, sizeof(content), file);
+    // past the magic and the key, the first `a` bytes are the ids of the commands
+    // and the only other nonzero byte of the second one is its text offset, 2
+    unsigned char *first = memchr(content + 16, 'a', len - 16);
+    cr_assert_not_null(first);
+    unsigned char *second = memchr(first + 1, 'a', content + len - first - 1);
+    cr_assert_not_null(second);
+    unsigned char *offset = memchr(second, 2, second - first);
+    cr_assert_not_null(offset);
+    *offset = 64;
+    fseek(file, 0, SEEK_SET);
+    fwrite(content, 1, len, file);
+    fclose(file);
+    cr_expect_null(script_cache_load(dir, key, input));
+}
+
+static void
+server_scripts_setup(void)
+{
+    static char *scripts[] = {"s/a/b/;p"};
+    static bool  loaded = false;
+    if (!loaded)
+        server_scripts_load(scripts, 1);
+    loaded = true;
+}
+
+Test(server_script, reused, .init = server_scripts_setup)
+{
+    struct arena arena = {NULL, NULL};
+    // the same script given as an operand or with -e
+    script_t script = server_script("s/a/b/;p", &arena);
+    cr_expect_eq(server_script("s/a/b/;p\n", &arena), script);
+    cr_expect_null(arena.chunks);
+    cr_expect_eq(script[0].id, 's');
+    cr_expect_eq(script[1].id, 'p');
+    // a script not given to the server is parsed for the request only
+    script_t other = server_script("s/a/c/;p", &arena);
+    cr_expect_neq(other, script);
+    cr_expect_not_null(arena.chunks);
+    arena_free(&arena);
+}
+
+static void *
+server_script_thread(void *arg)
+{
+    struct arena arena = {NULL, NULL};
+    int          null_fd = open("/dev/null", O_WRONLY);
+    thread_errors_set(null_fd, true);
+    server_script(arg, &arena);
+    close(null_fd);
+    return NULL;
+}
+
+// A worker which dies on a parse error leaves the parser usable
+Test(server_script, parse_error, .init = server_scripts_setup)
+{
+    pthread_t thread;
+    cr_assert_eq(pthread_create(&thread, NULL, server_script_thread, "s/a/"), 0);
+    pthread_join(thread, NULL);
+    struct arena arena = {NULL, NULL};
+    script_t     other = server_script("y/ab/cd/", &arena);
+    cr_expect_eq(other[0].id, 'y');
+    arena_free(&arena);
+}
@@ -4,29 +4,41 @@
 #include <criterion/logging.h>
 #include <criterion/redirect.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/wait.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 char *
-_debug_exec_pattern_space(void);
+_debug_exec_pattern_space(struct context *ctx);
 char *
-_debug_exec_hold_space(void);
+_debug_exec_hold_space(struct context *ctx);
 bool
-_debug_exec_last_line(void);
+_debug_exec_last_line(struct context *ctx);
 char *
-_debug_exec_set_pattern_space(const char *content);
+_debug_exec_set_pattern_space(struct context *ctx, const char *content);
 char *
-_debug_exec_set_hold_space(const char *content);
+_debug_exec_set_hold_space(struct context *ctx, const char *content);
 void
-_debug_exec_set_line_index(const size_t line_index_);
+_debug_exec_set_line_index(struct context *ctx, const size_t line_index_);
 void
-_debug_exec_set_last_line(const bool last_line_);
+_debug_exec_set_last_line(struct context *ctx, const bool last_line_);
 void
-exec_init(char **local_filepaths, size_t local_filepaths_len, bool auto_print_);
-FILE *
-current_file(void);
+exec_init(struct context *ctx,
+          char          **local_filepaths,
+          size_t          local_filepaths_len,
+          bool            auto_print_);
 char *
-next_line(void);
+next_line(struct context *ctx);
 void
-exec_commands(script_t commands);
+exec_commands(struct context *ctx, script_t commands);
+void
+exec_end_cycle(struct context *ctx);
+const char *
+_debug_idiom_find(struct context *ctx, script_t script, bool auto_print);
+
+static struct context context = CONTEXT_INIT;
 
 static struct command command;
 
@@ -35,9 +47,9 @@ Test(exec_command, insert)
     cr_redirect_stdout();
     command.id = 'i';
     command.data.text = "bonjour";
-    exec_command(&command);
-    fflush(stdout);
-    cr_expect_stdout_eq_str("bonjour");
+    exec_command(&context, &command);
+    output_flush(&context);
+    cr_expect_stdout_eq_str("bonjour\n");
 }
 
 Test(exec_command, read_file)
@@ -50,9 +62,10 @@ Test(exec_command, read_file)
     cr_redirect_stdout();
     command.id = 'r';
     command.data.text = template;
-    exec_command(&command);
+    exec_command(&context, &command);
     remove(template);
-    fflush(stdout);
+    exec_end_cycle(&context);
+    output_flush(&context);
     cr_expect_stdout_eq_str(expected);
 }
 
@@ -61,8 +74,9 @@ Test(exec_command, read_file_not_exist)
     cr_redirect_stdout();
     command.id = 'r';
     command.data.text = "/foo/bar/qux";
-    exec_command(&command);
-    fflush(stdout);
+    exec_command(&context, &command);
+    exec_end_cycle(&context);
+    output_flush(&context);
     FILE  *cr_stdout = cr_get_redirected_stdout();
     char   buf[8] = {0};
     size_t read_size = fread(buf, sizeof(char), 8, cr_stdout);
@@ -70,23 +84,59 @@ Test(exec_command, read_file_not_exist)
     cr_expect_stdout_eq_str("");
 }
 
+Test(exec_command, append)
+{
+    cr_redirect_stdout();
+    command.id = 'a';
+    command.data.text = "bonjour";
+    exec_command(&context, &command);
+    output_flush(&context);
+    FILE  *cr_stdout = cr_get_redirected_stdout();
+    char   buf[8] = {0};
+    size_t read_size = fread(buf, sizeof(char), 8, cr_stdout);
+    cr_expect_eq(read_size, 0);
+    exec_command(&context, &command);
+    exec_end_cycle(&context);
+    output_flush(&context);
+    cr_expect_stdout_eq_str("bonjour\nbonjour\n");
+}
+
+Test(exec_command, read_line)
+{
+    char template[] = "/tmp/sed_testXXXXXX";
+    FILE *tmp_file = fdopen(mkstemp(template), "w+");
+    fputs("foo\nbar", tmp_file);
+    fclose(tmp_file);
+    cr_redirect_stdout();
+    command.id = 'R';
+    command.data.text = template;
+    exec_command(&context, &command);
+    exec_command(&context, &command);
+    exec_end_cycle(&context);
+    exec_command(&context, &command);
+    exec_end_cycle(&context);
+    remove(template);
+    output_flush(&context);
+    cr_expect_stdout_eq_str("foo\nbar\n");
+}
+
 Test(exec_command, print_base)
 {
     cr_redirect_stdout();
     command.id = 'p';
-    _debug_exec_set_pattern_space("bonjour");
-    exec_command(&command);
-    fflush(stdout);
-    cr_expect_stdout_eq_str("bonjour");
+    _debug_exec_set_pattern_space(&context, "bonjour");
+    exec_command(&context, &command);
+    output_flush(&context);
+    cr_expect_stdout_eq_str("bonjour\n");
 }
 
 Test(exec_command, print_with_newlines)
 {
     cr_redirect_stdout();
     command.id = 'p';
-    _debug_exec_set_pattern_space("bon\njour\n");
-    exec_command(&command);
-    fflush(stdout);
+    _debug_exec_set_pattern_space(&context, "bon\njour");
+    exec_command(&context, &command);
+    output_flush(&context);
     cr_expect_stdout_eq_str("bon\njour\n");
 }
 
@@ -94,98 +144,114 @@ Test(exec_command, print_until_newline)
 {
     command.id = 'P';
     cr_redirect_stdout();
-    _debug_exec_set_pattern_space("bonj\nour\n");
-    exec_command(&command);
-    fflush(stdout);
-    cr_expect_stdout_eq_str("bonj");
+    _debug_exec_set_pattern_space(&context, "bonj\nour");
+    exec_command(&context, &command);
+    output_flush(&context);
+    cr_expect_stdout_eq_str("bonj\n");
 }
 
 Test(exec_command, print_until_newline_without_newline)
 {
     command.id = 'P';
     cr_redirect_stdout();
-    _debug_exec_set_pattern_space("bonjour");
-    exec_command(&command);
-    fflush(stdout);
-    cr_expect_stdout_eq_str("bonjour");
+    _debug_exec_set_pattern_space(&context, "bonjour");
+    exec_command(&context, &command);
+    output_flush(&context);
+    cr_expect_stdout_eq_str("bonjour\n");
 }
 
 Test(exec_command, delete)
 {
     command.id = 'd';
-    _debug_exec_set_pattern_space("foo");
-    exec_command(&command);
-    cr_assert_str_empty(_debug_exec_pattern_space());
-    _debug_exec_set_pattern_space("foo\nbar\nbaz");
-    exec_command(&command);
-    cr_assert_str_empty(_debug_exec_pattern_space());
+    _debug_exec_set_pattern_space(&context, "foo");
+    exec_command(&context, &command);
+    cr_assert_str_empty(_debug_exec_pattern_space(&context));
+    _debug_exec_set_pattern_space(&context, "foo\nbar\nbaz");
+    exec_command(&context, &command);
+    cr_assert_str_empty(_debug_exec_pattern_space(&context));
 }
 
 Test(exec_command, delete_newline)
 {
     command.id = 'D';
-    _debug_exec_set_pattern_space("foo");
-    exec_command(&command);
-    cr_assert_str_empty(_debug_exec_pattern_space());
-    _debug_exec_set_pattern_space("foo\nbar\nbaz");
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "bar\nbaz");
+    _debug_exec_set_pattern_space(&context, "foo");
+    exec_command(&context, &command);
+    cr_assert_str_empty(_debug_exec_pattern_space(&context));
+    _debug_exec_set_pattern_space(&context, "foo\nbar\nbaz");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "bar\nbaz");
 }
 
 Test(exec_command, exec_replace_pattern_by_hold)
 {
     command.id = 'g';
-    _debug_exec_set_pattern_space("foo");
-    _debug_exec_set_hold_space("bar");
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "bar");
-    cr_assert_str_eq(_debug_exec_hold_space(), "bar");
+    _debug_exec_set_pattern_space(&context, "foo");
+    _debug_exec_set_hold_space(&context, "bar");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "bar");
+    cr_assert_str_eq(_debug_exec_hold_space(&context), "bar");
 }
 
 Test(exec_command, exec_append_pattern_by_hold)
 {
     command.id = 'G';
-    _debug_exec_set_pattern_space("foo");
-    _debug_exec_set_hold_space("bar");
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "foo\nbar");
-    cr_assert_str_eq(_debug_exec_hold_space(), "bar");
+    _debug_exec_set_pattern_space(&context, "foo");
+    _debug_exec_set_hold_space(&context, "bar");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "foo\nbar");
+    cr_assert_str_eq(_debug_exec_hold_space(&context), "bar");
 }
 
 Test(exec_command, exec_replace_hold_by_pattern)
 {
     command.id = 'h';
-    _debug_exec_set_pattern_space("foo");
-    _debug_exec_set_hold_space("bar");
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_hold_space(), "foo");
-    cr_assert_str_eq(_debug_exec_pattern_space(), "foo");
+    _debug_exec_set_pattern_space(&context, "foo");
+    _debug_exec_set_hold_space(&context, "bar");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_hold_space(&context), "foo");
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "foo");
 }
 
 Test(exec_command, exec_append_hold_by_pattern)
 {
     command.id = 'H';
-    _debug_exec_set_pattern_space("foo");
-    _debug_exec_set_hold_space("bar");
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_hold_space(), "bar\nfoo");
-    cr_assert_str_eq(_debug_exec_pattern_space(), "foo");
+    _debug_exec_set_pattern_space(&context, "foo");
+    _debug_exec_set_hold_space(&context, "bar");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_hold_space(&context), "bar\nfoo");
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "foo");
+}
+
+Test(exec_command, shared_space_copied_on_write)
+{
+    _debug_exec_set_pattern_space(&context, "foo");
+    _debug_exec_set_hold_space(&context, "bar");
+    command.id = 'H';
+    exec_command(&context, &command);
+    command.id = 'g';
+    exec_command(&context, &command);
+    command.id = 'y';
+    command.data.translate.from = "o";
+    command.data.translate.to = "0";
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "bar\nf00");
+    cr_assert_str_eq(_debug_exec_hold_space(&context), "bar\nfoo");
 }
 
 Test(exec_command, exchange)
 {
     command.id = 'x';
-    _debug_exec_set_pattern_space("foo");
-    _debug_exec_set_hold_space("bar");
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "bar");
-    cr_assert_str_eq(_debug_exec_hold_space(), "foo");
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "foo");
-    cr_assert_str_eq(_debug_exec_hold_space(), "bar");
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "bar");
-    cr_assert_str_eq(_debug_exec_hold_space(), "foo");
+    _debug_exec_set_pattern_space(&context, "foo");
+    _debug_exec_set_hold_space(&context, "bar");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "bar");
+    cr_assert_str_eq(_debug_exec_hold_space(&context), "foo");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "foo");
+    cr_assert_str_eq(_debug_exec_hold_space(&context), "bar");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "bar");
+    cr_assert_str_eq(_debug_exec_hold_space(&context), "foo");
 }
 
 Test(exec_command, translate)
@@ -193,41 +259,41 @@ Test(exec_command, translate)
     command.id = 'y';
     command.data.translate.from = "ABC";
     command.data.translate.to = "DEF";
-    _debug_exec_set_pattern_space("ABCfooAbarBbazCABC");
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "DEFfooDbarEbazFDEF");
+    _debug_exec_set_pattern_space(&context, "ABCfooAbarBbazCABC");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "DEFfooDbarEbazFDEF");
 
     command.data.translate.from = "";
     command.data.translate.to = "";
-    _debug_exec_set_pattern_space("fooAbarBbazC");
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "fooAbarBbazC");
+    _debug_exec_set_pattern_space(&context, "fooAbarBbazC");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "fooAbarBbazC");
 
     command.data.translate.from = "\n\t\r";
     command.data.translate.to = "ABC";
-    _debug_exec_set_pattern_space("foo\nbar\tbaz\r");
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "fooAbarBbazC");
+    _debug_exec_set_pattern_space(&context, "foo\nbar\tbaz\r");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "fooAbarBbazC");
 }
 
 Test(exec_command, substitute)
 {
     command.id = 's';
     command.data.substitute.occurence_index = 0;
-    assert(regcomp(&command.data.substitute.preg, "abc*", 0) == 0);
+    command.data.substitute.regex = regex_compile("abc*", 0);
     command.data.substitute.replacement = "foo";
 
-    _debug_exec_set_pattern_space("abccccc");
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "foo");
+    _debug_exec_set_pattern_space(&context, "abccccc");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "foo");
 
-    _debug_exec_set_pattern_space("###abccccc###");
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "###foo###");
+    _debug_exec_set_pattern_space(&context, "###abccccc###");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "###foo###");
 
-    _debug_exec_set_pattern_space("###abccccc###abccc###");
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "###foo###abccc###");
+    _debug_exec_set_pattern_space(&context, "###abccccc###abccc###");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "###foo###abccc###");
 }
 
 Test(exec_command, substitute_regex_group)
@@ -235,72 +301,80 @@ Test(exec_command, substitute_regex_group)
     command.id = 's';
     command.data.substitute.occurence_index = 0;
 
-    assert(regcomp(&command.data.substitute.preg, "\\(abc*\\)_\\(def*\\)", 0) == 0);
+    command.data.substitute.regex = regex_compile("\\(abc*\\)_\\(def*\\)", 0);
     command.data.substitute.replacement = "[\\1]foo[\\2]";
-    _debug_exec_set_pattern_space("###abccc_defff###");
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "###[abccc]foo[defff]###");
-
-    assert(regcomp(&command.data.substitute.preg,
-                   "_\\(a\\)_\\(b\\)_\\(c\\)_\\(d\\)_\\(e\\)_\\(f\\)_\\(g\\)_\\(h\\)"
-                   "_\\(i\\)_",
-                   0) == 0);
+    _debug_exec_set_pattern_space(&context, "###abccc_defff###");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context),
+                     "###[abccc]foo[defff]###");
+
+    command.data.substitute.regex =
+        regex_compile("_\\(a\\)_\\(b\\)_\\(c\\)_\\(d\\)_\\(e\\)_\\(f\\)_\\(g\\)_\\(h\\)"
+                      "_\\(i\\)_",
+                      0);
     command.data.substitute.replacement = "-\\1-\\2-\\3-\\4-\\5-\\6-\\7-\\8-\\9-";
-    _debug_exec_set_pattern_space("###_a_b_c_d_e_f_g_h_i_###");
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "###-a-b-c-d-e-f-g-h-i-###");
+    _debug_exec_set_pattern_space(&context, "###_a_b_c_d_e_f_g_h_i_###");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context),
+                     "###-a-b-c-d-e-f-g-h-i-###");
 
-    assert(regcomp(&command.data.substitute.preg, "I\\(abc*\\)I", 0) == 0);
+    command.data.substitute.regex = regex_compile("I\\(abc*\\)I", 0);
     command.data.substitute.replacement = "\\0_&_\\1";
-    _debug_exec_set_pattern_space("###IabcccI###");
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "###IabcccI_IabcccI_abccc###");
+    _debug_exec_set_pattern_space(&context, "###IabcccI###");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context),
+                     "###IabcccI_IabcccI_abccc###");
 
-    assert(regcomp(&command.data.substitute.preg, "I\\(abc*\\)I", 0) == 0);
+    command.data.substitute.regex = regex_compile("I\\(abc*\\)I", 0);
     command.data.substitute.replacement = "\\2\\3\\0\\4_&\\5\\9_\\6\\1\\7\\8";
-    _debug_exec_set_pattern_space("###IabcccI###");
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "###IabcccI_IabcccI_abccc###");
+    _debug_exec_set_pattern_space(&context, "###IabcccI###");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context),
+                     "###IabcccI_IabcccI_abccc###");
 }
 
 Test(exec_command, substitute_escape)
 {
     command.id = 's';
     command.data.substitute.occurence_index = 0;
-    assert(regcomp(&command.data.substitute.preg, "\\(abc*\\)_\\(def*\\)", 0) == 0);
+    command.data.substitute.regex = regex_compile("\\(abc*\\)_\\(def*\\)", 0);
     command.data.substitute.replacement = "\\\\[\\1]\\f\\o\\&o\\[\\2]";
-    _debug_exec_set_pattern_space("###abccc_defff###");
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "###\\[abccc]fo&o[defff]###");
+    _debug_exec_set_pattern_space(&context, "###abccc_defff###");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context),
+                     "###\\[abccc]fo&o[defff]###");
 }
 
 Test(exec_command, substitute_occurence)
 {
     command.id = 's';
     command.data.substitute.occurence_index = 1;
-    assert(regcomp(&command.data.substitute.preg, "abc*", 0) == 0);
+    command.data.substitute.regex = regex_compile("abc*", 0);
     command.data.substitute.replacement = "foo";
-    _debug_exec_set_pattern_space("###abccc###abccc###abccc###");
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "###foo###abccc###abccc###");
+    _debug_exec_set_pattern_space(&context, "###abccc###abccc###abccc###");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context),
+                     "###foo###abccc###abccc###");
 
     command.data.substitute.occurence_index = 2;
     command.data.substitute.replacement = "foo";
-    _debug_exec_set_pattern_space("###abccc###abccc###abccc###");
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "###abccc###foo###abccc###");
+    _debug_exec_set_pattern_space(&context, "###abccc###abccc###abccc###");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context),
+                     "###abccc###foo###abccc###");
 
     command.data.substitute.occurence_index = 3;
     command.data.substitute.replacement = "foo";
-    _debug_exec_set_pattern_space("###abccc###abccc###abccc###");
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "###abccc###abccc###foo###");
+    _debug_exec_set_pattern_space(&context, "###abccc###abccc###abccc###");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context),
+                     "###abccc###abccc###foo###");
 
     command.data.substitute.occurence_index = 2;
     command.data.substitute.replacement = "foo";
-    _debug_exec_set_pattern_space("###abcccabcccabccc###");
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "###abcccfooabccc###");
+    _debug_exec_set_pattern_space(&context, "###abcccabcccabccc###");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "###abcccfooabccc###");
 }
 
 Test(exec_command, substitute_global)
@@ -308,15 +382,86 @@ Test(exec_command, substitute_global)
     command.id = 's';
     command.data.substitute.occurence_index = 0;
     command.data.substitute.global = true;
-    assert(regcomp(&command.data.substitute.preg, "abc*", 0) == 0);
+    command.data.substitute.regex = regex_compile("abc*", 0);
     command.data.substitute.replacement = "foo";
-    _debug_exec_set_pattern_space("###abccc###abccc###abccc###");
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "###foo###foo###foo###");
+    _debug_exec_set_pattern_space(&context, "###abccc###abccc###abccc###");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context),
+                     "###foo###foo###foo###");
+
+    _debug_exec_set_pattern_space(&context, "###abcccabcccabccc###");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "###foofoofoo###");
+}
 
-    _debug_exec_set_pattern_space("###abcccabcccabccc###");
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "###foofoofoo###");
+Test(exec_command, substitute_empty_match_after_match)
+{
+    command.id = 's';
+    command.data.substitute.occurence_index = 0;
+    command.data.substitute.global = true;
+    command.data.substitute.regex = regex_compile("b*", 0);
+    command.data.substitute.replacement = "-";
+    _debug_exec_set_pattern_space(&context, "abc");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "-a-c-");
+    _debug_exec_set_pattern_space(&context, "");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "-");
+    command.data.substitute.global = false;
+}
+
+// Matched without regexec, at most once even with `g`
+Test(exec_command, substitute_anchored)
+{
+    command.id = 's';
+    command.data.substitute.occurence_index = 0;
+    command.data.substitute.global = true;
+    command.data.substitute.regex = regex_compile("^", 0);
+    command.data.substitute.replacement = "> ";
+    _debug_exec_set_pattern_space(&context, "abc");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "> abc");
+
+    command.data.substitute.regex = regex_compile("[ \t]*$", 0);
+    command.data.substitute.replacement = "[&]";
+    _debug_exec_set_pattern_space(&context, "a b \t ");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "a b[ \t ]");
+
+    command.data.substitute.regex = regex_compile("\\.c$", 0);
+    command.data.substitute.replacement = ".h";
+    _debug_exec_set_pattern_space(&context, "a.c.c");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "a.c.h");
+
+    command.data.substitute.occurence_index = 2;
+    command.data.substitute.regex = regex_compile("^a", 0);
+    _debug_exec_set_pattern_space(&context, "aaa");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "aaa");
+    command.data.substitute.global = false;
+}
+
+// The literal is found past the blocks searched 16 bytes at a time
+Test(exec_command, substitute_icase)
+{
+    command.id = 's';
+    command.data.substitute.occurence_index = 0;
+    command.data.substitute.global = true;
+    command.data.substitute.regex = regex_compile("error", REG_ICASE);
+    command.data.substitute.replacement = "<&>";
+    _debug_exec_set_pattern_space(&context,
+                                  "Error: error, ERROR, eRRoR and errors over "
+                                  "sixteen bytes errOR");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context),
+                     "<Error>: <error>, <ERROR>, <eRRoR> and <error>s over "
+                     "sixteen bytes <errOR>");
+
+    _debug_exec_set_pattern_space(&context, "@[`{ err0r");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "@[`{ err0r");
+    command.data.substitute.global = false;
 }
 
 Test(exec_command, substitute_print)
@@ -324,16 +469,15 @@ Test(exec_command, substitute_print)
     command.id = 's';
     command.data.substitute.occurence_index = 0;
     command.data.substitute.print = true;
-    assert(regcomp(&command.data.substitute.preg, "abc*", 0) == 0);
+    command.data.substitute.regex = regex_compile("abc*", 0);
     command.data.substitute.replacement = "foo";
-    _debug_exec_set_pattern_space("###abccc###");
-    fflush(stdout);
+    _debug_exec_set_pattern_space(&context, "###abccc###");
+    output_flush(&context);
     cr_redirect_stdout();
-    exec_command(&command);
-    char *expected = "###foo###";
-    cr_assert_str_eq(_debug_exec_pattern_space(), expected);
-    fflush(stdout);
-    cr_expect_stdout_eq_str(expected);
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "###foo###");
+    output_flush(&context);
+    cr_expect_stdout_eq_str("###foo###\n");
 }
 
 Test(exec_command, substitute_print_no_replacement)
@@ -341,14 +485,14 @@ Test(exec_command, substitute_print_no_replacement)
     command.id = 's';
     command.data.substitute.occurence_index = 0;
     command.data.substitute.print = true;
-    assert(regcomp(&command.data.substitute.preg, "abc*", 0) == 0);
+    command.data.substitute.regex = regex_compile("abc*", 0);
     command.data.substitute.replacement = "foo";
-    _debug_exec_set_pattern_space("###accc###");
-    fflush(stdout);
+    _debug_exec_set_pattern_space(&context, "###accc###");
+    output_flush(&context);
     cr_redirect_stdout();
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "###accc###");
-    fflush(stdout);
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "###accc###");
+    output_flush(&context);
     cr_expect_stdout_eq_str("");
 }
 
@@ -363,18 +507,33 @@ Test(exec_command, substitute_write_file)
     command.id = 's';
     command.data.substitute.occurence_index = 0;
     command.data.substitute.write_filepath = template;
-    assert(regcomp(&command.data.substitute.preg, "abc*", 0) == 0);
+    command.data.substitute.regex = regex_compile("abc*", 0);
     command.data.substitute.replacement = "foo";
-    _debug_exec_set_pattern_space("###abccc###");
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "###foo###");
+    _debug_exec_set_pattern_space(&context, "###abccc###");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "###foo###");
+    write_targets_flush(&context);
 
     tmp_file = fopen(template, "r");
     assert(tmp_file != NULL);
-    cr_expect_file_contents_eq_str(tmp_file, "bonjour\naurevoir\n###foo###");
+    // the file is truncated when it's first written to
+    cr_expect_file_contents_eq_str(tmp_file, "###foo###\n");
     fclose(tmp_file);
 }
 
+// Written to the standard output buffer, in order with the rest of the output
+Test(exec_command, write_stdout)
+{
+    cr_redirect_stdout();
+    struct command write = {.id = 'w', .data.text = "/dev/stdout"};
+    struct command print = {.id = 'p'};
+    _debug_exec_set_pattern_space(&context, "bonjour");
+    exec_command(&context, &write);
+    exec_command(&context, &print);
+    output_flush(&context);
+    cr_expect_stdout_eq_str("bonjour\nbonjour\n");
+}
+
 Test(exec_command, substitute_write_file_no_replacement)
 {
     char template[] = "/tmp/sed_testXXXXXX";
@@ -386,11 +545,12 @@ Test(exec_command, substitute_write_file_no_replacement)
     command.id = 's';
     command.data.substitute.occurence_index = 0;
     command.data.substitute.write_filepath = template;
-    assert(regcomp(&command.data.substitute.preg, "abc*", 0) == 0);
+    command.data.substitute.regex = regex_compile("abc*", 0);
     command.data.substitute.replacement = "foo";
-    _debug_exec_set_pattern_space("###accc###");
-    exec_command(&command);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "###accc###");
+    _debug_exec_set_pattern_space(&context, "###accc###");
+    exec_command(&context, &command);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "###accc###");
+    write_targets_flush(&context);
 
     tmp_file = fopen(template, "r");
     assert(tmp_file != NULL);
@@ -402,126 +562,345 @@ Test(exec_command, print_escape_nothing_special)
 {
     cr_redirect_stdout();
     command.id = 'l';
-    _debug_exec_set_pattern_space("bonjour");
-    exec_command(&command);
-    fflush(stdout);
-    cr_expect_stdout_eq_str("bonjour");
+    _debug_exec_set_pattern_space(&context, "bonjour");
+    exec_command(&context, &command);
+    output_flush(&context);
+    cr_expect_stdout_eq_str("bonjour$\n");
 }
 
 Test(exec_command, print_escape_with_newline)
 {
     cr_redirect_stdout();
     command.id = 'l';
-    _debug_exec_set_pattern_space("bonjour\n");
-    exec_command(&command);
-    fflush(stdout);
-    cr_expect_stdout_eq_str("bonjour$\n");
+    _debug_exec_set_pattern_space(&context, "bon\njour");
+    exec_command(&context, &command);
+    output_flush(&context);
+    cr_expect_stdout_eq_str("bon\\njour$\n");
 }
 
 Test(exec_command, print_escape_with_escape)
 {
     cr_redirect_stdout();
     command.id = 'l';
-    _debug_exec_set_pattern_space("\\_\b_\t_\r_\v_\f_\n");
-    exec_command(&command);
-    fflush(stdout);
-    cr_expect_stdout_eq_str("\\\\_\\b_\\t_\\r_\\v_\\f_$\n");
+    _debug_exec_set_pattern_space(&context, "\\_\b_\t_\r_\v_\f_\n");
+    exec_command(&context, &command);
+    output_flush(&context);
+    cr_expect_stdout_eq_str("\\\\_\\b_\\t_\\r_\\v_\\f_\\n$\n");
 }
 
 Test(exec_command, print_escape_with_non_printable)
 {
     cr_redirect_stdout();
     command.id = 'l';
-    _debug_exec_set_pattern_space("\033\037\001\004\177");
-    exec_command(&command);
-    fflush(stdout);
-    cr_expect_stdout_eq_str("\\033\\037\\001\\004\\177");
+    _debug_exec_set_pattern_space(&context, "\033\037\001\004\177");
+    exec_command(&context, &command);
+    output_flush(&context);
+    cr_expect_stdout_eq_str("\\033\\037\\001\\004\\177$\n");
+}
+
+Test(exec_command, print_escape_high_bytes)
+{
+    cr_redirect_stdout();
+    command.id = 'l';
+    _debug_exec_set_pattern_space(&context, "a\377b\200");
+    exec_command(&context, &command);
+    output_flush(&context);
+    cr_expect_stdout_eq_str("a\\377b\\200$\n");
 }
 
 Test(exec_command, print_escape_fold)
 {
     cr_redirect_stdout();
     command.id = 'l';
-    _debug_exec_set_pattern_space("0123456789"
+    _debug_exec_set_pattern_space(&context, "0123456789"
                                   "0123456789"
                                   "0123456789"
                                   "0123456789"
                                   "0123456789"
                                   "0123456789"
                                   "foo");
-    exec_command(&command);
-    fflush(stdout);
+    exec_command(&context, &command);
+    output_flush(&context);
     cr_expect_stdout_eq_str("0123456789"
                             "0123456789"
                             "0123456789"
                             "0123456789"
                             "0123456789"
                             "0123456789\\\n"
-                            "foo");
+                            "foo$\n");
 }
 
-Test(current_file, no_filepaths)
-{
-    char  *filepaths[] = {};
-    size_t filepaths_len = 0;
-    exec_init(filepaths, filepaths_len, false);
-    FILE *file = current_file();
-    cr_expect_eq(file, stdin);
-}
-
-Test(current_file, one_file)
+Test(input_next_line, one_file)
 {
     char template[] = "/tmp/sed_testXXXXXX";
     FILE *t = fdopen(mkstemp(template), "w");
     assert(t != NULL);
-    fputs("bonjour", t);
+    fputs("bonjour\nje suis", t);
     fclose(t);
     char  *filepaths[] = {template};
     size_t filepaths_len = 1;
-    exec_init(filepaths, filepaths_len, false);
-    FILE *file = current_file();
-    cr_expect(!feof(file));
-    cr_expect_eq(file, current_file());
-    while (fgetc(file) != EOF)
-        ;
-    cr_expect(feof(file));
-    cr_expect_null(current_file());
+    input_init(&context, filepaths, filepaths_len);
+    size_t len;
+    char  *line = input_next_line(&context, &len);
+    cr_expect_eq(len, 7);
+    cr_expect(strncmp(line, "bonjour", len) == 0);
+    cr_expect(input_line_terminated(&context));
+    cr_expect(!input_file_end(&context));
+    line = input_next_line(&context, &len);
+    cr_expect_eq(len, 7);
+    cr_expect(strncmp(line, "je suis", len) == 0);
+    cr_expect(!input_line_terminated(&context));
+    cr_expect(input_file_end(&context));
+    cr_expect_null(input_next_line(&context, &len));
 }
 
-Test(current_file, two_file)
+Test(input_next_line, two_files_and_missing_one)
 {
     char  template1[] = "/tmp/sed_testXXXXXX";
     FILE *t1 = fdopen(mkstemp(template1), "w");
     assert(t1 != NULL);
-    fputs("bonjour", t1);
+    fputs("bonjour\n", t1);
     fclose(t1);
 
     char  template2[] = "/tmp/sed_testXXXXXX";
     FILE *t2 = fdopen(mkstemp(template2), "w");
     assert(t2 != NULL);
-    fputs("bonjour", t2);
+    fputs("charles\n", t2);
     fclose(t2);
 
-    char  *filepaths[] = {template1, template2};
-    size_t filepaths_len = 2;
-    exec_init(filepaths, filepaths_len, false);
+    char  *filepaths[] = {template1, "/tmp/sed_test_does_not_exist", template2};
+    size_t filepaths_len = 3;
+    input_init(&context, filepaths, filepaths_len);
+    size_t files_opened = context.stats.files_opened;
+    size_t len;
+    char  *line = input_next_line(&context, &len);
+    cr_expect(strncmp(line, "bonjour", len) == 0);
+    cr_expect(input_file_end(&context));
+    line = input_next_line(&context, &len);
+    cr_expect(strncmp(line, "charles", len) == 0);
+    cr_expect(input_file_end(&context));
+    cr_expect_null(input_next_line(&context, &len));
+    cr_expect_eq(context.stats.files_opened - files_opened, 2);
+}
 
-    FILE *file = current_file();
-    cr_expect(!feof(file));
-    cr_expect_eq(file, current_file());
-    while (fgetc(file) != EOF)
-        ;
-    cr_expect(feof(file));
+Test(input_next_line, longer_than_buffer)
+{
+    char template[] = "/tmp/sed_testXXXXXX";
+    FILE *t = fdopen(mkstemp(template), "w");
+    assert(t != NULL);
+    for (size_t i = 0; i < 200000; i++)
+        fputc('a' + i % 26, t);
+    fputs("\nb\n", t);
+    fclose(t);
+    char  *filepaths[] = {template};
+    size_t filepaths_len = 1;
+    input_init(&context, filepaths, filepaths_len);
+    size_t len;
+    char  *line = input_next_line(&context, &len);
+    cr_expect_eq(len, 200000);
+    cr_expect_eq(line[199999], 'a' + 199999 % 26);
+    line = input_next_line(&context, &len);
+    cr_expect(strncmp(line, "b", len) == 0);
+}
+
+// The file is bigger than what's read ahead, the output than what's written
+// behind. It's the regular path if io_uring isn't available.
+Test(input_next_line, io_uring)
+{
+    char  template[] = "/tmp/sed_testXXXXXX";
+    FILE *t = fdopen(mkstemp(template), "w");
+    assert(t != NULL);
+    for (size_t i = 0; i < 100000; i++)
+        fprintf(t, "line %zu\n", i);
+    fclose(t);
+    char  output_template[] = "/tmp/sed_testXXXXXX";
+    int   output_fd = mkstemp(output_template);
+    char *filepaths[] = {template};
+    struct context uring_context = CONTEXT_INIT;
+    uring_context.io_uring = true;
+    uring_context.output.fd = output_fd;
+    input_init(&uring_context, filepaths, 1);
+    size_t len;
+    size_t lines = 0;
+    for (char *line; (line = input_next_line(&uring_context, &len)) != NULL; lines++)
+    {
+        char expected[32];
+        snprintf(expected, sizeof(expected), "line %zu", lines);
+        cr_assert(len == strlen(expected) && memcmp(line, expected, len) == 0);
+        output_write(&uring_context, line, len);
+        output_separator(&uring_context);
+    }
+    cr_expect_eq(lines, 100000);
+    context_free(&uring_context);
+    close(output_fd);
+    FILE *input = fopen(template, "r");
+    FILE *output = fopen(output_template, "r");
+    int   c;
+    while ((c = fgetc(input)) != EOF)
+        cr_assert_eq(fgetc(output), c);
+    cr_expect_eq(fgetc(output), EOF);
+    fclose(input);
+    fclose(output);
+    remove(template);
+    remove(output_template);
+}
+
+#ifdef HAVE_ZLIB
+// Two gzip members, like `cat a.gz b.gz`, then a plain file
+Test(input_next_line, gzip)
+{
+    char template1[] = "/tmp/sed_testXXXXXX";
+    close(mkstemp(template1));
+    gzFile gz = gzopen(template1, "wb");
+    assert(gz != NULL);
+    gzputs(gz, "bonjour\nje ");
+    gzclose(gz);
+    gz = gzopen(template1, "ab");
+    assert(gz != NULL);
+    gzputs(gz, "suis\n");
+    gzclose(gz);
 
-    file = current_file();
-    cr_expect_not_null(file);
-    cr_expect(!feof(file));
-    cr_expect_eq(file, current_file());
-    while (fgetc(file) != EOF)
-        ;
-    cr_expect(feof(file));
+    char  template2[] = "/tmp/sed_testXXXXXX";
+    FILE *t2 = fdopen(mkstemp(template2), "w");
+    assert(t2 != NULL);
+    fputs("charles\n", t2);
+    fclose(t2);
 
-    cr_expect_null(current_file());
+    char *filepaths[] = {template1, template2};
+    input_init(&context, filepaths, 2);
+    size_t len;
+    char  *line = input_next_line(&context, &len);
+    cr_expect(len == 7 && strncmp(line, "bonjour", len) == 0);
+    line = input_next_line(&context, &len);
+    cr_expect(len == 7 && strncmp(line, "je suis", len) == 0);
+    cr_expect(input_file_end(&context));
+    line = input_next_line(&context, &len);
+    cr_expect(len == 7 && strncmp(line, "charles", len) == 0);
+    cr_expect_null(input_next_line(&context, &len));
+    remove(template1);
+    remove(template2);
+}
+#endif
+
+// The output is flushed before waiting for the next line of a pipe, the writer only
+// sends it once it saw the output
+Test(input_next_line, flush_before_blocking)
+{
+    int input_pipe[2];
+    int output_pipe[2];
+    cr_assert(pipe(input_pipe) == 0 && pipe(output_pipe) == 0);
+    pid_t pid = fork();
+    cr_assert(pid != -1);
+    if (pid == 0)
+    {
+        struct pollfd pollfd = {.fd = output_pipe[0], .events = POLLIN};
+        bool          flushed = poll(&pollfd, 1, 2000) == 1;
+        const char   *line = flushed ? "flushed\n" : "late\n";
+        _exit(write(input_pipe[1], line, strlen(line)) == -1);
+    }
+    context.input.stdin_fd = input_pipe[0];
+    context.output.fd = output_pipe[1];
+    input_init(&context, NULL, 0);
+    output_write(&context, "a\n", 2);
+    size_t len;
+    char  *line = input_next_line(&context, &len);
+    cr_expect(len == 7 && strncmp(line, "flushed", len) == 0);
+    cr_expect_eq(context.output.len, 0);
+    waitpid(pid, NULL, 0);
+    context.input.stdin_fd = STDIN_FILENO;
+    context.output.fd = STDOUT_FILENO;
+    input_init(&context, NULL, 0);
+    close(input_pipe[0]);
+    close(input_pipe[1]);
+    close(output_pipe[0]);
+    close(output_pipe[1]);
+}
+
+// A line shorter than a magic number is read without waiting for more of the pipe,
+// the writer only goes on once the line was read
+Test(input_next_line, short_first_line)
+{
+    int input_pipe[2];
+    int read_pipe[2];
+    cr_assert(pipe(input_pipe) == 0 && pipe(read_pipe) == 0);
+    pid_t pid = fork();
+    cr_assert(pid != -1);
+    if (pid == 0)
+    {
+        struct pollfd pollfd = {.fd = read_pipe[0], .events = POLLIN};
+        if (write(input_pipe[1], "a\n", 2) != 2)
+            _exit(1);
+        bool read = poll(&pollfd, 1, 2000) == 1;
+        if (!read && write(input_pipe[1], "late\n", 5) != 5)
+            _exit(1);
+        _exit(!read);
+    }
+    context.input.stdin_fd = input_pipe[0];
+    input_init(&context, NULL, 0);
+    size_t len;
+    char  *line = input_next_line(&context, &len);
+    cr_expect(len == 1 && line[0] == 'a');
+    cr_assert(write(read_pipe[1], "", 1) == 1);
+    int status;
+    waitpid(pid, &status, 0);
+    cr_expect(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    context.input.stdin_fd = STDIN_FILENO;
+    input_init(&context, NULL, 0);
+    close(input_pipe[0]);
+    close(input_pipe[1]);
+    close(read_pipe[0]);
+    close(read_pipe[1]);
+}
+
+Test(input_next_window, split_line)
+{
+    char template[] = "/tmp/sed_testXXXXXX";
+    FILE *t = fdopen(mkstemp(template), "w");
+    assert(t != NULL);
+    fputs("abcdefghij\nab\nabcdef", t);
+    fclose(t);
+    char  *filepaths[] = {template};
+    size_t filepaths_len = 1;
+    input_init(&context, filepaths, filepaths_len);
+    size_t len;
+    bool   line_end;
+    char  *window = input_next_window(&context, &len, 4, &line_end);
+    cr_expect(strncmp(window, "abcd", len) == 0 && !line_end);
+    window = input_next_window(&context, &len, 4, &line_end);
+    cr_expect(strncmp(window, "efgh", len) == 0 && !line_end);
+    window = input_next_window(&context, &len, 4, &line_end);
+    cr_expect(len == 2 && strncmp(window, "ij", len) == 0 && line_end);
+    window = input_next_window(&context, &len, 4, &line_end);
+    cr_expect(len == 2 && strncmp(window, "ab", len) == 0 && line_end);
+    window = input_next_window(&context, &len, 4, &line_end);
+    cr_expect(strncmp(window, "abcd", len) == 0 && !line_end);
+    window = input_next_window(&context, &len, 4, &line_end);
+    cr_expect(strncmp(window, "ef", len) == 0 && line_end);
+    cr_expect_null(input_next_window(&context, &len, 4, &line_end));
+}
+
+Test(input_next_line, multi_byte_separator)
+{
+    char template[] = "/tmp/sed_testXXXXXX";
+    FILE *t = fdopen(mkstemp(template), "w");
+    assert(t != NULL);
+    fputs("a\rb\r\nc\n\r\nd", t);
+    fclose(t);
+    char  *filepaths[] = {template};
+    size_t filepaths_len = 1;
+    input_set_separator(&context, "\r\n", 2);
+    input_init(&context, filepaths, filepaths_len);
+    size_t len;
+    char  *line = input_next_line(&context, &len);
+    cr_expect(len == 3 && strncmp(line, "a\rb", len) == 0);
+    line = input_next_line(&context, &len);
+    cr_expect(len == 2 && strncmp(line, "c\n", len) == 0);
+    cr_expect(input_line_terminated(&context));
+    line = input_next_line(&context, &len);
+    cr_expect(len == 1 && strncmp(line, "d", len) == 0);
+    cr_expect(!input_line_terminated(&context));
+    cr_expect_null(input_next_line(&context, &len));
+    input_set_separator(&context, "\n", 1);
 }
 
 Test(next_line, one_file_three_lines)
@@ -533,18 +912,18 @@ Test(next_line, one_file_three_lines)
     fclose(t);
     char  *filepaths[] = {template};
     size_t filepaths_len = 1;
-    exec_init(filepaths, filepaths_len, false);
+    exec_init(&context, filepaths, filepaths_len, false);
     char *line;
-    line = next_line();
-    cr_expect_str_eq(line, "a\n");
-    cr_expect(!_debug_exec_last_line());
-    line = next_line();
-    cr_expect_str_eq(line, "b\n");
-    line = next_line();
-    cr_expect_str_eq(line, "c\n");
-    line = next_line();
+    line = next_line(&context);
+    cr_expect_str_eq(line, "a");
+    cr_expect(!_debug_exec_last_line(&context));
+    line = next_line(&context);
+    cr_expect_str_eq(line, "b");
+    line = next_line(&context);
+    cr_expect_str_eq(line, "c");
+    line = next_line(&context);
     cr_expect_null(line);
-    cr_expect(_debug_exec_last_line());
+    cr_expect(_debug_exec_last_line(&context));
 }
 
 Test(next_line, two_files_four_lines)
@@ -562,22 +941,23 @@ Test(next_line, two_files_four_lines)
 
     char  *filepaths[] = {template1, template2};
     size_t filepaths_len = 2;
-    exec_init(filepaths, filepaths_len, false);
+    exec_init(&context, filepaths, filepaths_len, false);
     char *line;
-    line = next_line();
-    cr_expect_str_eq(line, "a\n");
-    cr_expect(!_debug_exec_last_line());
-    line = next_line();
-    cr_expect_str_eq(line, "b\n");
-    cr_expect(_debug_exec_last_line());
-    line = next_line();
-    cr_expect(!_debug_exec_last_line());
-    cr_expect_str_eq(line, "c\n");
-    line = next_line();
-    cr_expect_str_eq(line, "d\n");
-    line = next_line();
+    line = next_line(&context);
+    cr_expect_str_eq(line, "a");
+    cr_expect(!_debug_exec_last_line(&context));
+    line = next_line(&context);
+    cr_expect_str_eq(line, "b");
+    // `$` is the last line of the last file
+    cr_expect(!_debug_exec_last_line(&context));
+    line = next_line(&context);
+    cr_expect_str_eq(line, "c");
+    line = next_line(&context);
+    cr_expect_str_eq(line, "d");
+    cr_expect(_debug_exec_last_line(&context));
+    line = next_line(&context);
     cr_expect_null(line);
-    cr_expect(_debug_exec_last_line());
+    cr_expect(_debug_exec_last_line(&context));
 }
 
 Test(exec_command, next_no_auto_print)
@@ -589,17 +969,45 @@ Test(exec_command, next_no_auto_print)
     fclose(t);
     char  *filepaths[] = {template};
     size_t filepaths_len = 1;
-    exec_init(filepaths, filepaths_len, false);
+    exec_init(&context, filepaths, filepaths_len, false);
 
     command.id = 'n';
-    exec_command(&command);
-    cr_expect_str_eq(_debug_exec_pattern_space(), "a\n");
-    exec_command(&command);
-    cr_expect_str_eq(_debug_exec_pattern_space(), "b\n");
-    exec_command(&command);
-    cr_expect_str_eq(_debug_exec_pattern_space(), "c\n");
-    exec_command(&command);
-    cr_expect_str_eq(_debug_exec_pattern_space(), "d\n");
+    exec_command(&context, &command);
+    cr_expect_str_eq(_debug_exec_pattern_space(&context), "a");
+    exec_command(&context, &command);
+    cr_expect_str_eq(_debug_exec_pattern_space(&context), "b");
+    exec_command(&context, &command);
+    cr_expect_str_eq(_debug_exec_pattern_space(&context), "c");
+    exec_command(&context, &command);
+    cr_expect_str_eq(_debug_exec_pattern_space(&context), "d");
+}
+
+Test(exec_command, next_append_delete_newline_window)
+{
+    char template[] = "/tmp/sed_testXXXXXX";
+    FILE *t = fdopen(mkstemp(template), "w");
+    assert(t != NULL);
+    for (int i = 0; i < 1000; i++)
+        fprintf(t, "%d\n", i);
+    fclose(t);
+    char  *filepaths[] = {template};
+    size_t filepaths_len = 1;
+    exec_init(&context, filepaths, filepaths_len, false);
+
+    _debug_exec_set_pattern_space(&context, "start");
+    command.id = 'N';
+    exec_command(&context, &command);
+    char expected[32];
+    // the window slides through the buffer, which is compacted now and then
+    for (int i = 0; i < 999; i++)
+    {
+        command.id = 'N';
+        exec_command(&context, &command);
+        command.id = 'D';
+        exec_command(&context, &command);
+        sprintf(expected, "%d\n%d", i, i + 1);
+        cr_assert_str_eq(_debug_exec_pattern_space(&context), expected);
+    }
 }
 
 Test(exec_command, next_auto_print)
@@ -611,35 +1019,29 @@ Test(exec_command, next_auto_print)
     fclose(t);
     char  *filepaths[] = {template};
     size_t filepaths_len = 1;
-    exec_init(filepaths, filepaths_len, true);
+    exec_init(&context, filepaths, filepaths_len, true);
 
     cr_redirect_stdout();
-    _debug_exec_set_pattern_space("bonjour\n");
+    _debug_exec_set_pattern_space(&context, "bonjour");
     command.id = 'n';
-    exec_command(&command);
-    cr_expect_str_eq(_debug_exec_pattern_space(), "a\n");
-    exec_command(&command);
-    cr_expect_str_eq(_debug_exec_pattern_space(), "b\n");
-    exec_command(&command);
-    cr_expect_str_eq(_debug_exec_pattern_space(), "c\n");
-    exec_command(&command);
-    cr_expect_str_eq(_debug_exec_pattern_space(), "d\n");
-    fflush(stdout);
+    exec_command(&context, &command);
+    cr_expect_str_eq(_debug_exec_pattern_space(&context), "a");
+    exec_command(&context, &command);
+    cr_expect_str_eq(_debug_exec_pattern_space(&context), "b");
+    exec_command(&context, &command);
+    cr_expect_str_eq(_debug_exec_pattern_space(&context), "c");
+    exec_command(&context, &command);
+    cr_expect_str_eq(_debug_exec_pattern_space(&context), "d");
+    output_flush(&context);
     cr_expect_stdout_eq_str("bonjour\na\nb\nc\n");
 }
 
 Test(exec_command, comment)
 {
     command.id = '#';
-    exec_command(&command);
+    exec_command(&context, &command);
 }
 
-Test(exec_command, quit)
-{
-    command.id = 'q';
-    exec_command(&command);
-    cr_expect(false);  // should never get executed
-}
 
 Test(exec_command, print_line_number)
 {
@@ -650,28 +1052,28 @@ Test(exec_command, print_line_number)
     fclose(t);
     char  *filepaths[] = {template};
     size_t filepaths_len = 1;
-    exec_init(filepaths, filepaths_len, false);
+    exec_init(&context, filepaths, filepaths_len, false);
 
     cr_redirect_stdout();
     command.id = '=';
-    next_line();
-    exec_command(&command);
-    next_line();
-    exec_command(&command);
-    next_line();
-    exec_command(&command);
-    next_line();
-    exec_command(&command);
-    fflush(stdout);
+    next_line(&context);
+    exec_command(&context, &command);
+    next_line(&context);
+    exec_command(&context, &command);
+    next_line(&context);
+    exec_command(&context, &command);
+    next_line(&context);
+    exec_command(&context, &command);
+    output_flush(&context);
     cr_expect_stdout_eq_str("1\n2\n3\n4\n");
 }
 
 static void
 exec_commands_setup()
 {
-    _debug_exec_set_pattern_space("foo");
-    _debug_exec_set_hold_space("bar");
-    _debug_exec_set_line_index(1);
+    _debug_exec_set_pattern_space(&context, "foo");
+    _debug_exec_set_hold_space(&context, "bar");
+    _debug_exec_set_line_index(&context, 1);
 }
 
 Test(exec_commands, addresses_count_0, .init = exec_commands_setup)
@@ -681,30 +1083,30 @@ Test(exec_commands, addresses_count_0, .init = exec_commands_setup)
         {.id = 'G', .addresses = {.count = 0}},
         {.id = COMMAND_LAST},
     };
-    exec_commands(commands);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "foo\nbar\nbar");
+    exec_commands(&context, commands);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "foo\nbar\nbar");
 }
 
 Test(exec_commands, addresses_last_line_true, .init = exec_commands_setup)
 {
-    _debug_exec_set_last_line(true);
+    _debug_exec_set_last_line(&context, true);
     struct command commands[] = {
         {.id = 'G', .addresses = {.count = 1, .addresses = {{ADDRESS_LAST}}}},
         {.id = COMMAND_LAST},
     };
-    exec_commands(commands);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "foo\nbar");
+    exec_commands(&context, commands);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "foo\nbar");
 }
 
 Test(exec_commands, addresses_last_line_false, .init = exec_commands_setup)
 {
-    _debug_exec_set_last_line(false);
+    _debug_exec_set_last_line(&context, false);
     struct command commands[] = {
         {.id = 'G', .addresses = {.count = 1, .addresses = {{ADDRESS_LAST}}}},
         {.id = COMMAND_LAST},
     };
-    exec_commands(commands);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "foo");
+    exec_commands(&context, commands);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "foo");
 }
 
 Test(exec_commands, addresses_line_count_1_all_match, .init = exec_commands_setup)
@@ -716,8 +1118,8 @@ Test(exec_commands, addresses_line_count_1_all_match, .init = exec_commands_setu
          .addresses = {.count = 1, .addresses = {{ADDRESS_LINE, {.line = 1}}}}},
         {.id = COMMAND_LAST},
     };
-    exec_commands(commands);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "foo\nbar\nbar");
+    exec_commands(&context, commands);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "foo\nbar\nbar");
 }
 
 Test(exec_commands, addresses_line_count_1_none_match, .init = exec_commands_setup)
@@ -729,8 +1131,8 @@ Test(exec_commands, addresses_line_count_1_none_match, .init = exec_commands_set
          .addresses = {.count = 1, .addresses = {{ADDRESS_LINE, {.line = 3}}}}},
         {.id = COMMAND_LAST},
     };
-    exec_commands(commands);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "foo");
+    exec_commands(&context, commands);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "foo");
 }
 
 Test(exec_commands, addresses_line_count_1_some_match, .init = exec_commands_setup)
@@ -742,8 +1144,8 @@ Test(exec_commands, addresses_line_count_1_some_match, .init = exec_commands_set
          .addresses = {.count = 1, .addresses = {{ADDRESS_LINE, {.line = 1}}}}},
         {.id = COMMAND_LAST},
     };
-    exec_commands(commands);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "foo\nbar");
+    exec_commands(&context, commands);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "foo\nbar");
 }
 
 Test(exec_commands, addresses_regex_count_1_some_match, .init = exec_commands_setup)
@@ -753,10 +1155,10 @@ Test(exec_commands, addresses_regex_count_1_some_match, .init = exec_commands_se
         {.id = 'G', .addresses = {.count = 1, .addresses = {{ADDRESS_RE}}}},
         {.id = COMMAND_LAST},
     };
-    assert(regcomp(&commands[0].addresses.addresses[0].data.preg, "abc*", 0) == 0);
-    assert(regcomp(&commands[1].addresses.addresses[0].data.preg, "fo*", 0) == 0);
-    exec_commands(commands);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "foo\nbar");
+    commands[0].addresses.addresses[0].data.regex = regex_compile("abc*", 0);
+    commands[1].addresses.addresses[0].data.regex = regex_compile("fo*", 0);
+    exec_commands(&context, commands);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "foo\nbar");
 }
 
 Test(exec_commands, addresses_line_range, .init = exec_commands_setup)  // 2,5 p
@@ -764,18 +1166,17 @@ Test(exec_commands, addresses_line_range, .init = exec_commands_setup)  // 2,5 p
     struct command commands[] = {
         {'G',
          .addresses = {2,
-                       {{ADDRESS_LINE, {.line = 2}}, {ADDRESS_LINE, {.line = 3}}},
-                       .in_range = false}},
+                       {{ADDRESS_LINE, {.line = 2}}, {ADDRESS_LINE, {.line = 3}}}}},
         {COMMAND_LAST},
     };
-    exec_commands(commands);  // nothing happens
-    _debug_exec_set_line_index(2);
-    exec_commands(commands);  // executed
-    _debug_exec_set_line_index(3);
-    exec_commands(commands);  // executed
-    _debug_exec_set_line_index(4);
-    exec_commands(commands);  // nothing happens
-    cr_assert_str_eq(_debug_exec_pattern_space(), "foo\nbar\nbar");
+    exec_commands(&context, commands);  // nothing happens
+    _debug_exec_set_line_index(&context, 2);
+    exec_commands(&context, commands);  // executed
+    _debug_exec_set_line_index(&context, 3);
+    exec_commands(&context, commands);  // executed
+    _debug_exec_set_line_index(&context, 4);
+    exec_commands(&context, commands);  // nothing happens
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "foo\nbar\nbar");
 }
 
 Test(exec_commands, addresses_line_last_range, .init = exec_commands_setup)  // 3,$ p
@@ -783,19 +1184,18 @@ Test(exec_commands, addresses_line_last_range, .init = exec_commands_setup)  //
     struct command commands[] = {
         {'G',
          .addresses = {2,
-                       {{ADDRESS_LINE, {.line = 2}}, {ADDRESS_LAST}},
-                       .in_range = false}},
+                       {{ADDRESS_LINE, {.line = 2}}, {ADDRESS_LAST}}}},
         {COMMAND_LAST},
     };
-    exec_commands(commands);  // nothing happens
-    _debug_exec_set_line_index(2);
-    exec_commands(commands);  // executed
-    _debug_exec_set_line_index(3);
-    _debug_exec_set_last_line(true);
-    exec_commands(commands);  // executed
-    _debug_exec_set_line_index(4);
-    exec_commands(commands);  // nothing happens
-    cr_assert_str_eq(_debug_exec_pattern_space(), "foo\nbar\nbar");
+    exec_commands(&context, commands);  // nothing happens
+    _debug_exec_set_line_index(&context, 2);
+    exec_commands(&context, commands);  // executed
+    _debug_exec_set_line_index(&context, 3);
+    _debug_exec_set_last_line(&context, true);
+    exec_commands(&context, commands);  // executed
+    _debug_exec_set_line_index(&context, 4);
+    exec_commands(&context, commands);  // nothing happens
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "foo\nbar\nbar");
 }
 
 Test(exec_commands,
@@ -805,16 +1205,15 @@ Test(exec_commands,
     struct command commands[] = {
         {'G',
          .addresses = {2,
-                       {{ADDRESS_LINE, {.line = 2}}, {ADDRESS_LINE, {.line = 1}}},
-                       .in_range = false}},
+                       {{ADDRESS_LINE, {.line = 2}}, {ADDRESS_LINE, {.line = 1}}}}},
         {COMMAND_LAST},
     };
-    exec_commands(commands);  // nothing happens
-    _debug_exec_set_line_index(2);
-    exec_commands(commands);  // executed
-    _debug_exec_set_line_index(3);
-    exec_commands(commands);  // nothing happens
-    cr_assert_str_eq(_debug_exec_pattern_space(), "foo\nbar");
+    exec_commands(&context, commands);  // nothing happens
+    _debug_exec_set_line_index(&context, 2);
+    exec_commands(&context, commands);  // executed
+    _debug_exec_set_line_index(&context, 3);
+    exec_commands(&context, commands);  // nothing happens
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "foo\nbar");
 }
 
 Test(exec_commands,
@@ -824,42 +1223,41 @@ Test(exec_commands,
     struct command commands[] = {
         {'G',
          .addresses = {2,
-                       {{ADDRESS_LAST}, {ADDRESS_LINE, {.line = 2}}},
-                       .in_range = false}},
+                       {{ADDRESS_LAST}, {ADDRESS_LINE, {.line = 2}}}}},
         {COMMAND_LAST},
     };
-    exec_commands(commands);  // nothing happens
-    _debug_exec_set_line_index(2);
-    exec_commands(commands);  // nothing happens
-    _debug_exec_set_line_index(3);
-    _debug_exec_set_last_line(true);
-    exec_commands(commands);  // executed
-    _debug_exec_set_line_index(1);
-    _debug_exec_set_last_line(false);
-    exec_commands(commands);  // nothing happens
-    cr_assert_str_eq(_debug_exec_pattern_space(), "foo\nbar");
+    exec_commands(&context, commands);  // nothing happens
+    _debug_exec_set_line_index(&context, 2);
+    exec_commands(&context, commands);  // nothing happens
+    _debug_exec_set_line_index(&context, 3);
+    _debug_exec_set_last_line(&context, true);
+    exec_commands(&context, commands);  // executed
+    _debug_exec_set_line_index(&context, 1);
+    _debug_exec_set_last_line(&context, false);
+    exec_commands(&context, commands);  // nothing happens
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "foo\nbar");
 }
 
 Test(exec_commands, addresses_regex_range)  // /foo/,/bar/ p
 {
     struct command commands[] = {
-        {'H', .addresses = {2, {{ADDRESS_RE}, {ADDRESS_RE}}, .in_range = false}},
+        {'H', .addresses = {2, {{ADDRESS_RE}, {ADDRESS_RE}}}},
         {.id = COMMAND_LAST},
     };
-    _debug_exec_set_hold_space("");
-    assert(regcomp(&commands[0].addresses.addresses[0].data.preg, "#fo*", 0) == 0);
-    assert(regcomp(&commands[0].addresses.addresses[1].data.preg, "#ba*", 0) == 0);
-    _debug_exec_set_pattern_space("asdfasdf");
-    exec_commands(commands);  // nothing happens
-    _debug_exec_set_pattern_space("#foo");
-    exec_commands(commands);  // executed
-    _debug_exec_set_pattern_space("HELLO");
-    exec_commands(commands);  // executed
-    _debug_exec_set_pattern_space("#bar");
-    exec_commands(commands);  // executed
-    _debug_exec_set_pattern_space("asdfasdf");
-    exec_commands(commands);  // nothing happens
-    cr_expect_str_eq(_debug_exec_hold_space(), "\n#foo\nHELLO\n#bar");
+    _debug_exec_set_hold_space(&context, "");
+    commands[0].addresses.addresses[0].data.regex = regex_compile("#fo*", 0);
+    commands[0].addresses.addresses[1].data.regex = regex_compile("#ba*", 0);
+    _debug_exec_set_pattern_space(&context, "asdfasdf");
+    exec_commands(&context, commands);  // nothing happens
+    _debug_exec_set_pattern_space(&context, "#foo");
+    exec_commands(&context, commands);  // executed
+    _debug_exec_set_pattern_space(&context, "HELLO");
+    exec_commands(&context, commands);  // executed
+    _debug_exec_set_pattern_space(&context, "#bar");
+    exec_commands(&context, commands);  // executed
+    _debug_exec_set_pattern_space(&context, "asdfasdf");
+    exec_commands(&context, commands);  // nothing happens
+    cr_expect_str_eq(_debug_exec_hold_space(&context), "\n#foo\nHELLO\n#bar");
 }
 
 Test(exec_commands, addresses_same_line_range)  // 1,/foo/ p where line 1 == foo
@@ -867,19 +1265,48 @@ Test(exec_commands, addresses_same_line_range)  // 1,/foo/ p where line 1 == foo
     struct command commands[] = {
         {'H',
          .addresses = {2,
-                       {{ADDRESS_LINE, {.line = 1}}, {ADDRESS_RE}},
-                       .in_range = false}},
+                       {{ADDRESS_LINE, {.line = 1}}, {ADDRESS_RE}}}},
+        {.id = COMMAND_LAST},
+    };
+    _debug_exec_set_hold_space(&context, "");
+    commands[0].addresses.addresses[1].data.regex = regex_compile("#fo*", 0);
+    _debug_exec_set_line_index(&context, 1);
+    _debug_exec_set_pattern_space(&context, "#foo");
+    exec_commands(&context, commands);  // executed
+    _debug_exec_set_line_index(&context, 2);
+    _debug_exec_set_pattern_space(&context, "asdf");
+    exec_commands(&context, commands);  // nothing happens
+    cr_expect_str_eq(_debug_exec_hold_space(&context), "\n#foo");
+}
+
+// `d` ends the cycle, the next commands aren't run
+Test(exec_commands, delete_ends_cycle, .init = exec_commands_setup)
+{
+    struct command commands[] = {
+        {.id = 'd', .addresses = {.count = 0}},
+        {.id = 'G', .addresses = {.count = 0}},
         {.id = COMMAND_LAST},
     };
-    _debug_exec_set_hold_space("");
-    assert(regcomp(&commands[0].addresses.addresses[1].data.preg, "#fo*", 0) == 0);
-    _debug_exec_set_line_index(1);
-    _debug_exec_set_pattern_space("#foo");
-    exec_commands(commands);  // executed
-    _debug_exec_set_line_index(2);
-    _debug_exec_set_pattern_space("asdf");
-    exec_commands(commands);  // nothing happens
-    cr_expect_str_eq(_debug_exec_hold_space(), "\n#foo");
+    exec_commands(&context, commands);
+    cr_assert_str_empty(_debug_exec_pattern_space(&context));
+    exec_end_cycle(&context);
+}
+
+// The line of the first address never reached the command (e.g. `2d;2,3G`), the
+// range starts at the next line which does, only once
+Test(exec_commands, addresses_line_range_skipped_start, .init = exec_commands_setup)
+{
+    struct command commands[] = {
+        {'G',
+         .addresses = {2, {{ADDRESS_LINE, {.line = 2}}, {ADDRESS_LINE, {.line = 3}}}}},
+        {COMMAND_LAST},
+    };
+    _debug_exec_set_line_index(&context, 3);
+    exec_commands(&context, commands);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "foo\nbar");
+    _debug_exec_set_line_index(&context, 5);
+    exec_commands(&context, commands);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "foo\nbar");
 }
 
 Test(exec_commands, inverse_address_1, .init = exec_commands_setup)
@@ -893,8 +1320,8 @@ Test(exec_commands, inverse_address_1, .init = exec_commands_setup)
          .addresses = {.count = 1, .addresses = {{ADDRESS_LINE, {.line = 3}}}}},
         {.id = COMMAND_LAST},
     };
-    exec_commands(commands);
-    cr_assert_str_eq(_debug_exec_pattern_space(), "foo\nbar\nbar");
+    exec_commands(&context, commands);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "foo\nbar\nbar");
 }
 
 Test(exec_commands, inverse_addresses_line_range, .init = exec_commands_setup)  // 2,5 p
@@ -902,14 +1329,225 @@ Test(exec_commands, inverse_addresses_line_range, .init = exec_commands_setup)
     struct command commands[] = {
         {'G', .inverse = true,
          .addresses = {2,
-                       {{ADDRESS_LINE, {.line = 2}}, {ADDRESS_LINE, {.line = 3}}},
-                       .in_range = false}},
+                       {{ADDRESS_LINE, {.line = 2}}, {ADDRESS_LINE, {.line = 3}}}}},
         {COMMAND_LAST},
     };
-    exec_commands(commands);  // executed
-    _debug_exec_set_line_index(2);
-    exec_commands(commands);  // nothing happens
-    _debug_exec_set_line_index(3);
-    exec_commands(commands);  // nothing happens
-    cr_assert_str_eq(_debug_exec_pattern_space(), "foo\nbar");
+    exec_commands(&context, commands);  // executed
+    _debug_exec_set_line_index(&context, 2);
+    exec_commands(&context, commands);  // nothing happens
+    _debug_exec_set_line_index(&context, 3);
+    exec_commands(&context, commands);  // nothing happens
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "foo\nbar");
+}
+
+Test(exec_commands, profile, .init = exec_commands_setup)
+{
+    struct command commands[] = {
+        {.id = 'G', .addresses = {.count = 0}},
+        {.id = 'G', .inverse = true,
+         .addresses = {.count = 1, .addresses = {{ADDRESS_LINE, {.line = 1}}}}},
+        {.id = 'G',
+         .addresses = {.count = 1, .addresses = {{ADDRESS_LINE, {.line = 2}}}}},
+        {.id = COMMAND_LAST},
+    };
+    profile_init(commands, PROFILE_TEXT);
+    exec_commands(&context, commands);
+    _debug_exec_set_line_index(&context, 2);
+    exec_commands(&context, commands);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context),
+                     "foo\nbar\nbar\nbar\nbar");
+    cr_assert_eq(commands[0].profile->evaluations, 2);
+    cr_assert_eq(commands[0].profile->matches, 2);
+    cr_assert_eq(commands[0].profile->executions, 2);
+    cr_assert_eq(commands[1].profile->evaluations, 2);
+    cr_assert_eq(commands[1].profile->matches, 1);
+    cr_assert_eq(commands[1].profile->executions, 1);
+    cr_assert_eq(commands[2].profile->matches, 1);
+    cr_assert_eq(commands[2].profile->executions, 1);
+}
+
+Test(exec_commands, quit)
+{
+    // `q` ends the cycle and the commands after it aren't run
+    exec_init(&context, NULL, 0, true);
+    _debug_exec_set_pattern_space(&context, "foo");
+    struct command commands[] = {
+        {.id = 'q', .addresses = {.count = 0}},
+        {.id = 'G', .addresses = {.count = 0}},
+        {.id = COMMAND_LAST},
+    };
+    cr_redirect_stdout();
+    exec_commands(&context, commands);
+    output_flush(&context);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "foo");
+    cr_expect_stdout_eq_str("foo\n");
+}
+
+Test(exec_commands, regex_memo_invalidated, .init = exec_commands_setup)
+{
+    // /o/ is matched, then no longer matches once `s` and `y` changed the
+    // pattern space
+    char            script[] = "/o/s//0/g\n/o/G\n/0/y/0/o/\n/o/G";
+    struct command *commands = parse(script);
+    exec_commands(&context, commands);
+    cr_assert_str_eq(_debug_exec_pattern_space(&context), "foo\nbar");
+    script_free();
+}
+
+// The input is bigger than the ring between the reader and the executor, the
+// output than the one to the writer
+Test(exec, pipeline)
+{
+    char  template[] = "/tmp/sed_testXXXXXX";
+    FILE *t = fdopen(mkstemp(template), "w");
+    assert(t != NULL);
+    for (size_t i = 0; i < 200000; i++)
+        fprintf(t, "line %zu\n", i);
+    fclose(t);
+    char           output_template[] = "/tmp/sed_testXXXXXX";
+    int            output_fd = mkstemp(output_template);
+    char          *filepaths[] = {template, "/tmp/sed_test_does_not_exist", template};
+    char           script[] = "s/line/LINE/;$=";
+    struct context pipeline_context = CONTEXT_INIT;
+    pipeline_context.pipelined = true;
+    pipeline_context.output.fd = output_fd;
+    exec(&pipeline_context, parse(script), filepaths, 3, true);
+    cr_expect_null(pipeline_context.pipeline);
+    context_free(&pipeline_context);
+    script_free();
+    FILE *output = fdopen(output_fd, "r");
+    rewind(output);
+    char  *line = NULL;
+    size_t line_size = 0;
+    for (size_t i = 0; i < 399999; i++)
+    {
+        char expected[32];
+        snprintf(expected, sizeof(expected), "LINE %zu\n", i % 200000);
+        cr_assert(getline(&line, &line_size, output) != -1);
+        cr_assert_str_eq(line, expected);
+    }
+    cr_assert(getline(&line, &line_size, output) != -1);
+    cr_expect_str_eq(line, "400000\n");
+    cr_assert(getline(&line, &line_size, output) != -1);
+    cr_expect_str_eq(line, "LINE 199999\n");
+    cr_expect(getline(&line, &line_size, output) == -1);
+    free(line);
+    fclose(output);
+    remove(template);
+    remove(output_template);
+}
+
+// `r f; w f; r f` on two lines, f is reloaded by the second cycle while its
+// previous content is queued. It then needs more pages and is mapped elsewhere.
+Test(exec, read_file_rewritten)
+{
+    char  template[] = "/tmp/sed_testXXXXXX";
+    FILE *t = fdopen(mkstemp(template), "w");
+    assert(t != NULL);
+    // truncated before the first line is read
+    fputs("old\n", t);
+    fclose(t);
+    char  input_template[] = "/tmp/sed_testXXXXXX";
+    FILE *input = fdopen(mkstemp(input_template), "w");
+    assert(input != NULL);
+    char x[5001];
+    char y[5001];
+    memset(x, 'x', 5000);
+    memset(y, 'y', 5000);
+    x[5000] = '\0';
+    y[5000] = '\0';
+    fprintf(input, "%s\n%s\n", x, y);
+    fclose(input);
+    char           output_template[] = "/tmp/sed_testXXXXXX";
+    int            output_fd = mkstemp(output_template);
+    char          *filepaths[] = {input_template};
+    char           script[128];
+    struct context read_context = CONTEXT_INIT;
+    snprintf(script, sizeof(script), "r %s\nw %s\nr %s", template, template, template);
+    read_context.output.fd = output_fd;
+    exec(&read_context, parse(script), filepaths, 1, false);
+    context_free(&read_context);
+    script_free();
+    size_t expected_len = 4 * 5001;
+    char  *expected = xmalloc(expected_len);
+    char  *output = xmalloc(expected_len + 1);
+    snprintf(expected, expected_len, "%s\n%s\n%s\n", x, x, x);
+    memcpy(expected + 3 * 5001, y, 5000);
+    expected[expected_len - 1] = '\n';
+    cr_expect_eq(pread(output_fd, output, expected_len + 1, 0), expected_len);
+    cr_expect(memcmp(output, expected, expected_len) == 0);
+    free(expected);
+    free(output);
+    close(output_fd);
+    remove(template);
+    remove(input_template);
+    remove(output_template);
+}
+
+static const char *
+idiom_find(const char *script_string, bool auto_print)
+{
+    char       *script = xstrdup(script_string);
+    const char *name = _debug_idiom_find(&context, parse(script), auto_print);
+    free(script);
+    script_free();
+    return name;
+}
+
+Test(idiom, recognized)
+{
+    cr_assert_str_eq(idiom_find("$=", false), "count");
+    cr_assert_str_eq(idiom_find(" 1!G; h\n$ !d", true), "tac");
+    cr_assert_str_eq(idiom_find(":x;N;$!bx;s|\\n| |g", true), "join");
+    cr_assert_str_eq(idiom_find("$!N;/^\\(.*\\)\\n\\1$/!P;D", true), "uniq");
+    cr_assert_str_eq(idiom_find("s/^[[:blank:]]*//", true), "ltrim");
+    cr_assert_str_eq(idiom_find("s/^[ \t]*//", true), "ltrim");
+}
+
+Test(idiom, not_recognized)
+{
+    // the output would differ without auto print
+    cr_assert_null(idiom_find("$=", true));
+    cr_assert_null(idiom_find("1!G;h;$!d", false));
+    cr_assert_null(idiom_find("1!G;h;$d", true));
+    cr_assert_null(idiom_find(":x;N;$!by;s/\\n/ /g", true));
+    cr_assert_null(idiom_find("s/^[^ ]*//", true));
+    cr_assert_null(idiom_find("s/^[a-z]*//", true));
+}
+
+// Relative paths are opened from the directory of the context
+Test(exec, dir_fd)
+{
+    char dir[] = "/tmp/sed_testXXXXXX";
+    cr_assert_not_null(mkdtemp(dir));
+    char filepath[64];
+    snprintf(filepath, sizeof(filepath), "%s/in", dir);
+    FILE *input = fopen(filepath, "w");
+    cr_assert_not_null(input);
+    fputs("a\nb\n", input);
+    fclose(input);
+    char           output_template[] = "/tmp/sed_testXXXXXX";
+    int            output_fd = mkstemp(output_template);
+    char          *filepaths[] = {"in"};
+    struct context ctx = CONTEXT_INIT;
+    int            dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+    ctx.dir_fd = dir_fd;
+    ctx.output.fd = output_fd;
+    exec(&ctx, parse("w out\nr in"), filepaths, 1, true);
+    context_free(&ctx);
+    script_free();
+    char output[32] = {0};
+    cr_expect_eq(pread(output_fd, output, sizeof(output), 0), 12);
+    cr_expect_str_eq(output, "a\na\nb\nb\na\nb\n");
+    snprintf(filepath, sizeof(filepath), "%s/out", dir);
+    char *written = read_file(filepath);
+    cr_expect_str_eq(written, "a\nb\n");
+    free(written);
+    close(output_fd);
+    close(dir_fd);
+    remove(filepath);
+    snprintf(filepath, sizeof(filepath), "%s/in", dir);
+    remove(filepath);
+    remove(dir);
+    remove(output_template);
 }
@@ -0,0 +1,221 @@
+#include "sed.h"
+#include "libsed.h"
+#include <criterion/criterion.h>
+#include <pthread.h>
+
+#define RUNNERS 4
+#define RUNS 50
+
+struct runner
+{
+    struct sed *sed;
+    int         input_fd;
+    int         output_fd;
+};
+
+static int
+temp_file(const char *content)
+{
+    char template[] = "/tmp/sed_test_libsedXXXXXX";
+    int  fd = mkstemp(template);
+    cr_assert_neq(fd, -1);
+    unlink(template);
+    if (content != NULL)
+    {
+        cr_assert_eq(write(fd, content, strlen(content)), (ssize_t)strlen(content));
+        lseek(fd, 0, SEEK_SET);
+    }
+    return fd;
+}
+
+static char *
+temp_file_content(int fd)
+{
+    static char buf[4096];
+    ssize_t     len = pread(fd, buf, sizeof(buf) - 1, 0);
+    cr_assert_geq(len, 0);
+    buf[len] = '\0';
+    return buf;
+}
+
+static void *
+runner_run(void *arg)
+{
+    struct runner *runner = arg;
+    for (size_t i = 0; i < RUNS; i++)
+    {
+        lseek(runner->input_fd, 0, SEEK_SET);
+        ftruncate(runner->output_fd, 0);
+        lseek(runner->output_fd, 0, SEEK_SET);
+        sed_run(runner->sed, runner->input_fd, runner->output_fd);
+    }
+    return NULL;
+}
+
+Test(libsed, concurrent_contexts)
+{
+    // a range and the hold space, which are state of the context
+    struct sed_script *script = sed_compile("2,3s/a/b/g;H;$!d;x");
+    const char        *inputs[RUNNERS] = {"a\na\na\na\n", "aa\naa\n", "a\n", ""};
+    const char        *outputs[RUNNERS] = {
+        "\na\nb\nb\na\n", "\naa\nbb\n", "\na\n", ""};
+    struct runner runners[RUNNERS];
+    pthread_t     threads[RUNNERS];
+    for (size_t i = 0; i < RUNNERS; i++)
+    {
+        runners[i].sed = sed_new(script);
+        runners[i].input_fd = temp_file(inputs[i]);
+        runners[i].output_fd = temp_file(NULL);
+        cr_assert_eq(pthread_create(&threads[i], NULL, runner_run, &runners[i]), 0);
+    }
+    for (size_t i = 0; i < RUNNERS; i++)
+    {
+        pthread_join(threads[i], NULL);
+        cr_expect_str_eq(temp_file_content(runners[i].output_fd), outputs[i]);
+        close(runners[i].input_fd);
+        close(runners[i].output_fd);
+        sed_free(runners[i].sed);
+    }
+    sed_script_free(script);
+}
+
+Test(libsed, options)
+{
+    struct sed_script *script = sed_compile("$p");
+    struct sed        *sed = sed_new(script);
+    int                input_fd = temp_file("a;b;c;");
+    int                output_fd = temp_file(NULL);
+    sed_set_quiet(sed, true);
+    sed_set_separator(sed, ";", 1);
+    cr_expect_eq(sed_set_separator(sed, "", 0), -1);
+    cr_expect_str_eq(sed_error(), "invalid separator: empty");
+    cr_expect_eq(sed_run(sed, input_fd, output_fd), 0);
+    cr_expect_str_eq(temp_file_content(output_fd), "c;");
+    close(input_fd);
+    close(output_fd);
+    sed_free(sed);
+    sed_script_free(script);
+}
+
+struct collected
+{
+    char   buf[4096];
+    size_t len;
+};
+
+static void
+collect(void *data, const char *s, size_t len)
+{
+    struct collected *collected = data;
+    cr_assert_lt(collected->len + len, sizeof(collected->buf));
+    memcpy(collected->buf + collected->len, s, len);
+    collected->len += len;
+    collected->buf[collected->len] = '\0';
+}
+
+// Push input in chunks of chunk_len bytes, the output must be the same as a run
+// on a file
+static void
+push_expect_same(const char *text, const char *input, size_t chunk_len)
+{
+    struct sed_script *script = sed_compile(text);
+    struct sed        *sed = sed_new(script);
+    int                input_fd = temp_file(input);
+    int                output_fd = temp_file(NULL);
+    sed_run(sed, input_fd, output_fd);
+    struct collected collected = {.len = 0};
+    sed_start(sed, collect, &collected);
+    size_t len = strlen(input);
+    for (size_t i = 0; i < len; i += chunk_len)
+        sed_feed(sed, input + i, len - i < chunk_len ? len - i : chunk_len);
+    sed_finish(sed);
+    cr_expect_str_eq(collected.buf,
+                     temp_file_content(output_fd),
+                     "%s on chunks of %zu",
+                     text,
+                     chunk_len);
+    close(input_fd);
+    close(output_fd);
+    sed_free(sed);
+    sed_script_free(script);
+}
+
+Test(libsed, push_chunks)
+{
+    const char *scripts[] = {
+        "p", "$!N;P;D", "n;d", "$s/$/ end/", "2,3d", "N;N;s/\n/+/g", "3q", "$!d"};
+    const char *input = "one\ntwo\nthree\nfour\nfive";
+    for (size_t i = 0; i < sizeof(scripts) / sizeof(*scripts); i++)
+    {
+        for (size_t chunk_len = 1; chunk_len <= 7; chunk_len += 3)
+            push_expect_same(scripts[i], input, chunk_len);
+        push_expect_same(scripts[i], "one\ntwo\n", 1);
+    }
+}
+
+Test(libsed, push_latency)
+{
+    struct sed_script *script = sed_compile("N;s/\\n/-/");
+    struct sed        *sed = sed_new(script);
+    struct collected   collected = {.len = 0};
+    sed_start(sed, collect, &collected);
+    // a line is run as soon as the next one starts, `N` waits for the next line
+    cr_assert_eq(sed_feed(sed, "a\nb", 3), 1);
+    cr_expect_eq(collected.len, 0);
+    cr_assert_eq(sed_feed(sed, "\nc", 2), 1);
+    cr_expect_str_eq(collected.buf, "a-b\n");
+    sed_finish(sed);
+    cr_expect_str_eq(collected.buf, "a-b\n");
+    sed_free(sed);
+    sed_script_free(script);
+}
+
+Test(libsed, push_quit)
+{
+    struct sed_script *script = sed_compile("2q");
+    struct sed        *sed = sed_new(script);
+    struct collected   collected = {.len = 0};
+    sed_start(sed, collect, &collected);
+    cr_expect_eq(sed_feed(sed, "a\nb", 3), 1);
+    cr_expect_eq(sed_feed(sed, "\nc\n", 3), 0);
+    cr_expect_eq(sed_feed(sed, "d\n", 2), 0);
+    cr_expect_eq(sed_finish(sed), 0);
+    cr_expect_str_eq(collected.buf, "a\nb\n");
+    sed_free(sed);
+    sed_script_free(script);
+}
+
+// Errors are returned instead of exiting the process
+Test(libsed, errors)
+{
+    cr_expect_null(sed_compile("s/a/"));
+    cr_expect_str_eq(sed_error(), "unterminated 's' command");
+    // the shared parsing state was restored
+    struct sed_script *script = sed_compile("w /nonexistent/sed_test");
+    cr_assert_not_null(script);
+    struct sed *sed = sed_new(script);
+    int         input_fd = temp_file("a\n");
+    int         output_fd = temp_file(NULL);
+    cr_expect_eq(sed_run(sed, input_fd, output_fd), -1);
+    cr_expect_str_eq(sed_error(),
+                     "couldn't open file /nonexistent/sed_test: "
+                     "No such file or directory");
+    struct collected collected = {.len = 0};
+    cr_expect_eq(sed_start(sed, collect, &collected), -1);
+    cr_expect_eq(sed_feed(sed, "a\n", 2), -1);
+    cr_expect_eq(sed_finish(sed), -1);
+    close(input_fd);
+    close(output_fd);
+    sed_free(sed);
+    sed_script_free(script);
+    // the writes failing while the context is released
+    script = sed_compile("w /dev/full");
+    sed = sed_new(script);
+    cr_expect_eq(sed_start(sed, collect, &collected), 0);
+    cr_expect_eq(sed_feed(sed, "a\nb\n", 4), 1);
+    cr_expect_eq(sed_finish(sed), -1);
+    cr_expect_str_eq(sed_error(),
+                     "couldn't write to file /dev/full: No space left on device");
+    sed_free(sed);
+    sed_script_free(script);
+}
@@ -42,16 +42,16 @@ Test(parse_address, re)
     rest = parse_address(strcpy(input, "/abc*/"), &address);
     cr_expect_str_empty(rest);
     cr_expect_eq(address.type, ADDRESS_RE);
-    cr_expect_eq(regexec(&address.data.preg, "abc", 0, NULL, 0), 0);
-    cr_expect_eq(regexec(&address.data.preg, "abcccc", 0, NULL, 0), 0);
-    cr_expect_eq(regexec(&address.data.preg, "bccc", 0, NULL, 0), REG_NOMATCH);
+    cr_expect_eq(regexec(&address.data.regex->preg, "abc", 0, NULL, 0), 0);
+    cr_expect_eq(regexec(&address.data.regex->preg, "abcccc", 0, NULL, 0), 0);
+    cr_expect_eq(regexec(&address.data.regex->preg, "bccc", 0, NULL, 0), REG_NOMATCH);
 
     rest = parse_address(strcpy(input, "|abc*|"), &address);
     cr_expect_str_empty(rest);
     cr_expect_eq(address.type, ADDRESS_RE);
-    cr_expect_eq(regexec(&address.data.preg, "abc", 0, NULL, 0), 0);
-    cr_expect_eq(regexec(&address.data.preg, "abcccc", 0, NULL, 0), 0);
-    cr_expect_eq(regexec(&address.data.preg, "bccc", 0, NULL, 0), REG_NOMATCH);
+    cr_expect_eq(regexec(&address.data.regex->preg, "abc", 0, NULL, 0), 0);
+    cr_expect_eq(regexec(&address.data.regex->preg, "abcccc", 0, NULL, 0), 0);
+    cr_expect_eq(regexec(&address.data.regex->preg, "bccc", 0, NULL, 0), REG_NOMATCH);
 }
 
 Test(parse_address, re_escape)
@@ -59,9 +59,9 @@ Test(parse_address, re_escape)
     rest = parse_address(strcpy(input, "/a\\/bc*/"), &address);
     cr_expect_str_empty(rest);
     cr_expect_eq(address.type, ADDRESS_RE);
-    cr_expect_eq(regexec(&address.data.preg, "a/bc", 0, NULL, 0), 0);
-    cr_expect_eq(regexec(&address.data.preg, "a/bcccc", 0, NULL, 0), 0);
-    cr_expect_eq(regexec(&address.data.preg, "/bccc", 0, NULL, 0), REG_NOMATCH);
+    cr_expect_eq(regexec(&address.data.regex->preg, "a/bc", 0, NULL, 0), 0);
+    cr_expect_eq(regexec(&address.data.regex->preg, "a/bcccc", 0, NULL, 0), 0);
+    cr_expect_eq(regexec(&address.data.regex->preg, "/bccc", 0, NULL, 0), REG_NOMATCH);
 }
 
 Test(parse_address, re_error, .exit_code = 1)
@@ -179,7 +179,7 @@ Test(parse_command, error_unknown_command, .exit_code = 1)
 
 Test(parse_command, text)
 {
-    const char *text_commands = ":btrw";
+    const char *text_commands = ":btrRw";
     for (size_t i = 0; text_commands[i] != '\0'; i++)
     {
         input[0] = text_commands[i];
@@ -196,6 +196,11 @@ Test(parse_command, error_read_no_filepath, .exit_code = 1)
     parse_command(strcpy(input, "r"), &command);
 }
 
+Test(parse_command, error_read_line_no_filepath, .exit_code = 1)
+{
+    parse_command(strcpy(input, "R"), &command);
+}
+
 Test(parse_command, error_write_no_filepath, .exit_code = 1)
 {
     parse_command(strcpy(input, "w"), &command);
@@ -271,7 +276,7 @@ Test(parse_command, list)
     cr_expect_eq(command.id, '{');
     cr_expect_eq(command.data.children[0].id, 'p');
     cr_expect_eq(command.data.children[1].id, '}');
-    free(command.data.children);
+    script_free();
 
     rest = parse_command("{p;p;p;p;p;p;p;p;p;p;p;p;p;p;p;p;p;p;p;p}", &command);
     cr_expect_str_empty(rest);
@@ -279,7 +284,7 @@ Test(parse_command, list)
     for (size_t i = 0; i < 20; i++)
         cr_expect_eq(command.data.children[i].id, 'p');
     cr_expect_eq(command.data.children[20].id, '}');
-    free(command.data.children);
+    script_free();
 
     rest = parse_command("{10q}", &command);
     cr_expect_str_empty(rest);
@@ -289,7 +294,7 @@ Test(parse_command, list)
     cr_expect_eq(command.data.children[0].addresses.addresses[0].type, ADDRESS_LINE);
     cr_expect_eq(command.data.children[0].addresses.addresses[0].data.line, 10);
     cr_expect_eq(command.data.children[1].id, '}');
-    free(command.data.children);
+    script_free();
 
     rest = parse_command("{10,20p}", &command);
     cr_expect_str_empty(rest);
@@ -301,7 +306,7 @@ Test(parse_command, list)
     cr_expect_eq(command.data.children[0].addresses.addresses[1].type, ADDRESS_LINE);
     cr_expect_eq(command.data.children[0].addresses.addresses[1].data.line, 20);
     cr_expect_eq(command.data.children[1].id, '}');
-    free(command.data.children);
+    script_free();
 
     rest = parse_command(strcpy(input, "{rfoo\nwbar\n}"), &command);
     cr_expect_str_empty(rest);
@@ -311,7 +316,7 @@ Test(parse_command, list)
     cr_expect_eq(command.data.children[1].id, 'w');
     cr_expect_str_eq(command.data.children[1].data.text, "bar");
     cr_expect_eq(command.data.children[2].id, '}');
-    free(command.data.children);
+    script_free();
 
     rest = parse_command(strcpy(input, "{a\\ bonjour\n}"), &command);
     cr_expect_str_empty(rest);
@@ -319,46 +324,46 @@ Test(parse_command, list)
     cr_expect_eq(command.data.children[0].id, 'a');
     cr_expect_str_eq(command.data.children[0].data.text, "bonjour");
     cr_expect_eq(command.data.children[1].id, '}');
-    free(command.data.children);
+    script_free();
 
     rest = parse_command(strcpy(input, "{}"), &command);
     cr_expect_str_empty(rest);
     cr_expect_eq(command.id, '{');
     cr_expect_eq(command.data.children[0].id, '}');
-    free(command.data.children);
+    script_free();
 
     rest = parse_command(strcpy(input, "{;;;;; ;;;;;;;;;}"), &command);
     cr_expect_str_empty(rest);
     cr_expect_eq(command.id, '{');
     cr_expect_eq(command.data.children[0].id, '}');
-    free(command.data.children);
+    script_free();
 
     rest = parse_command(strcpy(input, "{;;; ;;;;p;;;;;; ;}"), &command);
     cr_expect_str_empty(rest);
     cr_expect_eq(command.id, '{');
     cr_expect_eq(command.data.children[0].id, 'p');
     cr_expect_eq(command.data.children[1].id, '}');
-    free(command.data.children);
+    script_free();
 
     rest = parse_command(strcpy(input, "{\n\n\n\n\n\n\n \n\n\n}"), &command);
     cr_expect_str_empty(rest);
     cr_expect_eq(command.id, '{');
     cr_expect_eq(command.data.children[0].id, '}');
-    free(command.data.children);
+    script_free();
 
     rest = parse_command(strcpy(input, "{\n\n\n \n\np\n\n\n\n\n\n}"), &command);
     cr_expect_str_empty(rest);
     cr_expect_eq(command.id, '{');
     cr_expect_eq(command.data.children[0].id, 'p');
     cr_expect_eq(command.data.children[1].id, '}');
-    free(command.data.children);
+    script_free();
 
     rest = parse_command(strcpy(input, "{\n\n;\n;\n\np\n\n;\n\n\n;\n}"), &command);
     cr_expect_str_empty(rest);
     cr_expect_eq(command.id, '{');
     cr_expect_eq(command.data.children[0].id, 'p');
     cr_expect_eq(command.data.children[1].id, '}');
-    free(command.data.children);
+    script_free();
 
     rest = parse_command(strcpy(input, "{;;;{;;{;;p;;};;};;;}"), &command);
     cr_expect_str_empty(rest);
@@ -369,7 +374,7 @@ Test(parse_command, list)
     cr_expect_eq(command.data.children[0].data.children[0].data.children[1].id, '}');
     cr_expect_eq(command.data.children[0].data.children[1].id, '}');
     cr_expect_eq(command.data.children[1].id, '}');
-    free(command.data.children);
+    script_free();
 
     rest = parse_command(strcpy(input, "{;p;;{;;p;;};;{p;p;p};;}"), &command);
     cr_expect_str_empty(rest);
@@ -404,7 +409,7 @@ Test(parse_command, list)
     for (size_t i = 0; i < len - 1; i++)
         cr_expect_eq(command.data.children[i].id, 'p');
     cr_expect_eq(command.data.children[len].id, '}');
-    free(command.data.children);
+    script_free();
 }
 
 Test(parse_command, error_list_extra_characters, .exit_code = 1)
@@ -466,9 +471,9 @@ Test(parse_command, substitute)
     cr_expect_str_empty(rest);
     cr_expect_eq(command.id, 's');
     cr_expect_str_eq(command.data.substitute.replacement, "def");
-    cr_expect_eq(regexec(&command.data.substitute.preg, "abc", 0, NULL, 0), 0);
-    cr_expect_eq(regexec(&command.data.substitute.preg, "abcccc", 0, NULL, 0), 0);
-    cr_expect_eq(regexec(&command.data.substitute.preg, "bccc", 0, NULL, 0),
+    cr_expect_eq(regexec(&command.data.substitute.regex->preg, "abc", 0, NULL, 0), 0);
+    cr_expect_eq(regexec(&command.data.substitute.regex->preg, "abcccc", 0, NULL, 0), 0);
+    cr_expect_eq(regexec(&command.data.substitute.regex->preg, "bccc", 0, NULL, 0),
                  REG_NOMATCH);
 
     rest = parse_command(strcpy(input,
@@ -490,18 +495,18 @@ Test(parse_command, substitute)
     cr_expect_str_empty(rest);
     cr_expect_eq(command.id, 's');
     cr_expect_str_eq(command.data.substitute.replacement, "def");
-    cr_expect_eq(regexec(&command.data.substitute.preg, "a\t", 0, NULL, 0), 0);
-    cr_expect_eq(regexec(&command.data.substitute.preg, "a\t\t\t\t", 0, NULL, 0), 0);
-    cr_expect_eq(regexec(&command.data.substitute.preg, "\t\t\t", 0, NULL, 0),
+    cr_expect_eq(regexec(&command.data.substitute.regex->preg, "a\t", 0, NULL, 0), 0);
+    cr_expect_eq(regexec(&command.data.substitute.regex->preg, "a\t\t\t\t", 0, NULL, 0), 0);
+    cr_expect_eq(regexec(&command.data.substitute.regex->preg, "\t\t\t", 0, NULL, 0),
                  REG_NOMATCH);
 
     rest = parse_command(strcpy(input, "s_\\_abc*_def\\__"), &command);
     cr_expect_str_empty(rest);
     cr_expect_eq(command.id, 's');
     cr_expect_str_eq(command.data.substitute.replacement, "def_");
-    cr_expect_eq(regexec(&command.data.substitute.preg, "_abc", 0, NULL, 0), 0);
-    cr_expect_eq(regexec(&command.data.substitute.preg, "_abcccc", 0, NULL, 0), 0);
-    cr_expect_eq(regexec(&command.data.substitute.preg, "abccc", 0, NULL, 0),
+    cr_expect_eq(regexec(&command.data.substitute.regex->preg, "_abc", 0, NULL, 0), 0);
+    cr_expect_eq(regexec(&command.data.substitute.regex->preg, "_abcccc", 0, NULL, 0), 0);
+    cr_expect_eq(regexec(&command.data.substitute.regex->preg, "abccc", 0, NULL, 0),
                  REG_NOMATCH);
 
     // delimiter can be a space
@@ -602,13 +607,13 @@ Test(parse, base)
     commands = parse("p");
     cr_expect_eq(commands[0].id, 'p');
     cr_expect_eq(commands[1].id, COMMAND_LAST);
-    free(commands);
+    script_free();
 
     commands = parse("p;p;p;p;p;p;p;p;p;p;p;p;p;p;p;p;p;p;p;p");
     for (size_t i = 0; i < 20; i++)
         cr_expect_eq(commands[i].id, 'p');
     cr_expect_eq(commands[20].id, COMMAND_LAST);
-    free(commands);
+    script_free();
 
     commands = parse("10q");
     cr_expect_eq(commands[0].id, 'q');
@@ -616,7 +621,7 @@ Test(parse, base)
     cr_expect_eq(commands[0].addresses.addresses[0].type, ADDRESS_LINE);
     cr_expect_eq(commands[0].addresses.addresses[0].data.line, 10);
     cr_expect_eq(commands[1].id, COMMAND_LAST);
-    free(commands);
+    script_free();
 
     commands = parse("10,20p");
     cr_expect_eq(commands[0].id, 'p');
@@ -626,7 +631,7 @@ Test(parse, base)
     cr_expect_eq(commands[0].addresses.addresses[1].type, ADDRESS_LINE);
     cr_expect_eq(commands[0].addresses.addresses[1].data.line, 20);
     cr_expect_eq(commands[1].id, COMMAND_LAST);
-    free(command.data.children);
+    script_free();
 
     commands = parse(strcpy(input, "rfoo\nwbar\n"));
     cr_expect_eq(commands[0].id, 'r');
@@ -634,40 +639,40 @@ Test(parse, base)
     cr_expect_eq(commands[1].id, 'w');
     cr_expect_str_eq(commands[1].data.text, "bar");
     cr_expect_eq(commands[2].id, COMMAND_LAST);
-    free(commands);
+    script_free();
 
     commands = parse(strcpy(input, "a\\ bonjour\n"));
     cr_expect_eq(commands[0].id, 'a');
     cr_expect_str_eq(commands[0].data.text, "bonjour");
     cr_expect_eq(commands[1].id, COMMAND_LAST);
-    free(commands);
+    script_free();
 
     commands = parse(strcpy(input, ""));
     cr_expect_eq(commands[0].id, COMMAND_LAST);
-    free(commands);
+    script_free();
 
     commands = parse(strcpy(input, ";;;;;;;; ;;;;;;"));
     cr_expect_eq(commands[0].id, COMMAND_LAST);
-    free(commands);
+    script_free();
 
     commands = parse(strcpy(input, ";;;; ;;;p; ;;;;;;"));
     cr_expect_eq(commands[0].id, 'p');
     cr_expect_eq(commands[1].id, COMMAND_LAST);
-    free(commands);
+    script_free();
 
     commands = parse(strcpy(input, "\n\n \n\n\n\n\n \n\n\n"));
     cr_expect_eq(commands[0].id, COMMAND_LAST);
-    free(commands);
+    script_free();
 
     commands = parse(strcpy(input, "\n\n\n\n\np\n\n\n\n\n\n"));
     cr_expect_eq(commands[0].id, 'p');
     cr_expect_eq(commands[1].id, COMMAND_LAST);
-    free(commands);
+    script_free();
 
     commands = parse(strcpy(input, "\n\n;\n; \n\np\n\n;\n\n\n;\n"));
     cr_expect_eq(commands[0].id, 'p');
     cr_expect_eq(commands[1].id, COMMAND_LAST);
-    free(commands);
+    script_free();
 
     commands = parse(strcpy(input, ";;;{;;{;;p;;};;};;;"));
     cr_expect_eq(commands[0].id, '{');
@@ -676,7 +681,7 @@ Test(parse, base)
     cr_expect_eq(commands[0].data.children[0].data.children[1].id, '}');
     cr_expect_eq(commands[0].data.children[1].id, '}');
     cr_expect_eq(commands[1].id, COMMAND_LAST);
-    free(commands);
+    script_free();
 
     commands = parse(strcpy(input, ";p;;{;;p;;};;{p;p;p};;"));
     cr_expect_eq(commands[0].id, 'p');
@@ -691,6 +696,128 @@ Test(parse, base)
     cr_expect_eq(commands[3].id, COMMAND_LAST);
 }
 
+Test(parse, separators)
+{
+    struct command *commands;
+    commands = parse(strcpy(input, "{p}\np\n/x/{p;p}\ns/a/b/w foo\np"));
+    cr_expect_eq(commands[0].id, '{');
+    cr_expect_eq(commands[1].id, 'p');
+    cr_expect_eq(commands[2].id, '{');
+    cr_expect_eq(commands[3].id, 's');
+    cr_expect_str_eq(commands[3].data.substitute.write_filepath, "foo");
+    cr_expect_eq(commands[4].id, 'p');
+    cr_expect_eq(commands[5].id, COMMAND_LAST);
+    script_free();
+
+    commands = parse(strcpy(input, "# comment; p\n:a;N;$!ba ; s/x/y/gp"));
+    cr_expect_eq(commands[0].id, '#');
+    cr_expect_eq(commands[1].id, ':');
+    cr_expect_str_eq(commands[1].data.text, "a");
+    cr_expect_eq(commands[2].id, 'N');
+    cr_expect_eq(commands[3].id, 'b');
+    cr_expect_str_eq(commands[3].data.text, "a");
+    cr_expect_eq(commands[4].id, 's');
+    cr_expect(commands[4].data.substitute.global);
+    cr_expect(commands[4].data.substitute.print);
+    cr_expect_eq(commands[5].id, COMMAND_LAST);
+    script_free();
+
+    commands = parse(strcpy(input, "a\\\nfoo\\\nbar\ni\\\tbaz\\"));
+    cr_expect_eq(commands[0].id, 'a');
+    cr_expect_str_eq(commands[0].data.text, "foo\nbar");
+    cr_expect_eq(commands[1].id, 'i');
+    cr_expect_str_eq(commands[1].data.text, "baz\\");
+    cr_expect_eq(commands[2].id, COMMAND_LAST);
+    script_free();
+}
+
+Test(parse, many_commands)
+{
+    const size_t len = 100000;
+    char        *s = xmalloc(len * 2 + 1);
+    for (size_t i = 0; i < len; i++)
+    {
+        s[i * 2] = 'p';
+        s[i * 2 + 1] = '\n';
+    }
+    s[len * 2] = '\0';
+    struct command *commands = parse(s);
+    for (size_t i = 0; i < len; i++)
+        cr_expect_eq(commands[i].id, 'p');
+    cr_expect_eq(commands[len].id, COMMAND_LAST);
+    script_free();
+    free(s);
+}
+
+Test(parse, regexes_interned)
+{
+    char            s1[] = "/abc/p;/abc/d;/x/s/abc/y/";
+    struct command *commands = parse(s1);
+    cr_expect_eq(commands[0].addresses.addresses[0].data.regex,
+                 commands[1].addresses.addresses[0].data.regex);
+    cr_expect_eq(commands[0].addresses.addresses[0].data.regex,
+                 commands[2].data.substitute.regex);
+    // used by `s` so compiled with submatches
+    cr_expect(!commands[0].addresses.addresses[0].data.regex->nosub);
+    cr_expect(commands[2].addresses.addresses[0].data.regex->nosub);
+    script_free();
+
+    // the empty regex can stand for any of them
+    char s2[] = "/x/p;s//y/";
+    commands = parse(s2);
+    cr_expect(!commands[0].addresses.addresses[0].data.regex->nosub);
+    cr_expect(!commands[1].data.substitute.regex->compiled);
+    script_free();
+}
+
+Test(parse, regexes_anchored)
+{
+    char            s[] = "/^#/d;/^$/d;s/\\.txt$/.md/;s/[ \t][ \t]*$//;"
+                          "/^a*/p;/a$\\|b$/p";
+    struct command *commands = parse(s);
+    struct regex   *regex = commands[0].addresses.addresses[0].data.regex;
+    cr_expect_eq(regex->anchor, ANCHOR_START);
+    cr_expect_str_eq(regex->literal, "#");
+    regex = commands[1].addresses.addresses[0].data.regex;
+    cr_expect_eq(regex->anchor, ANCHOR_BOTH);
+    cr_expect_eq(regex->literal_len, 0);
+    regex = commands[2].data.substitute.regex;
+    cr_expect_eq(regex->anchor, ANCHOR_END);
+    cr_expect_str_eq(regex->literal, ".txt");
+    regex = commands[3].data.substitute.regex;
+    cr_expect_eq(regex->anchor, ANCHOR_END_CLASS);
+    cr_expect(regex->class[' '] && regex->class['\t'] && !regex->class['a']);
+    cr_expect_eq(regex->class_min, 1);
+    cr_expect_eq(commands[4].addresses.addresses[0].data.regex->anchor, ANCHOR_NONE);
+    cr_expect_eq(commands[5].addresses.addresses[0].data.regex->anchor, ANCHOR_NONE);
+    script_free();
+}
+
+Test(parse, regexes_icase)
+{
+    char            s[] = "/Error/Ip;s/x/y/gI;s/^Ab/c/i;/x/p";
+    struct command *commands = parse(s);
+    struct regex   *regex = commands[0].addresses.addresses[0].data.regex;
+    cr_expect_eq(regex->cflags, REG_ICASE);
+    cr_expect(regex->folded);
+    cr_expect_str_eq(regex->literal, "error");
+    cr_expect_eq(commands[0].id, 'p');
+    cr_expect_eq(commands[1].data.substitute.regex->cflags, REG_ICASE);
+    cr_expect(commands[1].data.substitute.global);
+    regex = commands[2].data.substitute.regex;
+    cr_expect_eq(regex->anchor, ANCHOR_START);
+    cr_expect_str_eq(regex->literal, "ab");
+    // same source, other flags
+    cr_expect_neq(commands[3].addresses.addresses[0].data.regex,
+                  commands[1].data.substitute.regex);
+    script_free();
+}
+
+Test(parse, error_icase_empty_regex, .exit_code = 1)
+{
+    parse("s//x/I");
+}
+
 Test(parse, error_unexpected_closing_brace, .exit_code = 1)
 {
     parse("}");
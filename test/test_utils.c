@@ -32,6 +32,21 @@ Test(read_file, base)
     cr_assert_str_eq(actual, expected);
 }
 
+Test(read_file, larger_than_buffer)
+{
+    char template[] = "/tmp/sed_testXXXXXX";  // modified by mkstemp
+    FILE *tmp_file = fdopen(mkstemp(template), "w+");
+    assert(tmp_file != NULL);
+    static char expected[100001];
+    for (size_t i = 0; i < sizeof(expected) - 1; i++)
+        expected[i] = 'a' + i % 26;
+    fputs(expected, tmp_file);
+    fclose(tmp_file);
+    char *actual = read_file(template);
+    remove(template);
+    cr_assert_str_eq(actual, expected);
+}
+
 Test(read_file, error, .exit_code = 1)
 {
     read_file("doesnotexist");
@@ -52,3 +67,40 @@ Test(todigit, base)
     cr_assert_eq(todigit('a'), -1);
     cr_assert_eq(todigit('~'), -1);
 }
+
+Test(memcount, base)
+{
+    const char *s = "a\nbb\n\nccc\ndddddddd\ne\n\xff\n";
+    cr_assert_eq(memcount(s, strlen(s), '\n'), 7);
+    cr_assert_eq(memcount(s, strlen(s), 'd'), 8);
+    cr_assert_eq(memcount(s, strlen(s), '\xff'), 1);
+    cr_assert_eq(memcount(s, 3, '\n'), 1);
+    cr_assert_eq(memcount(s, 0, 'a'), 0);
+}
+
+static size_t arena_cleanup_calls = 0;
+
+static void
+arena_cleanup_count(void *ptr)
+{
+    (void)ptr;
+    arena_cleanup_calls++;
+}
+
+Test(arena, base)
+{
+    struct arena arena = {NULL, NULL};
+    char        *small = arena_strndup(&arena, "bonjour", 7);
+    char        *large = arena_alloc(&arena, 1000000);
+    memset(large, 'a', 1000000);
+    char *after = arena_alloc(&arena, 3);
+    cr_assert_str_eq(small, "bonjour");
+    cr_assert_eq((uintptr_t)large % 16, 0);
+    cr_assert_eq((uintptr_t)after % 16, 0);
+    cr_assert_eq(after - small, 16);
+    arena_defer(&arena, arena_cleanup_count, NULL);
+    arena_defer(&arena, arena_cleanup_count, NULL);
+    arena_free(&arena);
+    cr_assert_eq(arena_cleanup_calls, 2);
+    cr_assert_null(arena.chunks);
+}